@@ -0,0 +1,4 @@
+'''Benchmarks for the QPack C extension and pure Python implementation,
+compared with other serializers. Run `python -m bench --help` from the root
+of the repository.
+'''
@@ -0,0 +1,185 @@
+'''Command line for the benchmarks, see README.md.
+
+    python -m bench run -o result.json
+    python -m bench compare base.json result.json
+'''
+import argparse
+import json
+import sys
+
+from .compare import compare
+from .payloads import PAYLOADS
+from .runner import FORMAT, run, serializers
+
+METRICS = ('p50', 'p90', 'p99', 'mean', 'min')
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog='python -m bench',
+        description='QPack benchmarks')
+    commands = parser.add_subparsers(dest='command')
+
+    p = commands.add_parser('run', help='run the benchmarks')
+    p.add_argument(
+        '-o', '--output',
+        help='write the results as JSON to this file')
+    p.add_argument(
+        '-p', '--payload', action='append', choices=list(PAYLOADS),
+        help='payload to run, can be repeated (default: all)')
+    p.add_argument(
+        '-s', '--serializer', action='append',
+        help='serializer to run, can be repeated (default: all which are '
+             'available)')
+    p.add_argument(
+        '--samples', type=int, default=20,
+        help='number of samples for each measurement (default: 20)')
+    p.add_argument(
+        '--min-time', type=float, default=0.005,
+        help='minimum time of a sample in seconds (default: 0.005)')
+    p.add_argument(
+        '--seed', type=int, default=1,
+        help='seed for the payload generators (default: 1)')
+    p.add_argument(
+        '--scale', type=float, default=1.0,
+        help='size factor for the payloads (default: 1.0)')
+    p.add_argument(
+        '--quick', action='store_true',
+        help='few short samples, for a quick check')
+
+    p = commands.add_parser(
+        'compare',
+        help='compare two results, exits with status 1 on a regression')
+    p.add_argument('base', help='JSON result of the baseline run')
+    p.add_argument('new', help='JSON result to compare')
+    p.add_argument(
+        '-t', '--threshold', type=float, default=10.0,
+        help='change in percent which is a regression (default: 10)')
+    p.add_argument(
+        '-m', '--metric', choices=METRICS, default='p50',
+        help='time metric to compare (default: p50)')
+
+    commands.add_parser('list', help='list the payloads and serializers')
+
+    args = parser.parse_args(argv)
+    if args.command == 'run':
+        return _run(args)
+    if args.command == 'compare':
+        return _compare(args)
+    if args.command == 'list':
+        return _list()
+    parser.print_help()
+    return 2
+
+
+def _run(args):
+    if args.quick:
+        args.samples, args.min_time = 5, 0.001
+    try:
+        result = run(
+            payloads=args.payload, names=args.serializer,
+            samples=args.samples, min_time=args.min_time, seed=args.seed,
+            scale=args.scale, log=_Log())
+    except ValueError as e:
+        print(e, file=sys.stderr)
+        return 2
+
+    for name, reason in sorted(result['skipped'].items()):
+        print('skipped {}: {}'.format(name, reason))
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(result, f, indent=2)
+            f.write('\n')
+    return 0
+
+
+class _Log(object):
+    '''Prints each result when it is measured, with a header before the
+    first one.'''
+
+    def __init__(self):
+        self.header = True
+
+    def __call__(self, r):
+        if self.header:
+            self.header = False
+            print('{:<11} {:<10} {:<6} {:>9} {:>11} {:>10} {:>10} {:>10} '
+                  '{:>9}'.format('payload', 'serializer', 'op', 'size',
+                                 'MB/s', 'p50', 'p90', 'p99', 'memory'))
+        if 'error' in r:
+            print('{:<11} {:<10} {}'.format(r['payload'], r['serializer'],
+                                            r['error'][:56]))
+        else:
+            print('{:<11} {:<10} {:<6} {:>9} {:>11.1f} {:>10} {:>10} {:>10} '
+                  '{:>9}'.format(r['payload'], r['serializer'], r['op'],
+                                 r['size'], r['mb_per_sec'],
+                                 _ns(r['p50_ns']), _ns(r['p90_ns']),
+                                 _ns(r['p99_ns']),
+                                 _bytes(r['peak_memory'])))
+        sys.stdout.flush()
+
+
+def _compare(args):
+    results = []
+    for fn in (args.base, args.new):
+        with open(fn) as f:
+            result = json.load(f)
+        if result.get('format') != FORMAT:
+            print('{} has an unsupported format'.format(fn), file=sys.stderr)
+            return 2
+        results.append(result)
+
+    rows, warnings = compare(
+        results[0], results[1], args.threshold, args.metric + '_ns')
+    print('{:<11} {:<10} {:<6} {:>10} {:>10} {:>8} {:>8} {:>7}'.format(
+        'payload', 'serializer', 'op', 'base', 'new', 'time', 'memory',
+        'size'))
+    for row in rows:
+        print('{:<11} {:<10} {:<6} {:>10} {:>10} {:>8} {:>8} {:>7}  {}'
+              .format(row['payload'], row['serializer'], row['op'],
+                      _ns(row['base']), _ns(row['new']),
+                      _pct(row['change']), _pct(row['memory']),
+                      _pct(row['size']), ' '.join(row['regressions']))
+              .rstrip())
+    for warning in warnings:
+        print('warning: {}'.format(warning))
+
+    regressions = [row for row in rows if row['regressions']]
+    print('{} of {} compared results regressed (threshold {}%, {})'.format(
+        len(regressions), len(rows), args.threshold, args.metric))
+    return 1 if regressions else 0
+
+
+def _list():
+    available, missing = serializers()
+    print('payloads:')
+    for name, (generator, _) in PAYLOADS.items():
+        print('  {:<11} {}'.format(name, generator.__doc__.strip()))
+    print('serializers:')
+    for name, serializer in available.items():
+        print('  {:<11} {}'.format(name, serializer.version))
+    for name, reason in sorted(missing.items()):
+        print('  {:<11} not available: {}'.format(name, reason))
+    return 0
+
+
+def _ns(ns):
+    for unit, div in (('s', 1e9), ('ms', 1e6), ('us', 1e3)):
+        if ns >= div:
+            return '{:.3g} {}'.format(ns / div, unit)
+    return '{:.3g} ns'.format(ns)
+
+
+def _bytes(n):
+    for unit, div in (('MiB', 1 << 20), ('KiB', 1 << 10)):
+        if n >= div:
+            return '{:.1f} {}'.format(n / div, unit)
+    return '{} B'.format(n)
+
+
+def _pct(change):
+    return '{:+.1f}%'.format(change) if change else '0'
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,75 @@
+'''Compare two benchmark results.
+
+A time metric is a regression when it is more than `threshold` percent
+higher in the new result, the peak memory when it is more than `threshold`
+percent and at least MEMORY_MIN_DIFF bytes higher, and the size when the
+data is larger, since both runs pack the same payloads.
+'''
+
+# memory is measured per page, so small differences are noise
+MEMORY_MIN_DIFF = 256 * 1024
+
+
+def compare(base, new, threshold=10.0, metric='p50_ns'):
+    '''Returns a list with the comparison of each result which is in both
+    `base` and `new`, and a list with warnings.'''
+    warnings = []
+    if base.get('settings') != new.get('settings'):
+        warnings.append('the runs have different settings, so the payloads '
+                        'might not be the same')
+    for key in ('python', 'implementation', 'machine', 'memory'):
+        b = base['environment'].get(key)
+        n = new['environment'].get(key)
+        if b != n:
+            warnings.append('the runs have a different {}: {} and {}'.format(
+                key, b, n))
+
+    new_results = dict(
+        (_key(r), r) for r in new['results'] if 'error' not in r)
+    rows = []
+    for b in base['results']:
+        if 'error' in b:
+            continue
+        n = new_results.pop(_key(b), None)
+        if n is None:
+            warnings.append('{} {} {} is missing in the new result'.format(
+                *_key(b)))
+            continue
+        change = _change(b[metric], n[metric])
+        memory = _change(b['peak_memory'], n['peak_memory'])
+        regressions = []
+        if change > threshold:
+            regressions.append('time')
+        if memory > threshold and \
+                n['peak_memory'] - b['peak_memory'] >= MEMORY_MIN_DIFF:
+            regressions.append('memory')
+        if n['size'] > b['size']:
+            regressions.append('size')
+        rows.append({
+            'payload': b['payload'],
+            'serializer': b['serializer'],
+            'op': b['op'],
+            'base': b[metric],
+            'new': n[metric],
+            'change': change,
+            'memory': memory,
+            'size': _change(b['size'], n['size']),
+            'regressions': regressions,
+        })
+
+    for key in sorted(new_results):
+        warnings.append('{} {} {} is only in the new result'.format(*key))
+    return rows, warnings
+
+
+def _key(result):
+    return result['payload'], result['serializer'], result.get('op')
+
+
+def _change(base, new):
+    '''Returns the change from `base` to `new` in percent.'''
+    if base == new:
+        return 0.0
+    if not base:
+        return float('inf')
+    return (new - base) * 100.0 / base
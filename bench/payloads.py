@@ -0,0 +1,111 @@
+'''Payload generators for the benchmarks.
+
+Each generator takes a random.Random instance and a scale factor and returns
+the object which is packed. The same seed and scale always give the same
+object, so two runs measure the same data.
+'''
+import string
+from collections import OrderedDict
+
+
+def rpc(rnd, scale):
+    '''Tiny request message, like a single call on an RPC connection.'''
+    return {
+        'id': rnd.randint(1, 1 << 31),
+        'method': rnd.choice(['get_user', 'set_status', 'query', 'ping']),
+        'params': {
+            'user_id': rnd.randint(1, 100000),
+            'fields': ['name', 'email', 'created'],
+            'limit': 20,
+        },
+    }
+
+
+def wide(rnd, scale):
+    '''Rows with 40 columns of mixed types, like a query result.'''
+    columns = ['column_%02d' % i for i in range(40)]
+    rows = []
+    for i in range(int(500 * scale)):
+        row = {}
+        for j, column in enumerate(columns):
+            kind = j % 5
+            if kind == 0:
+                row[column] = rnd.randint(-1 << 40, 1 << 40)
+            elif kind == 1:
+                row[column] = rnd.random() * 1000.0
+            elif kind == 2:
+                row[column] = _text(rnd, 4, 16)
+            elif kind == 3:
+                row[column] = rnd.random() < 0.5
+            else:
+                row[column] = None if rnd.random() < 0.3 else i
+        rows.append(row)
+    return rows
+
+
+def deep(rnd, scale):
+    '''Nested maps and arrays, 100 levels deep with a few branches.'''
+    def node(depth):
+        if depth == 0:
+            return rnd.randint(0, 1000)
+        if depth % 2:
+            return {'level': depth, 'child': node(depth - 1), 'tag': 'n'}
+        return [depth, node(depth - 1), rnd.random()]
+    return [node(100) for _ in range(int(20 * scale))]
+
+
+def strings(rnd, scale):
+    '''Documents with mostly text, including non-ASCII text.'''
+    words = [_text(rnd, 3, 10) for _ in range(200)]
+    words += ['été', 'grüße', '日本語', '€uro']
+    docs = []
+    for i in range(int(1000 * scale)):
+        docs.append({
+            'title': ' '.join(rnd.choice(words) for _ in range(6)),
+            'body': ' '.join(rnd.choice(words) for _ in range(60)),
+            'author': rnd.choice(words),
+            'tags': [rnd.choice(words) for _ in range(4)],
+        })
+    return docs
+
+
+def timeseries(rnd, scale):
+    '''Numeric samples: integer timestamps with float values.'''
+    n = int(10000 * scale)
+    start = 1700000000000
+    value = 20.0
+    ts = []
+    values = []
+    for i in range(n):
+        value += rnd.gauss(0.0, 0.1)
+        ts.append(start + i * 1000)
+        values.append(value)
+    return {'series': 'temperature', 'ts': ts, 'values': values}
+
+
+def blobs(rnd, scale):
+    '''A few large binary values with some metadata.'''
+    size = int((1 << 20) * scale)
+    return [{
+        'name': 'blob-%d' % i,
+        'size': size,
+        'data': bytes(rnd.getrandbits(8) for _ in range(256)) * (size // 256),
+    } for i in range(4)]
+
+
+def _text(rnd, lo, hi):
+    return ''.join(
+        rnd.choice(string.ascii_lowercase)
+        for _ in range(rnd.randint(lo, hi)))
+
+
+# name: (generator, binary); `binary` is True when the payload has bytes
+# which must not be decoded when unpacking
+PAYLOADS = OrderedDict([
+    ('rpc', (rpc, False)),
+    ('wide', (wide, False)),
+    ('deep', (deep, False)),
+    ('strings', (strings, False)),
+    ('timeseries', (timeseries, False)),
+    ('blobs', (blobs, True)),
+])
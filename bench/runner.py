@@ -0,0 +1,340 @@
+'''Measure pack and unpack for each serializer and payload.
+
+For each payload, serializer and operation the runner first finds the number
+of loops for which a sample takes at least `min_time` seconds, and next takes
+`samples` samples after one warm-up sample. Garbage collection is disabled
+while timing, like timeit does. The latency percentiles are over the samples,
+as the time of a single call within a sample.
+
+The peak memory is measured with a single call. On Linux this call runs in a
+new process, which only creates its input, and the peak memory is the
+increase of the resident set size; this also counts memory which C code
+allocates with malloc(), and memory which is freed by an earlier call cannot
+hide the increase. The process uses malloc() instead of pymalloc, and gives
+free memory back to the system before the call. The size is measured per
+page, so it is only meaningful for larger payloads. Elsewhere it is the peak
+which tracemalloc reports for the Python memory allocators, in the same
+process.
+'''
+import ctypes
+import datetime
+import gc
+import json
+import os
+import pickle
+import platform
+import random
+import subprocess
+import sys
+import tempfile
+import time
+import tracemalloc
+from collections import OrderedDict
+
+from .payloads import PAYLOADS
+
+# version of the result format, see README.md
+FORMAT = 1
+
+
+class Serializer(object):
+
+    def __init__(self, name, version, pack, unpack, unpack_binary=None):
+        self.name = name
+        self.version = version
+        self.pack = pack
+        self.unpack = unpack
+        # unpack for payloads with bytes which must not be decoded
+        self.unpack_binary = unpack_binary or unpack
+
+
+def serializers():
+    '''Returns an OrderedDict with the serializers which are available and a
+    dict with the reason why each other serializer is not.'''
+    found = OrderedDict()
+    missing = {}
+
+    try:
+        import qpack
+        import qpack._qpack as _qpack
+    except ImportError as e:
+        missing['qpack'] = 'C extension is not built ({})'.format(e)
+    else:
+        found['qpack'] = Serializer(
+            'qpack', qpack.__version__, _qpack._packb,
+            lambda data: _qpack._unpackb(data, decode='utf-8'),
+            _qpack._unpackb)
+
+    import qpack
+    from qpack import fallback
+    found['fallback'] = Serializer(
+        'fallback', qpack.__version__, fallback.packb,
+        lambda data: fallback.unpackb(data, decode='utf-8'),
+        fallback.unpackb)
+
+    found['json'] = Serializer(
+        'json', json.__version__,
+        lambda obj: json.dumps(obj, separators=(',', ':')).encode('utf-8'),
+        json.loads)
+
+    found['pickle'] = Serializer(
+        'pickle', str(pickle.HIGHEST_PROTOCOL),
+        lambda obj: pickle.dumps(obj, pickle.HIGHEST_PROTOCOL),
+        pickle.loads)
+
+    try:
+        import msgpack
+    except ImportError:
+        missing['msgpack'] = 'not installed'
+    else:
+        found['msgpack'] = Serializer(
+            'msgpack', '.'.join(map(str, msgpack.version)),
+            lambda obj: msgpack.packb(obj, use_bin_type=True),
+            lambda data: msgpack.unpackb(data, raw=False))
+
+    return found, missing
+
+
+def run(payloads=None, names=None, samples=20, min_time=0.005, seed=1,
+        scale=1.0, log=None):
+    '''Returns the results for the given payload and serializer names, or
+    for all of them, in the result format.'''
+    available, missing = serializers()
+    names = list(available) if names is None else names
+    payloads = list(PAYLOADS) if payloads is None else payloads
+    for name in names:
+        if name not in available:
+            raise ValueError('serializer {} is not available: {}'.format(
+                name, missing.get(name, 'unknown serializer')))
+    for name in payloads:
+        if name not in PAYLOADS:
+            raise ValueError('unknown payload {}'.format(name))
+
+    memory = _memory_method()
+    results = []
+    for payload in payloads:
+        generator, binary = PAYLOADS[payload]
+        obj = generator(random.Random(seed), scale)
+        for name in names:
+            serializer = available[name]
+            for result in _measure_payload(
+                    serializer, payload, obj, binary, samples, min_time,
+                    memory, seed, scale):
+                results.append(result)
+                if log is not None:
+                    log(result)
+
+    return OrderedDict([
+        ('format', FORMAT),
+        ('created', datetime.datetime.now().isoformat(timespec='seconds')),
+        ('environment', _environment(available, memory)),
+        ('settings', OrderedDict([
+            ('samples', samples),
+            ('min_time', min_time),
+            ('seed', seed),
+            ('scale', scale),
+        ])),
+        ('skipped', missing),
+        ('results', results),
+    ])
+
+
+def _measure_payload(serializer, payload, obj, binary, samples, min_time,
+                     memory, seed, scale):
+    unpack = serializer.unpack_binary if binary else serializer.unpack
+    try:
+        data = serializer.pack(obj)
+        unpack(data)
+    except (TypeError, ValueError, OverflowError, RecursionError) as e:
+        # for example bytes in JSON
+        return [OrderedDict([
+            ('payload', payload),
+            ('serializer', serializer.name),
+            ('error', '{}: {}'.format(type(e).__name__, e)),
+        ])]
+
+    results = []
+    for op, fn, arg in (
+            ('pack', serializer.pack, obj),
+            ('unpack', unpack, data)):
+        loops, times = _timeit(fn, arg, samples, min_time)
+        times.sort()
+        mean = sum(times) / len(times)
+        results.append(OrderedDict([
+            ('payload', payload),
+            ('serializer', serializer.name),
+            ('op', op),
+            ('size', len(data)),
+            ('loops', loops),
+            ('samples', len(times)),
+            ('ops_per_sec', 1.0 / mean),
+            ('mb_per_sec', len(data) / mean / 1e6),
+            ('mean_ns', mean * 1e9),
+            ('min_ns', times[0] * 1e9),
+            ('p50_ns', _percentile(times, 50) * 1e9),
+            ('p90_ns', _percentile(times, 90) * 1e9),
+            ('p99_ns', _percentile(times, 99) * 1e9),
+            ('peak_memory', None),
+        ]))
+
+    if memory == 'tracemalloc':
+        for result, fn, arg in zip(results, (serializer.pack, unpack),
+                                   (obj, data)):
+            result['peak_memory'] = _peak_traced(fn, arg)
+        return results
+
+    with tempfile.NamedTemporaryFile(delete=False) as f:
+        f.write(data)
+    try:
+        for result in results:
+            result['peak_memory'] = _peak_child(
+                payload, serializer.name, result['op'], seed, scale, f.name)
+    finally:
+        os.unlink(f.name)
+    return results
+
+
+def _timeit(fn, arg, samples, min_time):
+    '''Returns the number of loops for each sample and a list with the time
+    of one call in seconds for each sample.'''
+    enabled = gc.isenabled()
+    gc.collect()
+    gc.disable()
+    try:
+        loops = 1
+        while True:
+            elapsed = _run(fn, arg, loops)
+            if elapsed >= min_time:
+                break
+            # aim a little over min_time, at most 10 times more loops
+            loops = min(
+                loops * 10,
+                max(loops + 1, int(loops * 1.2 * min_time / elapsed)))
+        _run(fn, arg, loops)
+        return loops, [_run(fn, arg, loops) / loops for _ in range(samples)]
+    finally:
+        if enabled:
+            gc.enable()
+
+
+def _run(fn, arg, loops):
+    it = range(loops)
+    start = time.perf_counter()
+    for _ in it:
+        fn(arg)
+    return time.perf_counter() - start
+
+
+def _percentile(values, p):
+    '''Returns percentile `p` of the sorted `values`, with linear
+    interpolation between the closest ranks.'''
+    k = (len(values) - 1) * p / 100.0
+    i = int(k)
+    if i + 1 == len(values):
+        return values[i]
+    return values[i] + (values[i + 1] - values[i]) * (k - i)
+
+
+def _memory_method():
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+        _proc_status('VmHWM')
+    except (IOError, OSError, ValueError):
+        return 'tracemalloc'
+    return 'rss'
+
+
+def _proc_status(field):
+    '''Returns a memory field of /proc/self/status in bytes.'''
+    with open('/proc/self/status') as f:
+        for line in f:
+            if line.startswith(field + ':'):
+                return int(line.split()[1]) * 1024
+    raise ValueError('{} is not found'.format(field))
+
+
+def _peak_traced(fn, arg):
+    '''Returns the peak memory in bytes which tracemalloc reports for a
+    single call.'''
+    gc.collect()
+    tracemalloc.start()
+    try:
+        fn(arg)
+        return tracemalloc.get_traced_memory()[1]
+    finally:
+        tracemalloc.stop()
+
+
+def _peak_child(payload, name, op, seed, scale, path):
+    '''Returns the peak memory in bytes for a single call in a new process;
+    `path` is a file with the packed payload.'''
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    env = dict(os.environ)
+    # without pymalloc all memory is allocated with malloc(), so the memory
+    # which is freed can be returned to the system by malloc_trim()
+    env['PYTHONMALLOC'] = 'malloc'
+    env['PYTHONPATH'] = os.pathsep.join(
+        p for p in (root, env.get('PYTHONPATH')) if p)
+    out = subprocess.check_output(
+        [sys.executable, '-m', 'bench.runner', payload, name, op, str(seed),
+         repr(scale), path],
+        env=env)
+    return int(out)
+
+
+def _child(payload, name, op, seed, scale, path):
+    '''Entry point of the process for _peak_child().'''
+    serializer = serializers()[0][name]
+    generator, binary = PAYLOADS[payload]
+    if op == 'pack':
+        fn = serializer.pack
+        arg = generator(random.Random(int(seed)), float(scale))
+    else:
+        fn = serializer.unpack_binary if binary else serializer.unpack
+        with open(path, 'rb') as f:
+            arg = f.read()
+    gc.collect()
+    try:
+        # return the memory which is freed by the imports to the system,
+        # otherwise the call can reuse it without a change of the size
+        ctypes.CDLL(None).malloc_trim(0)
+    except (AttributeError, OSError):
+        pass
+
+    # reset the peak resident set size to the current size
+    with open('/proc/self/clear_refs', 'w') as f:
+        f.write('5')
+    start = _proc_status('VmRSS')
+    fn(arg)
+    print(max(_proc_status('VmHWM') - start, 0))
+
+
+def _environment(available, memory):
+    return OrderedDict([
+        ('python', platform.python_version()),
+        ('implementation', platform.python_implementation()),
+        ('platform', platform.platform()),
+        ('machine', platform.machine()),
+        ('cpu_count', os.cpu_count()),
+        ('commit', _git_commit()),
+        ('serializers', OrderedDict(
+            (name, s.version) for name, s in available.items())),
+        ('memory', memory),
+    ])
+
+
+def _git_commit():
+    '''Returns the commit of the source tree, or None.'''
+    try:
+        out = subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'],
+            cwd=os.path.dirname(os.path.abspath(__file__)),
+            stderr=subprocess.DEVNULL)
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    return out.decode().strip()
+
+
+if __name__ == '__main__':
+    _child(*sys.argv[1:])
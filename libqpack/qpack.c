@@ -0,0 +1,1162 @@
+/*
+ * qpack.c - QPack format library
+ *
+ * See qpack.h. This file does not depend on Python.
+ */
+#include "qpack.h"
+
+static int tape_grow(qp_tape_t * tape);
+static int tape_parent(qp_tape_t * tape, qp_ssize_t depth, qp_ssize_t index);
+static int scanner_push(qp_scanner_t * scanner, qp_ssize_t frame);
+static void digest_compress(
+        qp_digest_t * digest,
+        const unsigned char * block,
+        int last);
+
+/*
+ * Initialize a packer with a buffer of `size` bytes, or QP_PACKER_INIT_SZ
+ * bytes when `size` is 0. Returns -1 when the allocation fails.
+ */
+int qp_packer_init(qp_packer_t * packer, qp_ssize_t size)
+{
+    packer->size = size ? size : QP_PACKER_INIT_SZ;
+    packer->len = 0;
+    packer->buffer = (unsigned char *) malloc(packer->size);
+    return (packer->buffer == NULL) ? -1 : 0;
+}
+
+void qp_packer_free(qp_packer_t * packer)
+{
+    free(packer->buffer);
+    packer->buffer = NULL;
+    packer->len = packer->size = 0;
+}
+
+/*
+ * Make room for at least `n` more bytes. The size is doubled (or more when
+ * required) so large data needs only a logarithmic number of reallocs.
+ */
+int qp_packer_grow(qp_packer_t * packer, qp_ssize_t n)
+{
+    qp_ssize_t size = packer->size;
+    qp_ssize_t required = packer->len + n;
+    unsigned char * tmp;
+
+    size = (size > QP_SSIZE_MAX / 2 || size * 2 < required)
+            ? required
+            : size * 2;
+
+    tmp = (unsigned char *) realloc(packer->buffer, size);
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    packer->buffer = tmp;
+    packer->size = size;
+    return 0;
+}
+
+/*
+ * Returns the size of the token at `pt` including the type byte, or 0 when
+ * the token is not completely available within `n` bytes. When the size
+ * does not fit in a qp_ssize_t, -1 is returned, -2 for an invalid typed
+ * array, -3 for an invalid back-reference and -4 for a template which is not
+ * followed by an array. The size of a template is the size of QP_HOOK and
+ * QP_TEMPLATE, without the array.
+ */
+qp_ssize_t qp_token_size(const unsigned char * pt, qp_ssize_t n)
+{
+    qp_ssize_t size;
+    unsigned char tp = *pt;
+
+    if ((tp < 128 && tp != QP_HOOK) || tp > QP_DOUBLE)
+    {
+        return 1;
+    }
+
+    switch ((qp_types_t) tp)
+    {
+    case QP_HOOK:
+        {
+            qp_ssize_t itemsize;
+            if (n < 3) return 0;
+            if (pt[1] == QP_TEMPLATE)
+            {
+                return (pt[2] == QP_ARRAY_OPEN || (
+                        pt[2] >= QP_ARRAY0 && pt[2] <= QP_ARRAY5)) ? 2 : -4;
+            }
+            if (pt[1] == QP_REF || pt[1] == QP_DICT)
+            {
+                switch (pt[2])
+                {
+                case QP_INT8:
+                    size = 4;
+                    break;
+                case QP_INT16:
+                    size = 5;
+                    break;
+                case QP_INT32:
+                    size = 7;
+                    break;
+                default:
+                    if (pt[2] >= 64)
+                    {
+                        return -3;
+                    }
+                    return 3;
+                }
+                if (size > n)
+                {
+                    return 0;
+                }
+                /* the index is a positive integer */
+                return (pt[size - 1] & 0x80) ? -3 : size;
+            }
+            itemsize = qp_typed_itemsize(pt[1]);
+            if (itemsize == 0 || pt[2] < 128 || pt[2] > QP_RAW64)
+            {
+                return -2;
+            }
+            size = qp_token_size(pt + 2, n - 2);
+            if (size <= 0)
+            {
+                return size;
+            }
+            if ((size - qp_raw_header_size(pt[2])) % itemsize)
+            {
+                return -2;
+            }
+            return 2 + size;
+        }
+    case QP_RAW8:
+        if (n < 2) return 0;
+        size = 2 + (qp_ssize_t) pt[1];
+        break;
+    case QP_RAW16:
+        {
+            uint16_t length;
+            if (n < 3) return 0;
+            memcpy(&length, pt + 1, sizeof(uint16_t));
+            size = 3 + (qp_ssize_t) length;
+        }
+        break;
+    case QP_RAW32:
+        {
+            uint32_t length;
+            if (n < 5) return 0;
+            memcpy(&length, pt + 1, sizeof(uint32_t));
+            if ((uint64_t) length > (uint64_t) (QP_SSIZE_MAX - 5))
+            {
+                goto overflow;
+            }
+            size = 5 + (qp_ssize_t) length;
+        }
+        break;
+    case QP_RAW64:
+        {
+            uint64_t length;
+            if (n < 9) return 0;
+            memcpy(&length, pt + 1, sizeof(uint64_t));
+            if (length > (uint64_t) (QP_SSIZE_MAX - 9))
+            {
+                goto overflow;
+            }
+            size = 9 + (qp_ssize_t) length;
+        }
+        break;
+    case QP_INT8:
+        size = 1 + sizeof(int8_t);
+        break;
+    case QP_INT16:
+        size = 1 + sizeof(int16_t);
+        break;
+    case QP_INT32:
+        size = 1 + sizeof(int32_t);
+        break;
+    case QP_INT64:
+        size = 1 + sizeof(int64_t);
+        break;
+    case QP_DOUBLE:
+        size = 1 + sizeof(double);
+        break;
+    default:
+        /* fixed raw strings lengths from 0 till 99 */
+        size = 1 + (qp_ssize_t) (tp - 128);
+    }
+
+    return (size > n) ? 0 : size;
+
+overflow:
+    return -1;
+}
+
+void qp_scanner_reset(qp_scanner_t * scanner)
+{
+    scanner->depth = 0;
+    scanner->pos = 0;
+    scanner->refs = 0;
+    scanner->templates = 0;
+    if (scanner->tape != NULL)
+    {
+        scanner->tape->len = 0;
+    }
+}
+
+/*
+ * Initialize a tape which starts with QP_TAPE_STACK_SZ tokens at `stack`, or
+ * with no tokens when `stack` is NULL.
+ */
+void qp_tape_init(qp_tape_t * tape, qp_token_t * stack)
+{
+    tape->tokens = tape->stack = stack;
+    tape->size = stack ? QP_TAPE_STACK_SZ : 0;
+    tape->len = 0;
+    tape->parents = NULL;
+    tape->parents_sz = 0;
+}
+
+void qp_tape_free(qp_tape_t * tape)
+{
+    if (tape->tokens != tape->stack)
+    {
+        free(tape->tokens);
+    }
+    free(tape->parents);
+    qp_tape_init(tape, tape->stack);
+}
+
+static int tape_grow(qp_tape_t * tape)
+{
+    qp_ssize_t size = tape->size ? tape->size * 2 : QP_TAPE_STACK_SZ;
+    qp_token_t * tmp;
+
+    if (tape->tokens == tape->stack)
+    {
+        tmp = (qp_token_t *) malloc(size * sizeof(qp_token_t));
+        if (tmp != NULL && tape->len)
+        {
+            memcpy(tmp, tape->tokens, tape->len * sizeof(qp_token_t));
+        }
+    }
+    else
+    {
+        tmp = (qp_token_t *) realloc(
+                tape->tokens,
+                size * sizeof(qp_token_t));
+    }
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    tape->tokens = tmp;
+    tape->size = size;
+    return 0;
+}
+
+/*
+ * Token `index` is an open array or map with its frame at `depth`; the
+ * scanner counts the items of the container on the token.
+ */
+static int tape_parent(qp_tape_t * tape, qp_ssize_t depth, qp_ssize_t index)
+{
+    if (depth >= tape->parents_sz)
+    {
+        qp_ssize_t size = tape->parents_sz ? tape->parents_sz * 2 : 8;
+        qp_ssize_t * tmp;
+
+        while (size <= depth)
+        {
+            size *= 2;
+        }
+        tmp = (qp_ssize_t *) realloc(tape->parents, size * sizeof(qp_ssize_t));
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        tape->parents = tmp;
+        tape->parents_sz = size;
+    }
+    tape->parents[depth] = index;
+    return 0;
+}
+
+static int scanner_push(qp_scanner_t * scanner, qp_ssize_t frame)
+{
+    if (scanner->depth == scanner->max_depth)
+    {
+        scanner->err = QP_SCAN_ERR_DEPTH;
+        return -1;
+    }
+    if (scanner->depth == scanner->size)
+    {
+        qp_ssize_t size = scanner->size ? scanner->size * 2 : 8;
+        qp_ssize_t * tmp;
+
+        if (scanner->frames == scanner->stack)
+        {
+            tmp = (qp_ssize_t *) malloc(size * sizeof(qp_ssize_t));
+            if (tmp != NULL && scanner->depth)
+            {
+                memcpy(
+                        tmp,
+                        scanner->frames,
+                        scanner->depth * sizeof(qp_ssize_t));
+            }
+        }
+        else
+        {
+            tmp = (qp_ssize_t *) realloc(
+                    scanner->frames,
+                    size * sizeof(qp_ssize_t));
+        }
+        if (tmp == NULL)
+        {
+            scanner->err = QP_SCAN_ERR_MEMORY;
+            return -1;
+        }
+        scanner->frames = tmp;
+        scanner->size = size;
+    }
+    scanner->frames[scanner->depth++] = frame;
+    return 0;
+}
+
+/*
+ * Size of the tokens which have a fixed size, by type. This is 0 for typed
+ * arrays, raw data with a length, arrays and maps which are not empty and
+ * close characters.
+ */
+static const unsigned char scan_fixed_size[256] = {
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*   0 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  16 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  32 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  48 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  64 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  80 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /*  96 */
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  1,  1,  1,  /* 112 */
+      1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16,  /* 128 */
+     17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32,  /* 144 */
+     33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48,  /* 160 */
+     49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64,  /* 176 */
+     65, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80,  /* 192 */
+     81, 82, 83, 84, 85, 86, 87, 88, 89, 90, 91, 92, 93, 94, 95, 96,  /* 208 */
+     97, 98, 99,100,  0,  0,  0,  0,  2,  3,  5,  9,  9,  1,  0,  0,  /* 224 */
+      0,  0,  0,  1,  0,  0,  0,  0,  0,  1,  1,  1,  0,  0,  0,  0,  /* 240 */
+};
+
+/*
+ * Used within qp_scanner_run() to write a token to the tape.
+ */
+#define SCAN_TAPE_ADD(__n)                                              \
+if (tape != NULL)                                                       \
+{                                                                       \
+    if (ntokens == tape->size)                                          \
+    {                                                                   \
+        tape->len = ntokens;                                            \
+        if (tape_grow(tape))                                            \
+        {                                                               \
+            goto memory;                                                \
+        }                                                               \
+        tokens = tape->tokens;                                          \
+    }                                                                   \
+    tokens[ntokens].pos = pos;                                          \
+    tokens[ntokens].n = __n;                                            \
+    ntokens++;                                                          \
+}
+
+/*
+ * Scan from `scanner->pos` until one complete value is found or the end of
+ * `data` is reached. On QP_SCAN_DONE, `scanner->pos` is the end of the value.
+ * The position, depth, frames and tape are kept in locals while scanning.
+ */
+qp_scan_rc_t qp_scanner_run(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        qp_ssize_t len)
+{
+    qp_ssize_t pos = scanner->pos;
+    qp_ssize_t depth = scanner->depth;
+    qp_ssize_t * frames = scanner->frames;
+    qp_tape_t * tape = scanner->tape;
+    qp_token_t * tokens = (tape != NULL) ? tape->tokens : NULL;
+    qp_ssize_t ntokens = (tape != NULL) ? tape->len : 0;
+    qp_ssize_t frame;
+    qp_ssize_t size;
+    qp_ssize_t n;
+    qp_scan_rc_t rc = QP_SCAN_MORE;
+
+    while (pos < len)
+    {
+        unsigned char tp = data[pos];
+
+        /*
+         * Most tokens have a fixed size. A single byte is handled on its own
+         * so the next position does not depend on the loaded size.
+         */
+        size = scan_fixed_size[tp];
+        if (size == 1)
+        {
+            SCAN_TAPE_ADD(1)
+            pos++;
+        }
+        else
+        {
+            if (size == 0)
+            {
+                switch ((qp_types_t) tp)
+                {
+                case QP_ARRAY1:
+                case QP_ARRAY2:
+                case QP_ARRAY3:
+                case QP_ARRAY4:
+                case QP_ARRAY5:
+                    frame = n = tp - QP_ARRAY0;
+                    goto push;
+                case QP_MAP1:
+                case QP_MAP2:
+                case QP_MAP3:
+                case QP_MAP4:
+                case QP_MAP5:
+                    n = tp - QP_MAP0;
+                    frame = n * 2;
+                    goto push;
+                case QP_ARRAY_OPEN:
+                    frame = QP_SCAN_OPEN_ARRAY;
+                    n = 0;
+                    goto push;
+                case QP_MAP_OPEN:
+                    frame = QP_SCAN_OPEN_MAP_KEY;
+                    n = 0;
+push:
+                    scanner->depth = depth;
+                    if (scanner_push(scanner, frame))
+                    {
+                        rc = QP_SCAN_ERROR;
+                        goto done;
+                    }
+                    frames = scanner->frames;
+                    SCAN_TAPE_ADD(n)
+                    if (tape != NULL && frame < 0 &&
+                        tape_parent(tape, depth, ntokens - 1))
+                    {
+                        goto memory;
+                    }
+                    depth++;
+                    pos++;
+                    continue;
+                case QP_ARRAY_CLOSE:
+                case QP_MAP_CLOSE:
+                    if (depth == 0 || frames[depth - 1] != (
+                            tp == QP_ARRAY_CLOSE
+                                ? QP_SCAN_OPEN_ARRAY
+                                : QP_SCAN_OPEN_MAP_KEY))
+                    {
+                        scanner->err = QP_SCAN_ERR_CLOSE;
+                        rc = QP_SCAN_ERROR;
+                        goto done;
+                    }
+                    depth--;
+                    pos++;
+                    goto complete;
+                default:
+                    /* typed arrays, back-references and raw data with a
+                     * length */
+                    size = qp_token_size(data + pos, len - pos);
+                    if (size <= 0)
+                    {
+                        if (size < 0)
+                        {
+                            scanner->err = (size == -1)
+                                    ? QP_SCAN_ERR_RAW_SIZE
+                                    : (size == -2)
+                                    ? QP_SCAN_ERR_TYPED
+                                    : (size == -3)
+                                    ? QP_SCAN_ERR_REF
+                                    : QP_SCAN_ERR_TEMPLATE;
+                            rc = QP_SCAN_ERROR;
+                        }
+                        goto done;
+                    }
+                    if (tp == QP_HOOK && data[pos + 1] == QP_TEMPLATE)
+                    {
+                        /* the array which follows is the value */
+                        SCAN_TAPE_ADD(size)
+                        scanner->templates++;
+                        pos += size;
+                        continue;
+                    }
+                    if (tp == QP_HOOK && (
+                            data[pos + 1] == QP_REF ||
+                            data[pos + 1] == QP_DICT))
+                    {
+                        scanner->refs++;
+                    }
+                }
+            }
+            else if (size > len - pos)
+            {
+                goto done;
+            }
+
+            SCAN_TAPE_ADD(size)
+            pos += size;
+        }
+
+complete:
+        /* a value is complete, update the frames of the parents */
+        while (depth)
+        {
+            frame = frames[depth - 1];
+            if (frame > 0)
+            {
+                if ((frames[depth - 1] = frame - 1))
+                {
+                    break;
+                }
+                depth--;
+                continue;
+            }
+            if (frame == QP_SCAN_OPEN_MAP_KEY)
+            {
+                frames[depth - 1] = QP_SCAN_OPEN_MAP_VALUE;
+                break;
+            }
+            if (frame == QP_SCAN_OPEN_MAP_VALUE)
+            {
+                frames[depth - 1] = QP_SCAN_OPEN_MAP_KEY;
+            }
+            if (tape != NULL)
+            {
+                /* count the item of an open array, or pair of an open map */
+                tokens[tape->parents[depth - 1]].n++;
+            }
+            break;
+        }
+
+        if (depth == 0)
+        {
+            rc = QP_SCAN_DONE;
+            break;
+        }
+    }
+    goto done;
+
+memory:
+    scanner->err = QP_SCAN_ERR_MEMORY;
+    rc = QP_SCAN_ERROR;
+
+done:
+    if (tape != NULL)
+    {
+        tape->len = ntokens;
+    }
+    scanner->pos = pos;
+    scanner->depth = depth;
+    return rc;
+}
+
+/*
+ * Returns 1 when the end of the data completes the scanned value, which is
+ * when the data ends at a token boundary, the innermost container is an open
+ * array or an open map which is expecting a key, and the value which is
+ * closed this way completes each of the other containers, or is an item of
+ * an open array or a value of an open map. When the scanner writes a tape,
+ * the containers which are closed are counted as items of their parents.
+ */
+int qp_scanner_at_end(qp_scanner_t * scanner, qp_ssize_t len)
+{
+    qp_ssize_t i;
+    qp_ssize_t frame;
+    qp_ssize_t depth = scanner->depth;
+
+    if (scanner->pos != len || depth == 0)
+    {
+        return 0;
+    }
+    frame = scanner->frames[depth - 1];
+    if (frame != QP_SCAN_OPEN_ARRAY && frame != QP_SCAN_OPEN_MAP_KEY)
+    {
+        return 0;
+    }
+    for (i = 0; i < depth - 1; i++)
+    {
+        frame = scanner->frames[i];
+        if (frame != 1 &&
+            frame != QP_SCAN_OPEN_ARRAY &&
+            frame != QP_SCAN_OPEN_MAP_VALUE)
+        {
+            return 0;
+        }
+    }
+    if (scanner->tape != NULL)
+    {
+        for (i = 0; i < depth - 1; i++)
+        {
+            if (scanner->frames[i] < 0)
+            {
+                scanner->tape->tokens[scanner->tape->parents[i]].n++;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Returns the number of items of the array at token `i` of a tape, or -1
+ * when the token is not an array.
+ */
+static qp_ssize_t tape_array_size(
+        const qp_tape_t * tape,
+        const unsigned char * data,
+        qp_ssize_t i)
+{
+    unsigned char tp = data[tape->tokens[i].pos];
+
+    if (tp == QP_ARRAY0)
+    {
+        return 0;  /* the token has the size in bytes */
+    }
+    return ((tp > QP_ARRAY0 && tp <= QP_ARRAY5) || tp == QP_ARRAY_OPEN)
+            ? tape->tokens[i].n
+            : -1;
+}
+
+/*
+ * Returns -1 when the template at token `i` of a complete tape is valid, or
+ * else the index of the invalid token. The array of a template must start
+ * with the keys, which is any value that unpacks to a list, followed by an
+ * array with a value for each key for each record.
+ */
+static qp_ssize_t tape_check_template(
+        const qp_tape_t * tape,
+        const unsigned char * data,
+        qp_ssize_t i)
+{
+    qp_ssize_t n = tape_array_size(tape, data, i + 1);
+    qp_ssize_t keys;
+    const unsigned char * pt;
+
+    if (n == 0)
+    {
+        return i;
+    }
+
+    i += 2;
+    pt = data + tape->tokens[i].pos;
+    keys = (pt[0] == QP_HOOK && pt[1] == QP_TEMPLATE)
+            ? tape_array_size(tape, data, i + 1) - 1
+            : tape_array_size(tape, data, i);
+    if (keys < 0)
+    {
+        return i;
+    }
+
+    while (--n)
+    {
+        i = qp_tape_next(tape, data, i);
+        if (tape_array_size(tape, data, i) != keys)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Check the value on the complete tape of `scanner` for a back-reference to
+ * raw data which is not numbered before it, and for an invalid template.
+ * This is not done while scanning since part of a value can refer to raw
+ * data before that part. On QP_SCAN_ERROR, `scanner->pos` is the offset of
+ * the invalid token.
+ */
+qp_scan_rc_t qp_scanner_check(
+        qp_scanner_t * scanner,
+        const unsigned char * data)
+{
+    const qp_tape_t * tape = scanner->tape;
+    qp_ssize_t raws = 0;
+    qp_ssize_t i;
+
+    for (i = 0; i < tape->len; i++)
+    {
+        const unsigned char * pt = data + tape->tokens[i].pos;
+        qp_ssize_t invalid;
+
+        if (pt[0] >= 128 + QP_REF_MIN_SZ && pt[0] <= QP_RAW64)
+        {
+            raws++;  /* numbered for back-references, see QP_REF */
+        }
+        else if (pt[0] != QP_HOOK)
+        {
+            continue;
+        }
+        else if (pt[1] == QP_REF && qp_ref_index(pt) >= raws)
+        {
+            scanner->err = QP_SCAN_ERR_REF;
+            scanner->pos = tape->tokens[i].pos;
+            return QP_SCAN_ERROR;
+        }
+        else if (pt[1] == QP_TEMPLATE &&
+                 (invalid = tape_check_template(tape, data, i)) != -1)
+        {
+            scanner->err = QP_SCAN_ERR_TEMPLATE;
+            scanner->pos = tape->tokens[invalid].pos;
+            return QP_SCAN_ERROR;
+        }
+    }
+    return QP_SCAN_DONE;
+}
+
+/*
+ * Returns the index of the token after the value which starts at token `i`
+ * of a complete tape for `data`; the items of arrays and maps are skipped.
+ */
+qp_ssize_t qp_tape_next(
+        const qp_tape_t * tape,
+        const unsigned char * data,
+        qp_ssize_t i)
+{
+    qp_ssize_t remaining = 1;
+
+    do
+    {
+        const qp_token_t * token = &tape->tokens[i++];
+
+        switch ((qp_types_t) data[token->pos])
+        {
+        case QP_ARRAY1:
+        case QP_ARRAY2:
+        case QP_ARRAY3:
+        case QP_ARRAY4:
+        case QP_ARRAY5:
+        case QP_ARRAY_OPEN:
+            remaining += token->n;
+            break;
+        case QP_MAP1:
+        case QP_MAP2:
+        case QP_MAP3:
+        case QP_MAP4:
+        case QP_MAP5:
+        case QP_MAP_OPEN:
+            remaining += 2 * token->n;
+            break;
+        case QP_HOOK:
+            if (data[token->pos + 1] == QP_TEMPLATE)
+            {
+                remaining++;  /* the array of the template */
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    while (--remaining);
+
+    return i;
+}
+
+/*
+ * Scan from `scanner->pos` until a value is complete, or until the end of
+ * `data` completes the value.
+ */
+qp_scan_rc_t qp_scan(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        qp_ssize_t len)
+{
+    qp_scan_rc_t rc = qp_scanner_run(scanner, data, len);
+    if (rc == QP_SCAN_MORE && qp_scanner_at_end(scanner, len))
+    {
+        rc = QP_SCAN_DONE;
+    }
+    return rc;
+}
+
+/*
+ * Used within qp_read() to call a callback which might be NULL.
+ */
+#define QP_CALLBACK(__fn, ...)                                          \
+if (callbacks->__fn != NULL && callbacks->__fn(arg, __VA_ARGS__))       \
+{                                                                       \
+    rc = QP_READ_STOP;                                                  \
+    goto done;                                                          \
+}
+
+#define QP_CALLBACK_END(__fn)                                           \
+if (callbacks->__fn != NULL && callbacks->__fn(arg))                    \
+{                                                                       \
+    rc = QP_READ_STOP;                                                  \
+    goto done;                                                          \
+}
+
+qp_read_rc_t qp_read(
+        const unsigned char * data,
+        qp_ssize_t len,
+        qp_ssize_t * pos,
+        qp_ssize_t max_depth,
+        const qp_callbacks_t * callbacks,
+        void * arg,
+        qp_scan_err_t * err)
+{
+    qp_token_t stack[QP_TAPE_STACK_SZ];
+    qp_ssize_t frames[QP_SCAN_STACK_SZ];
+    qp_scanner_t scanner;
+    qp_tape_t tape;
+    qp_ssize_t * remaining;
+    qp_ssize_t depth = 0;
+    qp_ssize_t i;
+    qp_read_rc_t rc = QP_READ_DONE;
+
+    qp_tape_init(&tape, stack);
+    scanner.frames = scanner.stack = frames;
+    scanner.size = QP_SCAN_STACK_SZ;
+    scanner.max_depth = max_depth ? max_depth : QP_MAX_DEPTH;
+    scanner.tape = &tape;
+    qp_scanner_reset(&scanner);
+    scanner.pos = *pos;
+
+    switch (qp_scan(&scanner, data, len))
+    {
+    case QP_SCAN_DONE:
+        break;
+    case QP_SCAN_MORE:
+        rc = QP_READ_MORE;
+        goto done;
+    case QP_SCAN_ERROR:
+        *pos = scanner.pos;
+        *err = scanner.err;
+        rc = QP_READ_ERROR;
+        goto done;
+    }
+
+    /*
+     * The frames of the scanner have room for the deepest container, so they
+     * are used again for the number of values which remain in each array and
+     * map; this is negative for a map.
+     */
+    remaining = scanner.frames;
+
+    for (i = 0; i < tape.len; i++)
+    {
+        const unsigned char * pt = data + tape.tokens[i].pos;
+        qp_ssize_t n = tape.tokens[i].n;
+        unsigned char tp = *pt;
+
+        if (tp < 64)
+        {
+            QP_CALLBACK(on_int, (int64_t) tp)
+        }
+        else if (tp < QP_HOOK)
+        {
+            QP_CALLBACK(on_int, (int64_t) 63 - tp)
+        }
+        else if (tp == QP_HOOK && pt[1] == QP_REF)
+        {
+            QP_CALLBACK(on_ref, qp_ref_index(pt))
+        }
+        else if (tp == QP_HOOK && pt[1] == QP_DICT)
+        {
+            QP_CALLBACK(on_dict, qp_ref_index(pt))
+        }
+        else if (tp == QP_HOOK && pt[1] == QP_TEMPLATE)
+        {
+            QP_CALLBACK_END(on_template)
+            continue;  /* the array is the value */
+        }
+        else if (tp == QP_HOOK)
+        {
+            qp_ssize_t size = 2 + qp_raw_header_size(pt[2]);
+            QP_CALLBACK(on_typed, (char) pt[1], pt + size, n - size)
+        }
+        else if (tp < 128)
+        {
+            QP_CALLBACK(on_double, (double) (tp - QP_DOUBLE_0))
+        }
+        else if (tp <= QP_RAW64)
+        {
+            qp_ssize_t size = qp_raw_header_size(tp);
+            QP_CALLBACK(on_raw, pt + size, n - size)
+        }
+        else switch ((qp_types_t) tp)
+        {
+        case QP_INT8:
+            QP_CALLBACK(on_int, (int64_t) (int8_t) pt[1])
+            break;
+        case QP_INT16:
+        {
+            int16_t integer;
+            memcpy(&integer, pt + 1, sizeof(int16_t));
+            QP_CALLBACK(on_int, (int64_t) integer)
+            break;
+        }
+        case QP_INT32:
+        {
+            int32_t integer;
+            memcpy(&integer, pt + 1, sizeof(int32_t));
+            QP_CALLBACK(on_int, (int64_t) integer)
+            break;
+        }
+        case QP_INT64:
+        {
+            int64_t integer;
+            memcpy(&integer, pt + 1, sizeof(int64_t));
+            QP_CALLBACK(on_int, integer)
+            break;
+        }
+        case QP_DOUBLE:
+        {
+            double d;
+            memcpy(&d, pt + 1, sizeof(double));
+            QP_CALLBACK(on_double, d)
+            break;
+        }
+        case QP_TRUE:
+        case QP_FALSE:
+            QP_CALLBACK(on_bool, tp == QP_TRUE)
+            break;
+        case QP_NULL:
+            QP_CALLBACK_END(on_null)
+            break;
+        case QP_ARRAY0:
+        case QP_ARRAY1:
+        case QP_ARRAY2:
+        case QP_ARRAY3:
+        case QP_ARRAY4:
+        case QP_ARRAY5:
+        case QP_ARRAY_OPEN:
+            if (tp == QP_ARRAY0)
+            {
+                n = 0;
+            }
+            QP_CALLBACK(on_array, n)
+            if (n)
+            {
+                remaining[depth++] = n;
+                continue;
+            }
+            QP_CALLBACK_END(on_array_end)
+            break;
+        default:
+            /* maps, close characters are not written to the tape */
+            if (tp == QP_MAP0)
+            {
+                n = 0;
+            }
+            QP_CALLBACK(on_map, n)
+            if (n)
+            {
+                remaining[depth++] = -2 * n;
+                continue;
+            }
+            QP_CALLBACK_END(on_map_end)
+        }
+
+        /* a value is complete, end the containers which are complete */
+        while (depth)
+        {
+            qp_ssize_t r = remaining[depth - 1];
+            if ((remaining[depth - 1] = (r > 0) ? r - 1 : r + 1))
+            {
+                break;
+            }
+            depth--;
+            if (r > 0)
+            {
+                QP_CALLBACK_END(on_array_end)
+            }
+            else
+            {
+                QP_CALLBACK_END(on_map_end)
+            }
+        }
+    }
+    *pos = scanner.pos;
+
+done:
+    if (scanner.frames != scanner.stack)
+    {
+        free(scanner.frames);
+    }
+    qp_tape_free(&tape);
+    return rc;
+}
+
+/*
+ * BLAKE2b, see RFC 7693.
+ */
+static const uint64_t digest_iv[8] =
+{
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char digest_sigma[12][16] =
+{
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}
+};
+
+#define DIGEST_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define DIGEST_G(a, b, c, d, x, y)                                      \
+do                                                                      \
+{                                                                       \
+    v[a] = v[a] + v[b] + (x);                                           \
+    v[d] = DIGEST_ROTR(v[d] ^ v[a], 32);                                \
+    v[c] = v[c] + v[d];                                                 \
+    v[b] = DIGEST_ROTR(v[b] ^ v[c], 24);                                \
+    v[a] = v[a] + v[b] + (y);                                           \
+    v[d] = DIGEST_ROTR(v[d] ^ v[a], 16);                                \
+    v[c] = v[c] + v[d];                                                 \
+    v[b] = DIGEST_ROTR(v[b] ^ v[c], 63);                                \
+}                                                                       \
+while (0)
+
+void qp_digest_init(qp_digest_t * digest)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        digest->h[i] = digest_iv[i];
+    }
+    /* parameter block: digest length, no key, fanout and depth 1 */
+    digest->h[0] ^= 0x01010000ULL ^ QP_DIGEST_SZ;
+    digest->t[0] = digest->t[1] = 0;
+    digest->len = 0;
+}
+
+/*
+ * Add `len` bytes of `data`. The last block is kept in the buffer since it
+ * is compressed differently by qp_digest_final().
+ */
+void qp_digest_update(
+        qp_digest_t * digest,
+        const unsigned char * data,
+        qp_ssize_t len)
+{
+    while (len > 0)
+    {
+        size_t n;
+
+        if (digest->len == sizeof(digest->buf))
+        {
+            digest_compress(digest, digest->buf, 0);
+            digest->len = 0;
+        }
+
+        if (digest->len == 0 && len > (qp_ssize_t) sizeof(digest->buf))
+        {
+            /* compress full blocks without copying them */
+            digest_compress(digest, data, 0);
+            data += sizeof(digest->buf);
+            len -= sizeof(digest->buf);
+            continue;
+        }
+
+        n = sizeof(digest->buf) - digest->len;
+        if ((qp_ssize_t) n > len)
+        {
+            n = (size_t) len;
+        }
+        memcpy(digest->buf + digest->len, data, n);
+        digest->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write the QP_DIGEST_SZ bytes of the digest to `out`.
+ */
+void qp_digest_final(qp_digest_t * digest, unsigned char * out)
+{
+    int i;
+
+    memset(digest->buf + digest->len, 0, sizeof(digest->buf) - digest->len);
+    digest_compress(digest, digest->buf, 1);
+
+    for (i = 0; i < QP_DIGEST_SZ; i++)
+    {
+        out[i] = (unsigned char) (digest->h[i / 8] >> (8 * (i % 8)));
+    }
+}
+
+/*
+ * Compress a block of 128 bytes. The byte counter includes the data of this
+ * block; for the last block only the bytes in the buffer are counted.
+ */
+static void digest_compress(
+        qp_digest_t * digest,
+        const unsigned char * block,
+        int last)
+{
+    uint64_t v[16], m[16];
+    uint64_t n = last ? digest->len : sizeof(digest->buf);
+    int i;
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    int j;
+#endif
+
+    digest->t[0] += n;
+    if (digest->t[0] < n)
+    {
+        digest->t[1]++;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(m, block, sizeof(m));
+#else
+    for (i = 0; i < 16; i++)
+    {
+        /* the words are little-endian, on any platform */
+        m[i] = 0;
+        for (j = 7; j >= 0; j--)
+        {
+            m[i] = (m[i] << 8) | block[i * 8 + j];
+        }
+    }
+#endif
+
+    for (i = 0; i < 8; i++)
+    {
+        v[i] = digest->h[i];
+        v[i + 8] = digest_iv[i];
+    }
+    v[12] ^= digest->t[0];
+    v[13] ^= digest->t[1];
+    if (last)
+    {
+        v[14] = ~v[14];
+    }
+
+    for (i = 0; i < 12; i++)
+    {
+        const unsigned char * s = digest_sigma[i];
+        DIGEST_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        DIGEST_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        DIGEST_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        DIGEST_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        DIGEST_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        DIGEST_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        DIGEST_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        DIGEST_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        digest->h[i] ^= v[i] ^ v[i + 8];
+    }
+}
@@ -0,0 +1,734 @@
+/*
+ * qpack.h - QPack format library
+ *
+ * The QPack type codes, encoding of values and the scanner which validates
+ * packed data and writes a tape with the tokens of a value. This library does
+ * not depend on Python; the Python extension and the C++ header qpack.hpp are
+ * both built on top of it.
+ */
+#ifndef QPACK_H_
+#define QPACK_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+
+/* Copied from stdint.h */
+#if (_MSC_VER < 1300)
+  typedef signed char       int8_t;
+  typedef signed short      int16_t;
+  typedef signed int        int32_t;
+  typedef unsigned char     uint8_t;
+  typedef unsigned short    uint16_t;
+  typedef unsigned int      uint32_t;
+#else
+  typedef signed __int8     int8_t;
+  typedef signed __int16    int16_t;
+  typedef signed __int32    int32_t;
+  typedef unsigned __int8   uint8_t;
+  typedef unsigned __int16  uint16_t;
+  typedef unsigned __int32  uint32_t;
+#endif
+typedef signed __int64      int64_t;
+typedef unsigned __int64    uint64_t;
+
+#else
+#include <stdint.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__cplusplus)
+#define QP_INLINE static __inline
+#else
+#define QP_INLINE static inline
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* signed size type for offsets and sizes, the same size as a pointer */
+typedef ptrdiff_t qp_ssize_t;
+
+#define QP_SSIZE_MAX ((qp_ssize_t) (((size_t) -1) >> 1))
+
+typedef enum
+{
+    /*
+     * Values with -##- will never be returned while unpacking. For example
+     * a QP_INT8 (1 byte signed integer) will be returned as QP_INT64.
+     */
+    QP_END,             /* at the end while unpacking */
+    QP_RAW,             /* raw string */
+    /*
+     * Both END and RAW are never actually packed but 0 and 1 are reserved
+     * for positive signed integers.
+     *
+     * Fixed positive integers from 0 till 63       [  0...63  ]
+     *
+     * Fixed negative integers from -60 till -1     [ 64...123 ]
+     *
+     */
+    QP_HOOK=124,        /* Typed array, back-reference, dictionary
+                           reference or template, see QP_TYPED_FORMATS,
+                           QP_REF, QP_DICT and QP_TEMPLATE */
+    QP_DOUBLE_N1=125,   /* ## double value -1.0 */
+    QP_DOUBLE_0,        /* ## double value 0.0 */
+    QP_DOUBLE_1,        /* ## double value 1.0 */
+    /*
+     * Fixed raw strings lengths from 0 till 99     [ 128...227 ]
+     */
+    QP_RAW8=228,        /* ## raw string with length < 1 byte */
+    QP_RAW16,           /* ## raw string with length < 1 byte */
+    QP_RAW32,           /* ## raw string with length < 1 byte */
+    QP_RAW64,           /* ## raw string with length < 1 byte */
+    QP_INT8,            /* ## 1 byte signed integer */
+    QP_INT16,           /* ## 2 byte signed integer */
+    QP_INT32,           /* ## 4 byte signed integer */
+    QP_INT64,           /* 8 bytes signed integer */
+    QP_DOUBLE,          /* 8 bytes double */
+    QP_ARRAY0,          /* empty array */
+    QP_ARRAY1,          /* array with 1 item */
+    QP_ARRAY2,          /* array with 2 items */
+    QP_ARRAY3,          /* array with 3 items */
+    QP_ARRAY4,          /* array with 4 items */
+    QP_ARRAY5,          /* array with 5 items */
+    QP_MAP0,            /* empty map */
+    QP_MAP1,            /* map with 1 item */
+    QP_MAP2,            /* map with 2 items */
+    QP_MAP3,            /* map with 3 items */
+    QP_MAP4,            /* map with 4 items */
+    QP_MAP5,            /* map with 5 items */
+    QP_TRUE,            /* boolean true */
+    QP_FALSE,           /* boolean false */
+    QP_NULL,            /* null (none, nil) */
+    QP_ARRAY_OPEN,      /* open a new array */
+    QP_MAP_OPEN,        /* open a new map */
+    QP_ARRAY_CLOSE,     /* close array */
+    QP_MAP_CLOSE        /* close map */
+} qp_types_t;
+
+/*
+ * Maximum number of nested containers which are packed or unpacked, unless
+ * a different max_depth is given.
+ */
+#define QP_MAX_DEPTH 1024
+
+/*
+ * A typed array is packed as QP_HOOK, followed by one of these format
+ * characters and a raw with the items in little-endian byte order.
+ */
+#define QP_TYPED_FORMATS "bBhHiIqQfd"
+
+/*
+ * A back-reference is packed as QP_HOOK, followed by QP_REF and a positive
+ * integer of at most 32 bits with the index of earlier raw data in the same
+ * value. The raw data which is packed with at least QP_REF_MIN_SZ bytes is
+ * numbered from 0 in the order of the data, except the raw of a typed
+ * array; a back-reference is not numbered itself.
+ */
+#define QP_REF 'r'
+#define QP_REF_MIN_SZ 3
+
+/*
+ * A dictionary reference is packed as QP_HOOK, followed by QP_DICT and a
+ * positive integer of at most 32 bits with the index of a string in the
+ * dictionary of a session; this dictionary is kept in sync by the packer and
+ * the unpacker of a stream of values. It starts with the strings which are
+ * preloaded by both sides. After each value, the raw data which is numbered
+ * for back-references and has at most QP_DICT_MAX_SZ bytes is added in
+ * order; once the dictionary is full, each string replaces the oldest string
+ * which is added after the preloaded strings.
+ */
+#define QP_DICT 's'
+#define QP_DICT_MAX_SZ 64
+
+/*
+ * A list of records with the same keys is packed as QP_HOOK, followed by
+ * QP_TEMPLATE and an array. The first item of the array is an array with the
+ * keys, and each next item is a record: an array with a value for each key.
+ * The template is a prefix of the array, so the scanner writes a token for
+ * QP_TEMPLATE which is not an item of a container.
+ */
+#define QP_TEMPLATE 't'
+
+/*
+ * Encoding. The qp_put_* functions write a value to `pt`, which must have
+ * room for the number of bytes which is returned by the matching qp_*_size
+ * function, and return the number of bytes written.
+ */
+
+/* maximum size of a packed integer or double */
+#define QP_NUMBER_MAX_SZ 9
+
+QP_INLINE qp_ssize_t qp_int64_size(int64_t i)
+{
+    return (i >= -60 && i < 64) ? 1 :
+           (i == (int8_t) i) ? 2 :
+           (i == (int16_t) i) ? 3 :
+           (i == (int32_t) i) ? 5 : 9;
+}
+
+QP_INLINE qp_ssize_t qp_put_int64(unsigned char * pt, int64_t i)
+{
+    int8_t i8;
+    int16_t i16;
+    int32_t i32;
+
+    if ((i8 = (int8_t) i) == i)
+    {
+        if (i8 >= 0 && i8 < 64)
+        {
+            *pt = (unsigned char) i8;
+            return 1;
+        }
+        if (i8 >= -60 && i8 < 0)
+        {
+            *pt = (unsigned char) (63 - i8);
+            return 1;
+        }
+        pt[0] = QP_INT8;
+        pt[1] = (unsigned char) i8;
+        return 2;
+    }
+
+    if ((i16 = (int16_t) i) == i)
+    {
+        *pt = QP_INT16;
+        memcpy(pt + 1, &i16, sizeof(int16_t));
+        return 3;
+    }
+
+    if ((i32 = (int32_t) i) == i)
+    {
+        *pt = QP_INT32;
+        memcpy(pt + 1, &i32, sizeof(int32_t));
+        return 5;
+    }
+
+    *pt = QP_INT64;
+    memcpy(pt + 1, &i, sizeof(int64_t));
+    return 9;
+}
+
+QP_INLINE qp_ssize_t qp_double_size(double d)
+{
+    return (d == -1.0 || d == 0.0 || d == 1.0) ? 1 : 9;
+}
+
+QP_INLINE qp_ssize_t qp_put_double(unsigned char * pt, double d)
+{
+    if (d == -1.0)
+    {
+        *pt = QP_DOUBLE_N1;
+        return 1;
+    }
+    if (d == 0.0)
+    {
+        *pt = QP_DOUBLE_0;
+        return 1;
+    }
+    if (d == 1.0)
+    {
+        *pt = QP_DOUBLE_1;
+        return 1;
+    }
+    *pt = QP_DOUBLE;
+    memcpy(pt + 1, &d, sizeof(double));
+    return 9;
+}
+
+/*
+ * Returns the size of the header of a raw with `size` bytes of data.
+ */
+QP_INLINE qp_ssize_t qp_raw_size(qp_ssize_t size)
+{
+    return (size < 100) ? 1 :
+           (size < 256) ? 2 :
+           (size < 65536) ? 3 :
+           ((uint64_t) size < 4294967296ULL) ? 5 : 9;
+}
+
+/*
+ * Write the header of a raw with `size` bytes of data; the data itself is
+ * written after the header by the caller.
+ */
+QP_INLINE qp_ssize_t qp_put_raw(unsigned char * pt, qp_ssize_t size)
+{
+    if (size < 100)
+    {
+        *pt = (unsigned char) (128 + size);
+        return 1;
+    }
+    if (size < 256)
+    {
+        pt[0] = QP_RAW8;
+        pt[1] = (unsigned char) size;
+        return 2;
+    }
+    if (size < 65536)
+    {
+        uint16_t length = (uint16_t) size;
+        *pt = QP_RAW16;
+        memcpy(pt + 1, &length, sizeof(uint16_t));
+        return 3;
+    }
+    if ((uint64_t) size < 4294967296ULL)
+    {
+        uint32_t length = (uint32_t) size;
+        *pt = QP_RAW32;
+        memcpy(pt + 1, &length, sizeof(uint32_t));
+        return 5;
+    }
+    {
+        uint64_t length = (uint64_t) size;
+        *pt = QP_RAW64;
+        memcpy(pt + 1, &length, sizeof(uint64_t));
+        return 9;
+    }
+}
+
+/*
+ * Returns the size of a back-reference to raw data `index`.
+ */
+QP_INLINE qp_ssize_t qp_ref_size(qp_ssize_t index)
+{
+    return 2 + qp_int64_size((int64_t) index);
+}
+
+QP_INLINE qp_ssize_t qp_put_ref(unsigned char * pt, qp_ssize_t index)
+{
+    pt[0] = QP_HOOK;
+    pt[1] = QP_REF;
+    return 2 + qp_put_int64(pt + 2, (int64_t) index);
+}
+
+/*
+ * Write a reference to dictionary string `index`, which has the same size as
+ * a back-reference.
+ */
+QP_INLINE qp_ssize_t qp_put_dict(unsigned char * pt, qp_ssize_t index)
+{
+    pt[0] = QP_HOOK;
+    pt[1] = QP_DICT;
+    return 2 + qp_put_int64(pt + 2, (int64_t) index);
+}
+
+/*
+ * Returns the index of the back-reference or dictionary reference at `pt`,
+ * which must be a complete token as it is accepted by the scanner.
+ */
+QP_INLINE qp_ssize_t qp_ref_index(const unsigned char * pt)
+{
+    switch (pt[2])
+    {
+    case QP_INT8:
+        return (qp_ssize_t) (int8_t) pt[3];
+    case QP_INT16:
+        {
+            int16_t i16;
+            memcpy(&i16, pt + 3, sizeof(int16_t));
+            return (qp_ssize_t) i16;
+        }
+    case QP_INT32:
+        {
+            int32_t i32;
+            memcpy(&i32, pt + 3, sizeof(int32_t));
+            return (qp_ssize_t) i32;
+        }
+    default:
+        return (qp_ssize_t) pt[2];
+    }
+}
+
+/*
+ * Returns the type which starts an array or map with `n` items, or the open
+ * type when `n` is larger than 5 or negative for an unknown size. An open
+ * array or map must be closed, except at the end of the data.
+ */
+QP_INLINE unsigned char qp_array_type(qp_ssize_t n)
+{
+    return (n >= 0 && n < 6) ? (unsigned char) (QP_ARRAY0 + n) : QP_ARRAY_OPEN;
+}
+
+QP_INLINE unsigned char qp_map_type(qp_ssize_t n)
+{
+    return (n >= 0 && n < 6) ? (unsigned char) (QP_MAP0 + n) : QP_MAP_OPEN;
+}
+
+/*
+ * A packer writes to a buffer which grows as required. The buffer is owned
+ * by the packer; set `buffer` to NULL to take ownership of the data.
+ */
+typedef struct
+{
+    unsigned char * buffer;
+    qp_ssize_t len;
+    qp_ssize_t size;
+} qp_packer_t;
+
+#define QP_PACKER_INIT_SZ 1024
+
+int qp_packer_init(qp_packer_t * packer, qp_ssize_t size);
+void qp_packer_free(qp_packer_t * packer);
+int qp_packer_grow(qp_packer_t * packer, qp_ssize_t n);
+
+#define QP_PACKER_RESIZE(packer, n)                                     \
+if ((packer)->len + (n) > (packer)->size && qp_packer_grow(packer, n))  \
+{                                                                       \
+    return -1;                                                          \
+}
+
+/*
+ * The qp_add_* functions append a value to the packer and return 0, or -1
+ * when the buffer cannot grow.
+ */
+QP_INLINE int qp_add_type(qp_packer_t * packer, unsigned char tp)
+{
+    QP_PACKER_RESIZE(packer, 1)
+    packer->buffer[packer->len++] = tp;
+    return 0;
+}
+
+QP_INLINE int qp_add_int64(qp_packer_t * packer, int64_t i)
+{
+    QP_PACKER_RESIZE(packer, QP_NUMBER_MAX_SZ)
+    packer->len += qp_put_int64(packer->buffer + packer->len, i);
+    return 0;
+}
+
+QP_INLINE int qp_add_double(qp_packer_t * packer, double d)
+{
+    QP_PACKER_RESIZE(packer, QP_NUMBER_MAX_SZ)
+    packer->len += qp_put_double(packer->buffer + packer->len, d);
+    return 0;
+}
+
+QP_INLINE int qp_add_raw(
+        qp_packer_t * packer,
+        const unsigned char * raw,
+        qp_ssize_t size)
+{
+    QP_PACKER_RESIZE(packer, qp_raw_size(size) + size)
+    packer->len += qp_put_raw(packer->buffer + packer->len, size);
+    memcpy(packer->buffer + packer->len, raw, size);
+    packer->len += size;
+    return 0;
+}
+
+/*
+ * Add a typed array with format `fmt`, see QP_TYPED_FORMATS. The `size` in
+ * bytes of the little-endian items at `raw` must be a multiple of the item
+ * size.
+ */
+QP_INLINE int qp_add_typed(
+        qp_packer_t * packer,
+        char fmt,
+        const unsigned char * raw,
+        qp_ssize_t size)
+{
+    QP_PACKER_RESIZE(packer, 2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = (unsigned char) fmt;
+    return qp_add_raw(packer, raw, size);
+}
+
+/*
+ * Add a back-reference to raw data `index`, see QP_REF.
+ */
+QP_INLINE int qp_add_ref(qp_packer_t * packer, qp_ssize_t index)
+{
+    QP_PACKER_RESIZE(packer, 2 + QP_NUMBER_MAX_SZ)
+    packer->len += qp_put_ref(packer->buffer + packer->len, index);
+    return 0;
+}
+
+/*
+ * Add a reference to dictionary string `index`, see QP_DICT.
+ */
+QP_INLINE int qp_add_dict(qp_packer_t * packer, qp_ssize_t index)
+{
+    QP_PACKER_RESIZE(packer, 2 + QP_NUMBER_MAX_SZ)
+    packer->len += qp_put_dict(packer->buffer + packer->len, index);
+    return 0;
+}
+
+/*
+ * Start a template, see QP_TEMPLATE. Add an array with `n` + 1 items next:
+ * the array with the keys, followed by `n` records.
+ */
+QP_INLINE int qp_add_template(qp_packer_t * packer)
+{
+    QP_PACKER_RESIZE(packer, 2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_TEMPLATE;
+    return 0;
+}
+
+QP_INLINE int qp_add_bool(qp_packer_t * packer, int b)
+{
+    return qp_add_type(packer, b ? QP_TRUE : QP_FALSE);
+}
+
+QP_INLINE int qp_add_null(qp_packer_t * packer)
+{
+    return qp_add_type(packer, QP_NULL);
+}
+
+/*
+ * Start an array with `n` items, or with an unknown number of items when `n`
+ * is negative. Call qp_close_array() with the same `n` after the items.
+ */
+QP_INLINE int qp_add_array(qp_packer_t * packer, qp_ssize_t n)
+{
+    return qp_add_type(packer, qp_array_type(n));
+}
+
+QP_INLINE int qp_close_array(qp_packer_t * packer, qp_ssize_t n)
+{
+    return (n >= 0 && n < 6) ? 0 : qp_add_type(packer, QP_ARRAY_CLOSE);
+}
+
+/*
+ * Start a map with `n` key/value pairs, or with an unknown number of pairs
+ * when `n` is negative. Call qp_close_map() with the same `n` after the
+ * pairs.
+ */
+QP_INLINE int qp_add_map(qp_packer_t * packer, qp_ssize_t n)
+{
+    return qp_add_type(packer, qp_map_type(n));
+}
+
+QP_INLINE int qp_close_map(qp_packer_t * packer, qp_ssize_t n)
+{
+    return (n >= 0 && n < 6) ? 0 : qp_add_type(packer, QP_MAP_CLOSE);
+}
+
+/*
+ * Decoding. The scanner walks the type bytes of packed data and writes a
+ * tape with one token for each value, in the order in which the values
+ * start; close characters are not written to the tape. Since the number of
+ * items of every array and map is on the tape, also for open arrays and maps,
+ * each container can be created at its final size.
+ */
+typedef struct
+{
+    qp_ssize_t pos;     /* offset of the type byte */
+    qp_ssize_t n;       /* number of items of an array, key/value pairs of a
+                           map, or the size in bytes for other values */
+} qp_token_t;
+
+typedef struct
+{
+    qp_token_t * tokens;
+    qp_ssize_t len;
+    qp_ssize_t size;
+    qp_token_t * stack;     /* initial tokens on the C stack, or NULL */
+    qp_ssize_t * parents;   /* token index for the open arrays and maps, by
+                               the depth of their frame in the scanner */
+    qp_ssize_t parents_sz;
+} qp_tape_t;
+
+/* number of tape tokens which fit on the stack */
+#define QP_TAPE_STACK_SZ 64
+
+/*
+ * For each open container the scanner keeps a frame with the number of
+ * items which are still expected, or one of the QP_SCAN_OPEN_* values for
+ * open arrays and maps. The scanner stops at a token which is not completely
+ * available and can be resumed once more data has been received.
+ */
+#define QP_SCAN_OPEN_ARRAY -1
+#define QP_SCAN_OPEN_MAP_KEY -2
+#define QP_SCAN_OPEN_MAP_VALUE -3
+
+typedef enum
+{
+    QP_SCAN_DONE,       /* a complete value has been scanned */
+    QP_SCAN_MORE,       /* more data is required */
+    QP_SCAN_ERROR       /* invalid data, see scanner->err */
+} qp_scan_rc_t;
+
+typedef enum
+{
+    QP_SCAN_ERR_CLOSE,      /* unexpected array or map close character */
+    QP_SCAN_ERR_DEPTH,      /* data exceeds the maximum depth */
+    QP_SCAN_ERR_RAW_SIZE,   /* raw size does not fit in a qp_ssize_t */
+    QP_SCAN_ERR_TYPED,      /* invalid typed array */
+    QP_SCAN_ERR_MEMORY,     /* allocation error */
+    QP_SCAN_ERR_REF,        /* invalid back-reference or dictionary
+                               reference */
+    QP_SCAN_ERR_TEMPLATE    /* template which is not followed by an array */
+} qp_scan_err_t;
+
+typedef struct
+{
+    qp_ssize_t * frames;
+    qp_ssize_t * stack; /* initial frames on the C stack, or NULL */
+    qp_ssize_t depth;
+    qp_ssize_t size;
+    qp_ssize_t max_depth;
+    qp_ssize_t pos;     /* offset of the next token */
+    qp_scan_err_t err;
+    qp_tape_t * tape;   /* tape which is written by the scanner, or NULL */
+    qp_ssize_t refs;    /* number of back-references and dictionary
+                           references which are scanned */
+    qp_ssize_t templates;   /* number of templates which are scanned */
+} qp_scanner_t;
+
+/* number of scanner frames which fit on the stack */
+#define QP_SCAN_STACK_SZ 32
+
+void qp_tape_init(qp_tape_t * tape, qp_token_t * stack);
+void qp_tape_free(qp_tape_t * tape);
+void qp_scanner_reset(qp_scanner_t * scanner);
+qp_scan_rc_t qp_scanner_run(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        qp_ssize_t len);
+int qp_scanner_at_end(qp_scanner_t * scanner, qp_ssize_t len);
+qp_scan_rc_t qp_scanner_check(
+        qp_scanner_t * scanner,
+        const unsigned char * data);
+qp_scan_rc_t qp_scan(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        qp_ssize_t len);
+qp_ssize_t qp_token_size(const unsigned char * pt, qp_ssize_t n);
+qp_ssize_t qp_tape_next(
+        const qp_tape_t * tape,
+        const unsigned char * data,
+        qp_ssize_t i);
+
+/*
+ * Returns the number of bytes before the data of the raw with type `tp`.
+ */
+QP_INLINE qp_ssize_t qp_raw_header_size(unsigned char tp)
+{
+    switch (tp)
+    {
+    case QP_RAW8:
+        return 2;
+    case QP_RAW16:
+        return 3;
+    case QP_RAW32:
+        return 5;
+    case QP_RAW64:
+        return 9;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Returns the item size for a typed array format, or 0 when the format is
+ * not supported.
+ */
+QP_INLINE qp_ssize_t qp_typed_itemsize(unsigned char fmt)
+{
+    switch (fmt)
+    {
+    case 'b':
+    case 'B':
+        return 1;
+    case 'h':
+    case 'H':
+        return 2;
+    case 'i':
+    case 'I':
+    case 'f':
+        return 4;
+    case 'q':
+    case 'Q':
+    case 'd':
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * SAX-style reader. qp_read() calls one of these functions for each value;
+ * a callback which is NULL is skipped. For an array or map, on_array or
+ * on_map is called with the number of items or key/value pairs, followed by
+ * the items and on_array_end or on_map_end. Raw data and typed arrays point
+ * into the packed data. A back-reference calls on_ref with the index of the
+ * raw data, see QP_REF, and a dictionary reference calls on_dict with the
+ * index of the string, see QP_DICT. A template calls on_template, followed
+ * by the callbacks for its array, see QP_TEMPLATE. A callback which returns
+ * a non-zero value stops reading.
+ */
+typedef struct
+{
+    int (*on_int)(void * arg, int64_t i);
+    int (*on_double)(void * arg, double d);
+    int (*on_raw)(void * arg, const unsigned char * raw, qp_ssize_t size);
+    int (*on_typed)(
+            void * arg,
+            char fmt,
+            const unsigned char * raw,
+            qp_ssize_t size);
+    int (*on_bool)(void * arg, int b);
+    int (*on_null)(void * arg);
+    int (*on_array)(void * arg, qp_ssize_t n);
+    int (*on_array_end)(void * arg);
+    int (*on_map)(void * arg, qp_ssize_t n);
+    int (*on_map_end)(void * arg);
+    int (*on_ref)(void * arg, qp_ssize_t index);
+    int (*on_dict)(void * arg, qp_ssize_t index);
+    int (*on_template)(void * arg);
+} qp_callbacks_t;
+
+typedef enum
+{
+    QP_READ_DONE,       /* a value has been read */
+    QP_READ_MORE,       /* the value is incomplete */
+    QP_READ_ERROR,      /* invalid data, see `err` */
+    QP_READ_STOP        /* a callback has stopped reading */
+} qp_read_rc_t;
+
+/*
+ * Read the value at `*pos` in `data`, calling `callbacks` with `arg`. The
+ * complete value is validated before the first callback. On QP_READ_DONE,
+ * `*pos` is set to the end of the value; on QP_READ_ERROR, `*pos` is set to
+ * the position of the error and `*err` to the kind of error. A `max_depth`
+ * of 0 uses QP_MAX_DEPTH.
+ */
+qp_read_rc_t qp_read(
+        const unsigned char * data,
+        qp_ssize_t len,
+        qp_ssize_t * pos,
+        qp_ssize_t max_depth,
+        const qp_callbacks_t * callbacks,
+        void * arg,
+        qp_scan_err_t * err);
+
+/*
+ * Digest. BLAKE2b with a QP_DIGEST_SZ byte output of data which is added in
+ * any number of parts, for example to key a cache on canonical packed data
+ * without keeping all data in memory. The result is the same as for
+ * hashlib.blake2b(data, digest_size=32) in Python.
+ */
+#define QP_DIGEST_SZ 32
+
+typedef struct
+{
+    uint64_t h[8];              /* chained state */
+    uint64_t t[2];              /* number of bytes compressed */
+    unsigned char buf[128];     /* block which is not yet compressed */
+    size_t len;                 /* number of bytes in `buf` */
+} qp_digest_t;
+
+void qp_digest_init(qp_digest_t * digest);
+void qp_digest_update(
+        qp_digest_t * digest,
+        const unsigned char * data,
+        qp_ssize_t len);
+void qp_digest_final(qp_digest_t * digest, unsigned char * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* QPACK_H_ */
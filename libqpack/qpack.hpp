@@ -0,0 +1,396 @@
+/*
+ * qpack.hpp - QPack for C++
+ *
+ * Header-only encoder and decoder on top of the qpack library (qpack.h),
+ * for integral, floating point, string, vector and map types. Add support
+ * for another type by specializing qpack::traits<T>.
+ *
+ *     std::string packed = qpack::pack(std::map<std::string, int>{{"a", 1}});
+ *     auto m = qpack::unpack<std::map<std::string, int>>(packed);
+ */
+#ifndef QPACK_HPP_
+#define QPACK_HPP_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "qpack.h"
+
+namespace qpack
+{
+
+class error : public std::runtime_error
+{
+public:
+    explicit error(const std::string & msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Growing buffer with the packed data.
+ */
+class buffer
+{
+public:
+    buffer()
+    {
+        if (qp_packer_init(&packer_, 0))
+        {
+            throw std::bad_alloc();
+        }
+    }
+    ~buffer() { qp_packer_free(&packer_); }
+    buffer(const buffer &) = delete;
+    buffer & operator=(const buffer &) = delete;
+
+    const unsigned char * data() const { return packer_.buffer; }
+    size_t size() const { return (size_t) packer_.len; }
+    std::string str() const
+    {
+        return std::string((const char *) packer_.buffer, size());
+    }
+    qp_packer_t * packer() { return &packer_; }
+
+private:
+    qp_packer_t packer_;
+};
+
+inline void check(int rc)
+{
+    if (rc)
+    {
+        throw std::bad_alloc();
+    }
+}
+
+/*
+ * Tokens of a packed value, written by the scanner of the qpack library.
+ * The whole value is validated before anything is unpacked.
+ */
+class reader
+{
+public:
+    reader(const unsigned char * data, size_t len, size_t max_depth = 0)
+        : data_(data), next_(0)
+    {
+        qp_tape_init(&tape_, stack_);
+        scanner_.frames = scanner_.stack = frames_;
+        scanner_.size = QP_SCAN_STACK_SZ;
+        scanner_.max_depth = max_depth ? (qp_ssize_t) max_depth : QP_MAX_DEPTH;
+        scanner_.tape = &tape_;
+        qp_scanner_reset(&scanner_);
+
+        qp_scan_rc_t rc = qp_scan(&scanner_, data, (qp_ssize_t) len);
+        if (rc != QP_SCAN_DONE)
+        {
+            release();
+            throw error(rc == QP_SCAN_MORE
+                    ? "qpack: missing data"
+                    : "qpack: invalid data");
+        }
+        end_ = (size_t) scanner_.pos;
+    }
+    ~reader() { release(); }
+    reader(const reader &) = delete;
+    reader & operator=(const reader &) = delete;
+
+    /* offset of the first byte after the value */
+    size_t end() const { return end_; }
+
+    /* returns the type byte of the next token and moves to the token */
+    unsigned char next(const unsigned char ** pt, qp_ssize_t * n)
+    {
+        const qp_token_t & token = tape_.tokens[next_++];
+        *pt = data_ + token.pos;
+        *n = token.n;
+        return **pt;
+    }
+
+private:
+    void release()
+    {
+        if (scanner_.frames != scanner_.stack)
+        {
+            free(scanner_.frames);
+        }
+        scanner_.frames = scanner_.stack;
+        qp_tape_free(&tape_);
+    }
+
+    const unsigned char * data_;
+    size_t end_;
+    qp_ssize_t next_;
+    qp_scanner_t scanner_;
+    qp_tape_t tape_;
+    qp_token_t stack_[QP_TAPE_STACK_SZ];
+    qp_ssize_t frames_[QP_SCAN_STACK_SZ];
+};
+
+/*
+ * Returns the integer for an integer token, or throws.
+ */
+inline int64_t read_int64(reader & r)
+{
+    const unsigned char * pt;
+    qp_ssize_t n;
+    unsigned char tp = r.next(&pt, &n);
+
+    if (tp < 64)
+    {
+        return tp;
+    }
+    if (tp < QP_HOOK)
+    {
+        return (int64_t) 63 - tp;
+    }
+    switch (tp)
+    {
+    case QP_INT8:
+        return (int8_t) pt[1];
+    case QP_INT16:
+    {
+        int16_t i;
+        memcpy(&i, pt + 1, sizeof(int16_t));
+        return i;
+    }
+    case QP_INT32:
+    {
+        int32_t i;
+        memcpy(&i, pt + 1, sizeof(int32_t));
+        return i;
+    }
+    case QP_INT64:
+    {
+        int64_t i;
+        memcpy(&i, pt + 1, sizeof(int64_t));
+        return i;
+    }
+    }
+    throw error("qpack: expecting an integer");
+}
+
+template <typename T, typename Enable = void>
+struct traits;
+
+template <>
+struct traits<bool>
+{
+    static void pack(buffer & b, bool value)
+    {
+        check(qp_add_bool(b.packer(), value));
+    }
+    static bool unpack(reader & r)
+    {
+        const unsigned char * pt;
+        qp_ssize_t n;
+        switch (r.next(&pt, &n))
+        {
+        case QP_TRUE:
+            return true;
+        case QP_FALSE:
+            return false;
+        }
+        throw error("qpack: expecting a boolean");
+    }
+};
+
+template <typename T>
+struct traits<T, typename std::enable_if<
+        std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static void pack(buffer & b, T value)
+    {
+        if (std::is_unsigned<T>::value &&
+            (uint64_t) value > (uint64_t) std::numeric_limits<int64_t>::max())
+        {
+            throw error("qpack: integer overflow");
+        }
+        check(qp_add_int64(b.packer(), (int64_t) value));
+    }
+    static T unpack(reader & r)
+    {
+        int64_t i = read_int64(r);
+        if (std::is_unsigned<T>::value
+                ? (i < 0 ||
+                   (uint64_t) i > (uint64_t) std::numeric_limits<T>::max())
+                : (i < (int64_t) std::numeric_limits<T>::min() ||
+                   i > (int64_t) std::numeric_limits<T>::max()))
+        {
+            throw error("qpack: integer overflow");
+        }
+        return (T) i;
+    }
+};
+
+template <typename T>
+struct traits<T, typename std::enable_if<
+        std::is_floating_point<T>::value>::type>
+{
+    static void pack(buffer & b, T value)
+    {
+        check(qp_add_double(b.packer(), (double) value));
+    }
+    static T unpack(reader & r)
+    {
+        const unsigned char * pt;
+        qp_ssize_t n;
+        unsigned char tp = r.next(&pt, &n);
+
+        if (tp >= QP_DOUBLE_N1 && tp <= QP_DOUBLE_1)
+        {
+            return (T) (tp - QP_DOUBLE_0);
+        }
+        if (tp == QP_DOUBLE)
+        {
+            double d;
+            memcpy(&d, pt + 1, sizeof(double));
+            return (T) d;
+        }
+        throw error("qpack: expecting a double");
+    }
+};
+
+template <>
+struct traits<std::string>
+{
+    static void pack(buffer & b, const std::string & value)
+    {
+        check(qp_add_raw(
+                b.packer(),
+                (const unsigned char *) value.data(),
+                (qp_ssize_t) value.size()));
+    }
+    static std::string unpack(reader & r)
+    {
+        const unsigned char * pt;
+        qp_ssize_t n;
+        unsigned char tp = r.next(&pt, &n);
+
+        if (tp < 128 || tp > QP_RAW64)
+        {
+            throw error("qpack: expecting raw data");
+        }
+        qp_ssize_t size = qp_raw_header_size(tp);
+        return std::string((const char *) pt + size, (size_t) (n - size));
+    }
+};
+
+template <typename T, typename A>
+struct traits<std::vector<T, A>>
+{
+    static void pack(buffer & b, const std::vector<T, A> & value)
+    {
+        qp_ssize_t n = (qp_ssize_t) value.size();
+        check(qp_add_array(b.packer(), n));
+        for (const T & item : value)
+        {
+            traits<T>::pack(b, item);
+        }
+        check(qp_close_array(b.packer(), n));
+    }
+    static std::vector<T, A> unpack(reader & r)
+    {
+        const unsigned char * pt;
+        qp_ssize_t n;
+        unsigned char tp = r.next(&pt, &n);
+        std::vector<T, A> value;
+
+        if ((tp < QP_ARRAY0 || tp > QP_ARRAY5) && tp != QP_ARRAY_OPEN)
+        {
+            throw error("qpack: expecting an array");
+        }
+        if (tp == QP_ARRAY0)
+        {
+            return value;
+        }
+        value.reserve((size_t) n);
+        for (qp_ssize_t i = 0; i < n; i++)
+        {
+            value.push_back(traits<T>::unpack(r));
+        }
+        return value;
+    }
+};
+
+template <typename K, typename V, typename C, typename A>
+struct traits<std::map<K, V, C, A>>
+{
+    static void pack(buffer & b, const std::map<K, V, C, A> & value)
+    {
+        qp_ssize_t n = (qp_ssize_t) value.size();
+        check(qp_add_map(b.packer(), n));
+        for (const auto & item : value)
+        {
+            traits<K>::pack(b, item.first);
+            traits<V>::pack(b, item.second);
+        }
+        check(qp_close_map(b.packer(), n));
+    }
+    static std::map<K, V, C, A> unpack(reader & r)
+    {
+        const unsigned char * pt;
+        qp_ssize_t n;
+        unsigned char tp = r.next(&pt, &n);
+        std::map<K, V, C, A> value;
+
+        if ((tp < QP_MAP0 || tp > QP_MAP5) && tp != QP_MAP_OPEN)
+        {
+            throw error("qpack: expecting a map");
+        }
+        if (tp == QP_MAP0)
+        {
+            return value;
+        }
+        for (qp_ssize_t i = 0; i < n; i++)
+        {
+            K key = traits<K>::unpack(r);
+            value.emplace(std::move(key), traits<V>::unpack(r));
+        }
+        return value;
+    }
+};
+
+/*
+ * Append `value` to buffer `b`.
+ */
+template <typename T>
+void pack(buffer & b, const T & value)
+{
+    traits<T>::pack(b, value);
+}
+
+template <typename T>
+std::string pack(const T & value)
+{
+    buffer b;
+    traits<T>::pack(b, value);
+    return b.str();
+}
+
+/*
+ * Unpack the value at the start of `data`. A qpack::error is raised when
+ * the data is invalid or does not match type T.
+ */
+template <typename T>
+T unpack(const unsigned char * data, size_t len)
+{
+    reader r(data, len);
+    return traits<T>::unpack(r);
+}
+
+template <typename T>
+T unpack(const std::string & data)
+{
+    return unpack<T>((const unsigned char *) data.data(), data.size());
+}
+
+}  // namespace qpack
+
+#endif  // QPACK_HPP_
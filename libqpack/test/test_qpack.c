@@ -0,0 +1,593 @@
+/*
+ * test_qpack.c - tests for the qpack library
+ */
+#include <stdio.h>
+#include "qpack.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+if (!(cond))                                                            \
+{                                                                       \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+    failures++;                                                         \
+}
+
+/*
+ * The reader callbacks write a short description of each event to a
+ * string, for example "[1,2.5,'ab',{'k',N}]".
+ */
+typedef struct
+{
+    char out[256];
+    size_t len;
+    int stop_at_null;
+} events_t;
+
+static void events_add(events_t * ev, const char * s)
+{
+    size_t n = strlen(s);
+    if (ev->len + n < sizeof(ev->out))
+    {
+        memcpy(ev->out + ev->len, s, n + 1);
+        ev->len += n;
+    }
+}
+
+static void events_sep(events_t * ev)
+{
+    if (ev->len && ev->out[ev->len - 1] != '[' &&
+            ev->out[ev->len - 1] != '{' &&
+            ev->out[ev->len - 1] != ':')
+    {
+        events_add(ev, ",");
+    }
+}
+
+static int on_int(void * arg, int64_t i)
+{
+    char buf[32];
+    events_sep((events_t *) arg);
+    sprintf(buf, "%lld", (long long) i);
+    events_add((events_t *) arg, buf);
+    return 0;
+}
+
+static int on_double(void * arg, double d)
+{
+    char buf[32];
+    events_sep((events_t *) arg);
+    sprintf(buf, "%g", d);
+    events_add((events_t *) arg, buf);
+    return 0;
+}
+
+static int on_raw(void * arg, const unsigned char * raw, qp_ssize_t size)
+{
+    char buf[64];
+    events_sep((events_t *) arg);
+    sprintf(buf, "'%.*s'", (int) size, (const char *) raw);
+    events_add((events_t *) arg, buf);
+    return 0;
+}
+
+static int on_bool(void * arg, int b)
+{
+    events_sep((events_t *) arg);
+    events_add((events_t *) arg, b ? "T" : "F");
+    return 0;
+}
+
+static int on_null(void * arg)
+{
+    events_sep((events_t *) arg);
+    events_add((events_t *) arg, "N");
+    return ((events_t *) arg)->stop_at_null;
+}
+
+static int on_array(void * arg, qp_ssize_t n)
+{
+    events_sep((events_t *) arg);
+    events_add((events_t *) arg, "[");
+    (void) n;
+    return 0;
+}
+
+static int on_array_end(void * arg)
+{
+    events_add((events_t *) arg, "]");
+    return 0;
+}
+
+static int on_map(void * arg, qp_ssize_t n)
+{
+    events_sep((events_t *) arg);
+    events_add((events_t *) arg, "{");
+    (void) n;
+    return 0;
+}
+
+static int on_map_end(void * arg)
+{
+    events_add((events_t *) arg, "}");
+    return 0;
+}
+
+static int on_ref(void * arg, qp_ssize_t index)
+{
+    char buf[32];
+    events_sep((events_t *) arg);
+    sprintf(buf, "@%ld", (long) index);
+    events_add((events_t *) arg, buf);
+    return 0;
+}
+
+static int on_dict(void * arg, qp_ssize_t index)
+{
+    char buf[32];
+    events_sep((events_t *) arg);
+    sprintf(buf, "#%ld", (long) index);
+    events_add((events_t *) arg, buf);
+    return 0;
+}
+
+static int on_template(void * arg)
+{
+    events_sep((events_t *) arg);
+    events_add((events_t *) arg, "t:");
+    return 0;
+}
+
+static const qp_callbacks_t callbacks = {
+    on_int,
+    on_double,
+    on_raw,
+    NULL,
+    on_bool,
+    on_null,
+    on_array,
+    on_array_end,
+    on_map,
+    on_map_end,
+    on_ref,
+    on_dict,
+    on_template
+};
+
+/*
+ * Read the value in `data` and compare the events with `want`.
+ */
+static int read_events(
+        const unsigned char * data,
+        qp_ssize_t len,
+        const char * want)
+{
+    events_t ev;
+    qp_ssize_t pos = 0;
+    qp_scan_err_t err;
+    qp_read_rc_t rc;
+
+    memset(&ev, 0, sizeof(ev));
+    rc = qp_read(data, len, &pos, 0, &callbacks, &ev, &err);
+    if (rc != QP_READ_DONE || pos != len || strcmp(ev.out, want))
+    {
+        fprintf(stderr, "read: %d %ld '%s' != '%s'\n",
+                (int) rc, (long) pos, ev.out, want);
+        return 0;
+    }
+    return 1;
+}
+
+static void test_put(void)
+{
+    unsigned char buf[QP_NUMBER_MAX_SZ];
+    int64_t ints[] = {
+        0, 63, 64, -1, -60, -61, 127, -128, 128, 32767, -32768, 32768,
+        2147483647LL, -2147483648LL, 2147483648LL, INT64_MAX, INT64_MIN};
+    double doubles[] = {-1.0, 0.0, 1.0, 1.5, -1e300};
+    size_t i;
+
+    CHECK(qp_put_int64(buf, 5) == 1 && buf[0] == 5);
+    CHECK(qp_put_int64(buf, -1) == 1 && buf[0] == 64);
+    CHECK(qp_put_int64(buf, -61) == 2 && buf[0] == QP_INT8);
+    CHECK(qp_put_int64(buf, 0xfe) == 3 && buf[0] == QP_INT16);
+
+    for (i = 0; i < sizeof(ints) / sizeof(int64_t); i++)
+    {
+        CHECK(qp_put_int64(buf, ints[i]) == qp_int64_size(ints[i]));
+    }
+    for (i = 0; i < sizeof(doubles) / sizeof(double); i++)
+    {
+        CHECK(qp_put_double(buf, doubles[i]) == qp_double_size(doubles[i]));
+    }
+    CHECK(qp_put_double(buf, 0.0) == 1 && buf[0] == QP_DOUBLE_0);
+
+    CHECK(qp_put_raw(buf, 0) == 1 && buf[0] == 128);
+    CHECK(qp_put_raw(buf, 99) == 1 && buf[0] == 227);
+    CHECK(qp_put_raw(buf, 100) == 2 && buf[0] == QP_RAW8 && buf[1] == 100);
+    CHECK(qp_put_raw(buf, 65535) == 3 && buf[0] == QP_RAW16);
+    CHECK(qp_put_raw(buf, 65536) == 5 && buf[0] == QP_RAW32);
+    CHECK(qp_raw_size(65536) == 5);
+
+    CHECK(qp_array_type(0) == QP_ARRAY0);
+    CHECK(qp_array_type(5) == QP_ARRAY5);
+    CHECK(qp_array_type(6) == QP_ARRAY_OPEN);
+    CHECK(qp_array_type(-1) == QP_ARRAY_OPEN);
+    CHECK(qp_map_type(2) == QP_MAP2);
+}
+
+static void test_packer(void)
+{
+    /* the same data as the Python test [0, {"Names": ["Iris", "Sasha"]}] */
+    static const unsigned char want[] = {
+        239, 0, 244, 133, 78, 97, 109, 101, 115, 239, 132, 73, 114,
+        105, 115, 133, 83, 97, 115, 104, 97};
+    qp_packer_t packer;
+    int i;
+
+    CHECK(qp_packer_init(&packer, 4) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_int64(&packer, 0) == 0);
+    CHECK(qp_add_map(&packer, 1) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "Names", 5) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "Iris", 4) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "Sasha", 5) == 0);
+    CHECK(qp_close_array(&packer, 2) == 0);
+    CHECK(qp_close_map(&packer, 1) == 0);
+    CHECK(qp_close_array(&packer, 2) == 0);
+    CHECK(packer.len == (qp_ssize_t) sizeof(want));
+    CHECK(memcmp(packer.buffer, want, sizeof(want)) == 0);
+    CHECK(read_events(
+            packer.buffer,
+            packer.len,
+            "[0,{'Names',['Iris','Sasha']}]"));
+
+    /* open arrays and maps, with and without the close character */
+    packer.len = 0;
+    CHECK(qp_add_array(&packer, -1) == 0);
+    for (i = 0; i < 7; i++)
+    {
+        CHECK(qp_add_int64(&packer, i * 100) == 0);
+    }
+    CHECK(qp_add_map(&packer, -1) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "k", 1) == 0);
+    CHECK(qp_add_null(&packer) == 0);
+    CHECK(qp_close_map(&packer, -1) == 0);
+    CHECK(qp_add_bool(&packer, 1) == 0);
+    CHECK(qp_add_double(&packer, 2.5) == 0);
+    CHECK(packer.buffer[0] == QP_ARRAY_OPEN);
+    CHECK(read_events(
+            packer.buffer,
+            packer.len,
+            "[0,100,200,300,400,500,600,{'k',N},T,2.5]"));
+    CHECK(qp_close_array(&packer, -1) == 0);
+    CHECK(read_events(
+            packer.buffer,
+            packer.len,
+            "[0,100,200,300,400,500,600,{'k',N},T,2.5]"));
+
+    qp_packer_free(&packer);
+}
+
+static void test_read(void)
+{
+    static const unsigned char nested[] = {
+        QP_ARRAY_OPEN, QP_ARRAY_OPEN, 1, QP_MAP_OPEN, 129, 'a', QP_ARRAY0,
+        QP_MAP_CLOSE, QP_MAP0, QP_ARRAY1, QP_ARRAY_OPEN};
+    static const unsigned char typed[] = {
+        QP_HOOK, 'h', 132, 1, 0, 2, 0};
+    static const unsigned char close[] = {QP_ARRAY1, QP_ARRAY_CLOSE};
+    static const unsigned char deep[] = {
+        QP_ARRAY1, QP_ARRAY1, QP_ARRAY1, QP_ARRAY0};
+    static const unsigned char stop[] = {QP_ARRAY2, QP_NULL, 1};
+    events_t ev;
+    qp_ssize_t pos;
+    qp_scan_err_t err;
+
+    CHECK(read_events(nested, sizeof(nested), "[[1,{'a',[]},{},[[]]]]"));
+
+    /* the end of the data closes the open arrays */
+    CHECK(read_events(nested, 3, "[[1]]"));
+
+    memset(&ev, 0, sizeof(ev));
+    pos = 0;
+    CHECK(qp_read(typed, sizeof(typed), &pos, 0, &callbacks, &ev, &err) ==
+            QP_READ_DONE);
+    CHECK(pos == (qp_ssize_t) sizeof(typed) && ev.len == 0);
+    CHECK(qp_token_size(typed, sizeof(typed)) == (qp_ssize_t) sizeof(typed));
+    CHECK(qp_token_size(typed, 3) == 0);
+
+    pos = 0;
+    CHECK(qp_read(nested, 5, &pos, 0, &callbacks, &ev, &err) ==
+            QP_READ_MORE);
+
+    pos = 0;
+    CHECK(qp_read(close, sizeof(close), &pos, 0, &callbacks, &ev, &err) ==
+            QP_READ_ERROR);
+    CHECK(pos == 1 && err == QP_SCAN_ERR_CLOSE);
+
+    pos = 0;
+    CHECK(qp_read(deep, sizeof(deep), &pos, 2, &callbacks, &ev, &err) ==
+            QP_READ_ERROR);
+    CHECK(err == QP_SCAN_ERR_DEPTH);
+    pos = 0;
+    CHECK(qp_read(deep, sizeof(deep), &pos, 3, &callbacks, &ev, &err) ==
+            QP_READ_DONE);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.stop_at_null = 1;
+    pos = 0;
+    CHECK(qp_read(stop, sizeof(stop), &pos, 0, &callbacks, &ev, &err) ==
+            QP_READ_STOP);
+    CHECK(strcmp(ev.out, "[N") == 0);
+}
+
+static void test_scanner(void)
+{
+    qp_packer_t packer;
+    qp_scanner_t scanner;
+    qp_tape_t tape;
+    qp_ssize_t i;
+
+    /* an open array which does not fit in the initial frames and tokens */
+    CHECK(qp_packer_init(&packer, 0) == 0);
+    for (i = 0; i < 60; i++)
+    {
+        CHECK(qp_add_array(&packer, -1) == 0);
+        CHECK(qp_add_int64(&packer, i) == 0);
+    }
+
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.max_depth = QP_MAX_DEPTH;
+    qp_tape_init(&tape, NULL);
+    scanner.tape = &tape;
+    qp_scanner_reset(&scanner);
+
+    CHECK(qp_scanner_run(&scanner, packer.buffer, packer.len) ==
+            QP_SCAN_MORE);
+    CHECK(qp_scanner_at_end(&scanner, packer.len));
+    CHECK(tape.len == 120);
+    CHECK(tape.tokens[0].pos == 0 && tape.tokens[0].n == 2);
+    CHECK(tape.tokens[118].n == 1);
+    CHECK(tape.tokens[119].pos == packer.len - 1);
+    CHECK(qp_tape_next(&tape, packer.buffer, 0) == 120);
+    CHECK(qp_tape_next(&tape, packer.buffer, 1) == 2);
+    CHECK(qp_tape_next(&tape, packer.buffer, 2) == 120);
+    CHECK(qp_tape_next(&tape, packer.buffer, 116) == 120);
+
+    free(scanner.frames);
+    qp_tape_free(&tape);
+    qp_packer_free(&packer);
+}
+
+static void test_ref(void)
+{
+    qp_packer_t packer;
+    qp_scanner_t scanner;
+    qp_tape_t tape;
+    unsigned char buf[16];
+    static const unsigned char negative[] = {QP_HOOK, QP_REF, QP_INT8, 0xff};
+    static const unsigned char int64[] = {
+        QP_HOOK, QP_REF, QP_INT64, 1, 0, 0, 0, 0, 0, 0, 0};
+    static const unsigned char valid[] = {
+        QP_ARRAY2, 131, 'a', 'b', 'c', QP_HOOK, QP_REF, 0};
+    qp_ssize_t pos;
+    qp_scan_err_t err;
+    events_t ev;
+
+    CHECK(qp_ref_size(63) == 3 && qp_put_ref(buf, 63) == 3);
+    CHECK(qp_token_size(buf, 3) == 3 && qp_ref_index(buf) == 63);
+    CHECK(qp_ref_size(64) == 4 && qp_put_ref(buf, 64) == 4);
+    CHECK(qp_token_size(buf, 3) == 0 && qp_ref_index(buf) == 64);
+    CHECK(qp_ref_size(40000) == 7 && qp_put_ref(buf, 40000) == 7);
+    CHECK(qp_token_size(buf, 7) == 7 && qp_ref_index(buf) == 40000);
+    CHECK(qp_token_size(negative, sizeof(negative)) == -3);
+    CHECK(qp_token_size(int64, sizeof(int64)) == -3);
+
+    CHECK(qp_packer_init(&packer, 0) == 0);
+    CHECK(qp_add_array(&packer, 3) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "abc", 3) == 0);
+    CHECK(qp_add_ref(&packer, 0) == 0);
+    CHECK(qp_add_ref(&packer, 300) == 0);
+    CHECK(read_events(packer.buffer, packer.len, "['abc',@0,@300]"));
+
+    /* the scanner counts the back-references */
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.max_depth = QP_MAX_DEPTH;
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, packer.buffer, packer.len) == QP_SCAN_DONE);
+    CHECK(scanner.refs == 2);
+    qp_scanner_reset(&scanner);
+    CHECK(scanner.refs == 0);
+
+    /* the check finds the back-reference which is not to earlier raw data */
+    qp_tape_init(&tape, NULL);
+    scanner.tape = &tape;
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, packer.buffer, packer.len) == QP_SCAN_DONE);
+    CHECK(qp_scanner_check(&scanner, packer.buffer) == QP_SCAN_ERROR);
+    CHECK(scanner.err == QP_SCAN_ERR_REF && scanner.pos == 8);
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, valid, sizeof(valid)) == QP_SCAN_DONE);
+    CHECK(qp_scanner_check(&scanner, valid) == QP_SCAN_DONE);
+    free(scanner.frames);
+    qp_tape_free(&tape);
+
+    memset(&ev, 0, sizeof(ev));
+    pos = 0;
+    CHECK(qp_read(negative, sizeof(negative), &pos, 0, &callbacks, &ev, &err)
+            == QP_READ_ERROR);
+    CHECK(pos == 0 && err == QP_SCAN_ERR_REF);
+
+    qp_packer_free(&packer);
+}
+
+static void test_dict(void)
+{
+    qp_packer_t packer;
+    qp_scanner_t scanner;
+    unsigned char buf[16];
+    static const unsigned char negative[] = {QP_HOOK, QP_DICT, QP_INT8, 0xff};
+
+    CHECK(qp_put_dict(buf, 100) == qp_ref_size(100));
+    CHECK(buf[1] == QP_DICT);
+    CHECK(qp_token_size(buf, 4) == 4 && qp_ref_index(buf) == 100);
+    CHECK(qp_token_size(negative, sizeof(negative)) == -3);
+
+    CHECK(qp_packer_init(&packer, 0) == 0);
+    CHECK(qp_add_map(&packer, 1) == 0);
+    CHECK(qp_add_dict(&packer, 7) == 0);
+    CHECK(qp_add_ref(&packer, 0) == 0);
+    CHECK(read_events(packer.buffer, packer.len, "{#7,@0}"));
+
+    /* dictionary references are counted with the back-references */
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.max_depth = QP_MAX_DEPTH;
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, packer.buffer, packer.len) == QP_SCAN_DONE);
+    CHECK(scanner.refs == 2);
+    free(scanner.frames);
+
+    qp_packer_free(&packer);
+}
+
+static void test_template(void)
+{
+    qp_packer_t packer;
+    qp_scanner_t scanner;
+    qp_tape_t tape;
+    qp_ssize_t pos;
+    qp_scan_err_t err;
+    events_t ev;
+    static const unsigned char map[] = {QP_HOOK, QP_TEMPLATE, QP_MAP0};
+    static const unsigned char record[] = {
+        QP_HOOK, QP_TEMPLATE, QP_ARRAY2, QP_ARRAY1, 129, 'k', QP_ARRAY0};
+
+    CHECK(qp_packer_init(&packer, 0) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_template(&packer) == 0);
+    CHECK(qp_add_array(&packer, 3) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "id", 2) == 0);
+    CHECK(qp_add_raw(&packer, (const unsigned char *) "v", 1) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_int64(&packer, 1) == 0);
+    CHECK(qp_add_null(&packer) == 0);
+    CHECK(qp_add_array(&packer, 2) == 0);
+    CHECK(qp_add_int64(&packer, 2) == 0);
+    CHECK(qp_add_bool(&packer, 1) == 0);
+    CHECK(qp_add_int64(&packer, 5) == 0);
+    CHECK(read_events(
+            packer.buffer,
+            packer.len,
+            "[t:[['id','v'],[1,N],[2,T]],5]"));
+
+    /* the template has a token which is not an item of the outer array */
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.max_depth = QP_MAX_DEPTH;
+    qp_tape_init(&tape, NULL);
+    scanner.tape = &tape;
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, packer.buffer, packer.len) == QP_SCAN_DONE);
+    CHECK(tape.len == 13);
+    CHECK(tape.tokens[0].n == 2 && tape.tokens[1].n == 2);
+    CHECK(qp_tape_next(&tape, packer.buffer, 1) == 12);
+    CHECK(qp_tape_next(&tape, packer.buffer, 2) == 12);
+    CHECK(scanner.refs == 0 && scanner.templates == 1);
+    CHECK(qp_scanner_check(&scanner, packer.buffer) == QP_SCAN_DONE);
+
+    /* a record must have a value for each key */
+    qp_scanner_reset(&scanner);
+    CHECK(qp_scan(&scanner, record, sizeof(record)) == QP_SCAN_DONE);
+    CHECK(qp_scanner_check(&scanner, record) == QP_SCAN_ERROR);
+    CHECK(scanner.err == QP_SCAN_ERR_TEMPLATE && scanner.pos == 6);
+    free(scanner.frames);
+    qp_tape_free(&tape);
+
+    CHECK(qp_token_size(packer.buffer + 1, 2) == 0);
+    CHECK(qp_token_size(packer.buffer + 1, 3) == 2);
+    CHECK(qp_token_size(map, sizeof(map)) == -4);
+
+    memset(&ev, 0, sizeof(ev));
+    pos = 0;
+    CHECK(qp_read(map, sizeof(map), &pos, 0, &callbacks, &ev, &err)
+            == QP_READ_ERROR);
+    CHECK(pos == 0 && err == QP_SCAN_ERR_TEMPLATE);
+
+    pos = 0;
+    CHECK(qp_read(packer.buffer, 4, &pos, 0, &callbacks, &ev, &err)
+            == QP_READ_MORE);
+
+    qp_packer_free(&packer);
+}
+
+static int digest_is(qp_digest_t * digest, const char * hex)
+{
+    unsigned char out[QP_DIGEST_SZ];
+    char buf[2 * QP_DIGEST_SZ + 1];
+    int i;
+
+    qp_digest_final(digest, out);
+    for (i = 0; i < QP_DIGEST_SZ; i++)
+    {
+        sprintf(buf + 2 * i, "%02x", out[i]);
+    }
+    return strcmp(buf, hex) == 0;
+}
+
+static void test_digest(void)
+{
+    qp_digest_t digest;
+    unsigned char data[1000];
+    qp_ssize_t parts[] = {1, 127, 128, 129, 256, 359};
+    qp_ssize_t i, pos = 0;
+
+    /* the same as hashlib.blake2b(data, digest_size=32) in Python */
+    qp_digest_init(&digest);
+    CHECK(digest_is(&digest,
+            "0e5751c026e543b2e8ab2eb06099daa1"
+            "d1e5df47778f7787faab45cdf12fe3a8"));
+
+    qp_digest_init(&digest);
+    qp_digest_update(&digest, (const unsigned char *) "abc", 3);
+    CHECK(digest_is(&digest,
+            "bddd813c634239723171ef3fee98579b"
+            "94964e3bb1cb3e427262c8c068d52319"));
+
+    /* data which is added in parts of different sizes */
+    for (i = 0; i < 1000; i++)
+    {
+        data[i] = (unsigned char) (i % 251);
+    }
+    qp_digest_init(&digest);
+    for (i = 0; i < 6; i++)
+    {
+        qp_digest_update(&digest, data + pos, parts[i]);
+        pos += parts[i];
+    }
+    CHECK(pos == 1000);
+    CHECK(digest_is(&digest,
+            "b372d0608f720c8c3dd41e9c8eecb101"
+            "43b41abe520b616607e754bf79c08331"));
+}
+
+int main(void)
+{
+    test_put();
+    test_packer();
+    test_read();
+    test_scanner();
+    test_ref();
+    test_dict();
+    test_template();
+    test_digest();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_qpack: OK\n");
+    return 0;
+}
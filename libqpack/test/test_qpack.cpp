@@ -0,0 +1,147 @@
+/*
+ * test_qpack.cpp - tests for the C++ header qpack.hpp
+ */
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "qpack.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+if (!(cond))                                                            \
+{                                                                       \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+    failures++;                                                         \
+}
+
+template <typename T>
+static bool roundtrip(const T & value)
+{
+    return qpack::unpack<T>(qpack::pack(value)) == value;
+}
+
+template <typename T, typename U>
+static bool raises(const U & value)
+{
+    try
+    {
+        qpack::unpack<T>(qpack::pack(value));
+    }
+    catch (const qpack::error &)
+    {
+        return true;
+    }
+    return false;
+}
+
+static void test_pack()
+{
+    /* the same data as the Python test {"Names": ["Iris", "Sasha"]} */
+    std::map<std::string, std::vector<std::string>> names = {
+        {"Names", {"Iris", "Sasha"}}};
+    std::string want = "\xf4\x85Names\xef\x84Iris\x85Sasha";
+
+    CHECK(qpack::pack(names) == want);
+    CHECK(qpack::pack(-61) == "\xe8\xc3");
+    CHECK(qpack::pack(1.0) == "\x7f");
+    CHECK(qpack::pack(true) == "\xf9");
+    CHECK(qpack::pack(std::vector<int>(6, 1)) ==
+          "\xfc\x01\x01\x01\x01\x01\x01\xfe");
+
+    qpack::buffer b;
+    qpack::pack(b, 5);
+    qpack::pack(b, std::string("x"));
+    CHECK(b.str() == "\x05\x81x");
+}
+
+static void test_roundtrip()
+{
+    CHECK(roundtrip(0));
+    CHECK(roundtrip(-60));
+    CHECK(roundtrip((int8_t) -128));
+    CHECK(roundtrip((uint16_t) 65535));
+    CHECK(roundtrip((int64_t) INT64_MIN));
+    CHECK(roundtrip((uint64_t) INT64_MAX));
+    CHECK(roundtrip(-1.0));
+    CHECK(roundtrip(0.25f));
+    CHECK(roundtrip(123.4567));
+    CHECK(roundtrip(false));
+    CHECK(roundtrip(std::string()));
+    CHECK(roundtrip(std::string(70000, 'q')));
+    CHECK(roundtrip(std::vector<int>()));
+    CHECK(roundtrip(std::vector<double>{0.0, 1.1, 2.2}));
+
+    std::vector<std::vector<int>> nested;
+    for (int i = 0; i < 100; i++)
+    {
+        nested.push_back(std::vector<int>(i, i * 1000));
+    }
+    CHECK(roundtrip(nested));
+
+    std::map<int, std::map<std::string, bool>> maps;
+    for (int i = 0; i < 10; i++)
+    {
+        maps[i * 7]["k" + std::to_string(i)] = i % 2 == 0;
+    }
+    maps[-1];
+    CHECK(roundtrip(maps));
+}
+
+typedef std::map<int, int> int_map;
+
+static void test_errors()
+{
+    CHECK(raises<int8_t>(128));
+    CHECK(raises<uint32_t>(-1));
+    CHECK(raises<int>(1.5));
+    CHECK(raises<std::string>(1));
+    CHECK(raises<std::vector<int>>(int_map()));
+    CHECK(raises<int_map>(std::vector<int>()));
+    CHECK(raises<bool>(std::string("true")));
+
+    bool thrown = false;
+    try
+    {
+        qpack::pack((uint64_t) UINT64_MAX);
+    }
+    catch (const qpack::error &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    std::string packed = qpack::pack(std::vector<int>{1, 2, 3});
+    thrown = false;
+    try
+    {
+        qpack::unpack<std::vector<int>>(packed.substr(0, 2));
+    }
+    catch (const qpack::error &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    /* the end of the data closes an open array */
+    packed = qpack::pack(std::vector<int>(7, 3));
+    CHECK(qpack::unpack<std::vector<int>>(packed.substr(0, 4)) ==
+          std::vector<int>(3, 3));
+}
+
+int main()
+{
+    test_pack();
+    test_roundtrip();
+    test_errors();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_qpack_cpp: OK\n");
+    return 0;
+}
@@ -6,11 +6,27 @@
 try:
     import qpack._qpack as _qpack
     packb = _qpack._packb
+    packb_into = _qpack._packb_into
+    packed_size = _qpack._packed_size
+    digest = _qpack._digest
     unpackb = _qpack._unpackb
+    unpack_from = _qpack._unpack_from
+    skip = _qpack._skip
+    validate = _qpack._validate
+    get = _qpack._get
+    packb_many = _qpack._packb_many
+    unpack_many = _qpack._unpack_many
+    Unpacker = _qpack.Unpacker
+    Packer = _qpack.Packer
 
 except ImportError as ex:
-    from .fallback import packb, unpackb
+    from .fallback import packb, packb_into, packed_size, digest, unpackb, \
+        unpack_from, skip, validate, get, packb_many, unpack_many, Unpacker, \
+        Packer
 
 __version_info__ = (0, 0, 21)
 __version__ = '.'.join(map(str, __version_info__))
-__all__ = ['packb', 'unpackb']
+__all__ = [
+    'packb', 'packb_into', 'packed_size', 'digest', 'unpackb', 'unpack_from',
+    'skip', 'validate', 'get', 'packb_many', 'unpack_many', 'Unpacker',
+    'Packer']
@@ -6,33 +6,28 @@
  */
 #include <Python.h>
 #include <stddef.h>
-
-#if defined(_WIN32) || defined(_WIN64)
-
-/* Copied from stdint.h */
-#if (_MSC_VER < 1300)
-  typedef signed char       int8_t;
-  typedef signed short      int16_t;
-  typedef signed int        int32_t;
-  typedef unsigned char     uint8_t;
-  typedef unsigned short    uint16_t;
-  typedef unsigned int      uint32_t;
-#else
-  typedef signed __int8     int8_t;
-  typedef signed __int16    int16_t;
-  typedef signed __int32    int32_t;
-  typedef unsigned __int8   uint8_t;
-  typedef unsigned __int16  uint16_t;
-  typedef unsigned __int32  uint32_t;
+#if defined(Py_GIL_DISABLED) && !defined(_WIN32)
+#include <unistd.h>
 #endif
-typedef signed __int64      int64_t;
-typedef unsigned __int64    uint64_t;
+#include "qpack.h"
 
+/*
+ * Raw data which is decoded is first checked for pure ASCII using SSE2 on
+ * x86-64 and, when the CPU supports it, AVX2. The check is selected at
+ * runtime by ascii_init().
+ */
+#if PY_MAJOR_VERSION >= 3 && (defined(__x86_64__) || defined(_M_X64))
+#define QP_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define QP_AVX2 1
+#include <immintrin.h>
+#endif
 #endif
 
 #if PY_MAJOR_VERSION >= 3
 
-#define PY_COMPAT_COMPARE(obj, str) PyUnicode_CompareWithASCIIString(obj, str)
+#define PY_COMPAT_COMPARE(obj, str) (PyUnicode_CompareWithASCIIString(obj, str) == 0)
 #define PY_COMPAT_CHECK PyUnicode_Check
 #define PY_DECODELATIN1(pt, size, error) PyUnicode_DecodeLatin1(pt, size, error)
 #define PYLONG_FROMLONGLONG(integer) PyLong_FromLongLong(integer)
@@ -42,68 +37,10 @@ typedef unsigned __int64    uint64_t;
 #define PY_COMPAT_CHECK PyString_Check
 #define PY_DECODELATIN1(pt, size, error) PyString_Decode(pt, size, "latin-1", error)
 #define PYLONG_FROMLONGLONG(integer) PyInt_FromSsize_t((ssize_t) integer)
-#define PyUnicode_InternInPlace(__straddr) (void) (__straddr)
 
 #endif
 
-static PyObject PY_ARRAY_CLOSE = {0};
-static PyObject PY_MAP_CLOSE = {0};
 
-#define Py_QPackCHECK(obj) (obj == &PY_ARRAY_CLOSE || obj == &PY_MAP_CLOSE)
-
-typedef enum
-{
-    /*
-     * Values with -##- will never be returned while unpacking. For example
-     * a QP_INT8 (1 byte signed integer) will be returned as QP_INT64.
-     */
-    QP_END,             /* at the end while unpacking */
-    QP_RAW,             /* raw string */
-    /*
-     * Both END and RAW are never actually packed but 0 and 1 are reserved
-     * for positive signed integers.
-     *
-     * Fixed positive integers from 0 till 63       [  0...63  ]
-     *
-     * Fixed negative integers from -60 till -1     [ 64...123 ]
-     *
-     */
-    QP_HOOK=124,        /* Hook is not used by SiriDB */
-    QP_DOUBLE_N1=125,   /* ## double value -1.0 */
-    QP_DOUBLE_0,        /* ## double value 0.0 */
-    QP_DOUBLE_1,        /* ## double value 1.0 */
-    /*
-     * Fixed raw strings lengths from 0 till 99     [ 128...227 ]
-     */
-    QP_RAW8=228,        /* ## raw string with length < 1 byte */
-    QP_RAW16,           /* ## raw string with length < 1 byte */
-    QP_RAW32,           /* ## raw string with length < 1 byte */
-    QP_RAW64,           /* ## raw string with length < 1 byte */
-    QP_INT8,            /* ## 1 byte signed integer */
-    QP_INT16,           /* ## 2 byte signed integer */
-    QP_INT32,           /* ## 4 byte signed integer */
-    QP_INT64,           /* 8 bytes signed integer */
-    QP_DOUBLE,          /* 8 bytes double */
-    QP_ARRAY0,          /* empty array */
-    QP_ARRAY1,          /* array with 1 item */
-    QP_ARRAY2,          /* array with 2 items */
-    QP_ARRAY3,          /* array with 3 items */
-    QP_ARRAY4,          /* array with 4 items */
-    QP_ARRAY5,          /* array with 5 items */
-    QP_MAP0,            /* empty map */
-    QP_MAP1,            /* map with 1 item */
-    QP_MAP2,            /* map with 2 items */
-    QP_MAP3,            /* map with 3 items */
-    QP_MAP4,            /* map with 4 items */
-    QP_MAP5,            /* map with 5 items */
-    QP_TRUE,            /* boolean true */
-    QP_FALSE,           /* boolean false */
-    QP_NULL,            /* null (none, nil) */
-    QP_ARRAY_OPEN,      /* open a new array */
-    QP_MAP_OPEN,        /* open a new map */
-    QP_ARRAY_CLOSE,     /* close array */
-    QP_MAP_CLOSE        /* close map */
-} qp_types_t;
 
 typedef enum
 {
@@ -112,98 +49,549 @@ typedef enum
     DECODE_LATIN1
 } decode_t;
 
+typedef struct
+{
+    PyObject * obj;     /* list, tuple or dict which is packed (borrowed) */
+    PyObject ** items;  /* items of a list or tuple, NULL for a dict */
+    PyObject * value;   /* dict value to pack after its key (borrowed) */
+    Py_ssize_t pos;     /* next item index or dict position */
+    Py_ssize_t size;    /* number of items */
+    Py_ssize_t record;  /* number of keys when the items are the records of a
+                           template, or 0 */
+    int values;         /* only the values of the dict are packed, for a
+                           record of a template */
+    unsigned char close;        /* type which closes the container, or 0
+                                   when the container has less than six
+                                   items */
+} pack_frame_t;
+
+/*
+ * With refs=True, raw data which is packed again is replaced with a
+ * back-reference to its first copy, see QP_REF. The packer keeps a hash
+ * table with the offsets of the raw data which is already in the buffer.
+ */
+typedef struct
+{
+    uint32_t hash;
+    uint32_t size;      /* size of the raw data, 0 for an empty slot */
+    Py_ssize_t offset;  /* offset of the raw data in the buffer */
+    Py_ssize_t index;   /* number of the raw data, see QP_REF */
+} pack_ref_t;
+
+/*
+ * The dictionary of a Packer, see QP_DICT. Each string is copied to an
+ * entry and a hash table maps the strings to the newest entry.
+ */
+typedef struct
+{
+    uint32_t hash;
+    uint32_t size;
+    unsigned char raw[QP_DICT_MAX_SZ];
+} pack_dict_entry_t;
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t index;     /* index of the entry + 1, 0 for an empty slot */
+} pack_dict_slot_t;
+
+typedef struct
+{
+    Py_ssize_t offset;  /* offset of the raw data in the packed value */
+    Py_ssize_t size;
+} pack_dict_raw_t;
+
+typedef struct
+{
+    pack_dict_entry_t * entries;
+    pack_dict_slot_t * slots;
+    Py_ssize_t slots_sz;        /* number of slots, a power of two */
+    Py_ssize_t n_static;        /* number of preloaded strings */
+    Py_ssize_t size;            /* number of strings which are added */
+    Py_ssize_t next;            /* number of strings which are added so far */
+    pack_dict_raw_t * pending;  /* raw data which is added when the value
+                                   is packed */
+    Py_ssize_t pending_len;
+    Py_ssize_t pending_sz;
+} pack_dict_t;
+
 typedef struct
 {
     unsigned char * buffer;
     Py_ssize_t size;
     Py_ssize_t len;
+    unsigned char * scratch;    /* buffer owned by the packer */
+    Py_ssize_t scratch_sz;
+    PyObject * bytes;   /* when set, buffer points into this bytes object */
+    int in_use;         /* set while a cached packer is busy */
+    int cached;         /* packer is owned by the thread state */
+    int fixed;          /* buffer is owned by the caller and cannot grow */
+    int measure;        /* only count the size, nothing is written */
+    int nogil;          /* containers are copied and the GIL is released to
+                           copy large raw data, see packb() */
+    int canonical;      /* map keys are sorted and NaN values are the same */
+    int templates;      /* lists of dicts with the same keys are packed as a
+                           template, see QP_TEMPLATE */
+    qp_digest_t * digest;       /* when set, data is added to the digest
+                                   instead of kept in the buffer */
+    pack_ref_t * refs;          /* raw data for back-references, or NULL */
+    Py_ssize_t refs_sz;         /* number of slots, a power of two */
+    Py_ssize_t refs_len;        /* number of slots which are used */
+    Py_ssize_t raws;            /* number of raw data which is numbered */
+    pack_dict_t * dict;         /* dictionary of a Packer, or NULL */
+    pack_frame_t * frames;      /* stack of open containers */
+    Py_ssize_t frames_sz;
+    Py_ssize_t max_depth;
 } packer_t;
 
+/*
+ * Map keys are cached while unpacking so repeated keys are created only
+ * once. The cache is a direct mapped table on the raw key data; only keys
+ * up to KEYCACHE_KEY_SZ bytes are cached and a new key replaces the key
+ * which is stored in the same slot. A small message does not pay for the
+ * cache: the first KEYCACHE_MIN_KEYS keys are not cached, and the table
+ * starts with KEYCACHE_INIT_SZ slots and doubles when half of the slots are
+ * used, up to the size of the cache.
+ */
+#define KEYCACHE_KEY_SZ 48
+#define KEYCACHE_DEFAULT_SZ 128
+#define KEYCACHE_MIN_KEYS 8
+#define KEYCACHE_INIT_SZ 16
+
+typedef struct
+{
+    PyObject * key;
+    uint32_t hash;
+    uint32_t size;
+    unsigned char raw[KEYCACHE_KEY_SZ];
+} keycache_entry_t;
+
+typedef struct
+{
+    keycache_entry_t * entries;     /* allocated on first use */
+    Py_ssize_t size;                /* maximum number of entries, 0 if
+                                       disabled */
+    Py_ssize_t cap;                 /* number of allocated entries */
+    Py_ssize_t used;                /* number of entries with a key */
+    Py_ssize_t seen;                /* keys before the cache is allocated */
+} keycache_t;
+
+/*
+ * The dictionary of an Unpacker, see QP_DICT. The preloaded strings are
+ * followed by the strings which are added, as objects for the decode
+ * option of the Unpacker.
+ */
+typedef struct
+{
+    PyObject ** objs;
+    Py_ssize_t n_static;        /* number of preloaded strings */
+    Py_ssize_t size;            /* number of strings which are added */
+    Py_ssize_t next;            /* number of strings which are added so far */
+} unpack_dict_t;
+
+/* number of strings which a Packer and Unpacker add by default */
+#define DICT_DEFAULT_SZ 4096
+#define DICT_MAX_SZ 0x100000
+
 typedef struct
 {
     decode_t decode;
     int use_tuples;
     int ignore_decode_errors;
+    Py_ssize_t view_min_size;   /* raw values of at least this size are
+                                   returned as a memoryview */
+    /* state for returning memoryview objects, set by unpack_view() */
+    PyObject * source;          /* object which is unpacked (borrowed) */
+    PyObject * view;            /* read-only memoryview of source */
+    const unsigned char * base; /* start of the data in source */
+    PyObject * array_type;      /* array.array, set by typed_array_new() */
+    keycache_t keycache;
+    Py_ssize_t max_depth;
+    Py_ssize_t threads;         /* threads for a large top-level array */
+    int refs;                   /* the value has back-references */
+    int columnar;               /* see unpack_columns_t */
+    unpack_dict_t * dict;       /* dictionary of an Unpacker, or NULL */
 } unpack_options_t;
 
-#define DEFAULT_ALLOC_SZ 65536
+/*
+ * When a value has back-references, unpackb() keeps the objects for the
+ * raw data which is numbered, see QP_REF.
+ */
+typedef struct
+{
+    PyObject * obj;
+    Py_ssize_t size;    /* size of the raw data */
+} unpack_ref_t;
+
+typedef struct
+{
+    unpack_ref_t * items;
+    Py_ssize_t len;
+    Py_ssize_t size;
+} unpack_refs_t;
+
+#define UNPACK_REFS_INIT_SZ 64
+
+typedef enum
+{
+    UNPACK_FRAME_ARRAY,         /* list or tuple */
+    UNPACK_FRAME_MAP,           /* dict */
+    UNPACK_FRAME_TEMPLATE,      /* list or tuple with the records of a
+                                   template, see QP_TEMPLATE */
+    UNPACK_FRAME_RECORD,        /* dict for a record of a template */
+    UNPACK_FRAME_COLUMNS,       /* top-level array with columnar=True */
+    UNPACK_FRAME_ROW            /* map or template record which is added
+                                   to the columns, see unpack_columns_t */
+} unpack_frame_kind_t;
+
+typedef struct
+{
+    PyObject * obj;     /* container which is unpacked */
+    PyObject * key;     /* map key which is waiting for its value, or the
+                           list or tuple with the keys of a template */
+    Py_ssize_t n;       /* number of items, or key/value pairs for a map */
+    Py_ssize_t i;       /* number of items which are unpacked */
+    unpack_frame_kind_t kind;
+} unpack_frame_t;
+
+/*
+ * With columnar=True, unpackb() adds the values of each map in the top-level
+ * array, or of each record of a template, to a column for its key instead of
+ * creating a dict for each row. Integer and float values are kept in C until
+ * the column is complete and becomes an array.array; a column with any other
+ * value, or with a missing value, becomes a list.
+ */
+typedef enum
+{
+    UNPACK_COLUMN_EMPTY,
+    UNPACK_COLUMN_INT,      /* int64_t values */
+    UNPACK_COLUMN_DOUBLE,   /* double values */
+    UNPACK_COLUMN_LIST      /* list which is created at the final size */
+} unpack_column_kind_t;
+
+typedef struct
+{
+    PyObject * key;
+    PyObject * list;        /* values of a UNPACK_COLUMN_LIST column */
+    char * numbers;         /* values of an integer or float column */
+    Py_ssize_t len;         /* number of values */
+    unpack_column_kind_t kind;
+} unpack_column_t;
+
+typedef struct
+{
+    unpack_column_t * items;
+    Py_ssize_t len;
+    Py_ssize_t size;
+    Py_ssize_t rows;        /* number of rows in the array */
+    Py_ssize_t row;         /* number of rows which are complete */
+    int template;           /* the rows are the records of a template */
+} unpack_columns_t;
+
+#define UNPACK_COLUMNS_INIT_SZ 16
+
+/* array.array in Python 2 has no type code for a 64-bit integer */
+#if PY_MAJOR_VERSION >= 3
+#define UNPACK_COLUMN_INT_CHECK(obj) PyLong_CheckExact(obj)
+#else
+#define UNPACK_COLUMN_INT_CHECK(obj) 0
+#endif
+
+/*
+ * A value is unpacked in two stages. First the scanner of the qpack library
+ * validates the data and writes a tape with one token for each value; this
+ * stage does not use the Python API so it runs without the GIL for large
+ * data. Next, unpackb() creates the Python objects from the tape.
+ *
+ * The GIL is released while scanning at least this number of bytes; when
+ * the size of a value is not known up front, the GIL is released after
+ * scanning this number of bytes of the value.
+ */
+#define SCAN_NOGIL_SZ 4096
+
+/*
+ * With threads=N, the items of a large array at the top of a value are
+ * created by up to N threads; each thread takes a range of at least
+ * UNPACK_THREAD_MIN_ITEMS items. Threads are only used when they run in
+ * parallel, see threads_parallel().
+ */
+#define UNPACK_THREAD_MIN_ITEMS 1024
+
+typedef struct
+{
+    const unsigned char * data;
+    qp_tape_t * tape;
+    qp_ssize_t token;       /* tape index of the first item */
+    Py_ssize_t start;       /* index of the first item */
+    Py_ssize_t end;
+    PyObject * obj;         /* list or tuple for the items (borrowed) */
+    unpack_options_t options;   /* copy with its own key cache */
+    PyObject * err_type;    /* exception which is raised by the job */
+    PyObject * err_value;
+    PyObject * err_tb;
+} unpack_job_t;
+
+typedef enum
+{
+    GET_FOUND,          /* the value for the path is found */
+    GET_MISSING_KEY,    /* a path item is not found */
+    GET_MISSING_INDEX,  /* an array index is out of range */
+    GET_INCOMPLETE,     /* more data is required */
+    GET_ERROR,          /* invalid data, see scanner->err */
+    GET_TEMPLATE        /* a template is on the path, see get_refs() */
+} get_rc_t;
+
+typedef struct
+{
+    PyObject * obj;     /* path item */
+    PyObject * bytes;   /* UTF-8 encoded path item, or NULL */
+    const char * raw;   /* raw data for a str or bytes path item */
+    Py_ssize_t size;
+    int64_t integer;    /* value for an integer path item */
+    int is_int;
+} get_step_t;
+
+/* number of path items which fit on the stack */
+#define GET_STEPS_SZ 16
+
+/* raw data smaller than this is checked for ASCII inline */
+#define ASCII_INLINE_SZ 16
+
+/* returns 1 when all bytes are ASCII, selected by ascii_init() */
+static int (*ascii_check)(const unsigned char * pt, Py_ssize_t size);
+
+typedef struct
+{
+    PyObject_HEAD
+    unsigned char * buffer;
+    Py_ssize_t size;
+    Py_ssize_t len;
+    Py_ssize_t pos;     /* offset of the next value */
+    qp_scanner_t scanner;
+    qp_tape_t tape;        /* tape of the value which is scanned */
+    unpack_options_t options;
+    unpack_dict_t dict;
+} unpacker_t;
+
+typedef struct
+{
+    PyObject_HEAD
+    pack_dict_t dict;
+    Py_ssize_t max_depth;
+} session_packer_t;
+
+/*
+ * An Unpacker or Packer can be shared by threads. In a free-threaded build,
+ * the calls which change its state are serialized with a lock on the object;
+ * with the GIL this is a plain call.
+ */
+#ifdef Py_BEGIN_CRITICAL_SECTION
+#define LOCKED_CALL(RET, SELF, CALL)                                    \
+Py_BEGIN_CRITICAL_SECTION(SELF);                                        \
+RET = CALL;                                                             \
+Py_END_CRITICAL_SECTION();
+#else
+#define LOCKED_CALL(RET, SELF, CALL)                                    \
+RET = CALL;
+#endif
+
+/*
+ * Jobs for threads_run(), which are used by packb() and unpackb() with
+ * threads=N. Threads only run in parallel in a free-threaded build of Python
+ * while the GIL is disabled, see threads_parallel(); with the GIL they take
+ * turns and are slower than the calling thread alone. The threads are
+ * started once and wait in a pool for the next call. Each job runs with a
+ * new thread state for the interpreter of the caller, so this works in
+ * sub-interpreters.
+ */
+#define THREADS_MAX 64
+
+typedef void (*job_fn_t)(void * job);
+
+#ifdef Py_GIL_DISABLED
+typedef struct
+{
+    PyThread_type_lock start;   /* released to start a job */
+    PyThread_type_lock done;    /* released when the job is done */
+    job_fn_t fn;
+    void * job;
+    PyInterpreterState * interp;
+    int ok;                     /* the job has run in the thread */
+} worker_t;
+
+#ifdef _WIN32
+#define THREADS_PID() 0L
+#else
+#define THREADS_PID() ((long) getpid())
+#endif
+
+static struct
+{
+    PyMutex mutex;
+    int busy;                   /* a caller uses the workers */
+    Py_ssize_t n;               /* number of workers which are started */
+    long pid;                   /* process which has started the workers */
+    worker_t workers[THREADS_MAX - 1];
+} threads_pool;
+#endif
+
+/*
+ * A new packer starts with a scratch buffer of PACKER_INIT_SZ bytes which
+ * grows geometrically up to PACKER_CACHE_SZ. Each thread keeps one packer
+ * which is reused by packb(). Once the data does not fit in PACKER_CACHE_SZ
+ * bytes, the packer moves to a bytes object which keeps growing geometrically
+ * and is returned by packb() without making another copy.
+ */
+#define PACKER_INIT_SZ 1024
+#define PACKER_CACHE_SZ 65536
+#define PACKER_CACHE_KEY "_qpack.packer"
 
 #define PACKER_RESIZE(LEN)                                              \
-if (packer->len + LEN > packer->size)                                   \
+if (packer->len + LEN > packer->size && packer_grow(packer, LEN))       \
 {                                                                       \
-    unsigned char * tmp;                                                \
-    packer->size = ((packer->len + LEN) / DEFAULT_ALLOC_SZ + 1)         \
-            * DEFAULT_ALLOC_SZ;                                         \
-    tmp = (unsigned char *) realloc(packer->buffer, packer->size);      \
-    if (tmp == NULL)                                                    \
-    {                                                                   \
-        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");  \
-        packer->size = packer->len;                                     \
-        return -1;                                                      \
-    }                                                                   \
-    packer->buffer = tmp;                                               \
+    return -1;  /* PyErr is set */                                      \
 }
 
-#define UNPACK_CHECK_SZ(size)                                           \
-if ((*pt) + size > end)                                                 \
-{                                                                       \
-    PyErr_SetString(PyExc_ValueError, "unpackb() is missing data");     \
-    return NULL;                                                        \
-}
+/*
+ * With threads=N, the items of a large list or tuple are packed by up to N
+ * threads, each for a range of at least PACK_THREAD_MIN_ITEMS items. These
+ * threads release the GIL to copy raw data of at least PACK_NOGIL_SZ bytes.
+ */
+#define PACK_THREAD_MIN_ITEMS 256
+#define PACK_NOGIL_SZ 65536
+
+typedef struct
+{
+    PyObject ** items;
+    Py_ssize_t start;       /* index of the first item */
+    Py_ssize_t end;
+    packer_t packer;        /* packer for the range of items */
+    PyObject * err_type;    /* exception which is raised by the job */
+    PyObject * err_value;
+    PyObject * err_tb;
+} pack_job_t;
+
+/*
+ * Used within packb() to pack, or only measure, an object which is not a
+ * container.
+ */
+#define PACK_SCALAR(obj)                                                \
+(packer->measure ? measure_scalar(obj, packer) : pack_scalar(obj, packer))
+
+#define PACK_IS_CONTAINER(obj)                                          \
+PyType_HasFeature(Py_TYPE(obj),                                         \
+        Py_TPFLAGS_LIST_SUBCLASS |                                      \
+        Py_TPFLAGS_TUPLE_SUBCLASS |                                     \
+        Py_TPFLAGS_DICT_SUBCLASS)
+
+/* lists and dicts must be copied when they might change while packed */
+#ifdef Py_GIL_DISABLED
+#define PACK_COPY(packer) 1
+#else
+#define PACK_COPY(packer) ((packer)->nogil)
+#endif
+
+/*
+ * In canonical mode, the keys of a map are packed first and the pairs are
+ * sorted on the packed keys.
+ */
+typedef struct
+{
+    const unsigned char * pt;   /* packed key */
+    Py_ssize_t size;
+    PyObject * key;             /* (borrowed) */
+    PyObject * value;           /* (borrowed) */
+} pack_key_t;
+
+/* initial size for the packed keys of a map, for each key */
+#define PACK_KEY_INIT_SZ 16
 
+/*
+ * With templates=True, a list or tuple with at least this number of dicts
+ * which have the same keys in the same order is packed as a template, see
+ * QP_TEMPLATE.
+ */
+#define PACK_TEMPLATE_MIN_RECORDS 2
+
+/*
+ * The table for back-references starts with PACK_REFS_INIT_SZ slots and
+ * grows up to PACK_REFS_MAX_SZ slots; once half of these are used, no more
+ * raw data is added. Raw data larger than PACK_REF_MAX_SZ bytes is not
+ * looked up since hashing is slower than copying the data.
+ */
+#define PACK_REFS_INIT_SZ 256
+#define PACK_REFS_MAX_SZ 131072
+#define PACK_REF_MAX_SZ 256
+
+/*
+ * Raw data is added to the table for back-references when enabled, and is
+ * looked up in the dictionary of a Packer first.
+ */
+#define PACK_RAW(packer, raw, size)                                     \
+((packer)->refs == NULL                                                 \
+        ? add_raw(packer, raw, size)                                    \
+        : (packer)->dict == NULL                                        \
+        ? add_ref(packer, raw, size)                                    \
+        : add_dict_raw(packer, raw, size))
+
+#define UNPACKER_INIT_SZ 4096
+
+
+#define UNPACK_STACK_SZ 32
+
+/*
+ * Used within unpackb() to set `obj` to the integer at `pt`.
+ */
+#define UNPACK_INT(intx_t)                              \
+{                                                       \
+    intx_t integer;                                     \
+    memcpy(&integer, pt + 1, sizeof(intx_t));           \
+    obj = PYLONG_FROMLONGLONG((long long) integer);     \
+    break;                                              \
+}
 
-#define UNPACK_RAW(size, __options)                                     \
-UNPACK_CHECK_SZ(size)                                                   \
-switch(__options->decode)                                               \
+/*
+ * Push a new container `obj` with `n` items on the stack of unpackb(). The
+ * depth is already checked by the scanner.
+ */
+#define UNPACK_PUSH(__kind, __n)                                        \
+if (obj == NULL)                                                        \
+{                                                                       \
+    goto failed;  /* PyErr is set */                                    \
+}                                                                       \
+if (depth == frames_sz)                                                 \
 {                                                                       \
-case DECODE_NONE:                                                       \
-    obj = PyBytes_FromStringAndSize((const char *) *pt, size);          \
-    break;                                                              \
-case DECODE_UTF8:                                                       \
-    obj = PyUnicode_DecodeUTF8((const char *) *pt, size, NULL);         \
-    if (__options->ignore_decode_errors && obj == NULL)                 \
+    unpack_frame_t * tmp = (unpack_frame_t *) malloc(                   \
+            frames_sz * 2 * sizeof(unpack_frame_t));                    \
+    if (tmp == NULL)                                                    \
     {                                                                   \
-        PyErr_Clear();                                                  \
-        obj = PyBytes_FromStringAndSize((const char *) *pt, size);      \
+        Py_DECREF(obj);                                                 \
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");  \
+        goto failed;                                                    \
     }                                                                   \
-    break;                                                              \
-case DECODE_LATIN1:                                                     \
-    obj = PyUnicode_DecodeLatin1((const char *) *pt, size, NULL);       \
-    if (__options->ignore_decode_errors && obj == NULL)                 \
+    memcpy(tmp, frames, frames_sz * sizeof(unpack_frame_t));            \
+    if (frames != stack)                                                \
     {                                                                   \
-        PyErr_Clear();                                                  \
-        obj = PyBytes_FromStringAndSize((const char *) *pt, size);      \
+        free(frames);                                                   \
     }                                                                   \
-    break;                                                              \
+    frames = tmp;                                                       \
+    frames_sz *= 2;                                                     \
 }                                                                       \
-(*pt) += size;                                                          \
-return obj;
-
-#define UNPACK_FIXED_RAW(uintx_t, __options)            \
-{                                                       \
-    Py_ssize_t size;                                    \
-    UNPACK_CHECK_SZ(sizeof(uintx_t))                    \
-    size = (Py_ssize_t) *((uintx_t *) *pt);             \
-    (*pt) += sizeof(uintx_t);                           \
-    UNPACK_RAW(size, __options)                         \
-}
-
-#define UNPACK_INT(intx_t)                              \
-{                                                       \
-    long long integer;                                  \
-    UNPACK_CHECK_SZ(sizeof(intx_t))                     \
-    integer = (long long) *((intx_t *) *pt);            \
-    (*pt) += sizeof(intx_t);                            \
-    obj = PYLONG_FROMLONGLONG(integer);                 \
-    return obj;                                         \
-}
+frame = &frames[depth++];                                               \
+frame->obj = obj;                                                       \
+frame->key = NULL;                                                      \
+frame->n = __n;                                                         \
+frame->i = 0;                                                           \
+frame->kind = __kind;
 
-#define SET_UNEXPECTED(obj)                                                 \
-if (Py_QPackCHECK(obj))                                                     \
-{                                                                           \
-    PyErr_SetString(                                                        \
-            PyExc_ValueError,                                               \
-            "unpackb() found an unexpected array or map close character");  \
+/*
+ * Used within unpackb() to keep `obj` for back-references.
+ */
+#define UNPACK_REF_ADD(__size)                                          \
+if (obj != NULL && unpack_refs_add(&refs, obj, __size))                 \
+{                                                                       \
+    Py_DECREF(obj);                                                     \
+    goto failed;                                                        \
 }
 
 /* Documentation strings */
@@ -213,6 +601,27 @@ static char module_docstring[] =
 static char packb_docstring[] =
     "Serialize a Python object to QPack format.";
 
+static char packed_size_docstring[] =
+"packed_size(obj, max_depth=1024)\n"
+"\n"
+"Returns the number of bytes which packb() returns for `obj`, without\n"
+"writing the data.";
+
+static char digest_docstring[] =
+"digest(obj, max_depth=1024)\n"
+"\n"
+"Returns the 32 byte BLAKE2b digest of packb(obj, canonical=True), without\n"
+"keeping the packed data in memory. This is the same as\n"
+"hashlib.blake2b(packb(obj, canonical=True), digest_size=32).digest().";
+
+static char packb_into_docstring[] =
+"Serialize a Python object to QPack format into a writable buffer.\n"
+"\n"
+"The data is written to `buffer` starting at `offset` and the number of\n"
+"bytes written is returned. A ValueError is raised when the data does not\n"
+"fit in the buffer, in which case the buffer might be partially written.\n"
+"See unpackb() for the max_depth keyword argument.";
+
 static char unpackb_docstring[] =
 "De-serialize QPack data to a Python object.\n"
 "\n"
@@ -229,72 +638,725 @@ static char unpackb_docstring[] =
 "        raised if a raw value fails to decode.\n"
 "        When set to True, a value which has failed to deocode will be\n"
 "        returned as bytes but other values are still decoded.\n"
+"        (Default value: False)\n"
+"    raw_as_view:\n"
+"        When decode is None, return raw data as read-only memoryview\n"
+"        slices of the input instead of bytes. This can be True for all raw\n"
+"        data, or a size to only return raw data of at least this size as\n"
+"        a memoryview. Map keys are always bytes. The memoryview objects\n"
+"        keep the input alive.\n"
+"        (Default value: False)\n"
+"    key_cache_size:\n"
+"        Number of map keys which are cached while unpacking, so repeated\n"
+"        keys are created only once. An Unpacker keeps this cache between\n"
+"        values. Use 0 to disable the cache.\n"
+"        (Default value: 128)\n"
+"    max_depth:\n"
+"        Maximum number of nested arrays and maps. A ValueError is raised\n"
+"        for data which is nested deeper. packb() and packb_into() accept\n"
+"        the same argument.\n"
+"        (Default value: 1024)\n"
+"    threads:\n"
+"        Number of threads which create the items of a large array at the\n"
+"        top of the data, only for unpackb(). Threads are only used in a\n"
+"        free-threaded build of Python while the GIL is disabled.\n"
+"        (Default value: 1)\n"
+"    columnar:\n"
+"        Unpack a top-level array of maps, or a template, as a dict with a\n"
+"        column for each key instead of a dict for each row, only for\n"
+"        unpackb(). A column is an array.array for only integers ('q') or\n"
+"        only floats ('d'), or else a list. A row without the key has None\n"
+"        in the column. A ValueError is raised for other data. The\n"
+"        threads argument does not apply.\n"
 "        (Default value: False)";
 
+static char unpacker_docstring[] =
+"Unpacker(decode=None, ignore_decode_errors=False, use_tuples=False,\n"
+"         dictionary=None, dictionary_size=None)\n"
+"\n"
+"Streaming de-serializer. Data can be fed in chunks of any size and\n"
+"iterating over the unpacker returns each complete value which has been\n"
+"received so far. Partially received values are kept until the remaining\n"
+"data is fed. See unpackb() for the other keyword arguments.\n"
+"\n"
+"The values of a Packer are unpacked by an Unpacker with the same\n"
+"`dictionary` and `dictionary_size`; when one of these is given, the\n"
+"Unpacker keeps a dictionary of strings in the same way as a Packer.";
+
+static char unpacker_feed_docstring[] =
+"Append a bytes-like object to the internal buffer.";
+
+static char packer_docstring[] =
+"Packer(dictionary=None, dictionary_size=4096, max_depth=1024)\n"
+"\n"
+"Serializer for a stream of values which keeps a dictionary of strings\n"
+"between the values. A string which is in the dictionary is packed as a\n"
+"reference of 3 to 7 bytes. The dictionary starts with the str or bytes\n"
+"objects in `dictionary`, of at most 64 bytes each, and each value adds its\n"
+"strings of 3 to 64 bytes; once `dictionary_size` strings are added, each\n"
+"next string replaces the oldest one. Raw data which is repeated within a\n"
+"value is packed as a back-reference, like packb(refs=True).\n"
+"\n"
+"The values must be unpacked in the same order by an Unpacker with the\n"
+"same `dictionary` and `dictionary_size`.";
+
+static char packer_pack_docstring[] =
+"pack(obj)\n"
+"\n"
+"Serialize a Python object to QPack format and add its strings to the\n"
+"dictionary.";
+
+static char unpack_from_docstring[] =
+"unpack_from(buffer, offset=0, **kwargs)\n"
+"\n"
+"De-serialize one QPack value from any bytes-like object, starting at\n"
+"`offset`. Returns a tuple (obj, next_offset) where `next_offset` points to\n"
+"the first byte after the value. See unpackb() for the keyword arguments.";
+
+static char skip_docstring[] =
+"skip(buffer, offset=0, max_depth=1024)\n"
+"\n"
+"Returns the offset of the first byte after the QPack value at `offset`,\n"
+"without creating Python objects. A ValueError with the position of the\n"
+"first error is raised when the value is invalid or incomplete.";
+
+static char validate_docstring[] =
+"validate(buffer, offset=0, max_depth=1024)\n"
+"\n"
+"Check that the data from `offset` up to the end of `buffer` is exactly one\n"
+"well-formed QPack value, without creating Python objects. A ValueError\n"
+"with the position of the first error is raised when the data is invalid.\n"
+"Open arrays and maps which are not closed at the end of the data are valid,\n"
+"the same as for unpackb().";
+
+static char packb_many_docstring[] =
+"packb_many(iterable, max_depth=1024, concat=False)\n"
+"\n"
+"Serialize each object in `iterable` and return a list with the packed\n"
+"bytes. When `concat` is True, a tuple (packed, offsets) is returned where\n"
+"`packed` holds all values and `offsets` is an array.array('q') with the\n"
+"start of each value followed by the total size.";
+
+static char unpack_many_docstring[] =
+"unpack_many(buffers, **kwargs)\n"
+"\n"
+"De-serialize a list or tuple of bytes-like objects, or all concatenated\n"
+"values in a single bytes-like object, and return a list. The options are\n"
+"parsed once and the key cache is shared by all values. See unpackb() for\n"
+"the keyword arguments.";
+
+static char get_docstring[] =
+"get(buffer, path, default=<missing>, **kwargs)\n"
+"\n"
+"De-serialize only the value at `path`, a list or tuple with map keys and\n"
+"array indexes. Map keys can be str, bytes or int and array indexes must\n"
+"be int. The values which are not on the path are skipped without creating\n"
+"Python objects. A KeyError (or an IndexError for an array index which is\n"
+"out of range) is raised when the path is not found, unless `default` is\n"
+"given. See unpackb() for the other keyword arguments.";
+
 /* Available functions */
 static PyObject * _qpack_packb(
         PyObject * self,
         PyObject * args,
         PyObject * kwargs);
+static PyObject * _qpack_packb_into(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_packed_size(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_digest(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
 static PyObject * _qpack_unpackb(
         PyObject * self,
         PyObject * args,
         PyObject * kwargs);
+static PyObject * _qpack_unpack_from(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_skip(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_validate(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_get(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_packb_many(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
+static PyObject * _qpack_unpack_many(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs);
 
 /* other static methods */
 static packer_t * packer_new(void);
 static void packer_free(packer_t * packer);
+static int packer_grow(packer_t * packer, Py_ssize_t n);
+static packer_t * packer_acquire(void);
+static PyObject * packer_finish(packer_t * packer);
+static void packer_release(packer_t * packer);
+static void packer_capsule_free(PyObject * capsule);
 static int add_raw(packer_t * packer, const unsigned char * buffer, Py_ssize_t size);
+static int add_ref(
+        packer_t * packer,
+        const unsigned char * raw,
+        Py_ssize_t size);
+static int refs_init(packer_t * packer);
+static int refs_grow(packer_t * packer);
+static uint64_t raw_hash(const unsigned char * raw, Py_ssize_t size);
+static int add_dict_raw(
+        packer_t * packer,
+        const unsigned char * raw,
+        Py_ssize_t size);
+static Py_ssize_t pack_dict_find(
+        pack_dict_t * dict,
+        const unsigned char * raw,
+        Py_ssize_t size,
+        uint32_t hash);
+static void pack_dict_add(
+        pack_dict_t * dict,
+        Py_ssize_t index,
+        const unsigned char * raw,
+        Py_ssize_t size);
+static void pack_dict_commit(pack_dict_t * dict, const unsigned char * data);
+static void pack_dict_clear(pack_dict_t * dict);
+static int digest_raw(
+        packer_t * packer,
+        const unsigned char * buffer,
+        Py_ssize_t size);
+static int pack_scalar(PyObject * obj, packer_t * packer);
+static int pack_buffer(PyObject * obj, packer_t * packer);
+static char buffer_typed(Py_buffer * view);
+static int measure_scalar(PyObject * obj, packer_t * packer);
 static int packb(PyObject * obj, packer_t * packer);
+static int packb_frames(PyObject * obj, packer_t * packer, PyObject * copies);
+static PyObject * packb_copy(PyObject * obj, int is_map, PyObject * copies);
+#if PY_MAJOR_VERSION < 3
+static PyObject * packb_items(PyObject * obj, PyObject * copies);
+#endif
+static PyObject * packb_sorted(
+        PyObject * obj,
+        packer_t * packer,
+        Py_ssize_t depth,
+        PyObject * copies);
+static int pack_key_cmp(const void * a, const void * b);
+static int template_keys(PyObject * obj, PyObject ** keys);
+static int template_record(PyObject * keys, PyObject * obj);
+static int pack_template(
+        PyObject * keys,
+        Py_ssize_t n,
+        packer_t * packer);
+static PyObject * packb_exact(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        int canonical);
+static PyObject * packb_threads(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        int canonical,
+        Py_ssize_t nthreads);
+static void pack_job(void * arg);
+static int packed_size(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        Py_ssize_t * size);
+static int unpack_at_key(
+        unpack_frame_t * frames,
+        Py_ssize_t depth,
+        int template);
 static PyObject * unpackb(
-        unsigned char ** pt,
-        const unsigned char * const end,
+        const unsigned char * data,
+        qp_tape_t * tape,
         unpack_options_t * options);
-
-/* Module specification */
-static PyMethodDef module_methods[] =
-{
-    {
-            "_packb",
-            (PyCFunction)_qpack_packb,
+static PyObject * unpack_tape(
+        const unsigned char * data,
+        qp_tape_t * tape,
+        unpack_options_t * options);
+static PyObject * unpack_threads(
+        const unsigned char * data,
+        qp_tape_t * tape,
+        unpack_options_t * options,
+        Py_ssize_t nthreads);
+static void unpack_job(void * arg);
+static int threads_parallel(void);
+static void threads_run(
+        job_fn_t fn,
+        void * jobs,
+        size_t size,
+        Py_ssize_t n);
+#ifdef Py_GIL_DISABLED
+static int threads_start(worker_t * w);
+static void threads_main(void * arg);
+#endif
+static PyObject * unpack_value(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        Py_ssize_t * offset,
+        unpack_options_t * options);
+static int get_read_buffer(PyObject * obj, Py_buffer * view);
+static PyObject * unpack_view(
+        Py_buffer * view,
+        Py_ssize_t * offset,
+        unpack_options_t * options);
+static PyObject * unpack_raw_view(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options);
+static PyObject * unpack_raw(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options);
+static PyObject * unpack_raw_value(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options);
+static PyObject * unpack_key(
+        const unsigned char * raw,
+        Py_ssize_t size,
+        unpack_options_t * options);
+static int unpack_refs_add(
+        unpack_refs_t * refs,
+        PyObject * obj,
+        Py_ssize_t size);
+static void unpack_refs_clear(unpack_refs_t * refs);
+static PyObject * unpack_record(unpack_frame_t * frame, Py_ssize_t size);
+static int columns_add(
+        unpack_columns_t * columns,
+        PyObject * index,
+        PyObject * key,
+        Py_ssize_t pos,
+        PyObject * obj);
+static int columns_row_end(unpack_columns_t * columns);
+static int columns_finish(
+        unpack_columns_t * columns,
+        PyObject * index,
+        unpack_options_t * options);
+static void columns_clear(unpack_columns_t * columns);
+static int column_set(
+        unpack_column_t * column,
+        Py_ssize_t rows,
+        Py_ssize_t row,
+        PyObject * obj);
+static int column_to_list(unpack_column_t * column, Py_ssize_t rows);
+static void unpack_dict_commit(unpack_dict_t * dict, unpack_refs_t * refs);
+static void unpack_dict_clear(unpack_dict_t * dict);
+static PyObject * dict_strings(
+        PyObject * kwargs,
+        const char * name,
+        Py_ssize_t default_size,
+        Py_ssize_t * size);
+static PyObject * unpack_typed(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unsigned char fmt,
+        unpack_options_t * options);
+static PyObject * typed_array_new(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unsigned char fmt,
+        PyObject ** array_type);
+static void keycache_clear(keycache_t * keycache);
+static void keycache_grow(keycache_t * keycache);
+static void ascii_init(void);
+static int ascii_scalar(const unsigned char * pt, Py_ssize_t size);
+#ifdef QP_SSE2
+static int ascii_sse2(const unsigned char * pt, Py_ssize_t size);
+#endif
+#ifdef QP_AVX2
+static int ascii_avx2(const unsigned char * pt, Py_ssize_t size);
+#endif
+static int unpack_options_init(
+        unpack_options_t * options,
+        PyObject * kwargs);
+static PyObject * options_kwarg(
+        PyObject * kwargs,
+        const char * name,
+        Py_ssize_t * n);
+static int max_depth_init(PyObject * o_max_depth, Py_ssize_t * max_depth);
+static qp_scan_rc_t scanner_scan(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len);
+static void scanner_set_err(qp_scanner_t * scanner, Py_ssize_t start);
+static int scan_view(
+        Py_buffer * view,
+        Py_ssize_t * offset,
+        Py_ssize_t max_depth);
+static Py_ssize_t scan_args(
+        const char * fmt,
+        PyObject * args,
+        PyObject * kwargs,
+        int to_end);
+static get_rc_t get_skip(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        Py_ssize_t * pos);
+static get_rc_t get_walk(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        get_step_t * steps,
+        Py_ssize_t n,
+        Py_ssize_t * step);
+static get_rc_t get_refs(
+        Py_buffer * view,
+        get_step_t * steps,
+        Py_ssize_t n,
+        unpack_options_t * options,
+        Py_ssize_t * step,
+        PyObject ** value);
+static int unpack_many_view(
+        Py_buffer * view,
+        PyObject * unpacked,
+        unpack_options_t * options,
+        int all);
+static int unpacker_init(unpacker_t * self, PyObject * args, PyObject * kwargs);
+static int unpacker_dict_init(unpacker_t * self, PyObject * kwargs);
+static void unpacker_dealloc(unpacker_t * self);
+static PyObject * unpacker_feed(unpacker_t * self, PyObject * data);
+static PyObject * unpacker_next(unpacker_t * self);
+static PyObject * unpacker_do_feed(unpacker_t * self, PyObject * data);
+static PyObject * unpacker_do_next(unpacker_t * self);
+static int session_packer_init(
+        session_packer_t * self,
+        PyObject * args,
+        PyObject * kwargs);
+static void session_packer_dealloc(session_packer_t * self);
+static PyObject * session_packer_pack(session_packer_t * self, PyObject * obj);
+static PyObject * session_packer_do_pack(
+        session_packer_t * self,
+        PyObject * obj);
+
+/* Unpacker type specification */
+static PyMethodDef unpacker_methods[] =
+{
+    {
+            "feed",
+            (PyCFunction)unpacker_feed,
+            METH_O,
+            unpacker_feed_docstring
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+/* Packer type specification */
+static PyMethodDef session_packer_methods[] =
+{
+    {
+            "pack",
+            (PyCFunction)session_packer_pack,
+            METH_O,
+            packer_pack_docstring
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+/*
+ * Unpacker and Packer are heap types which are created by the module exec
+ * function, so each (sub-)interpreter has its own type objects.
+ *
+ * The type and module slots store functions as void pointers, which ISO C
+ * does not allow but the Python C API requires.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+static PyType_Slot unpacker_slots[] =
+{
+    {Py_tp_dealloc, (void *) unpacker_dealloc},
+    {Py_tp_doc, (void *) unpacker_docstring},
+    {Py_tp_iter, (void *) PyObject_SelfIter},
+    {Py_tp_iternext, (void *) unpacker_next},
+    {Py_tp_methods, (void *) unpacker_methods},
+    {Py_tp_init, (void *) unpacker_init},
+    {Py_tp_new, (void *) PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec unpacker_spec =
+{
+    "_qpack.Unpacker",                  /* name */
+    sizeof(unpacker_t),                 /* basicsize */
+    0,                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT,                 /* flags */
+    unpacker_slots                      /* slots */
+};
+
+static PyType_Slot session_packer_slots[] =
+{
+    {Py_tp_dealloc, (void *) session_packer_dealloc},
+    {Py_tp_doc, (void *) packer_docstring},
+    {Py_tp_methods, (void *) session_packer_methods},
+    {Py_tp_init, (void *) session_packer_init},
+    {Py_tp_new, (void *) PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec session_packer_spec =
+{
+    "_qpack.Packer",                    /* name */
+    sizeof(session_packer_t),           /* basicsize */
+    0,                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT,                 /* flags */
+    session_packer_slots                /* slots */
+};
+#else
+static PyTypeObject UnpackerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_qpack.Unpacker",                  /* tp_name */
+    sizeof(unpacker_t),                 /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)unpacker_dealloc,       /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    unpacker_docstring,                 /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    PyObject_SelfIter,                  /* tp_iter */
+    (iternextfunc)unpacker_next,        /* tp_iternext */
+    unpacker_methods,                   /* tp_methods */
+    0,                                  /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)unpacker_init,            /* tp_init */
+    0,                                  /* tp_alloc */
+    PyType_GenericNew,                  /* tp_new */
+};
+
+static PyTypeObject PackerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_qpack.Packer",                    /* tp_name */
+    sizeof(session_packer_t),           /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)session_packer_dealloc, /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    packer_docstring,                   /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    session_packer_methods,             /* tp_methods */
+    0,                                  /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)session_packer_init,      /* tp_init */
+    0,                                  /* tp_alloc */
+    PyType_GenericNew,                  /* tp_new */
+};
+#endif
+
+/* Module specification */
+static PyMethodDef module_methods[] =
+{
+    {
+            "_packb",
+            (PyCFunction)_qpack_packb,
             METH_VARARGS | METH_KEYWORDS,
             packb_docstring
     },
+    {
+            "_packb_into",
+            (PyCFunction)_qpack_packb_into,
+            METH_VARARGS | METH_KEYWORDS,
+            packb_into_docstring
+    },
+    {
+            "_packed_size",
+            (PyCFunction)_qpack_packed_size,
+            METH_VARARGS | METH_KEYWORDS,
+            packed_size_docstring
+    },
+    {
+            "_digest",
+            (PyCFunction)_qpack_digest,
+            METH_VARARGS | METH_KEYWORDS,
+            digest_docstring
+    },
     {
             "_unpackb",
             (PyCFunction)_qpack_unpackb,
             METH_VARARGS | METH_KEYWORDS,
             unpackb_docstring
     },
+    {
+            "_unpack_from",
+            (PyCFunction)_qpack_unpack_from,
+            METH_VARARGS | METH_KEYWORDS,
+            unpack_from_docstring
+    },
+    {
+            "_skip",
+            (PyCFunction)_qpack_skip,
+            METH_VARARGS | METH_KEYWORDS,
+            skip_docstring
+    },
+    {
+            "_validate",
+            (PyCFunction)_qpack_validate,
+            METH_VARARGS | METH_KEYWORDS,
+            validate_docstring
+    },
+    {
+            "_get",
+            (PyCFunction)_qpack_get,
+            METH_VARARGS | METH_KEYWORDS,
+            get_docstring
+    },
+    {
+            "_packb_many",
+            (PyCFunction)_qpack_packb_many,
+            METH_VARARGS | METH_KEYWORDS,
+            packb_many_docstring
+    },
+    {
+            "_unpack_many",
+            (PyCFunction)_qpack_unpack_many,
+            METH_VARARGS | METH_KEYWORDS,
+            unpack_many_docstring
+    },
     {NULL, NULL, 0, NULL}
 };
 
 #if PY_MAJOR_VERSION >= 3
+    /* Initialize the module, called for each (sub-)interpreter */
+    static int module_exec(PyObject * m)
+    {
+        PyObject * tp;
+
+        ascii_init();
+
+        tp = PyType_FromSpec(&unpacker_spec);
+        if (tp == NULL) return -1;
+
+        if (PyModule_AddObject(m, "Unpacker", tp))
+        {
+            Py_DECREF(tp);
+            return -1;
+        }
+
+        tp = PyType_FromSpec(&session_packer_spec);
+        if (tp == NULL) return -1;
+
+        if (PyModule_AddObject(m, "Packer", tp))
+        {
+            Py_DECREF(tp);
+            return -1;
+        }
+        return 0;
+    }
+
+    /*
+     * The module has no global Python objects, so it can be imported in
+     * sub-interpreters with their own GIL and does not need the GIL in a
+     * free-threaded build. Packers are cached per thread state and each
+     * Unpacker and Packer object is locked while it is used.
+     */
+    static PyModuleDef_Slot module_slots[] = {
+        {Py_mod_exec, (void *) module_exec},
+#ifdef Py_mod_multiple_interpreters
+        {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+        {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+        {0, NULL}
+    };
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
     static struct PyModuleDef moduledef = {
         PyModuleDef_HEAD_INIT,
         "_qpack",          /* m_name */
         module_docstring,  /* m_doc */
-        -1,                /* m_size */
+        0,                 /* m_size */
         module_methods,    /* m_methods */
-        NULL,              /* m_reload */
+        module_slots,      /* m_slots */
         NULL,              /* m_traverse */
         NULL,              /* m_clear */
         NULL,              /* m_free */
     };
 
-    /* Initialize the module */
     PyMODINIT_FUNC PyInit__qpack(void)
     {
-        return PyModule_Create(&moduledef);
+        return PyModuleDef_Init(&moduledef);
     }
 #else
     PyMODINIT_FUNC init_qpack(void)
     {
-        PyObject *m = Py_InitModule3(
+        PyObject *m;
+
+        if (PyType_Ready(&UnpackerType) < 0) return;
+        if (PyType_Ready(&PackerType) < 0) return;
+
+        ascii_init();
+
+        m = Py_InitModule3(
                 "_qpack",
                 module_methods,
                 module_docstring);
         if (m == NULL) return;
+
+        Py_INCREF(&UnpackerType);
+        PyModule_AddObject(m, "Unpacker", (PyObject *) &UnpackerType);
+        Py_INCREF(&PackerType);
+        PyModule_AddObject(m, "Packer", (PyObject *) &PackerType);
     }
 #endif
 
@@ -304,9 +1366,25 @@ static packer_t * packer_new(void)
     packer_t * packer = (packer_t *) malloc(sizeof(packer_t));
     if (packer != NULL)
     {
-        packer->size = DEFAULT_ALLOC_SZ;
+        packer->size = packer->scratch_sz = PACKER_INIT_SZ;
         packer->len = 0;
-        packer->buffer = (unsigned char *) malloc(DEFAULT_ALLOC_SZ);
+        packer->bytes = NULL;
+        packer->in_use = 0;
+        packer->cached = 0;
+        packer->fixed = 0;
+        packer->measure = 0;
+        packer->nogil = 0;
+        packer->canonical = 0;
+        packer->templates = 0;
+        packer->digest = NULL;
+        packer->refs = NULL;
+        packer->refs_sz = packer->refs_len = packer->raws = 0;
+        packer->dict = NULL;
+        packer->frames = NULL;
+        packer->frames_sz = 0;
+        packer->max_depth = QP_MAX_DEPTH;
+        packer->buffer = packer->scratch = \
+                (unsigned char *) malloc(PACKER_INIT_SZ);
         if (packer->buffer == NULL)
         {
             packer_free(packer);
@@ -318,279 +1396,641 @@ static packer_t * packer_new(void)
 
 static void packer_free(packer_t * packer)
 {
-    free(packer->buffer);
+    free(packer->refs);
+    free(packer->frames);
+    free(packer->scratch);
     free(packer);
 }
 
-static int add_raw(packer_t * packer, const unsigned char * buffer, Py_ssize_t size)
+/*
+ * Make room for at least `n` more bytes. The size is doubled (or more when
+ * required) so large objects need only a logarithmic number of reallocs.
+ */
+static int packer_grow(packer_t * packer, Py_ssize_t n)
 {
-    PACKER_RESIZE(5 + size)
+    Py_ssize_t size = packer->size;
+    Py_ssize_t required = packer->len + n;
 
-    if (size < 100)
+    if (packer->fixed)
     {
-        packer->buffer[packer->len++] = 128 + (char) size;
+        PyErr_SetString(
+                PyExc_ValueError,
+                "packb_into() buffer is too small");
+        return -1;
     }
-    else if (size < 256)
+
+    if (packer->digest != NULL)
     {
-        uint8_t length = (uint8_t) size;
-        packer->buffer[packer->len++] = QP_RAW8;
-        packer->buffer[packer->len++] = length;
+        /* the buffer is reused once its data is added to the digest */
+        qp_digest_update(packer->digest, packer->buffer, packer->len);
+        packer->len = 0;
+        if (n <= size)
+        {
+            return 0;
+        }
+        required = n;
     }
-    else if (size < 65536)
+
+    /* grow geometrically, or exactly to the required size when a single
+     * large item, for example a raw or typed array, needs more space */
+    size = (size > PY_SSIZE_T_MAX / 2 || size * 2 < required)
+            ? required
+            : size * 2;
+
+    if (packer->bytes != NULL)
     {
-        uint16_t length = (uint16_t) size;
-        packer->buffer[packer->len++] = QP_RAW16;
-        memcpy(packer->buffer + packer->len, &length, sizeof(uint16_t));
-        packer->len += sizeof(uint16_t);
+        if (_PyBytes_Resize(&packer->bytes, size) == -1)
+        {
+            return -1;  /* PyErr is set, bytes is set to NULL */
+        }
     }
-    else if (size < 4294967296)
+    else if (size > PACKER_CACHE_SZ && packer->digest == NULL)
     {
-        uint32_t length = (uint32_t) size;
-        packer->buffer[packer->len++] = QP_RAW32;
-        memcpy(packer->buffer + packer->len, &length, sizeof(uint32_t));
-        packer->len += sizeof(uint32_t);
+        packer->bytes = PyBytes_FromStringAndSize(NULL, size);
+        if (packer->bytes == NULL)
+        {
+            return -1;  /* PyErr is set */
+        }
+        if (packer->len)
+        {
+            /* a new job packer has no buffer yet */
+            memcpy(PyBytes_AS_STRING(packer->bytes), packer->buffer,
+                   packer->len);
+        }
     }
     else
     {
-        uint64_t length = (uint64_t) size;
-        packer->buffer[packer->len++] = QP_RAW64;
-        memcpy(packer->buffer + packer->len, &length, sizeof(uint64_t));
-        packer->len += sizeof(uint64_t);
+        unsigned char * tmp = (unsigned char *) realloc(packer->scratch, size);
+        if (tmp == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return -1;
+        }
+        packer->scratch = packer->buffer = tmp;
+        packer->scratch_sz = packer->size = size;
+        return 0;
     }
 
-    memcpy(packer->buffer + packer->len, buffer, size);
-    packer->len += size;
-
+    packer->buffer = (unsigned char *) PyBytes_AS_STRING(packer->bytes);
+    packer->size = size;
     return 0;
 }
 
-static int packb(PyObject * obj, packer_t * packer)
+/*
+ * Returns the packed data as a bytes object. When the data has been written
+ * to a bytes object, this object is shrunk in place and returned.
+ */
+static PyObject * packer_finish(packer_t * packer)
 {
-    if (obj == Py_True)
+    PyObject * packed = packer->bytes;
+
+    if (packed == NULL)
     {
-        PACKER_RESIZE(1)
-        packer->buffer[packer->len++] = QP_TRUE;
-        return 0;
+        return PyBytes_FromStringAndSize(
+                (const char *) packer->buffer,
+                packer->len);
     }
 
-    if (obj == Py_False)
+    packer->bytes = NULL;
+    packer->buffer = packer->scratch;
+    packer->size = packer->scratch_sz;
+    if (_PyBytes_Resize(&packed, packer->len) == -1)
     {
-        PACKER_RESIZE(1)
-        packer->buffer[packer->len++] = QP_FALSE;
-        return 0;
+        return NULL;  /* PyErr is set */
     }
+    return packed;
+}
 
-    if (obj == Py_None)
+static void packer_capsule_free(PyObject * capsule)
+{
+    packer_t * packer = (packer_t *) PyCapsule_GetPointer(
+            capsule,
+            PACKER_CACHE_KEY);
+    if (packer != NULL)
     {
-        PACKER_RESIZE(1)
-        packer->buffer[packer->len++] = QP_NULL;
-        return 0;
+        packer_free(packer);
     }
+}
+
+/*
+ * Returns the packer which is cached in the current thread state. A new
+ * packer is returned when the cached packer is already in use.
+ */
+static packer_t * packer_acquire(void)
+{
+    PyObject * capsule;
+    PyObject * dict = PyThreadState_GetDict();
+    packer_t * packer;
 
-    if (PyList_Check(obj))
+    if (dict == NULL)
     {
-        Py_ssize_t size;
-        PACKER_RESIZE(1)
+        return packer_new();
+    }
 
-        size = PyList_GET_SIZE(obj);
-        if (size < 6)
+    capsule = PyDict_GetItemString(dict, PACKER_CACHE_KEY);
+    if (capsule != NULL)
+    {
+        packer = (packer_t *) PyCapsule_GetPointer(capsule, PACKER_CACHE_KEY);
+        if (packer == NULL)
         {
-            Py_ssize_t i;
-            packer->buffer[packer->len++] = QP_ARRAY0 + (char) size;
-
-            for (i = 0; i < size; i++)
-            {
-                if (packb(PyList_GET_ITEM(obj, i), packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
-            }
+            return NULL;  /* PyErr is set */
         }
-        else
+        if (packer->in_use)
         {
-            Py_ssize_t i;
-            packer->buffer[packer->len++] = QP_ARRAY_OPEN;
+            return packer_new();
+        }
+        packer->in_use = 1;
+        return packer;
+    }
 
-            for (i = 0; i < size; i++)
-            {
-                if (packb(PyList_GET_ITEM(obj, i), packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
-            }
+    packer = packer_new();
+    if (packer == NULL)
+    {
+        return NULL;
+    }
 
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_ARRAY_CLOSE;
-        }
-        return 0;
+    capsule = PyCapsule_New(packer, PACKER_CACHE_KEY, packer_capsule_free);
+    if (capsule == NULL)
+    {
+        packer_free(packer);
+        return NULL;  /* PyErr is set */
     }
 
-    if (PyTuple_Check(obj))
+    if (PyDict_SetItemString(dict, PACKER_CACHE_KEY, capsule) == -1)
     {
-        Py_ssize_t size;
-        PACKER_RESIZE(1)
+        Py_DECREF(capsule);  /* frees the packer */
+        return NULL;  /* PyErr is set */
+    }
 
-        size = PyTuple_GET_SIZE(obj);
-        if (size < 6)
-        {
-            Py_ssize_t i;
-            packer->buffer[packer->len++] = QP_ARRAY0 + (char) size;
+    Py_DECREF(capsule);  /* the thread state dict holds a reference */
+    packer->cached = 1;
+    packer->in_use = 1;
+    return packer;
+}
 
-            for (i = 0; i < size; i++)
-            {
-                if (packb(PyTuple_GET_ITEM(obj, i), packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
-            }
-        }
-        else
-        {
-            Py_ssize_t i;
-            packer->buffer[packer->len++] = QP_ARRAY_OPEN;
+static void packer_release(packer_t * packer)
+{
+    Py_XDECREF(packer->bytes);
 
-            for (i = 0; i < size; i++)
-            {
-                if (packb(PyTuple_GET_ITEM(obj, i), packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
-            }
+    if (!packer->cached)
+    {
+        packer_free(packer);
+        return;
+    }
 
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_ARRAY_CLOSE;
+    packer->bytes = NULL;
+    packer->buffer = packer->scratch;
+    packer->size = packer->scratch_sz;
+    packer->len = 0;
+    packer->in_use = 0;
+    packer->canonical = 0;
+    packer->templates = 0;
+    packer->digest = NULL;
+    free(packer->refs);
+    packer->refs = NULL;
+    packer->refs_sz = packer->refs_len = packer->raws = 0;
+    packer->dict = NULL;
+}
+
+static int add_raw(packer_t * packer, const unsigned char * buffer, Py_ssize_t size)
+{
+    Py_ssize_t n = qp_raw_size(size) + size;
+    if (packer->len + n > packer->size)
+    {
+        if (packer->digest != NULL)
+        {
+            return digest_raw(packer, buffer, size);
         }
-        return 0;
+        if (packer_grow(packer, n))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    packer->len += qp_put_raw(packer->buffer + packer->len, size);
+    if (packer->nogil && size >= PACK_NOGIL_SZ)
+    {
+        /* the raw data is kept alive by a copy of its container */
+        Py_BEGIN_ALLOW_THREADS
+        memcpy(packer->buffer + packer->len, buffer, size);
+        Py_END_ALLOW_THREADS
     }
+    else
+    {
+        memcpy(packer->buffer + packer->len, buffer, size);
+    }
+    packer->len += size;
+    return 0;
+}
+
+/*
+ * Add raw data, or a back-reference when the same raw data is packed before
+ * and the back-reference is smaller. Both the packer and the unpacker number
+ * all raw data of at least QP_REF_MIN_SZ bytes which is packed in full.
+ */
+static int add_ref(
+        packer_t * packer,
+        const unsigned char * raw,
+        Py_ssize_t size)
+{
+    pack_ref_t * ref;
+    Py_ssize_t i, n, mask;
+    uint64_t hash;
 
-    if (PyDict_Check(obj))
+    if (size < QP_REF_MIN_SZ)
     {
-        PyObject * key;
-        PyObject * value;
-        Py_ssize_t pos = 0;
-        Py_ssize_t size = PyDict_Size(obj);
+        return add_raw(packer, raw, size);
+    }
 
-        PACKER_RESIZE(1)
+    if (size > PACK_REF_MAX_SZ)
+    {
+        packer->raws++;
+        return add_raw(packer, raw, size);
+    }
 
-        if (size < 6)
+    hash = raw_hash(raw, size);
+    mask = packer->refs_sz - 1;
+    for (i = hash & mask;; i = (i + 1) & mask)
+    {
+        ref = &packer->refs[i];
+        if (ref->size == 0)
         {
-            packer->buffer[packer->len++] = QP_MAP0 + (char) size;
-            while (PyDict_Next(obj, &pos, &key, &value))
-            {
-                if (packb(key, packer) || packb(value, packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
-            }
+            break;
         }
-        else
+        if (ref->hash == (uint32_t) hash &&
+            ref->size == (uint32_t) size &&
+            memcmp(packer->buffer + ref->offset, raw, size) == 0)
         {
-            packer->buffer[packer->len++] = QP_MAP_OPEN;
-            while (PyDict_Next(obj, &pos, &key, &value))
+            n = qp_ref_size(ref->index);
+            if (n < qp_raw_size(size) + size)
             {
-                if (packb(key, packer) || packb(value, packer))
-                {
-                    return -1;  /* PyErr is set */
-                }
+                PACKER_RESIZE(n)
+                packer->len += qp_put_ref(
+                        packer->buffer + packer->len,
+                        ref->index);
+                return 0;
             }
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_MAP_CLOSE;
+            /* the raw data is packed in full again */
+            packer->raws++;
+            return add_raw(packer, raw, size);
         }
-        return 0;
     }
 
-#if PY_MAJOR_VERSION >= 3
-    if (PyLong_Check(obj))
+    if (packer->refs_len * 2 < packer->refs_sz)
     {
-        /* An Overflow Error might be raised */
-        int64_t i64 = PyLong_AsLongLong(obj);
-#else
-    if (PyLong_Check(obj) || PyInt_Check(obj))
+        ref->hash = (uint32_t) hash;
+        ref->size = (uint32_t) size;
+        ref->offset = packer->len + qp_raw_size(size);
+        ref->index = packer->raws;
+        if (++packer->refs_len * 2 >= packer->refs_sz &&
+            packer->refs_sz < PACK_REFS_MAX_SZ &&
+            refs_grow(packer))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    packer->raws++;
+    return add_raw(packer, raw, size);
+}
+
+static int refs_init(packer_t * packer)
+{
+    packer->refs = (pack_ref_t *) calloc(
+            PACK_REFS_INIT_SZ,
+            sizeof(pack_ref_t));
+    if (packer->refs == NULL)
     {
-        /* An Overflow Error might be raised */
-        int64_t i64 = PyLong_Check(obj) ?
-                (int64_t) PyLong_AsLongLong(obj) : (int64_t) PyInt_AsLong(obj);
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        return -1;
+    }
+    packer->refs_sz = PACK_REFS_INIT_SZ;
+    packer->refs_len = packer->raws = 0;
+    return 0;
+}
 
-#endif
-        int8_t i8;
-        int16_t i16;
-        int32_t i32;
+/*
+ * Double the number of slots for back-references.
+ */
+static int refs_grow(packer_t * packer)
+{
+    Py_ssize_t i, j;
+    Py_ssize_t size = packer->refs_sz * 2;
+    pack_ref_t * refs = (pack_ref_t *) calloc(size, sizeof(pack_ref_t));
 
-        if ((i8 = (int8_t) i64) == i64)
-        {
-            PACKER_RESIZE(2)
+    if (refs == NULL)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        return -1;
+    }
 
-            if (i8 >= 0 && i8 < 64)
+    for (i = 0; i < packer->refs_sz; i++)
+    {
+        pack_ref_t * ref = &packer->refs[i];
+        if (ref->size == 0)
+        {
+            continue;
+        }
+        for (j = ref->hash & (size - 1);; j = (j + 1) & (size - 1))
+        {
+            if (refs[j].size == 0)
             {
-                packer->buffer[packer->len++] = i8;
+                refs[j] = *ref;
+                break;
             }
-            else if (i8 >= -60 && i8 < 0)
+        }
+    }
+
+    free(packer->refs);
+    packer->refs = refs;
+    packer->refs_sz = size;
+    return 0;
+}
+
+/*
+ * Hash for back-references and the dictionary of a Packer.
+ */
+static uint64_t raw_hash(const unsigned char * raw, Py_ssize_t size)
+{
+    Py_ssize_t i;
+    uint64_t hash = (uint64_t) size;
+    uint64_t word;
+
+    /* hash eight bytes at a time, the last word is padded with zeros */
+    for (i = 0; i < size; i += 8)
+    {
+        word = 0;
+        memcpy(&word, raw + i, (size - i < 8) ? size - i : 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/*
+ * Add raw data as a reference when it is in the dictionary of a Packer, or
+ * else the same as add_ref(). The raw data which is numbered is added to the
+ * dictionary by pack_dict_commit() once the value is packed.
+ */
+static int add_dict_raw(
+        packer_t * packer,
+        const unsigned char * raw,
+        Py_ssize_t size)
+{
+    pack_dict_t * dict = packer->dict;
+    Py_ssize_t raws = packer->raws;
+    Py_ssize_t offset, index;
+
+    if (size < QP_REF_MIN_SZ || size > QP_DICT_MAX_SZ)
+    {
+        return add_ref(packer, raw, size);
+    }
+
+    index = pack_dict_find(dict, raw, size, (uint32_t) raw_hash(raw, size));
+    if (index >= 0 && qp_ref_size(index) < qp_raw_size(size) + size)
+    {
+        PACKER_RESIZE(qp_ref_size(index))
+        packer->len += qp_put_dict(packer->buffer + packer->len, index);
+        return 0;
+    }
+
+    offset = packer->len + qp_raw_size(size);
+    if (add_ref(packer, raw, size))
+    {
+        return -1;  /* PyErr is set */
+    }
+    if (packer->raws == raws)
+    {
+        return 0;  /* packed as a back-reference */
+    }
+
+    if (dict->pending_len == dict->pending_sz)
+    {
+        Py_ssize_t sz = dict->pending_sz ? dict->pending_sz * 2 : 64;
+        pack_dict_raw_t * tmp = (pack_dict_raw_t *) realloc(
+                dict->pending,
+                sz * sizeof(pack_dict_raw_t));
+        if (tmp == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return -1;
+        }
+        dict->pending = tmp;
+        dict->pending_sz = sz;
+    }
+    dict->pending[dict->pending_len].offset = offset;
+    dict->pending[dict->pending_len].size = size;
+    dict->pending_len++;
+    return 0;
+}
+
+/*
+ * Returns the newest index of a string in the dictionary, or -1.
+ */
+static Py_ssize_t pack_dict_find(
+        pack_dict_t * dict,
+        const unsigned char * raw,
+        Py_ssize_t size,
+        uint32_t hash)
+{
+    Py_ssize_t i, mask = dict->slots_sz - 1;
+
+    for (i = hash & mask;; i = (i + 1) & mask)
+    {
+        pack_dict_slot_t * slot = &dict->slots[i];
+        pack_dict_entry_t * entry;
+        if (slot->index == 0)
+        {
+            return -1;
+        }
+        entry = &dict->entries[slot->index - 1];
+        if (slot->hash == hash &&
+            entry->size == (uint32_t) size &&
+            memcmp(entry->raw, raw, size) == 0)
+        {
+            return slot->index - 1;
+        }
+    }
+}
+
+/*
+ * Set dictionary entry `index` to a string of at most QP_DICT_MAX_SZ bytes.
+ * The string which is replaced is removed from the hash table, unless the
+ * table maps it to a newer entry. The table has at least twice the number of
+ * entries so it is never full.
+ */
+static void pack_dict_add(
+        pack_dict_t * dict,
+        Py_ssize_t index,
+        const unsigned char * raw,
+        Py_ssize_t size)
+{
+    pack_dict_entry_t * entry = &dict->entries[index];
+    pack_dict_slot_t * slots = dict->slots;
+    Py_ssize_t i, j, k, mask = dict->slots_sz - 1;
+    uint32_t hash;
+
+    if (entry->size)
+    {
+        for (i = entry->hash & mask; slots[i].index; i = (i + 1) & mask)
+        {
+            if (slots[i].index != (uint32_t) index + 1)
             {
-                packer->buffer[packer->len++] = 63 - i8;
+                continue;
             }
-            else
+            /* move the next slots of the same cluster back */
+            for (j = i;;)
             {
-                packer->buffer[packer->len++] = QP_INT8;
-                packer->buffer[packer->len++] = i8;
+                j = (j + 1) & mask;
+                if (slots[j].index == 0)
+                {
+                    break;
+                }
+                k = slots[j].hash & mask;
+                if ((j > i && (k <= i || k > j)) ||
+                    (j < i && k <= i && k > j))
+                {
+                    slots[i] = slots[j];
+                    i = j;
+                }
             }
-            return 0;
+            slots[i].index = 0;
+            break;
         }
+    }
 
-        if ((i16 = (int16_t) i64) == i64)
-        {
-            PACKER_RESIZE(3)
+    hash = (uint32_t) raw_hash(raw, size);
+    entry->hash = hash;
+    entry->size = (uint32_t) size;
+    memcpy(entry->raw, raw, size);
 
-            packer->buffer[packer->len++] = QP_INT16;
-            memcpy(packer->buffer + packer->len, &i16, sizeof(int16_t));
-            packer->len += sizeof(int16_t);
-            return 0;
-        }
+    if (size < QP_REF_MIN_SZ)
+    {
+        return;  /* never looked up */
+    }
 
-        if ((i32 = (int32_t) i64) == i64)
+    for (i = hash & mask;; i = (i + 1) & mask)
+    {
+        pack_dict_slot_t * slot = &slots[i];
+        if (slot->index == 0 || (
+                slot->hash == hash &&
+                dict->entries[slot->index - 1].size == (uint32_t) size &&
+                memcmp(dict->entries[slot->index - 1].raw, raw, size) == 0))
         {
-            PACKER_RESIZE(5)
-
-            packer->buffer[packer->len++] = QP_INT32;
-            memcpy(packer->buffer + packer->len, &i32, sizeof(int32_t));
-            packer->len += sizeof(int32_t);
-            return 0;
+            slot->hash = hash;
+            slot->index = (uint32_t) index + 1;
+            return;
         }
+    }
+}
+
+/*
+ * Add the raw data of a value which is packed to the dictionary, in the
+ * same order as the Unpacker does.
+ */
+static void pack_dict_commit(pack_dict_t * dict, const unsigned char * data)
+{
+    Py_ssize_t i;
+
+    for (i = 0; dict->size && i < dict->pending_len; i++)
+    {
+        pack_dict_add(
+                dict,
+                dict->n_static + dict->next % dict->size,
+                data + dict->pending[i].offset,
+                dict->pending[i].size);
+        dict->next++;
+    }
+    dict->pending_len = 0;
+}
+
+static void pack_dict_clear(pack_dict_t * dict)
+{
+    free(dict->entries);
+    free(dict->slots);
+    free(dict->pending);
+    memset(dict, 0, sizeof(pack_dict_t));
+}
 
-        PACKER_RESIZE(9)
+/*
+ * Add raw data which does not fit in the buffer to the digest, without
+ * copying the data to the buffer.
+ */
+static int digest_raw(
+        packer_t * packer,
+        const unsigned char * buffer,
+        Py_ssize_t size)
+{
+    PACKER_RESIZE(qp_raw_size(size))
+    packer->len += qp_put_raw(packer->buffer + packer->len, size);
+    qp_digest_update(packer->digest, packer->buffer, packer->len);
+    qp_digest_update(packer->digest, buffer, size);
+    packer->len = 0;
+    return 0;
+}
 
-        packer->buffer[packer->len++] = QP_INT64;
-        memcpy(packer->buffer + packer->len, &i64, sizeof(int64_t));
-        packer->len += sizeof(int64_t);
+static int pack_scalar(PyObject * obj, packer_t * packer)
+{
+    if (obj == Py_True)
+    {
+        PACKER_RESIZE(1)
+        packer->buffer[packer->len++] = QP_TRUE;
+        return 0;
+    }
 
+    if (obj == Py_False)
+    {
+        PACKER_RESIZE(1)
+        packer->buffer[packer->len++] = QP_FALSE;
         return 0;
     }
 
-    if (PyFloat_Check(obj))
+    if (obj == Py_None)
     {
-        double d = PyFloat_AsDouble(obj);
-        if (d == -1.0)
+        PACKER_RESIZE(1)
+        packer->buffer[packer->len++] = QP_NULL;
+        return 0;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyLong_Check(obj))
+    {
+        /* An Overflow Error might be raised */
+        int64_t i64 = PyLong_AsLongLong(obj);
+#else
+    if (PyLong_Check(obj) || PyInt_Check(obj))
+    {
+        /* An Overflow Error might be raised */
+        int64_t i64 = PyLong_Check(obj) ?
+                (int64_t) PyLong_AsLongLong(obj) : (int64_t) PyInt_AsLong(obj);
+
+#endif
+        if (i64 == -1 && PyErr_Occurred())
         {
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_DOUBLE_N1;
+            return -1;  /* PyErr is set */
         }
-        else if (d == 0.0)
+
+        /* the exact size is only required when the buffer is almost full */
+        if (packer->len + QP_NUMBER_MAX_SZ > packer->size)
         {
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_DOUBLE_0;
+            PACKER_RESIZE(qp_int64_size(i64))
         }
-        else if (d == 1.0)
+        packer->len += qp_put_int64(packer->buffer + packer->len, i64);
+        return 0;
+    }
+
+    if (PyFloat_Check(obj))
+    {
+        double d = PyFloat_AsDouble(obj);
+        if (d != d && packer->canonical)
         {
-            PACKER_RESIZE(1)
-            packer->buffer[packer->len++] = QP_DOUBLE_1;
+            /* all NaN values are packed as the same quiet NaN */
+            uint64_t nan = 0x7ff8000000000000ULL;
+            memcpy(&d, &nan, sizeof(double));
         }
-        else
+        if (packer->len + QP_NUMBER_MAX_SZ > packer->size)
         {
-            PACKER_RESIZE(9)
-            packer->buffer[packer->len++] = QP_DOUBLE;
-            memcpy(packer->buffer + packer->len, &d, sizeof(double));
-            packer->len += sizeof(double);
+            PACKER_RESIZE(qp_double_size(d))
         }
-
+        packer->len += qp_put_double(packer->buffer + packer->len, d);
         return 0;
     }
 
@@ -599,7 +2039,7 @@ static int packb(PyObject * obj, packer_t * packer)
     {
         Py_ssize_t size;
         unsigned char * raw = (unsigned char *) PyUnicode_AsUTF8AndSize(obj, &size);
-        return (raw == NULL) ? -1 : add_raw(packer, raw, size);
+        return (raw == NULL) ? -1 : PACK_RAW(packer, raw, size);
     }
 #else
     if (PyUnicode_Check(obj))
@@ -621,7 +2061,7 @@ static int packb(PyObject * obj, packer_t * packer)
             return -1;
         }
 
-        rc = add_raw(packer, raw, size);
+        rc = PACK_RAW(packer, raw, size);
         Py_DECREF(tmp);
 
         return rc;
@@ -632,7 +2072,7 @@ static int packb(PyObject * obj, packer_t * packer)
         Py_ssize_t size;
         unsigned char * raw;
         return (PyString_AsStringAndSize(obj, &raw, &size) == -1) ?
-                -1 : add_raw(packer, raw, size);
+                -1 : PACK_RAW(packer, raw, size);
     }
 #endif
 
@@ -641,7 +2081,12 @@ static int packb(PyObject * obj, packer_t * packer)
         Py_ssize_t size;
         unsigned char * buffer;
         return (PyBytes_AsStringAndSize(obj, (char **) &buffer, &size) == -1) ?
-                -1 : add_raw(packer, buffer, size);
+                -1 : PACK_RAW(packer, buffer, size);
+    }
+
+    if (PyObject_CheckBuffer(obj))
+    {
+        return pack_buffer(obj, packer);
     }
 
     PyErr_SetString(
@@ -651,106 +2096,1067 @@ static int packb(PyObject * obj, packer_t * packer)
     return -1;
 }
 
-static PyObject * unpackb(
-        unsigned char ** pt,
-        const unsigned char * const end,
-        unpack_options_t * options
-)
+/*
+ * Pack an object which supports the buffer protocol. Numeric items are
+ * packed as a typed array, unsigned 8-bit and char items as raw data.
+ */
+static int pack_buffer(PyObject * obj, packer_t * packer)
 {
-    PyObject * obj;
-    unsigned char tp;
+    Py_buffer view;
+    char typed;
+    int rc;
 
-    if (*pt >= end)
+    if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS))
     {
-        PyErr_SetString(PyExc_ValueError, "unpackb() is missing data");
-        return NULL;
+        return -1;  /* PyErr is set */
+    }
+
+    typed = buffer_typed(&view);
+    if (typed == '?')
+    {
+        rc = -1;  /* PyErr is set */
+    }
+    else if (typed == '\0')
+    {
+        rc = PACK_RAW(packer, (unsigned char *) view.buf, view.len);
     }
+    else
+    {
+        if (packer->len + 2 > packer->size && packer_grow(packer, 2))
+        {
+            PyBuffer_Release(&view);
+            return -1;  /* PyErr is set */
+        }
+        packer->buffer[packer->len++] = QP_HOOK;
+        packer->buffer[packer->len++] = typed;
+        rc = add_raw(packer, (unsigned char *) view.buf, view.len);
+    }
+
+    PyBuffer_Release(&view);
+    return rc;
+}
 
-    tp = **pt;
-    (*pt)++;
+/*
+ * Returns the typed array format for the buffer `view`, '\0' when the
+ * buffer is packed as raw data, or '?' and sets PyErr when the format is
+ * not supported.
+ */
+static char buffer_typed(Py_buffer * view)
+{
+    const char * fmt;
+    char typed;
 
-    switch (tp)
+    fmt = view->format == NULL ? "B" : view->format;
+    if (*fmt == '@' || *fmt == '=' || *fmt == '<')
     {
-    case 0:
-    case 1:
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-    case 6:
-    case 7:
-    case 8:
-    case 9:
-    case 10:
-    case 11:
-    case 12:
-    case 13:
-    case 14:
-    case 15:
-    case 16:
-    case 17:
-    case 18:
-    case 19:
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-    case 26:
-    case 27:
-    case 28:
-    case 29:
-    case 30:
-    case 31:
-    case 32:
-    case 33:
-    case 34:
-    case 35:
-    case 36:
-    case 37:
-    case 38:
-    case 39:
-    case 40:
-    case 41:
-    case 42:
-    case 43:
-    case 44:
-    case 45:
-    case 46:
-    case 47:
-    case 48:
-    case 49:
-    case 50:
-    case 51:
-    case 52:
-    case 53:
-    case 54:
-    case 55:
-    case 56:
-    case 57:
-    case 58:
-    case 59:
-    case 60:
-    case 61:
-    case 62:
-    case 63:
-#if PY_MAJOR_VERSION >= 3
-        obj = PyLong_FromLong((long) tp);
-#else
-        obj = PyInt_FromLong((long) tp);
-#endif
-        return obj;
+        fmt++;
+    }
 
-    case 64:
-    case 65:
-    case 66:
-    case 67:
-    case 68:
-    case 69:
-    case 70:
-    case 71:
-    case 72:
+    /* the native integer formats are stored by their size */
+    switch (fmt[1] == '\0' ? fmt[0] : '\0')
+    {
+    case 'c':
+    case 'B':
+        typed = view->itemsize == 1 ? '\0' : '?';
+        break;
+    case 'b':
+    case 'h':
+    case 'i':
+    case 'l':
+    case 'q':
+    case 'n':
+        typed = view->itemsize == 1 ? 'b' :
+                view->itemsize == 2 ? 'h' :
+                view->itemsize == 4 ? 'i' :
+                view->itemsize == 8 ? 'q' : '?';
+        break;
+    case 'H':
+    case 'I':
+    case 'L':
+    case 'Q':
+    case 'N':
+        typed = view->itemsize == 2 ? 'H' :
+                view->itemsize == 4 ? 'I' :
+                view->itemsize == 8 ? 'Q' : '?';
+        break;
+    case 'f':
+        typed = view->itemsize == 4 ? 'f' : '?';
+        break;
+    case 'd':
+        typed = view->itemsize == 8 ? 'd' : '?';
+        break;
+    default:
+        typed = '?';
+    }
+
+    if (typed == '?')
+    {
+        PyErr_Format(
+                PyExc_TypeError,
+                "packb(), unsupported buffer format '%s'",
+                view->format);
+    }
+    return typed;
+}
+
+/*
+ * Add the packed size of an object which is not a container to the length
+ * of a packer in measure mode, the same as pack_scalar() would write.
+ */
+static int measure_scalar(PyObject * obj, packer_t * packer)
+{
+    Py_ssize_t size;
+
+    if (obj == Py_True || obj == Py_False || obj == Py_None)
+    {
+        packer->len++;
+        return 0;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyLong_Check(obj))
+    {
+        /* An Overflow Error might be raised */
+        int64_t i64 = PyLong_AsLongLong(obj);
+#else
+    if (PyLong_Check(obj) || PyInt_Check(obj))
+    {
+        /* An Overflow Error might be raised */
+        int64_t i64 = PyLong_Check(obj) ?
+                (int64_t) PyLong_AsLongLong(obj) : (int64_t) PyInt_AsLong(obj);
+#endif
+        if (i64 == -1 && PyErr_Occurred())
+        {
+            return -1;  /* PyErr is set */
+        }
+        packer->len += qp_int64_size(i64);
+        return 0;
+    }
+
+    if (PyFloat_Check(obj))
+    {
+        packer->len += qp_double_size(PyFloat_AsDouble(obj));
+        return 0;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(obj))
+    {
+        /* the UTF-8 data is cached by the str object for the write pass */
+        if (PyUnicode_AsUTF8AndSize(obj, &size) == NULL)
+        {
+            return -1;  /* PyErr is set */
+        }
+        packer->len += qp_raw_size(size) + size;
+        return 0;
+    }
+#else
+    if (PyUnicode_Check(obj))
+    {
+        PyObject * tmp = PyUnicode_AsUTF8String(obj);
+        if (tmp == NULL)
+        {
+            return -1;  /* PyErr is set */
+        }
+        size = PyString_GET_SIZE(tmp);
+        Py_DECREF(tmp);
+        packer->len += qp_raw_size(size) + size;
+        return 0;
+    }
+#endif
+
+    if (PyBytes_Check(obj))
+    {
+        size = PyBytes_GET_SIZE(obj);
+        packer->len += qp_raw_size(size) + size;
+        return 0;
+    }
+
+    if (PyObject_CheckBuffer(obj))
+    {
+        Py_buffer view;
+        char typed;
+
+        if (PyObject_GetBuffer(obj, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS))
+        {
+            return -1;  /* PyErr is set */
+        }
+        typed = buffer_typed(&view);
+        size = view.len;
+        PyBuffer_Release(&view);
+        if (typed == '?')
+        {
+            return -1;  /* PyErr is set */
+        }
+        packer->len += (typed ? 2 : 0) + qp_raw_size(size) + size;
+        return 0;
+    }
+
+    PyErr_SetString(
+        PyExc_TypeError,
+        "packb(), trying to pack an unsupported type");
+
+    return -1;
+}
+
+/*
+ * Pack an object. Containers are not packed recursively; for each list,
+ * tuple or dict which is being packed a frame is pushed on the stack of the
+ * packer. Items which are not a container are packed directly from the loop
+ * over the container.
+ */
+static int packb(PyObject * obj, packer_t * packer)
+{
+    PyObject * copies;
+    int rc;
+
+#ifndef Py_GIL_DISABLED
+    if (!packer->nogil && !packer->canonical)
+    {
+        return packb_frames(obj, packer, NULL);
+    }
+#endif
+
+    if (!PACK_IS_CONTAINER(obj))
+    {
+        return PACK_SCALAR(obj);
+    }
+
+    copies = PyList_New(0);
+    if (copies == NULL)
+    {
+        return -1;  /* PyErr is set */
+    }
+    rc = packb_frames(obj, packer, copies);
+    Py_DECREF(copies);
+    return rc;
+}
+
+/*
+ * Without the GIL, another thread can change a list or dict while it is
+ * packed. Returns a copy (borrowed) which is kept alive by `copies`.
+ */
+static PyObject * packb_copy(PyObject * obj, int is_map, PyObject * copies)
+{
+    PyObject * copy = is_map ? PyDict_Copy(obj) : PyList_AsTuple(obj);
+    if (copy == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+    if (PyList_Append(copies, copy))
+    {
+        Py_DECREF(copy);
+        return NULL;  /* PyErr is set */
+    }
+    Py_DECREF(copy);
+    return copy;
+}
+
+#if PY_MAJOR_VERSION < 3
+/*
+ * A copy of a dict can have another order on Python 2. Returns a tuple
+ * (borrowed) with the keys of dict `obj`, each followed by its value, in the
+ * order of the dict, like packb_sorted(). The tuple is kept alive by
+ * `copies`.
+ */
+static PyObject * packb_items(PyObject * obj, PyObject * copies)
+{
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t i = 0, pos = 0;
+    PyObject * items = PyTuple_New(PyDict_Size(obj) * 2);
+    if (items == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+    while (PyDict_Next(obj, &pos, &key, &value))
+    {
+        Py_INCREF(key);
+        PyTuple_SET_ITEM(items, i++, key);
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(items, i++, value);
+    }
+    if (PyList_Append(copies, items))
+    {
+        Py_DECREF(items);
+        return NULL;  /* PyErr is set */
+    }
+    Py_DECREF(items);
+    return items;
+}
+#endif
+
+/*
+ * Returns a tuple (borrowed) with the keys of dict `obj`, each followed by
+ * its value, sorted on the packed keys. The tuple is kept alive by `copies`.
+ * Keys which are packed to the same bytes, for example 'a' and b'a', cannot
+ * be sorted and raise a ValueError.
+ */
+static PyObject * packb_sorted(
+        PyObject * obj,
+        packer_t * packer,
+        Py_ssize_t depth,
+        PyObject * copies)
+{
+    packer_t kp = {0};
+    pack_key_t * keys;
+    PyObject * key;
+    PyObject * value;
+    PyObject * sorted = NULL;
+    Py_ssize_t i, n, start, pos = 0;
+
+    if (PACK_COPY(packer))
+    {
+        obj = packb_copy(obj, 1, copies);
+        if (obj == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+    }
+
+    n = PyDict_Size(obj);
+    keys = (pack_key_t *) malloc((n ? n : 1) * sizeof(pack_key_t));
+    kp.scratch = kp.buffer = (unsigned char *) malloc(
+            (n ? n : 1) * PACK_KEY_INIT_SZ);
+    if (keys == NULL || kp.scratch == NULL)
+    {
+        free(keys);
+        free(kp.scratch);
+        return PyErr_NoMemory();
+    }
+    kp.size = kp.scratch_sz = (n ? n : 1) * PACK_KEY_INIT_SZ;
+
+    /* the keys are one level deeper than the dict */
+    kp.canonical = 1;
+    kp.max_depth = depth < packer->max_depth
+            ? packer->max_depth - depth - 1
+            : 0;
+
+    for (i = 0; i < n && PyDict_Next(obj, &pos, &key, &value); i++)
+    {
+        start = kp.len;
+        if (packb(key, &kp))
+        {
+            goto done;  /* PyErr is set */
+        }
+        keys[i].size = kp.len - start;
+        keys[i].key = key;
+        keys[i].value = value;
+    }
+    n = i;
+
+    /* the buffer of the packer does not move once all keys are packed */
+    for (i = 0, start = 0; i < n; start += keys[i++].size)
+    {
+        keys[i].pt = kp.buffer + start;
+    }
+
+    qsort(keys, n, sizeof(pack_key_t), pack_key_cmp);
+
+    for (i = 1; i < n; i++)
+    {
+        if (pack_key_cmp(&keys[i - 1], &keys[i]) == 0)
+        {
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "packb() canonical map has keys which pack the same");
+            goto done;
+        }
+    }
+
+    sorted = PyTuple_New(n * 2);
+    if (sorted == NULL)
+    {
+        goto done;  /* PyErr is set */
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        Py_INCREF(keys[i].key);
+        PyTuple_SET_ITEM(sorted, i * 2, keys[i].key);
+        Py_INCREF(keys[i].value);
+        PyTuple_SET_ITEM(sorted, i * 2 + 1, keys[i].value);
+    }
+
+    if (PyList_Append(copies, sorted))
+    {
+        Py_CLEAR(sorted);
+        goto done;  /* PyErr is set */
+    }
+    Py_DECREF(sorted);
+
+done:
+    Py_XDECREF(kp.bytes);
+    free(kp.scratch);
+    free(kp.frames);
+    free(keys);
+    return sorted;
+}
+
+/*
+ * Compare packed keys byte by byte; a key which is a prefix of another key
+ * comes first.
+ */
+static int pack_key_cmp(const void * a, const void * b)
+{
+    const pack_key_t * ka = (const pack_key_t *) a;
+    const pack_key_t * kb = (const pack_key_t *) b;
+    int rc = memcmp(ka->pt, kb->pt, ka->size < kb->size ? ka->size : kb->size);
+    return rc ? rc : (ka->size > kb->size) - (ka->size < kb->size);
+}
+
+/*
+ * Set `*keys` to a new list with the keys of the records when list or tuple
+ * `obj` can be packed as a template, or to NULL when it cannot. The keys
+ * must not be containers, and are compared on their type and value. Returns
+ * -1 with PyErr set on an error.
+ */
+static int template_keys(PyObject * obj, PyObject ** keys)
+{
+    PyObject ** items = PySequence_Fast_ITEMS(obj);
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(obj);
+    int rc = 1;
+
+    *keys = NULL;
+    if (n < PACK_TEMPLATE_MIN_RECORDS || !PyDict_Check(items[0]))
+    {
+        return 0;
+    }
+
+    *keys = PyDict_Keys(items[0]);
+    if (*keys == NULL)
+    {
+        return -1;  /* PyErr is set */
+    }
+
+    for (i = 0; rc == 1 && i < PyList_GET_SIZE(*keys); i++)
+    {
+        rc = !PACK_IS_CONTAINER(PyList_GET_ITEM(*keys, i));
+    }
+
+    for (i = 1; rc == 1 && i < n; i++)
+    {
+        LOCKED_CALL(rc, items[i], template_record(*keys, items[i]))
+    }
+
+    if (rc != 1 || PyList_GET_SIZE(*keys) == 0)
+    {
+        Py_CLEAR(*keys);
+    }
+    return rc == -1 ? -1 : 0;
+}
+
+/*
+ * Returns 1 when `obj` is a dict with the same `keys` in the same order, 0
+ * when it is not, or -1 with PyErr set.
+ */
+static int template_record(PyObject * keys, PyObject * obj)
+{
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t i = 0, pos = 0;
+    int rc = 1;
+
+    if (!PyDict_Check(obj) || PyDict_Size(obj) != PyList_GET_SIZE(keys))
+    {
+        return 0;
+    }
+    while (rc == 1 && PyDict_Next(obj, &pos, &key, &value))
+    {
+        PyObject * other = PyList_GET_ITEM(keys, i++);
+        if (key != other)
+        {
+            rc = (Py_TYPE(key) == Py_TYPE(other))
+                    ? PyObject_RichCompareBool(key, other, Py_EQ)
+                    : 0;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Start a template for `n` records; this is followed by the records, and a
+ * close character when the array has more than five items.
+ */
+static int pack_template(
+        PyObject * keys,
+        Py_ssize_t n,
+        packer_t * packer)
+{
+    Py_ssize_t i, size = PyList_GET_SIZE(keys);
+
+    PACKER_RESIZE(4)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_TEMPLATE;
+    packer->buffer[packer->len++] = qp_array_type(n + 1);
+    packer->buffer[packer->len++] = qp_array_type(size);
+    for (i = 0; i < size; i++)
+    {
+        if (pack_scalar(PyList_GET_ITEM(keys, i), packer))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    if (size > 5)
+    {
+        PACKER_RESIZE(1)
+        packer->buffer[packer->len++] = QP_ARRAY_CLOSE;
+    }
+    return 0;
+}
+
+/*
+ * Walk the containers of `obj`. When `copies` is not NULL, lists and dicts
+ * are copied before they are packed when required and `copies` keeps the
+ * copies, together with the sorted maps in canonical mode.
+ */
+static int packb_frames(PyObject * obj, packer_t * packer, PyObject * copies)
+{
+    pack_frame_t * frame;
+    Py_ssize_t depth = 0;
+
+    if (!PACK_IS_CONTAINER(obj))
+    {
+        return PACK_SCALAR(obj);
+    }
+
+    for (;;)
+    {
+        Py_ssize_t size;
+        int is_map = PyDict_Check(obj);
+        int keys = 0;
+        Py_ssize_t record = depth ? packer->frames[depth - 1].record : 0;
+        Py_ssize_t n_keys = 0;
+        PyObject * template = NULL;
+
+        if (is_map && packer->canonical)
+        {
+            obj = packb_sorted(obj, packer, depth, copies);
+            if (obj == NULL)
+            {
+                return -1;  /* PyErr is set */
+            }
+            keys = 1;
+        }
+        else if (PACK_COPY(packer) && !PyTuple_Check(obj))
+        {
+#if PY_MAJOR_VERSION < 3
+            /* only the jobs of packb_threads() copy, without templates */
+            keys = is_map;
+            obj = keys
+                    ? packb_items(obj, copies)
+                    : packb_copy(obj, 0, copies);
+#else
+            obj = packb_copy(obj, is_map, copies);
+#endif
+            if (obj == NULL)
+            {
+                return -1;  /* PyErr is set */
+            }
+        }
+
+        size = keys ? PyTuple_GET_SIZE(obj) / 2
+                : is_map ? PyDict_Size(obj)
+                : PySequence_Fast_GET_SIZE(obj);
+
+        if (!is_map && packer->templates && template_keys(obj, &template))
+        {
+            return -1;  /* PyErr is set */
+        }
+
+        if (template != NULL)
+        {
+            int rc = pack_template(template, size, packer);
+            n_keys = PyList_GET_SIZE(template);
+            Py_DECREF(template);
+            if (rc)
+            {
+                return -1;  /* PyErr is set */
+            }
+        }
+        else if (record)
+        {
+            /* a record of a template is packed as an array with the values */
+            if (size != record)
+            {
+                PyErr_SetString(
+                        PyExc_RuntimeError,
+                        "dictionary changed size during packing");
+                return -1;
+            }
+            PACKER_RESIZE(1)
+            packer->buffer[packer->len++] = qp_array_type(size);
+        }
+        else
+        {
+            PACKER_RESIZE(1)
+            if (!packer->measure)
+            {
+                packer->buffer[packer->len] = is_map
+                        ? qp_map_type(size)
+                        : qp_array_type(size);
+            }
+            packer->len++;
+        }
+
+        if (size)
+        {
+            if (depth == packer->max_depth)
+            {
+                PyErr_SetString(
+                        PyExc_ValueError,
+                        "packb() exceeds the maximum depth");
+                return -1;
+            }
+
+            if (depth == packer->frames_sz)
+            {
+                Py_ssize_t sz = packer->frames_sz ? packer->frames_sz * 2 : 16;
+                pack_frame_t * tmp = (pack_frame_t *) realloc(
+                        packer->frames,
+                        sz * sizeof(pack_frame_t));
+                if (tmp == NULL)
+                {
+                    PyErr_SetString(
+                            PyExc_MemoryError,
+                            "Memory allocation error");
+                    return -1;
+                }
+                packer->frames = tmp;
+                packer->frames_sz = sz;
+            }
+
+            frame = &packer->frames[depth++];
+            frame->obj = obj;
+            frame->items = (is_map && !keys)
+                    ? NULL
+                    : PySequence_Fast_ITEMS(obj);
+            frame->value = NULL;
+            frame->pos = 0;
+            /* the keys of a sorted map are items of the frame */
+            frame->size = keys ? size * 2 : size;
+            frame->record = n_keys;
+            frame->values = record != 0;
+            /* the array of a template starts with the keys */
+            frame->close = (size + (n_keys != 0) < 6) ? 0
+                    : (is_map && !record) ? QP_MAP_CLOSE
+                    : QP_ARRAY_CLOSE;
+        }
+
+        /* find the next container to pack, closing finished containers */
+        for (;;)
+        {
+            if (depth == 0)
+            {
+                return 0;
+            }
+
+            frame = &packer->frames[depth - 1];
+            obj = NULL;
+
+            if (frame->items != NULL)
+            {
+                Py_ssize_t pos = frame->pos;
+                while (pos < frame->size)
+                {
+                    PyObject * item = frame->items[pos++];
+                    if (PACK_IS_CONTAINER(item))
+                    {
+                        obj = item;
+                        break;
+                    }
+                    if (PACK_SCALAR(item))
+                    {
+                        return -1;  /* PyErr is set */
+                    }
+                }
+                frame->pos = pos;
+            }
+            else
+            {
+                PyObject * item;
+                for (;;)
+                {
+                    if (frame->value != NULL)
+                    {
+                        item = frame->value;
+                        frame->value = NULL;
+                    }
+                    else if (!PyDict_Next(
+                            frame->obj,
+                            &frame->pos,
+                            &item,
+                            &frame->value))
+                    {
+                        break;
+                    }
+                    else if (frame->values)
+                    {
+                        /* the keys of a record are packed by the template */
+                        item = frame->value;
+                        frame->value = NULL;
+                    }
+                    if (PACK_IS_CONTAINER(item))
+                    {
+                        obj = item;
+                        break;
+                    }
+                    if (PACK_SCALAR(item))
+                    {
+                        return -1;  /* PyErr is set */
+                    }
+                }
+            }
+
+            if (obj != NULL)
+            {
+                break;
+            }
+
+            if (frame->close)
+            {
+                PACKER_RESIZE(1)
+                if (!packer->measure)
+                {
+                    packer->buffer[packer->len] = frame->close;
+                }
+                packer->len++;
+            }
+            depth--;
+        }
+    }
+}
+
+/*
+ * Set `*size` to the packed size of `obj` without writing the data.
+ */
+static int packed_size(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        Py_ssize_t * size)
+{
+    packer_t packer = {0};
+    int rc;
+
+    packer.size = PY_SSIZE_T_MAX;
+    packer.measure = 1;
+    packer.max_depth = max_depth;
+
+    rc = packb(obj, &packer);
+    free(packer.frames);
+    *size = packer.len;
+    return rc;
+}
+
+/*
+ * Pack `obj` in two passes: the first pass computes the size so the second
+ * pass writes to a bytes object of exactly this size. The bytes object can
+ * still grow when the object changes between the passes. The size is the
+ * same in canonical mode, so only the second pass is canonical.
+ */
+static PyObject * packb_exact(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        int canonical)
+{
+    packer_t packer = {0};
+    PyObject * packed;
+    Py_ssize_t size;
+
+    if (packed_size(obj, max_depth, &size))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    packer.bytes = PyBytes_FromStringAndSize(NULL, size);
+    if (packer.bytes == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+    packer.buffer = (unsigned char *) PyBytes_AS_STRING(packer.bytes);
+    packer.size = size;
+    packer.max_depth = max_depth;
+    packer.canonical = canonical;
+
+    packed = packb(obj, &packer) ? NULL : packer_finish(&packer);
+
+    Py_XDECREF(packer.bytes);
+    free(packer.frames);
+    return packed;
+}
+
+/*
+ * Pack the list or tuple `obj` with `nthreads` jobs, each for a range of the
+ * items. Since an array with more than five items is closed by a close
+ * character, the packed ranges are joined between a single open and close.
+ */
+static PyObject * packb_threads(
+        PyObject * obj,
+        Py_ssize_t max_depth,
+        int canonical,
+        Py_ssize_t nthreads)
+{
+    pack_job_t * jobs;
+    PyObject * seq;
+    PyObject * packed = NULL;
+    Py_ssize_t j, n, size = 2;
+
+    /* the items cannot change while they are packed */
+    seq = PySequence_Tuple(obj);
+    if (seq == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+    n = PyTuple_GET_SIZE(seq);
+
+    jobs = (pack_job_t *) calloc(nthreads, sizeof(pack_job_t));
+    if (jobs == NULL)
+    {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    for (j = 0; j < nthreads; j++)
+    {
+        pack_job_t * job = &jobs[j];
+        job->items = PySequence_Fast_ITEMS(seq);
+        job->start = j * n / nthreads;
+        job->end = (j + 1) * n / nthreads;
+        /* the array at the top counts for the maximum depth */
+        job->packer.max_depth = max_depth - 1;
+        job->packer.nogil = 1;
+        job->packer.canonical = canonical;
+    }
+
+    threads_run(pack_job, jobs, sizeof(pack_job_t), nthreads);
+
+    for (j = 0; j < nthreads; j++)
+    {
+        pack_job_t * job = &jobs[j];
+        if (job->err_type != NULL)
+        {
+            if (size != -1)
+            {
+                /* raise the exception of the first job which has failed */
+                PyErr_Restore(job->err_type, job->err_value, job->err_tb);
+                size = -1;
+                continue;
+            }
+            Py_DECREF(job->err_type);
+            Py_XDECREF(job->err_value);
+            Py_XDECREF(job->err_tb);
+        }
+        else if (size != -1)
+        {
+            size += job->packer.len;
+        }
+    }
+
+    if (size != -1)
+    {
+        packed = PyBytes_FromStringAndSize(NULL, size);
+    }
+
+    if (packed != NULL)
+    {
+        unsigned char * pt = (unsigned char *) PyBytes_AS_STRING(packed);
+
+        *pt++ = QP_ARRAY_OPEN;
+        Py_BEGIN_ALLOW_THREADS
+        for (j = 0; j < nthreads; j++)
+        {
+            if (jobs[j].packer.len)
+            {
+                memcpy(pt, jobs[j].packer.buffer, jobs[j].packer.len);
+                pt += jobs[j].packer.len;
+            }
+        }
+        Py_END_ALLOW_THREADS
+        *pt = QP_ARRAY_CLOSE;
+    }
+
+    for (j = 0; j < nthreads; j++)
+    {
+        Py_XDECREF(jobs[j].packer.bytes);
+        free(jobs[j].packer.scratch);
+        free(jobs[j].packer.frames);
+    }
+    free(jobs);
+    Py_DECREF(seq);
+    return packed;
+}
+
+/*
+ * Pack the items of a job. An exception is kept in the job, since the job
+ * might run in another thread.
+ */
+static void pack_job(void * arg)
+{
+    pack_job_t * job = (pack_job_t *) arg;
+    Py_ssize_t i;
+
+    for (i = job->start; i < job->end; i++)
+    {
+        if (packb(job->items[i], &job->packer))
+        {
+            break;
+        }
+    }
+
+    /* the thread state of the job is cleared when it is done, so an
+     * exception is moved to the job */
+    if (PyErr_Occurred())
+    {
+        PyErr_Fetch(&job->err_type, &job->err_value, &job->err_tb);
+    }
+}
+
+/*
+ * Returns 1 when the next value on the stack of `depth` frames is a map key,
+ * or a key in the array of a template. Argument `template` is set when the
+ * columns of columnar=True have a template.
+ */
+static int unpack_at_key(
+        unpack_frame_t * frames,
+        Py_ssize_t depth,
+        int template)
+{
+    unpack_frame_t * frame = depth ? &frames[depth - 1] : NULL;
+
+    if (frame == NULL)
+    {
+        return 0;
+    }
+    if (frame->kind == UNPACK_FRAME_MAP ||
+        (frame->kind == UNPACK_FRAME_ROW && !template))
+    {
+        return frame->key == NULL;
+    }
+    if (frame->kind != UNPACK_FRAME_ARRAY || depth < 2)
+    {
+        return 0;
+    }
+    /* the array of keys is the first item of a template */
+    frame = &frames[depth - 2];
+    return frame->i == 0 && (
+            frame->kind == UNPACK_FRAME_TEMPLATE ||
+            (frame->kind == UNPACK_FRAME_COLUMNS && template));
+}
+
+/*
+ * Create the Python objects for the tokens on `tape`, which is written by
+ * the scanner for the value in `data` so the data is known to be complete
+ * and valid. Containers are not unpacked recursively; for each container
+ * which is being unpacked a frame is pushed on a stack which starts on the C
+ * stack and moves to the heap when it needs to grow.
+ */
+static PyObject * unpackb(
+        const unsigned char * data,
+        qp_tape_t * tape,
+        unpack_options_t * options)
+{
+    unpack_frame_t stack[UNPACK_STACK_SZ];
+    unpack_frame_t * frames = stack;
+    unpack_frame_t * frame = NULL;  /* top of the stack */
+    qp_token_t * token = tape->tokens;
+    Py_ssize_t frames_sz = UNPACK_STACK_SZ;
+    Py_ssize_t depth = 0;
+    Py_ssize_t size;
+    PyObject * obj;
+    const unsigned char * pt;
+    unsigned char tp;
+    unpack_refs_t refs = {NULL, 0, 0};
+    unpack_columns_t columns = {NULL, 0, 0, 0, 0, 0};
+    int template = 0;
+    int rc;
+
+    for (;; token++)
+    {
+        pt = data + token->pos;
+        tp = *pt;
+
+        switch (tp)
+        {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+    case 8:
+    case 9:
+    case 10:
+    case 11:
+    case 12:
+    case 13:
+    case 14:
+    case 15:
+    case 16:
+    case 17:
+    case 18:
+    case 19:
+    case 20:
+    case 21:
+    case 22:
+    case 23:
+    case 24:
+    case 25:
+    case 26:
+    case 27:
+    case 28:
+    case 29:
+    case 30:
+    case 31:
+    case 32:
+    case 33:
+    case 34:
+    case 35:
+    case 36:
+    case 37:
+    case 38:
+    case 39:
+    case 40:
+    case 41:
+    case 42:
+    case 43:
+    case 44:
+    case 45:
+    case 46:
+    case 47:
+    case 48:
+    case 49:
+    case 50:
+    case 51:
+    case 52:
+    case 53:
+    case 54:
+    case 55:
+    case 56:
+    case 57:
+    case 58:
+    case 59:
+    case 60:
+    case 61:
+    case 62:
+    case 63:
+#if PY_MAJOR_VERSION >= 3
+            obj = PyLong_FromLong((long) tp);
+#else
+            obj = PyInt_FromLong((long) tp);
+#endif
+            break;
+
+    case 64:
+    case 65:
+    case 66:
+    case 67:
+    case 68:
+    case 69:
+    case 70:
+    case 71:
+    case 72:
     case 73:
     case 74:
     case 75:
@@ -803,542 +3209,4057 @@ static PyObject * unpackb(
     case 122:
     case 123:
 #if PY_MAJOR_VERSION >= 3
-        obj = PyLong_FromLong((long) 63 - tp);
-#else
-        obj = PyInt_FromLong((long) 63 - tp);
+            obj = PyLong_FromLong((long) 63 - tp);
+#else
+            obj = PyInt_FromLong((long) 63 - tp);
+#endif
+            break;
+
+        case 124:
+            if (pt[1] == QP_TEMPLATE)
+            {
+                /* the next token is the array of the template */
+                template = 1;
+                continue;
+            }
+            if (pt[1] == QP_REF)
+            {
+                /* a back-reference to raw data which is unpacked before */
+                size = qp_ref_index(pt);
+                if (size >= refs.len)
+                {
+                    PyErr_SetString(
+                            PyExc_ValueError,
+                            "unpackb() found an invalid back-reference");
+                    goto failed;
+                }
+                obj = refs.items[size].obj;
+                if (PyMemoryView_Check(obj) &&
+                    unpack_at_key(frames, depth, columns.template))
+                {
+                    /* the first copy is a value, but keys are never views */
+                    Py_buffer * view = PyMemoryView_GET_BUFFER(obj);
+                    obj = PyBytes_FromStringAndSize(
+                            (const char *) view->buf,
+                            view->len);
+                    break;
+                }
+                Py_INCREF(obj);
+                break;
+            }
+            if (pt[1] == QP_DICT)
+            {
+                /* a string in the dictionary of an Unpacker */
+                unpack_dict_t * dict = options->dict;
+                if (dict == NULL)
+                {
+                    PyErr_SetString(
+                            PyExc_ValueError,
+                            "unpackb() found a dictionary reference, use an "
+                            "Unpacker with the dictionary of the Packer");
+                    goto failed;
+                }
+                size = qp_ref_index(pt);
+                if (size >= dict->n_static + dict->size ||
+                    dict->objs[size] == NULL)
+                {
+                    PyErr_SetString(
+                            PyExc_ValueError,
+                            "unpackb() found an invalid dictionary "
+                            "reference");
+                    goto failed;
+                }
+                obj = dict->objs[size];
+                Py_INCREF(obj);
+                break;
+            }
+            /* a typed array, the format character is followed by a raw */
+            size = 2 + qp_raw_header_size(pt[2]);
+            obj = unpack_typed(pt + size, token->n - size, pt[1], options);
+            break;
+
+        case 125:
+            obj = PyFloat_FromDouble(-1.0);
+            break;
+
+        case 126:
+            obj = PyFloat_FromDouble(0.0);
+            break;
+
+        case 127:
+            obj = PyFloat_FromDouble(1.0);
+            break;
+
+    case 128:
+    case 129:
+    case 130:
+    case 131:
+    case 132:
+    case 133:
+    case 134:
+    case 135:
+    case 136:
+    case 137:
+    case 138:
+    case 139:
+    case 140:
+    case 141:
+    case 142:
+    case 143:
+    case 144:
+    case 145:
+    case 146:
+    case 147:
+    case 148:
+    case 149:
+    case 150:
+    case 151:
+    case 152:
+    case 153:
+    case 154:
+    case 155:
+    case 156:
+    case 157:
+    case 158:
+    case 159:
+    case 160:
+    case 161:
+    case 162:
+    case 163:
+    case 164:
+    case 165:
+    case 166:
+    case 167:
+    case 168:
+    case 169:
+    case 170:
+    case 171:
+    case 172:
+    case 173:
+    case 174:
+    case 175:
+    case 176:
+    case 177:
+    case 178:
+    case 179:
+    case 180:
+    case 181:
+    case 182:
+    case 183:
+    case 184:
+    case 185:
+    case 186:
+    case 187:
+    case 188:
+    case 189:
+    case 190:
+    case 191:
+    case 192:
+    case 193:
+    case 194:
+    case 195:
+    case 196:
+    case 197:
+    case 198:
+    case 199:
+    case 200:
+    case 201:
+    case 202:
+    case 203:
+    case 204:
+    case 205:
+    case 206:
+    case 207:
+    case 208:
+    case 209:
+    case 210:
+    case 211:
+    case 212:
+    case 213:
+    case 214:
+    case 215:
+    case 216:
+    case 217:
+    case 218:
+    case 219:
+    case 220:
+    case 221:
+    case 222:
+    case 223:
+    case 224:
+    case 225:
+    case 226:
+    case 227:
+            size = tp - 128;
+            if (!unpack_at_key(frames, depth, columns.template))
+            {
+                obj = unpack_raw_value(pt + 1, size, options);
+            }
+            else
+            {
+                /* the keys in the array of a template are not cached since
+                 * these are created only once */
+                obj = (frame->kind != UNPACK_FRAME_ARRAY &&
+                       size <= KEYCACHE_KEY_SZ &&
+                       options->keycache.size)
+                    ? unpack_key(pt + 1, size, options)
+                    : unpack_raw(pt + 1, size, options);
+            }
+            if (options->refs && size >= QP_REF_MIN_SZ)
+            {
+                UNPACK_REF_ADD(size)
+            }
+            break;
+        case 228:
+        case 229:
+        case 230:
+        case 231:
+            size = qp_raw_header_size(tp);
+            obj = unpack_at_key(frames, depth, columns.template)
+                ? unpack_raw(pt + size, token->n - size, options)
+                : unpack_raw_value(pt + size, token->n - size, options);
+            if (options->refs)
+            {
+                UNPACK_REF_ADD(token->n - size)
+            }
+            break;
+
+        case 232:
+            UNPACK_INT(int8_t)
+        case 233:
+            UNPACK_INT(int16_t)
+        case 234:
+            UNPACK_INT(int32_t)
+        case 235:
+            UNPACK_INT(int64_t)
+
+        case 236:
+            {
+                double d;
+                memcpy(&d, pt + 1, sizeof(double));
+                obj = PyFloat_FromDouble(d);
+            }
+            break;
+
+        case 237:
+            if (template)
+            {
+                goto invalid_template;
+            }
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_TEMPLATE &&
+                frame->i)
+            {
+                obj = unpack_record(frame, 0);
+                break;
+            }
+            if (frame == NULL && options->columnar)
+            {
+                obj = PyDict_New();
+                break;
+            }
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_COLUMNS &&
+                columns.template &&
+                frame->i)
+            {
+                if (PySequence_Fast_GET_SIZE(frame->key))
+                {
+                    goto invalid_template;
+                }
+                obj = frame->obj;
+                Py_INCREF(obj);
+                break;
+            }
+            obj = options->use_tuples ? PyTuple_New(0) : PyList_New(0);
+            break;
+        case 238:
+        case 239:
+        case 240:
+        case 241:
+        case 242:
+        case 252:
+            size = token->n;
+            if (frame == NULL && options->columnar)
+            {
+                /* the values of the rows are added to the columns */
+                if (template && size == 0)
+                {
+                    goto invalid_template;
+                }
+                columns.rows = template ? size - 1 : size;
+                columns.template = template;
+                template = 0;
+                obj = PyDict_New();
+                if (size == 0)
+                {
+                    break;  /* an empty open array */
+                }
+                UNPACK_PUSH(UNPACK_FRAME_COLUMNS, size)
+                continue;
+            }
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_COLUMNS &&
+                columns.template &&
+                frame->i)
+            {
+                /* a record of the template as a row */
+                if (size != PySequence_Fast_GET_SIZE(frame->key))
+                {
+                    goto invalid_template;
+                }
+                obj = frame->obj;
+                Py_INCREF(obj);
+                if (size == 0)
+                {
+                    break;  /* an empty open array for a record */
+                }
+                UNPACK_PUSH(UNPACK_FRAME_ROW, size)
+                continue;
+            }
+            if (template)
+            {
+                /* the records follow the array with the keys */
+                if (size == 0)
+                {
+                    goto invalid_template;
+                }
+                template = 0;
+                obj = options->use_tuples
+                        ? PyTuple_New(size - 1)
+                        : PyList_New(size - 1);
+                UNPACK_PUSH(UNPACK_FRAME_TEMPLATE, size)
+                continue;
+            }
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_TEMPLATE &&
+                frame->i)
+            {
+                obj = unpack_record(frame, size);
+                if (size == 0)
+                {
+                    break;  /* an empty open array for a record */
+                }
+                UNPACK_PUSH(UNPACK_FRAME_RECORD, size)
+                continue;
+            }
+            obj = options->use_tuples ? PyTuple_New(size) : PyList_New(size);
+            if (size == 0)
+            {
+                break;  /* an empty open array */
+            }
+            UNPACK_PUSH(UNPACK_FRAME_ARRAY, size)
+            continue;
+
+        case 243:
+            if (frame != NULL && frame->kind == UNPACK_FRAME_TEMPLATE)
+            {
+                goto invalid_template;
+            }
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_COLUMNS &&
+                !columns.template)
+            {
+                obj = frame->obj;  /* an empty row */
+                Py_INCREF(obj);
+                break;
+            }
+            obj = PyDict_New();
+            break;
+        case 244:
+        case 245:
+        case 246:
+        case 247:
+        case 248:
+        case 253:
+            if (frame != NULL && frame->kind == UNPACK_FRAME_TEMPLATE)
+            {
+                goto invalid_template;
+            }
+            size = token->n;
+            if (frame != NULL &&
+                frame->kind == UNPACK_FRAME_COLUMNS &&
+                !columns.template)
+            {
+                /* a row; the frame has the columns dict as a placeholder */
+                obj = frame->obj;
+                Py_INCREF(obj);
+                if (size == 0)
+                {
+                    break;  /* an empty open map */
+                }
+                UNPACK_PUSH(UNPACK_FRAME_ROW, size)
+                continue;
+            }
+            obj = (size > 5) ? _PyDict_NewPresized(size) : PyDict_New();
+            if (size == 0)
+            {
+                break;  /* an empty open map */
+            }
+            UNPACK_PUSH(UNPACK_FRAME_MAP, size)
+            continue;
+
+        case 249:
+            Py_INCREF(Py_True);
+            obj = Py_True;
+            break;
+
+        case 250:
+            Py_INCREF(Py_False);
+            obj = Py_False;
+            break;
+
+        case 251:
+            Py_INCREF(Py_None);
+            obj = Py_None;
+            break;
+
+        case 254:
+        case 255:
+            /* close characters are not written to the tape */
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() found an unexpected array or map close "
+                    "character");
+            goto failed;
+        }
+
+        if (obj == NULL)
+        {
+            goto failed;  /* PyErr is set */
+        }
+
+        /* add the value to the containers on the stack */
+        for (;;)
+        {
+            if (frame == NULL)
+            {
+                if (frames != stack)
+                {
+                    free(frames);
+                }
+                if (options->dict != NULL)
+                {
+                    unpack_dict_commit(options->dict, &refs);
+                }
+                unpack_refs_clear(&refs);
+                columns_clear(&columns);
+                return obj;
+            }
+
+            if (frame->kind == UNPACK_FRAME_ARRAY)
+            {
+                if (options->use_tuples)
+                {
+                    PyTuple_SET_ITEM(frame->obj, frame->i, obj);
+                }
+                else
+                {
+                    PyList_SET_ITEM(frame->obj, frame->i, obj);
+                }
+            }
+            else if (frame->kind == UNPACK_FRAME_RECORD)
+            {
+                /* the records of a template share the key objects */
+                rc = PyDict_SetItem(
+                        frame->obj,
+                        PySequence_Fast_ITEMS(frames[depth - 2].key)[frame->i],
+                        obj);
+                Py_DECREF(obj);
+                if (rc == -1)
+                {
+                    goto failed;
+                }
+            }
+            else if (frame->kind == UNPACK_FRAME_ROW)
+            {
+                PyObject * key;
+                if (columns.template)
+                {
+                    key = PySequence_Fast_ITEMS(frames[0].key)[frame->i];
+                }
+                else if (frame->key == NULL)
+                {
+                    frame->key = obj;
+                    break;
+                }
+                else
+                {
+                    key = frame->key;
+                }
+                rc = columns_add(&columns, frames[0].obj, key, frame->i, obj);
+                Py_DECREF(obj);
+                Py_CLEAR(frame->key);
+                if (rc == -1)
+                {
+                    goto failed;
+                }
+            }
+            else if (frame->kind == UNPACK_FRAME_COLUMNS)
+            {
+                if (columns.template && frame->i == 0)
+                {
+                    if (!PyList_CheckExact(obj) && !PyTuple_CheckExact(obj))
+                    {
+                        Py_DECREF(obj);
+                        goto invalid_template;
+                    }
+                    frame->key = obj;
+                }
+                else
+                {
+                    /* a row ends with the placeholder of its frame */
+                    Py_DECREF(obj);
+                    if (obj != frame->obj)
+                    {
+                        if (columns.template)
+                        {
+                            goto invalid_template;
+                        }
+                        PyErr_SetString(
+                                PyExc_ValueError,
+                                "unpackb() columnar=True requires an array "
+                                "of maps");
+                        goto failed;
+                    }
+                    if (columns_row_end(&columns))
+                    {
+                        goto failed;  /* PyErr is set */
+                    }
+                }
+            }
+            else if (frame->kind == UNPACK_FRAME_TEMPLATE)
+            {
+                if (frame->i == 0
+                        ? !PyList_CheckExact(obj) && !PyTuple_CheckExact(obj)
+                        : !PyDict_CheckExact(obj))
+                {
+                    Py_DECREF(obj);
+                    goto invalid_template;
+                }
+                if (frame->i == 0)
+                {
+                    frame->key = obj;
+                }
+                else if (options->use_tuples)
+                {
+                    PyTuple_SET_ITEM(frame->obj, frame->i - 1, obj);
+                }
+                else
+                {
+                    PyList_SET_ITEM(frame->obj, frame->i - 1, obj);
+                }
+            }
+            else if (frame->key == NULL)
+            {
+                frame->key = obj;
+                break;
+            }
+            else
+            {
+                rc = PyDict_SetItem(frame->obj, frame->key, obj);
+                Py_DECREF(frame->key);
+                Py_DECREF(obj);
+                frame->key = NULL;
+                if (rc == -1)
+                {
+                    goto failed;
+                }
+            }
+
+            if (++frame->i < frame->n)
+            {
+                break;
+            }
+
+            /* the container on top of the stack is complete */
+            obj = frame->obj;
+            if (frame->kind == UNPACK_FRAME_TEMPLATE)
+            {
+                Py_CLEAR(frame->key);
+            }
+            else if (frame->kind == UNPACK_FRAME_COLUMNS)
+            {
+                Py_CLEAR(frame->key);
+                if (columns_finish(&columns, obj, options))
+                {
+                    goto failed;  /* PyErr is set */
+                }
+            }
+            frame = (--depth) ? &frames[depth - 1] : NULL;
+        }
+    }
+
+invalid_template:
+    PyErr_SetString(
+            PyExc_ValueError,
+            "unpackb() found an invalid template");
+
+failed:
+    while (depth--)
+    {
+        Py_DECREF(frames[depth].obj);
+        Py_XDECREF(frames[depth].key);
+    }
+    if (frames != stack)
+    {
+        free(frames);
+    }
+    unpack_refs_clear(&refs);
+    columns_clear(&columns);
+    return NULL;
+}
+
+static PyObject * _qpack_packb(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    PyObject * packed;
+    PyObject * obj;
+    PyObject * o_exact;
+    PyObject * o_threads;
+    PyObject * o_canonical;
+    PyObject * o_refs;
+    PyObject * o_templates;
+    Py_ssize_t size;
+    Py_ssize_t threads = 1;
+    packer_t * packer;
+    int exact;
+    int canonical;
+    int refs;
+    int templates;
+
+    size = PyTuple_GET_SIZE(args);
+
+    if (size != 1)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "packb() missing 1 required positional argument: 'o'");
+        return NULL;
+    }
+
+    packer = packer_acquire();
+    if (packer == NULL)
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        }
+        return NULL;
+    }
+
+    obj = PyTuple_GET_ITEM(args, 0);
+
+    packer->max_depth = QP_MAX_DEPTH;
+    if (kwargs && max_depth_init(
+            PyDict_GetItemString(kwargs, "max_depth"),
+            &packer->max_depth))
+    {
+        packer_release(packer);
+        return NULL;  /* PyErr is set */
+    }
+
+    o_threads = kwargs ? PyDict_GetItemString(kwargs, "threads") : NULL;
+    if (o_threads != NULL)
+    {
+        threads = PyNumber_AsSsize_t(o_threads, PyExc_OverflowError);
+        if (threads < 1)
+        {
+            if (!PyErr_Occurred())
+            {
+                PyErr_SetString(
+                        PyExc_ValueError,
+                        "packb() threads must be at least 1");
+            }
+            packer_release(packer);
+            return NULL;
+        }
+        if (threads > THREADS_MAX)
+        {
+            threads = THREADS_MAX;
+        }
+        size = (PyList_Check(obj) || PyTuple_Check(obj))
+                ? PySequence_Fast_GET_SIZE(obj) / PACK_THREAD_MIN_ITEMS
+                : 0;
+        if (size < threads)
+        {
+            threads = size;
+        }
+    }
+
+    o_canonical = kwargs ? PyDict_GetItemString(kwargs, "canonical") : NULL;
+    canonical = o_canonical ? PyObject_IsTrue(o_canonical) : 0;
+    o_exact = kwargs ? PyDict_GetItemString(kwargs, "exact") : NULL;
+    exact = o_exact ? PyObject_IsTrue(o_exact) : 0;
+    o_refs = kwargs ? PyDict_GetItemString(kwargs, "refs") : NULL;
+    refs = o_refs ? PyObject_IsTrue(o_refs) : 0;
+    o_templates = kwargs ? PyDict_GetItemString(kwargs, "templates") : NULL;
+    templates = o_templates ? PyObject_IsTrue(o_templates) : 0;
+    if (exact == -1 || canonical == -1 || refs == -1 || templates == -1)
+    {
+        packed = NULL;  /* PyErr is set */
+    }
+    else if (refs || (templates && !canonical))
+    {
+        /* back-references point into the one buffer which is written, and
+         * templates are not measured or packed by threads, so both threads
+         * and exact are ignored; the maps of canonical data are sorted so
+         * templates are not used */
+        packer->canonical = canonical;
+        packer->templates = templates && !canonical;
+        packed = ((refs && refs_init(packer)) || packb(obj, packer))
+                ? NULL
+                : packer_finish(packer);
+    }
+    else if (threads > 1 && packer->max_depth > 0 && threads_parallel())
+    {
+        packed = packb_threads(obj, packer->max_depth, canonical, threads);
+    }
+    else if (exact)
+    {
+        packed = packb_exact(obj, packer->max_depth, canonical);
+    }
+    else
+    {
+        packer->canonical = canonical;
+        packed = packb(obj, packer) ? NULL : packer_finish(packer);
+    }
+
+    packer_release(packer);
+    return packed;
+}
+
+static PyObject * _qpack_packb_into(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    static char * kwlist[] = {"obj", "buffer", "offset", "max_depth", NULL};
+    PyObject * obj;
+    PyObject * target;
+    PyObject * o_max_depth = NULL;
+    Py_ssize_t offset = 0;
+    Py_buffer view;
+    packer_t packer = {0};
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            "OO|nO:packb_into",
+            kwlist,
+            &obj,
+            &target,
+            &offset,
+            &o_max_depth))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    packer.max_depth = QP_MAX_DEPTH;
+    if (max_depth_init(o_max_depth, &packer.max_depth))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    if (PyObject_GetBuffer(target, &view, PyBUF_WRITABLE) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    if (offset < 0 || offset > view.len)
+    {
+        PyBuffer_Release(&view);
+        PyErr_SetString(
+                PyExc_ValueError,
+                "packb_into() offset is out of range");
+        return NULL;
+    }
+
+    packer.buffer = (unsigned char *) view.buf + offset;
+    packer.size = view.len - offset;
+    packer.fixed = 1;
+
+    rc = packb(obj, &packer);
+
+    free(packer.frames);
+    PyBuffer_Release(&view);
+    return rc ? NULL : PyLong_FromSsize_t(packer.len);
+}
+
+static PyObject * _qpack_packed_size(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    static char * kwlist[] = {"obj", "max_depth", NULL};
+    PyObject * obj;
+    PyObject * o_max_depth = NULL;
+    Py_ssize_t max_depth = QP_MAX_DEPTH;
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            "O|O:packed_size",
+            kwlist,
+            &obj,
+            &o_max_depth) ||
+        max_depth_init(o_max_depth, &max_depth) ||
+        packed_size(obj, max_depth, &size))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    return PyLong_FromSsize_t(size);
+}
+
+static PyObject * _qpack_digest(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    static char * kwlist[] = {"obj", "max_depth", NULL};
+    PyObject * obj;
+    PyObject * o_max_depth = NULL;
+    PyObject * digested = NULL;
+    Py_ssize_t max_depth = QP_MAX_DEPTH;
+    unsigned char out[QP_DIGEST_SZ];
+    qp_digest_t digest;
+    packer_t * packer;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            "O|O:digest",
+            kwlist,
+            &obj,
+            &o_max_depth) ||
+        max_depth_init(o_max_depth, &max_depth))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    packer = packer_acquire();
+    if (packer == NULL)
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        }
+        return NULL;
+    }
+
+    qp_digest_init(&digest);
+    packer->max_depth = max_depth;
+    packer->canonical = 1;
+    packer->digest = &digest;
+
+    if (packb(obj, packer) == 0)
+    {
+        qp_digest_update(&digest, packer->buffer, packer->len);
+        qp_digest_final(&digest, out);
+        digested = PyBytes_FromStringAndSize(
+                (const char *) out,
+                QP_DIGEST_SZ);
+    }
+
+    packer_release(packer);
+    return digested;
+}
+
+/*
+ * Get a buffer with the data to unpack from `obj`. On Python 2 objects such
+ * as mmap and array only support the old buffer protocol.
+ */
+static int get_read_buffer(PyObject * obj, Py_buffer * view)
+{
+#if PY_MAJOR_VERSION < 3
+    if (!PyObject_CheckBuffer(obj))
+    {
+        const void * buf;
+        Py_ssize_t len;
+
+        if (PyObject_AsReadBuffer(obj, &buf, &len) == -1)
+        {
+            return -1;  /* PyErr is set */
+        }
+        return PyBuffer_FillInfo(view, obj, (void *) buf, len, 1, 0);
+    }
+#endif
+    return PyObject_GetBuffer(obj, view, PyBUF_SIMPLE);
+}
+
+static PyObject * _qpack_unpackb(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    PyObject * obj;
+    PyObject * unpacked;
+    PyObject * o_threads;
+    PyObject * o_columnar;
+    Py_ssize_t size;
+    Py_ssize_t offset = 0;
+    Py_buffer view;
+    unpack_options_t options = {
+        .decode=DECODE_NONE,        /* None */
+        .ignore_decode_errors=0,    /* False */
+        .use_tuples=0,              /* False */
+    };
+
+    size = PyTuple_GET_SIZE(args);
+
+    if (size != 1)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "unpackb(), exactly one positional argument is expected");
+        return NULL;
+    }
+
+    obj = PyTuple_GET_ITEM(args, 0);
+
+    if (unpack_options_init(&options, kwargs))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    o_threads = kwargs ? PyDict_GetItemString(kwargs, "threads") : NULL;
+    if (o_threads != NULL)
+    {
+        options.threads = PyNumber_AsSsize_t(o_threads, PyExc_OverflowError);
+        if (options.threads == -1 && PyErr_Occurred())
+        {
+            return NULL;  /* PyErr is set */
+        }
+        if (options.threads < 1)
+        {
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() threads must be at least 1");
+            return NULL;
+        }
+        if (options.threads > THREADS_MAX)
+        {
+            options.threads = THREADS_MAX;
+        }
+    }
+
+    o_columnar = kwargs ? PyDict_GetItemString(kwargs, "columnar") : NULL;
+    if (o_columnar != NULL)
+    {
+        options.columnar = PyObject_IsTrue(o_columnar);
+        if (options.columnar == -1)
+        {
+            return NULL;  /* PyErr is set */
+        }
+    }
+
+    if (get_read_buffer(obj, &view) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    unpacked = unpack_view(&view, &offset, &options);
+
+    PyBuffer_Release(&view);
+    return unpacked;
+}
+
+static PyObject * _qpack_unpack_from(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    PyObject * obj;
+    PyObject * o_offset = NULL;
+    PyObject * unpacked;
+    Py_ssize_t size;
+    Py_ssize_t offset = 0;
+    Py_buffer view;
+    unpack_options_t options = {
+        .decode=DECODE_NONE,        /* None */
+        .ignore_decode_errors=0,    /* False */
+        .use_tuples=0,              /* False */
+    };
+
+    size = PyTuple_GET_SIZE(args);
+
+    if (size != 1 && size != 2)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "unpack_from(), expecting a buffer and an optional offset");
+        return NULL;
+    }
+
+    obj = PyTuple_GET_ITEM(args, 0);
+
+    if (size == 2)
+    {
+        o_offset = PyTuple_GET_ITEM(args, 1);
+    }
+    else if (kwargs)
+    {
+        o_offset = PyDict_GetItemString(kwargs, "offset");
+    }
+
+    if (o_offset != NULL)
+    {
+        offset = PyNumber_AsSsize_t(o_offset, PyExc_OverflowError);
+        if (offset == -1 && PyErr_Occurred())
+        {
+            return NULL;  /* PyErr is set */
+        }
+    }
+
+    if (unpack_options_init(&options, kwargs))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    if (get_read_buffer(obj, &view) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    if (offset < 0 || offset > view.len)
+    {
+        PyBuffer_Release(&view);
+        PyErr_SetString(
+                PyExc_ValueError,
+                "unpack_from() offset is out of range");
+        return NULL;
+    }
+
+    unpacked = unpack_view(&view, &offset, &options);
+
+    PyBuffer_Release(&view);
+    return (unpacked == NULL) ? NULL : Py_BuildValue("(Nn)", unpacked, offset);
+}
+
+/*
+ * Shared by skip() and validate(); scans the value in `buffer` at the given
+ * offset and returns the end of the value, or -1 with PyErr set.
+ */
+static Py_ssize_t scan_args(
+        const char * fmt,
+        PyObject * args,
+        PyObject * kwargs,
+        int to_end)
+{
+    static char * kwlist[] = {"buffer", "offset", "max_depth", NULL};
+    PyObject * obj;
+    PyObject * o_max_depth = NULL;
+    Py_ssize_t offset = 0;
+    Py_ssize_t max_depth = QP_MAX_DEPTH;
+    Py_buffer view;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            fmt,
+            kwlist,
+            &obj,
+            &offset,
+            &o_max_depth) ||
+        max_depth_init(o_max_depth, &max_depth))
+    {
+        return -1;  /* PyErr is set */
+    }
+
+    if (get_read_buffer(obj, &view) == -1)
+    {
+        return -1;  /* PyErr is set */
+    }
+
+    if (offset < 0 || offset > view.len)
+    {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "offset is out of range");
+        return -1;
+    }
+
+    rc = scan_view(&view, &offset, max_depth);
+    if (rc == 0 && to_end && offset != view.len)
+    {
+        PyErr_Format(
+                PyExc_ValueError,
+                "unexpected data after the value at position %zd",
+                offset);
+        rc = -1;
+    }
+
+    PyBuffer_Release(&view);
+    return rc ? -1 : offset;
+}
+
+static PyObject * _qpack_skip(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    Py_ssize_t offset = scan_args("O|nO:skip", args, kwargs, 0);
+    return (offset == -1) ? NULL : PyLong_FromSsize_t(offset);
+}
+
+static PyObject * _qpack_validate(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    if (scan_args("O|nO:validate", args, kwargs, 1) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject * _qpack_get(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    PyObject * obj;
+    PyObject * path;
+    PyObject * o_default = NULL;
+    PyObject * unpacked = NULL;
+    PyObject ** items;
+    Py_ssize_t i, n, step = 0;
+    Py_ssize_t offset = 0;
+    Py_buffer view;
+    qp_scanner_t scanner = {0};
+    get_step_t stack[GET_STEPS_SZ];
+    get_step_t * steps = stack;
+    get_rc_t rc;
+    unpack_options_t options = {
+        .decode=DECODE_NONE,        /* None */
+        .ignore_decode_errors=0,    /* False */
+        .use_tuples=0,              /* False */
+    };
+
+    if (PyTuple_GET_SIZE(args) != 2)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "get(), expecting a buffer and a path");
+        return NULL;
+    }
+
+    obj = PyTuple_GET_ITEM(args, 0);
+    path = PyTuple_GET_ITEM(args, 1);
+
+    if (!PyList_Check(path) && !PyTuple_Check(path))
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "get() path must be a list or tuple");
+        return NULL;
+    }
+
+    if (kwargs)
+    {
+        o_default = PyDict_GetItemString(kwargs, "default");
+    }
+
+    if (unpack_options_init(&options, kwargs))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    n = PySequence_Fast_GET_SIZE(path);
+    items = PySequence_Fast_ITEMS(path);
+
+    if (n > GET_STEPS_SZ)
+    {
+        steps = (get_step_t *) malloc(n * sizeof(get_step_t));
+        if (steps == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        get_step_t * s = steps + i;
+        PyObject * item = items[i];
+
+        s->obj = item;
+        s->bytes = NULL;
+        s->is_int = 0;
+
+#if PY_MAJOR_VERSION >= 3
+        if (PyLong_Check(item))
+#else
+        if (PyLong_Check(item) || PyInt_Check(item))
+#endif
+        {
+            s->integer = (int64_t) PyLong_AsLongLong(item);
+            if (s->integer == -1 && PyErr_Occurred())
+            {
+                goto cleanup;  /* PyErr is set */
+            }
+            s->is_int = 1;
+        }
+        else if (PyBytes_Check(item))
+        {
+            s->raw = PyBytes_AS_STRING(item);
+            s->size = PyBytes_GET_SIZE(item);
+        }
+        else if (PyUnicode_Check(item))
+        {
+            s->bytes = PyUnicode_AsUTF8String(item);
+            if (s->bytes == NULL)
+            {
+                goto cleanup;  /* PyErr is set */
+            }
+            s->raw = PyBytes_AS_STRING(s->bytes);
+            s->size = PyBytes_GET_SIZE(s->bytes);
+        }
+        else
+        {
+            PyErr_SetString(
+                    PyExc_TypeError,
+                    "get() path items must be str, bytes or int");
+            goto cleanup;
+        }
+    }
+
+    if (get_read_buffer(obj, &view) == -1)
+    {
+        goto cleanup;  /* PyErr is set */
+    }
+
+    scanner.max_depth = options.max_depth;
+
+    if (view.len >= SCAN_NOGIL_SZ)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        rc = get_walk(
+                &scanner,
+                (unsigned char *) view.buf,
+                view.len,
+                steps,
+                n,
+                &step);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+        rc = get_walk(
+                &scanner,
+                (unsigned char *) view.buf,
+                view.len,
+                steps,
+                n,
+                &step);
+    }
+
+    if ((scanner.refs &&
+         (rc == GET_FOUND ||
+          rc == GET_MISSING_KEY ||
+          rc == GET_MISSING_INDEX)) ||
+        rc == GET_TEMPLATE)
+    {
+        rc = get_refs(&view, steps, n, &options, &step, &unpacked);
+    }
+
+    switch (rc)
+    {
+    case GET_FOUND:
+        if (unpacked != NULL)
+        {
+            break;  /* found by get_refs() */
+        }
+        /* the containers on the path count for the maximum depth */
+        options.max_depth -= n;
+        offset = scanner.pos;
+        unpacked = unpack_view(&view, &offset, &options);
+        break;
+    case GET_MISSING_KEY:
+    case GET_MISSING_INDEX:
+        if (o_default != NULL)
+        {
+            Py_INCREF(o_default);
+            unpacked = o_default;
+            break;
+        }
+        PyErr_SetObject(
+                rc == GET_MISSING_KEY ? PyExc_KeyError : PyExc_IndexError,
+                steps[step].obj);
+        break;
+    case GET_INCOMPLETE:
+        PyErr_Format(
+                PyExc_ValueError,
+                "missing data at position %zd",
+                scanner.pos);
+        break;
+    case GET_ERROR:
+        if (!PyErr_Occurred())
+        {
+            scanner_set_err(&scanner, 0);
+        }
+        break;
+    case GET_TEMPLATE:
+        break;  /* handled by get_refs() */
+    }
+
+    PyBuffer_Release(&view);
+
+cleanup:
+    while (i--)
+    {
+        Py_XDECREF(steps[i].bytes);
+    }
+    if (steps != stack)
+    {
+        free(steps);
+    }
+    free(scanner.frames);
+    return unpacked;
+}
+
+static PyObject * _qpack_packb_many(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    static char * kwlist[] = {"iterable", "max_depth", "concat", NULL};
+    PyObject * iterable;
+    PyObject * o_max_depth = NULL;
+    PyObject * o_concat = NULL;
+    PyObject * seq;
+    PyObject * result = NULL;
+    PyObject * array_type = NULL;
+    PyObject ** items;
+    Py_ssize_t i, n;
+    packer_t * packer;
+    int concat;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            "O|OO:packb_many",
+            kwlist,
+            &iterable,
+            &o_max_depth,
+            &o_concat) ||
+        (concat = o_concat ? PyObject_IsTrue(o_concat) : 0) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+#ifdef Py_GIL_DISABLED
+    /* another thread can change a list while it is packed */
+    seq = PySequence_Tuple(iterable);
+#else
+    seq = PySequence_Fast(iterable, "packb_many() expects an iterable");
+#endif
+    if (seq == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    packer = packer_acquire();
+    if (packer == NULL)
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        }
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    packer->max_depth = QP_MAX_DEPTH;
+    if (max_depth_init(o_max_depth, &packer->max_depth))
+    {
+        goto done;  /* PyErr is set */
+    }
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    items = PySequence_Fast_ITEMS(seq);
+
+    if (concat)
+    {
+        PyObject * packed;
+        PyObject * offsets;
+        int64_t * offs = (int64_t *) malloc((n + 1) * sizeof(int64_t));
+        if (offs == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            goto done;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            offs[i] = (int64_t) packer->len;
+            if (packb(items[i], packer))
+            {
+                free(offs);
+                goto done;  /* PyErr is set */
+            }
+        }
+        offs[n] = (int64_t) packer->len;
+
+        packed = packer_finish(packer);
+        offsets = (packed == NULL) ? NULL : typed_array_new(
+                (unsigned char *) offs,
+                (n + 1) * sizeof(int64_t),
+                'q',
+                &array_type);
+        Py_XDECREF(array_type);
+        free(offs);
+        if (offsets == NULL)
+        {
+            Py_XDECREF(packed);
+            goto done;  /* PyErr is set */
+        }
+        result = Py_BuildValue("(NN)", packed, offsets);
+        goto done;
+    }
+
+    result = PyList_New(n);
+    if (result == NULL)
+    {
+        goto done;  /* PyErr is set */
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        PyObject * packed;
+
+        packer->len = 0;
+        packed = packb(items[i], packer) ? NULL : packer_finish(packer);
+        if (packed == NULL)
+        {
+            Py_CLEAR(result);
+            goto done;  /* PyErr is set */
+        }
+        PyList_SET_ITEM(result, i, packed);
+    }
+
+done:
+    packer_release(packer);
+    Py_DECREF(seq);
+    return result;
+}
+
+/*
+ * Unpack `view` into the list `unpacked`; with `all` set, the data must
+ * contain only complete values which are all unpacked, otherwise only the
+ * first value is unpacked. The key cache is kept for the next buffer.
+ */
+static int unpack_many_view(
+        Py_buffer * view,
+        PyObject * unpacked,
+        unpack_options_t * options,
+        int all)
+{
+    unsigned char * buffer = (unsigned char *) view->buf;
+    qp_token_t tokens[QP_TAPE_STACK_SZ];
+    qp_ssize_t frames[QP_SCAN_STACK_SZ];
+    qp_tape_t tape;
+    qp_scanner_t scanner = {0};
+    Py_ssize_t offset = 0;
+    int rc = 0;
+
+    qp_tape_init(&tape, tokens);
+    scanner.frames = scanner.stack = frames;
+    scanner.size = QP_SCAN_STACK_SZ;
+    scanner.tape = &tape;
+
+    options->source = view->obj;
+    options->base = buffer;
+
+    do
+    {
+        PyObject * obj = unpack_value(
+                &scanner,
+                buffer,
+                view->len,
+                &offset,
+                options);
+        if (obj == NULL)
+        {
+            rc = -1;  /* PyErr is set */
+            break;
+        }
+        rc = PyList_Append(unpacked, obj);
+        Py_DECREF(obj);
+    }
+    while (rc == 0 && all && offset < view->len);
+
+    Py_CLEAR(options->view);
+    if (scanner.frames != scanner.stack)
+    {
+        free(scanner.frames);
+    }
+    qp_tape_free(&tape);
+    return rc;
+}
+
+static PyObject * _qpack_unpack_many(
+        PyObject * self,
+        PyObject * args,
+        PyObject * kwargs)
+{
+    PyObject * obj;
+    PyObject * unpacked;
+    Py_buffer view;
+    int rc = 0;
+    unpack_options_t options = {
+        .decode=DECODE_NONE,        /* None */
+        .ignore_decode_errors=0,    /* False */
+        .use_tuples=0,              /* False */
+    };
+
+    if (PyTuple_GET_SIZE(args) != 1)
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "unpack_many(), exactly one positional argument is expected");
+        return NULL;
+    }
+
+    obj = PyTuple_GET_ITEM(args, 0);
+
+    if (unpack_options_init(&options, kwargs))
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    unpacked = PyList_New(0);
+    if (unpacked == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    if (PyList_Check(obj) || PyTuple_Check(obj))
+    {
+        Py_ssize_t i;
+
+        for (i = 0; rc == 0 && i < PySequence_Fast_GET_SIZE(obj); i++)
+        {
+            /* a new reference, in case another thread changes the list */
+            PyObject * item = PySequence_GetItem(obj, i);
+            rc = (item == NULL)
+                    ? -1
+                    : get_read_buffer(item, &view);
+            Py_XDECREF(item);
+            if (rc == 0)
+            {
+                rc = unpack_many_view(&view, unpacked, &options, 0);
+                PyBuffer_Release(&view);
+            }
+        }
+    }
+    else if ((rc = get_read_buffer(obj, &view)) == 0)
+    {
+        if (view.len)
+        {
+            rc = unpack_many_view(&view, unpacked, &options, 1);
+        }
+        PyBuffer_Release(&view);
+    }
+
+    Py_XDECREF(options.array_type);
+    keycache_clear(&options.keycache);
+
+    if (rc)
+    {
+        Py_DECREF(unpacked);
+        return NULL;  /* PyErr is set */
+    }
+    return unpacked;
+}
+
+/*
+ * Unpack one value from `view`, starting at `*offset`. On success, the
+ * offset is set to the end of the value.
+ */
+static PyObject * unpack_view(
+        Py_buffer * view,
+        Py_ssize_t * offset,
+        unpack_options_t * options)
+{
+    PyObject * unpacked;
+    unsigned char * buffer = (unsigned char *) view->buf;
+    qp_token_t tokens[QP_TAPE_STACK_SZ];
+    qp_ssize_t frames[QP_SCAN_STACK_SZ];
+    qp_tape_t tape;
+    qp_scanner_t scanner = {0};
+
+    qp_tape_init(&tape, tokens);
+    scanner.frames = scanner.stack = frames;
+    scanner.size = QP_SCAN_STACK_SZ;
+    scanner.tape = &tape;
+
+    options->source = view->obj;
+    options->base = buffer;
+
+    unpacked = unpack_value(&scanner, buffer, view->len, offset, options);
+
+    Py_XDECREF(options->view);
+    options->view = NULL;
+    Py_CLEAR(options->array_type);
+    keycache_clear(&options->keycache);
+
+    if (scanner.frames != scanner.stack)
+    {
+        free(scanner.frames);
+    }
+    qp_tape_free(&tape);
+    return unpacked;
+}
+
+/*
+ * Create the Python objects for a complete tape. A large array at the top is
+ * unpacked by more than one thread when this is enabled with `threads`.
+ */
+static PyObject * unpack_tape(
+        const unsigned char * data,
+        qp_tape_t * tape,
+        unpack_options_t * options)
+{
+    Py_ssize_t nthreads = options->threads;
+    unsigned char tp = data[tape->tokens[0].pos];
+
+    if (options->columnar)
+    {
+        /* unpackb() checks the items of the array or template */
+        if (tp != QP_ARRAY_OPEN &&
+            (tp < QP_ARRAY0 || tp > QP_ARRAY5) &&
+            (tp != QP_HOOK || data[tape->tokens[0].pos + 1] != QP_TEMPLATE))
+        {
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() columnar=True requires an array of maps");
+            return NULL;
+        }
+        return unpackb(data, tape, options);
+    }
+
+    /* only an open array can have enough items; back-references point to
+     * raw data which is unpacked before, so these are unpacked in order */
+    if (nthreads > 1 && tp == QP_ARRAY_OPEN && !options->refs)
+    {
+        Py_ssize_t n = tape->tokens[0].n / UNPACK_THREAD_MIN_ITEMS;
+        if (n < nthreads)
+        {
+            nthreads = n;
+        }
+        if (nthreads > 1 && threads_parallel())
+        {
+            return unpack_threads(data, tape, options, nthreads);
+        }
+    }
+    return unpackb(data, tape, options);
+}
+
+/*
+ * Unpack the array at the first token of `tape` with `nthreads` jobs, each
+ * for a range of the items. Since all data is scanned before, the jobs only
+ * create the objects.
+ */
+static PyObject * unpack_threads(
+        const unsigned char * data,
+        qp_tape_t * tape,
+        unpack_options_t * options,
+        Py_ssize_t nthreads)
+{
+    unpack_job_t * jobs;
+    PyObject * obj;
+    Py_ssize_t i, j;
+    Py_ssize_t n = tape->tokens[0].n;
+    qp_ssize_t token = 1;
+
+    obj = options->use_tuples ? PyTuple_New(n) : PyList_New(n);
+    if (obj == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    jobs = (unpack_job_t *) calloc(nthreads, sizeof(unpack_job_t));
+    if (jobs == NULL)
+    {
+        Py_DECREF(obj);
+        return PyErr_NoMemory();
+    }
+
+    /* find the first token of each range of items */
+    for (i = 0, j = 0; j < nthreads; i++)
+    {
+        if (i == j * n / nthreads)
+        {
+            unpack_job_t * job = &jobs[j++];
+            job->data = data;
+            job->tape = tape;
+            job->token = token;
+            job->start = i;
+            job->end = j * n / nthreads;
+            job->obj = obj;
+            job->options = *options;
+            job->options.keycache.entries = NULL;
+            job->options.keycache.seen = 0;
+            job->options.view = NULL;
+            job->options.array_type = NULL;
+        }
+        token = qp_tape_next(tape, data, token);
+    }
+
+    threads_run(unpack_job, jobs, sizeof(unpack_job_t), nthreads);
+
+    for (j = 0; j < nthreads; j++)
+    {
+        unpack_job_t * job = &jobs[j];
+        if (job->err_type != NULL)
+        {
+            if (obj != NULL)
+            {
+                /* raise the exception of the first job which has failed */
+                PyErr_Restore(job->err_type, job->err_value, job->err_tb);
+                Py_CLEAR(obj);
+                continue;
+            }
+            Py_DECREF(job->err_type);
+            Py_XDECREF(job->err_value);
+            Py_XDECREF(job->err_tb);
+        }
+    }
+
+    free(jobs);
+    return obj;
+}
+
+/*
+ * Create the items of a job. An exception is kept in the job, since the job
+ * might run in another thread.
+ */
+static void unpack_job(void * arg)
+{
+    unpack_job_t * job = (unpack_job_t *) arg;
+    Py_ssize_t i;
+    qp_tape_t tape = *job->tape;
+    qp_ssize_t token = job->token;
+
+    for (i = job->start; i < job->end; i++)
+    {
+        PyObject * item;
+
+        tape.tokens = job->tape->tokens + token;
+        item = unpackb(job->data, &tape, &job->options);
+        if (item == NULL)
+        {
+            PyErr_Fetch(&job->err_type, &job->err_value, &job->err_tb);
+            break;
+        }
+        if (job->options.use_tuples)
+        {
+            PyTuple_SET_ITEM(job->obj, i, item);
+        }
+        else
+        {
+            PyList_SET_ITEM(job->obj, i, item);
+        }
+        token = qp_tape_next(job->tape, job->data, token);
+    }
+
+    Py_CLEAR(job->options.view);
+    Py_CLEAR(job->options.array_type);
+    keycache_clear(&job->options.keycache);
+}
+
+/*
+ * Returns 1 when the jobs of threads_run() run in parallel, which is only in
+ * a free-threaded build while the GIL is disabled. The GIL can be enabled at
+ * runtime, for example by importing an extension module which needs it.
+ */
+static int threads_parallel(void)
+{
+#ifdef Py_GIL_DISABLED
+    PyObject * fn = PySys_GetObject("_is_gil_enabled");
+    PyObject * enabled;
+    int rc;
+
+    if (fn == NULL)
+    {
+        return 1;
+    }
+    enabled = PyObject_CallNoArgs(fn);
+    if (enabled == NULL)
+    {
+        PyErr_Clear();
+        return 0;
+    }
+    rc = (enabled == Py_False);
+    Py_DECREF(enabled);
+    return rc;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Call `fn` for each of the `n` jobs of `size` bytes at `jobs`, with the GIL
+ * held. The calling thread runs the first job and each other job runs in a
+ * worker of the pool, or in the calling thread when no worker can be started
+ * or another caller uses the pool. All jobs are done on return.
+ */
+static void threads_run(
+        job_fn_t fn,
+        void * jobs,
+        size_t size,
+        Py_ssize_t n)
+{
+    Py_ssize_t j = 1;
+#ifdef Py_GIL_DISABLED
+    PyInterpreterState * interp = PyInterpreterState_Get();
+    worker_t * workers = threads_pool.workers;
+    long pid = THREADS_PID();
+    Py_ssize_t started = 1;
+    int busy;
+
+    PyMutex_Lock(&threads_pool.mutex);
+    if (threads_pool.pid != pid)
+    {
+        /* the workers of the parent do not exist after a fork */
+        threads_pool.pid = pid;
+        threads_pool.busy = 0;
+        threads_pool.n = 0;
+    }
+    busy = threads_pool.busy;
+    threads_pool.busy = 1;
+    PyMutex_Unlock(&threads_pool.mutex);
+
+    for (; !busy && started < n; started++)
+    {
+        worker_t * w = &workers[started - 1];
+        if (started > threads_pool.n)
+        {
+            if (threads_start(w))
+            {
+                break;  /* the other jobs run in the calling thread */
+            }
+            threads_pool.n = started;
+        }
+        w->fn = fn;
+        w->job = (char *) jobs + started * size;
+        w->interp = interp;
+        w->ok = 0;
+        PyThread_release_lock(w->start);
+    }
+#endif
+
+    fn(jobs);
+
+#ifdef Py_GIL_DISABLED
+    if (!busy)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        for (; j < started; j++)
+        {
+            PyThread_acquire_lock(workers[j - 1].done, WAIT_LOCK);
+        }
+        Py_END_ALLOW_THREADS
+        for (j = 1; j < started; j++)
+        {
+            if (!workers[j - 1].ok)
+            {
+                fn((char *) jobs + j * size);
+            }
+        }
+        PyMutex_Lock(&threads_pool.mutex);
+        threads_pool.busy = 0;
+        PyMutex_Unlock(&threads_pool.mutex);
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        fn((char *) jobs + j * size);
+    }
+}
+
+#ifdef Py_GIL_DISABLED
+/*
+ * Start the thread of worker `w`, which waits for its first job. Returns -1
+ * when the thread cannot be started.
+ */
+static int threads_start(worker_t * w)
+{
+    w->start = PyThread_allocate_lock();
+    w->done = PyThread_allocate_lock();
+    if (w->start != NULL && w->done != NULL)
+    {
+        PyThread_acquire_lock(w->start, WAIT_LOCK);
+        PyThread_acquire_lock(w->done, WAIT_LOCK);
+        if (PyThread_start_new_thread(threads_main, w) !=
+                PYTHREAD_INVALID_THREAD_ID)
+        {
+            return 0;
+        }
+        PyThread_release_lock(w->start);
+        PyThread_release_lock(w->done);
+    }
+    if (w->start != NULL)
+    {
+        PyThread_free_lock(w->start);
+    }
+    if (w->done != NULL)
+    {
+        PyThread_free_lock(w->done);
+    }
+    w->start = w->done = NULL;
+    return -1;
+}
+
+/*
+ * Entry point of a worker which is started by threads_start(). The worker
+ * runs each job it is given with a new thread state and never stops; it does
+ * not hold a thread state while it waits.
+ */
+static void threads_main(void * arg)
+{
+    worker_t * w = (worker_t *) arg;
+
+    for (;;)
+    {
+        PyThreadState * tstate;
+
+        PyThread_acquire_lock(w->start, WAIT_LOCK);
+        tstate = PyThreadState_New(w->interp);
+        if (tstate != NULL)
+        {
+            PyEval_RestoreThread(tstate);
+            w->fn(w->job);
+            w->ok = 1;
+            PyThreadState_Clear(tstate);
+            PyThreadState_DeleteCurrent();
+        }
+        PyThread_release_lock(w->done);
+    }
+}
+#endif
+
+/*
+ * Unpack the value at `*offset` in `data`. The scanner first writes the tape
+ * for the value and next, unpackb() creates the Python objects from the tape.
+ * On success, the offset is set to the end of the value.
+ */
+static PyObject * unpack_value(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        Py_ssize_t * offset,
+        unpack_options_t * options)
+{
+    qp_scanner_reset(scanner);
+    scanner->pos = *offset;
+    scanner->max_depth = options->max_depth;
+
+    switch (scanner_scan(scanner, data, len))
+    {
+    case QP_SCAN_DONE:
+        *offset = scanner->pos;
+        options->refs = scanner->refs != 0;
+        return unpack_tape(data, scanner->tape, options);
+    case QP_SCAN_MORE:
+        break;
+    case QP_SCAN_ERROR:
+        switch (scanner->err)
+        {
+        case QP_SCAN_ERR_CLOSE:
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() found an unexpected array or map close "
+                    "character");
+            return NULL;
+        case QP_SCAN_ERR_DEPTH:
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() exceeds the maximum depth");
+            return NULL;
+        case QP_SCAN_ERR_RAW_SIZE:
+            /* the raw data can never be complete */
+            break;
+        case QP_SCAN_ERR_TYPED:
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() found an invalid typed array");
+            return NULL;
+        case QP_SCAN_ERR_REF:
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() found an invalid back-reference");
+            return NULL;
+        case QP_SCAN_ERR_TEMPLATE:
+            PyErr_SetString(
+                    PyExc_ValueError,
+                    "unpackb() found an invalid template");
+            return NULL;
+        case QP_SCAN_ERR_MEMORY:
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return NULL;
+        }
+        break;
+    }
+    PyErr_SetString(PyExc_ValueError, "unpackb() is missing data");
+    return NULL;
+}
+
+static int unpack_options_init(
+        unpack_options_t * options,
+        PyObject * kwargs)
+{
+    PyObject * o_decode;
+    PyObject * o_ignore_decode_errors;
+    PyObject * o_use_tuples;
+    PyObject * o_raw_as_view;
+    PyObject * o_key_cache_size;
+    PyObject * o_max_depth;
+    Py_ssize_t n;
+
+    options->max_depth = QP_MAX_DEPTH;
+    options->keycache.entries = NULL;
+    options->keycache.seen = 0;
+    options->keycache.size = KEYCACHE_DEFAULT_SZ;
+    options->view_min_size = PY_SSIZE_T_MAX;
+    options->source = NULL;
+    options->view = NULL;
+    options->base = NULL;
+    options->array_type = NULL;
+    options->threads = 1;
+    options->columnar = 0;
+    options->dict = NULL;
+
+    if (kwargs && (n = PyDict_Size(kwargs)))
+    {
+        /* stop looking for keyword arguments once all of them are found */
+        o_decode = options_kwarg(kwargs, "decode", &n);
+        o_ignore_decode_errors = options_kwarg(
+                kwargs,
+                "ignore_decode_errors",
+                &n);
+        o_use_tuples = options_kwarg(kwargs, "use_tuples", &n);
+        o_raw_as_view = options_kwarg(kwargs, "raw_as_view", &n);
+        o_key_cache_size = options_kwarg(kwargs, "key_cache_size", &n);
+        o_max_depth = options_kwarg(kwargs, "max_depth", &n);
+
+        if (o_decode != NULL)
+        {
+            if (PY_COMPAT_CHECK(o_decode))
+            {
+                if (    PY_COMPAT_COMPARE(o_decode, "utf-8") ||
+                        PY_COMPAT_COMPARE(o_decode, "UTF-8") ||
+                        PY_COMPAT_COMPARE(o_decode, "Utf-8") ||
+                        PY_COMPAT_COMPARE(o_decode, "utf8") ||
+                        PY_COMPAT_COMPARE(o_decode, "UTF8") ||
+                        PY_COMPAT_COMPARE(o_decode, "Utf8"))
+                {
+                    options->decode = DECODE_UTF8;
+                }
+                else if(PY_COMPAT_COMPARE(o_decode, "latin-1") ||
+                        PY_COMPAT_COMPARE(o_decode, "LATIN-1") ||
+                        PY_COMPAT_COMPARE(o_decode, "Latin-1") ||
+                        PY_COMPAT_COMPARE(o_decode, "latin1") ||
+                        PY_COMPAT_COMPARE(o_decode, "LATIN1") ||
+                        PY_COMPAT_COMPARE(o_decode, "Latin1"))
+                {
+                    options->decode = DECODE_LATIN1;
+                }
+                else
+                {
+                    PyErr_SetString(
+                            PyExc_LookupError,
+                            "unpackb() unsupported encoding");
+                    return -1;
+                }
+            }
+            else if (o_decode != Py_None)
+            {
+                PyErr_SetString(
+                        PyExc_LookupError,
+                        "unpackb() decode is expecting 'None' or a 'str' object");
+                return -1;
+            }
+
+            if (o_ignore_decode_errors != NULL)
+            {
+                options->ignore_decode_errors = \
+                    PyObject_IsTrue(o_ignore_decode_errors);
+            }
+        }
+
+        if (o_use_tuples != NULL)
+        {
+            options->use_tuples = PyObject_IsTrue(o_use_tuples);
+        }
+
+        if (o_raw_as_view == Py_True)
+        {
+            options->view_min_size = 0;
+        }
+        else if (
+                o_raw_as_view != NULL &&
+                o_raw_as_view != Py_False &&
+                o_raw_as_view != Py_None)
+        {
+            Py_ssize_t min_size = PyNumber_AsSsize_t(
+                    o_raw_as_view,
+                    PyExc_OverflowError);
+            if (min_size == -1 && PyErr_Occurred())
+            {
+                return -1;  /* PyErr is set */
+            }
+            if (min_size < 0)
+            {
+                PyErr_SetString(
+                        PyExc_ValueError,
+                        "unpackb() raw_as_view must be a bool or a "
+                        "positive size");
+                return -1;
+            }
+            options->view_min_size = min_size;
+        }
+
+        if (o_key_cache_size != NULL)
+        {
+            Py_ssize_t size = 0;
+            Py_ssize_t keys = PyNumber_AsSsize_t(
+                    o_key_cache_size,
+                    PyExc_OverflowError);
+            if (keys == -1 && PyErr_Occurred())
+            {
+                return -1;  /* PyErr is set */
+            }
+            if (keys < 0 || keys > 0x100000)
+            {
+                PyErr_SetString(
+                        PyExc_ValueError,
+                        "unpackb() key_cache_size must be between 0 and "
+                        "1048576");
+                return -1;
+            }
+            /* round up to a power of two so the slot is a simple mask */
+            if (keys)
+            {
+                for (size = 1; size < keys; size <<= 1);
+            }
+            options->keycache.size = size;
+        }
+
+        if (max_depth_init(o_max_depth, &options->max_depth))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the keyword argument `name` (borrowed) or NULL. The counter `n`
+ * holds the number of keyword arguments which are not found yet, so no more
+ * lookups are done once all of them are found.
+ */
+static PyObject * options_kwarg(
+        PyObject * kwargs,
+        const char * name,
+        Py_ssize_t * n)
+{
+    PyObject * o;
+
+    if (*n == 0)
+    {
+        return NULL;
+    }
+
+    o = PyDict_GetItemString(kwargs, name);
+    if (o != NULL)
+    {
+        (*n)--;
+    }
+    return o;
+}
+
+/*
+ * Set `max_depth` from the max_depth keyword argument, when given.
+ */
+static int max_depth_init(PyObject * o_max_depth, Py_ssize_t * max_depth)
+{
+    Py_ssize_t n;
+
+    if (o_max_depth == NULL)
+    {
+        return 0;
+    }
+
+    n = PyNumber_AsSsize_t(o_max_depth, PyExc_OverflowError);
+    if (n == -1 && PyErr_Occurred())
+    {
+        return -1;  /* PyErr is set */
+    }
+    if (n < 0)
+    {
+        PyErr_SetString(
+                PyExc_ValueError,
+                "max_depth must not be negative");
+        return -1;
+    }
+    *max_depth = n;
+    return 0;
+}
+
+static void keycache_clear(keycache_t * keycache)
+{
+    if (keycache->entries != NULL)
+    {
+        Py_ssize_t i;
+        for (i = 0; i < keycache->cap; i++)
+        {
+            Py_XDECREF(keycache->entries[i].key);
+        }
+        free(keycache->entries);
+        keycache->entries = NULL;
+    }
+    keycache->seen = 0;
+}
+
+/*
+ * Double the number of slots of the key cache. A key which moves to a slot
+ * which is already used by another key is dropped. When no memory can be
+ * allocated the cache keeps its size.
+ */
+static void keycache_grow(keycache_t * keycache)
+{
+    Py_ssize_t i;
+    Py_ssize_t cap = keycache->cap * 2;
+    keycache_entry_t * entries = (keycache_entry_t *) calloc(
+            cap,
+            sizeof(keycache_entry_t));
+    if (entries == NULL)
+    {
+        return;
+    }
+
+    keycache->used = 0;
+    for (i = 0; i < keycache->cap; i++)
+    {
+        keycache_entry_t * entry = &keycache->entries[i];
+        keycache_entry_t * slot;
+        if (entry->key == NULL)
+        {
+            continue;
+        }
+        slot = &entries[entry->hash & (cap - 1)];
+        if (slot->key != NULL)
+        {
+            Py_DECREF(entry->key);
+            continue;
+        }
+        *slot = *entry;
+        keycache->used++;
+    }
+    free(keycache->entries);
+    keycache->entries = entries;
+    keycache->cap = cap;
+}
+
+/*
+ * Unpack a raw value of `size` bytes at `pt` using the decode options.
+ */
+static PyObject * unpack_raw(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options)
+{
+    PyObject * obj = NULL;
+#if PY_MAJOR_VERSION >= 3
+    int is_ascii;
+#endif
+
+    if (options->decode == DECODE_NONE)
+    {
+        return PyBytes_FromStringAndSize((const char *) pt, size);
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    /* ASCII is decoded the same by UTF-8 and latin-1 and needs only a copy
+     * into a compact str; other data is decoded and validated by Python */
+    if (size < ASCII_INLINE_SZ)
+    {
+        unsigned char c = 0;
+        Py_ssize_t i;
+        for (i = 0; i < size; i++)
+        {
+            c |= pt[i];
+        }
+        is_ascii = c < 128;
+        if (is_ascii && size == 1)
+        {
+            /* single characters are cached by Python */
+            return PyUnicode_FromOrdinal(*pt);
+        }
+    }
+    else
+    {
+        is_ascii = ascii_check(pt, size);
+    }
+
+    if (is_ascii)
+    {
+        obj = PyUnicode_New(size, 127);
+        if (obj != NULL)
+        {
+            memcpy(PyUnicode_1BYTE_DATA(obj), pt, size);
+        }
+        return obj;
+    }
+#endif
+
+    switch(options->decode)
+    {
+    case DECODE_NONE:
+        break;
+    case DECODE_UTF8:
+        obj = PyUnicode_DecodeUTF8((const char *) pt, size, NULL);
+        break;
+    case DECODE_LATIN1:
+        obj = PyUnicode_DecodeLatin1((const char *) pt, size, NULL);
+        break;
+    }
+
+    if (obj == NULL && options->ignore_decode_errors)
+    {
+        PyErr_Clear();
+        obj = PyBytes_FromStringAndSize((const char *) pt, size);
+    }
+    return obj;
+}
+
+/*
+ * Select the fastest ascii_check() for the CPU. Called when the module is
+ * initialized.
+ */
+static void ascii_init(void)
+{
+    ascii_check = ascii_scalar;
+#ifdef QP_SSE2
+    ascii_check = ascii_sse2;
+#endif
+#ifdef QP_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ascii_check = ascii_avx2;
+    }
+#endif
+}
+
+/*
+ * Returns 1 when the `size` bytes at `pt` are all ASCII, checking eight
+ * bytes at a time.
+ */
+static int ascii_scalar(const unsigned char * pt, Py_ssize_t size)
+{
+    uint64_t acc = 0, word;
+
+    for (; size >= 32; pt += 32, size -= 32)
+    {
+        uint64_t w[4];
+        memcpy(w, pt, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) & 0x8080808080808080ULL)
+        {
+            return 0;
+        }
+    }
+    for (; size >= 8; pt += 8, size -= 8)
+    {
+        memcpy(&word, pt, sizeof(uint64_t));
+        acc |= word;
+    }
+    for (; size; pt++, size--)
+    {
+        acc |= *pt;
+    }
+    return (acc & 0x8080808080808080ULL) == 0;
+}
+
+#ifdef QP_SSE2
+/*
+ * Same as ascii_scalar(), with SSE2 for blocks of 16 bytes.
+ */
+static int ascii_sse2(const unsigned char * pt, Py_ssize_t size)
+{
+    for (; size >= 64; pt += 64, size -= 64)
+    {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i *) pt),
+                    _mm_loadu_si128((const __m128i *) (pt + 16))),
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i *) (pt + 32)),
+                    _mm_loadu_si128((const __m128i *) (pt + 48))));
+        if (_mm_movemask_epi8(acc))
+        {
+            return 0;
+        }
+    }
+    for (; size >= 16; pt += 16, size -= 16)
+    {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) pt)))
+        {
+            return 0;
+        }
+    }
+    return ascii_scalar(pt, size);
+}
+#endif
+
+#ifdef QP_AVX2
+/*
+ * Same as ascii_scalar(), with AVX2 for blocks of 32 bytes.
+ */
+__attribute__((target("avx2")))
+static int ascii_avx2(const unsigned char * pt, Py_ssize_t size)
+{
+    uint64_t acc = 0, word;
+
+    for (; size >= 128; pt += 128, size -= 128)
+    {
+        __m256i vacc = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i *) pt),
+                    _mm256_loadu_si256((const __m256i *) (pt + 32))),
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i *) (pt + 64)),
+                    _mm256_loadu_si256((const __m256i *) (pt + 96))));
+        if (_mm256_movemask_epi8(vacc))
+        {
+            return 0;
+        }
+    }
+    for (; size >= 32; pt += 32, size -= 32)
+    {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) pt)))
+        {
+            return 0;
+        }
+    }
+    /* no call to a non-AVX function here; the compiler does not clear the
+     * upper AVX state before a tail call which makes SSE code slow */
+    for (; size >= 8; pt += 8, size -= 8)
+    {
+        memcpy(&word, pt, sizeof(uint64_t));
+        acc |= word;
+    }
+    for (; size; pt++, size--)
+    {
+        acc |= *pt;
+    }
+    return (acc & 0x8080808080808080ULL) == 0;
+}
+#endif
+
+/*
+ * Unpack a raw map key of at most KEYCACHE_KEY_SZ bytes. The key is looked
+ * up in the key cache using the raw data so a repeated key is neither
+ * decoded nor created again.
+ */
+static PyObject * unpack_key(
+        const unsigned char * raw,
+        Py_ssize_t size,
+        unpack_options_t * options)
+{
+    PyObject * key;
+    keycache_t * keycache = &options->keycache;
+    keycache_entry_t * entry;
+    Py_ssize_t i;
+    uint32_t hash = 2166136261u;
+
+    if (keycache->entries == NULL)
+    {
+        if (keycache->seen < KEYCACHE_MIN_KEYS)
+        {
+            keycache->seen++;
+            return unpack_raw(raw, size, options);
+        }
+        keycache->cap = keycache->size < KEYCACHE_INIT_SZ
+                ? keycache->size
+                : KEYCACHE_INIT_SZ;
+        keycache->used = 0;
+        keycache->entries = (keycache_entry_t *) calloc(
+                keycache->cap,
+                sizeof(keycache_entry_t));
+        if (keycache->entries == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return NULL;
+        }
+    }
+
+    /* FNV-1a */
+    for (i = 0; i < size; i++)
+    {
+        hash = (hash ^ raw[i]) * 16777619u;
+    }
+
+    entry = &keycache->entries[hash & (keycache->cap - 1)];
+    if (entry->key != NULL &&
+        entry->hash == hash &&
+        entry->size == (uint32_t) size &&
+        memcmp(entry->raw, raw, size) == 0)
+    {
+        Py_INCREF(entry->key);
+        return entry->key;
+    }
+
+    key = unpack_raw(raw, size, options);
+    if (key != NULL)
+    {
+        /* grow instead of replacing a key while the cache is small */
+        if (keycache->cap < keycache->size &&
+            (entry->key != NULL || keycache->used * 2 >= keycache->cap))
+        {
+            keycache_grow(keycache);
+            entry = &keycache->entries[hash & (keycache->cap - 1)];
+        }
+        if (entry->key == NULL)
+        {
+            keycache->used++;
+        }
+        Py_XDECREF(entry->key);
+        Py_INCREF(key);
+        entry->key = key;
+        entry->hash = hash;
+        entry->size = (uint32_t) size;
+        memcpy(entry->raw, raw, size);
+    }
+    return key;
+}
+
+/*
+ * Returns a new dict for a record with `size` values of the template which
+ * is unpacked in `frame`, or NULL with PyErr set when the template has a
+ * different number of keys.
+ */
+static PyObject * unpack_record(unpack_frame_t * frame, Py_ssize_t size)
+{
+    if (size != PySequence_Fast_GET_SIZE(frame->key))
+    {
+        PyErr_SetString(
+                PyExc_ValueError,
+                "unpackb() found an invalid template");
+        return NULL;
+    }
+    return (size > 5) ? _PyDict_NewPresized(size) : PyDict_New();
+}
+
+/*
+ * Add `obj` to the column for `key`, which is the value at position `pos` in
+ * the current row. The columns are numbered in `index` until the columns
+ * are complete, which is the dict that unpackb() returns. Since the rows
+ * usually have the same keys in the same order, the column at `pos` is tried
+ * first.
+ */
+static int columns_add(
+        unpack_columns_t * columns,
+        PyObject * index,
+        PyObject * key,
+        Py_ssize_t pos,
+        PyObject * obj)
+{
+    unpack_column_t * column;
+    PyObject * o_i;
+    Py_ssize_t i;
+
+    if (pos < columns->len && columns->items[pos].key == key)
+    {
+        return column_set(
+                &columns->items[pos],
+                columns->rows,
+                columns->row,
+                obj);
+    }
+
+    o_i = PyDict_GetItem(index, key);
+    if (o_i != NULL)
+    {
+        i = PyNumber_AsSsize_t(o_i, NULL);
+        return column_set(
+                &columns->items[i],
+                columns->rows,
+                columns->row,
+                obj);
+    }
+
+    /* a new column, with None for each row before */
+    if (columns->len == columns->size)
+    {
+        Py_ssize_t sz = columns->size
+                ? columns->size * 2
+                : UNPACK_COLUMNS_INIT_SZ;
+        unpack_column_t * tmp = (unpack_column_t *) realloc(
+                columns->items,
+                sz * sizeof(unpack_column_t));
+        if (tmp == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return -1;
+        }
+        columns->items = tmp;
+        columns->size = sz;
+    }
+
+    o_i = PYLONG_FROMLONGLONG((long long) columns->len);
+    if (o_i == NULL || PyDict_SetItem(index, key, o_i))
+    {
+        Py_XDECREF(o_i);
+        return -1;  /* PyErr is set */
+    }
+    Py_DECREF(o_i);
+
+    column = &columns->items[columns->len++];
+    Py_INCREF(key);
+    column->key = key;
+    column->list = NULL;
+    column->numbers = NULL;
+    column->len = 0;
+    column->kind = UNPACK_COLUMN_EMPTY;
+
+    for (i = 0; i < columns->row; i++)
+    {
+        if (column_set(column, columns->rows, i, Py_None))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    return column_set(column, columns->rows, columns->row, obj);
+}
+
+/*
+ * Complete the current row; columns without a value for the row get None.
+ */
+static int columns_row_end(unpack_columns_t * columns)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < columns->len; i++)
+    {
+        unpack_column_t * column = &columns->items[i];
+        if (column->len == columns->row &&
+            column_set(column, columns->rows, columns->row, Py_None))
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    columns->row++;
+    return 0;
+}
+
+/*
+ * Replace the column numbers in `index` with the columns.
+ */
+static int columns_finish(
+        unpack_columns_t * columns,
+        PyObject * index,
+        unpack_options_t * options)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < columns->len; i++)
+    {
+        unpack_column_t * column = &columns->items[i];
+        PyObject * obj;
+        int rc;
+
+        switch (column->kind)
+        {
+        case UNPACK_COLUMN_INT:
+            obj = typed_array_new(
+                    (const unsigned char *) column->numbers,
+                    column->len * sizeof(int64_t),
+                    'q',
+                    &options->array_type);
+            break;
+        case UNPACK_COLUMN_DOUBLE:
+            obj = typed_array_new(
+                    (const unsigned char *) column->numbers,
+                    column->len * sizeof(double),
+                    'd',
+                    &options->array_type);
+            break;
+        default:
+            obj = column->list;
+            Py_INCREF(obj);
+        }
+
+        if (obj == NULL)
+        {
+            return -1;  /* PyErr is set */
+        }
+        rc = PyDict_SetItem(index, column->key, obj);
+        Py_DECREF(obj);
+        if (rc == -1)
+        {
+            return -1;  /* PyErr is set */
+        }
+    }
+    return 0;
+}
+
+static void columns_clear(unpack_columns_t * columns)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < columns->len; i++)
+    {
+        Py_DECREF(columns->items[i].key);
+        Py_XDECREF(columns->items[i].list);
+        free(columns->items[i].numbers);
+    }
+    free(columns->items);
+}
+
+/*
+ * Set the value of `column` for `row` to `obj`. A row has at most one value
+ * in a column, so the last value is used for a key which is repeated in a
+ * map. All values fit since the column is created for `rows` values.
+ */
+static int column_set(
+        unpack_column_t * column,
+        Py_ssize_t rows,
+        Py_ssize_t row,
+        PyObject * obj)
+{
+    if (column->len > row)
+    {
+        column->len = row;
+        if (column->kind == UNPACK_COLUMN_LIST)
+        {
+            Py_CLEAR(PySequence_Fast_ITEMS(column->list)[row]);
+        }
+    }
+
+    switch (column->kind)
+    {
+    case UNPACK_COLUMN_EMPTY:
+        if (UNPACK_COLUMN_INT_CHECK(obj) || PyFloat_CheckExact(obj))
+        {
+            column->numbers = (char *) malloc(rows * 8);
+            if (column->numbers == NULL)
+            {
+                PyErr_SetString(
+                        PyExc_MemoryError,
+                        "Memory allocation error");
+                return -1;
+            }
+            column->kind = PyFloat_CheckExact(obj)
+                    ? UNPACK_COLUMN_DOUBLE
+                    : UNPACK_COLUMN_INT;
+            return column_set(column, rows, row, obj);
+        }
+        column->list = PyList_New(rows);
+        if (column->list == NULL)
+        {
+            return -1;  /* PyErr is set */
+        }
+        column->kind = UNPACK_COLUMN_LIST;
+        break;
+    case UNPACK_COLUMN_INT:
+        if (UNPACK_COLUMN_INT_CHECK(obj))
+        {
+            /* integers in QPack data fit in an int64_t */
+            int64_t integer = (int64_t) PyLong_AsLongLong(obj);
+            memcpy(column->numbers + 8 * column->len++, &integer, 8);
+            return 0;
+        }
+        if (column_to_list(column, rows))
+        {
+            return -1;  /* PyErr is set */
+        }
+        break;
+    case UNPACK_COLUMN_DOUBLE:
+        if (PyFloat_CheckExact(obj))
+        {
+            double d = PyFloat_AS_DOUBLE(obj);
+            memcpy(column->numbers + 8 * column->len++, &d, 8);
+            return 0;
+        }
+        if (column_to_list(column, rows))
+        {
+            return -1;  /* PyErr is set */
+        }
+        break;
+    case UNPACK_COLUMN_LIST:
+        break;
+    }
+
+    Py_INCREF(obj);
+    PyList_SET_ITEM(column->list, column->len++, obj);
+    return 0;
+}
+
+/*
+ * Replace the numbers of an integer or float column with a list.
+ */
+static int column_to_list(unpack_column_t * column, Py_ssize_t rows)
+{
+    Py_ssize_t i;
+    PyObject * list = PyList_New(rows);
+
+    if (list == NULL)
+    {
+        return -1;  /* PyErr is set */
+    }
+
+    for (i = 0; i < column->len; i++)
+    {
+        PyObject * obj;
+        if (column->kind == UNPACK_COLUMN_INT)
+        {
+            int64_t integer;
+            memcpy(&integer, column->numbers + 8 * i, 8);
+            obj = PYLONG_FROMLONGLONG((long long) integer);
+        }
+        else
+        {
+            double d;
+            memcpy(&d, column->numbers + 8 * i, 8);
+            obj = PyFloat_FromDouble(d);
+        }
+        if (obj == NULL)
+        {
+            Py_DECREF(list);
+            return -1;  /* PyErr is set */
+        }
+        PyList_SET_ITEM(list, i, obj);
+    }
+
+    free(column->numbers);
+    column->numbers = NULL;
+    column->list = list;
+    column->kind = UNPACK_COLUMN_LIST;
+    return 0;
+}
+
+/*
+ * Keep a reference to `obj` for back-references.
+ */
+static int unpack_refs_add(
+        unpack_refs_t * refs,
+        PyObject * obj,
+        Py_ssize_t size)
+{
+    if (refs->len == refs->size)
+    {
+        Py_ssize_t sz = refs->size ? refs->size * 2 : UNPACK_REFS_INIT_SZ;
+        unpack_ref_t * tmp = (unpack_ref_t *) realloc(
+                refs->items,
+                sz * sizeof(unpack_ref_t));
+        if (tmp == NULL)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return -1;
+        }
+        refs->items = tmp;
+        refs->size = sz;
+    }
+    Py_INCREF(obj);
+    refs->items[refs->len].obj = obj;
+    refs->items[refs->len].size = size;
+    refs->len++;
+    return 0;
+}
+
+static void unpack_refs_clear(unpack_refs_t * refs)
+{
+    Py_ssize_t i;
+    for (i = 0; i < refs->len; i++)
+    {
+        Py_DECREF(refs->items[i].obj);
+    }
+    free(refs->items);
+}
+
+/*
+ * Add the raw data of a value which is unpacked to the dictionary, in the
+ * same order as the Packer does, see QP_DICT.
+ */
+static void unpack_dict_commit(unpack_dict_t * dict, unpack_refs_t * refs)
+{
+    Py_ssize_t i, index;
+
+    for (i = 0; dict->size && i < refs->len; i++)
+    {
+        if (refs->items[i].size > QP_DICT_MAX_SZ)
+        {
+            continue;
+        }
+        index = dict->n_static + dict->next % dict->size;
+        Py_XDECREF(dict->objs[index]);
+        Py_INCREF(refs->items[i].obj);
+        dict->objs[index] = refs->items[i].obj;
+        dict->next++;
+    }
+}
+
+static void unpack_dict_clear(unpack_dict_t * dict)
+{
+    Py_ssize_t i;
+    for (i = 0; dict->objs != NULL && i < dict->n_static + dict->size; i++)
+    {
+        Py_XDECREF(dict->objs[i]);
+    }
+    free(dict->objs);
+    memset(dict, 0, sizeof(unpack_dict_t));
+}
+
+/*
+ * Returns a tuple with the raw data of the `dictionary` keyword argument of
+ * a Packer or Unpacker, and sets `size` to `dictionary_size`. A str is
+ * encoded to UTF-8, the same as when it is packed.
+ */
+static PyObject * dict_strings(
+        PyObject * kwargs,
+        const char * name,
+        Py_ssize_t default_size,
+        Py_ssize_t * size)
+{
+    PyObject * o_dictionary;
+    PyObject * o_size;
+    PyObject * seq;
+    PyObject * strings;
+    Py_ssize_t i, n;
+
+    o_dictionary = kwargs ? PyDict_GetItemString(kwargs, "dictionary") : NULL;
+    o_size = kwargs ? PyDict_GetItemString(kwargs, "dictionary_size") : NULL;
+
+    *size = default_size;
+    if (o_size != NULL && o_size != Py_None)
+    {
+        *size = PyNumber_AsSsize_t(o_size, PyExc_OverflowError);
+        if (*size == -1 && PyErr_Occurred())
+        {
+            return NULL;  /* PyErr is set */
+        }
+        if (*size < 0 || *size > DICT_MAX_SZ)
+        {
+            PyErr_Format(
+                    PyExc_ValueError,
+                    "%s() dictionary_size must be between 0 and 1048576",
+                    name);
+            return NULL;
+        }
+    }
+
+    if (o_dictionary == NULL || o_dictionary == Py_None)
+    {
+        return PyTuple_New(0);
+    }
+
+    seq = PySequence_Fast(o_dictionary, "dictionary must be a sequence");
+    if (seq == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n > DICT_MAX_SZ)
+    {
+        Py_DECREF(seq);
+        PyErr_Format(
+                PyExc_ValueError,
+                "%s() dictionary has more than 1048576 strings",
+                name);
+        return NULL;
+    }
+
+    strings = PyTuple_New(n);
+    if (strings == NULL)
+    {
+        Py_DECREF(seq);
+        return NULL;  /* PyErr is set */
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        PyObject * o = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject * raw;
+
+        if (PyUnicode_Check(o))
+        {
+            raw = PyUnicode_AsUTF8String(o);
+            if (raw == NULL)
+            {
+                goto failed;  /* PyErr is set */
+            }
+        }
+        else if (PyBytes_Check(o))
+        {
+            Py_INCREF(o);
+            raw = o;
+        }
+        else
+        {
+            PyErr_Format(
+                    PyExc_TypeError,
+                    "%s() dictionary must hold str or bytes objects",
+                    name);
+            goto failed;
+        }
+
+        PyTuple_SET_ITEM(strings, i, raw);
+        if (PyBytes_GET_SIZE(raw) > QP_DICT_MAX_SZ)
+        {
+            PyErr_Format(
+                    PyExc_ValueError,
+                    "%s() dictionary strings must be at most 64 bytes",
+                    name);
+            goto failed;
+        }
+    }
+
+    Py_DECREF(seq);
+    return strings;
+
+failed:
+    Py_DECREF(seq);
+    Py_DECREF(strings);
+    return NULL;
+}
+
+/*
+ * Returns a read-only memoryview on the raw data at `pt`. The memoryview
+ * keeps a reference to the source so no data is copied.
+ */
+static PyObject * unpack_raw_view(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options)
+{
+    Py_ssize_t start;
+
+    if (options->source == NULL)
+    {
+        /* no source object to refer to */
+        return PyBytes_FromStringAndSize((const char *) pt, size);
+    }
+
+#if PY_MAJOR_VERSION < 3
+    if (!PyBytes_Check(options->source))
+    {
+        /* on Python 2 a slice gets a new buffer from the source, which is
+         * writable for a bytearray, and mmap has no new buffer interface,
+         * so the view is on a copy of the data */
+        PyObject * view;
+        PyObject * copy = PyBytes_FromStringAndSize((const char *) pt, size);
+        if (copy == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+        view = PyMemoryView_FromObject(copy);
+        Py_DECREF(copy);
+        return view;
+    }
+#endif
+
+    if (options->view == NULL)
+    {
+        PyObject * view = PyMemoryView_FromObject(options->source);
+        if (view == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+
+#if PY_MAJOR_VERSION >= 3
+        {
+            PyObject * tmp = PyObject_CallMethod(view, "cast", "s", "B");
+            Py_DECREF(view);
+            if (tmp == NULL)
+            {
+                return NULL;  /* PyErr is set */
+            }
+            view = tmp;
+        }
 #endif
+
+        /* the view is new and not shared, so it can be made read-only the
+         * same as memoryview.toreadonly() does, which is new in Python 3.8;
+         * slices keep this flag */
+        PyMemoryView_GET_BUFFER(view)->readonly = 1;
+        options->view = view;
+    }
+
+    start = pt - options->base;
+    return PySequence_GetSlice(options->view, start, start + size);
+}
+
+/*
+ * Unpack raw data which is not a map key, as a memoryview when raw_as_view
+ * applies to its size. Map keys are always bytes or str.
+ */
+static PyObject * unpack_raw_value(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unpack_options_t * options)
+{
+    return (options->decode == DECODE_NONE &&
+            size >= options->view_min_size)
+        ? unpack_raw_view(pt, size, options)
+        : unpack_raw(pt, size, options);
+}
+
+/*
+ * Create an array.array, or a memoryview when raw_as_view applies to the
+ * size of the data, for the typed array data at `pt`.
+ */
+static PyObject * unpack_typed(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unsigned char fmt,
+        unpack_options_t * options)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject * obj;
+    PyObject * tmp;
+    char typecode[2] = {(char) fmt, '\0'};
+
+    if (size >= options->view_min_size && options->source != NULL)
+    {
+        tmp = unpack_raw_view(pt, size, options);
+        if (tmp == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+        obj = PyObject_CallMethod(tmp, "cast", "s", typecode);
+        Py_DECREF(tmp);
         return obj;
+    }
+#endif
+
+    return typed_array_new(pt, size, fmt, &options->array_type);
+}
+
+/*
+ * Create an array.array with format `fmt` and a copy of the `size` bytes at
+ * `pt`. The array type is looked up on first use and kept in `*array_type`
+ * by the caller, instead of in a static variable, since each
+ * (sub-)interpreter has its own array module.
+ */
+static PyObject * typed_array_new(
+        const unsigned char * pt,
+        Py_ssize_t size,
+        unsigned char fmt,
+        PyObject ** array_type)
+{
+    PyObject * obj;
+    PyObject * tmp;
+    char typecode[2] = {(char) fmt, '\0'};
+
+#if PY_MAJOR_VERSION < 3
+    /* array.array has no 'q' and 'Q' on Python 2 */
+    if (sizeof(long) == 8 && (fmt == 'q' || fmt == 'Q'))
+    {
+        typecode[0] = (fmt == 'q') ? 'l' : 'L';
+    }
+#endif
+
+    if (*array_type == NULL)
+    {
+        PyObject * module = PyImport_ImportModule("array");
+        if (module == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+        *array_type = PyObject_GetAttrString(module, "array");
+        Py_DECREF(module);
+        if (*array_type == NULL)
+        {
+            return NULL;  /* PyErr is set */
+        }
+    }
+
+    obj = PyObject_CallFunction(*array_type, "s", typecode);
+    if (obj == NULL)
+    {
+        return NULL;  /* PyErr is set */
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    /* copy the data only once, directly into the array */
+    tmp = PyMemoryView_FromMemory((char *) pt, size, PyBUF_READ);
+    if (tmp == NULL)
+    {
+        Py_DECREF(obj);
+        return NULL;  /* PyErr is set */
+    }
+    tmp = PyObject_CallMethod(obj, "frombytes", "N", tmp);
+#else
+    tmp = PyObject_CallMethod(obj, "fromstring", "s#", pt, size);
+#endif
+    if (tmp == NULL)
+    {
+        Py_DECREF(obj);
+        return NULL;  /* PyErr is set */
+    }
+    Py_DECREF(tmp);
+    return obj;
+}
+
+/*
+ * Scan from `scanner->pos` until a value is complete, or until the end of
+ * `data` completes the value. The first SCAN_NOGIL_SZ bytes are scanned while
+ * holding the GIL so small values do not pay for releasing it; the GIL is
+ * released to scan the rest of a larger value.
+ */
+static qp_scan_rc_t scanner_scan(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len)
+{
+    qp_scan_rc_t rc;
 
-    case 124:
-        /* This is actually reserved for an object hook but
-         * return None as this is not implemented yet */
-        Py_INCREF(Py_None);
-        return Py_None;
+    if (len - scanner->pos > SCAN_NOGIL_SZ)
+    {
+        rc = qp_scanner_run(scanner, data, scanner->pos + SCAN_NOGIL_SZ);
+        if (rc == QP_SCAN_MORE)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            rc = qp_scanner_run(scanner, data, len);
+            Py_END_ALLOW_THREADS
+        }
+    }
+    else
+    {
+        rc = qp_scanner_run(scanner, data, len);
+    }
 
-    case 125:
-        obj = PyFloat_FromDouble(-1.0);
-        return obj;
+    if (rc == QP_SCAN_MORE && qp_scanner_at_end(scanner, len))
+    {
+        rc = QP_SCAN_DONE;
+    }
+    return rc;
+}
 
-    case 126:
-        obj = PyFloat_FromDouble(0.0);
-        return obj;
+/*
+ * Set PyErr for a scan error. The position is reported relative to `start`.
+ */
+static void scanner_set_err(qp_scanner_t * scanner, Py_ssize_t start)
+{
+    Py_ssize_t pos = scanner->pos - start;
 
-    case 127:
-        obj = PyFloat_FromDouble(1.0);
-        return obj;
+    switch (scanner->err)
+    {
+    case QP_SCAN_ERR_CLOSE:
+        PyErr_Format(
+                PyExc_ValueError,
+                "unexpected array or map close character at position %zd",
+                pos);
+        break;
+    case QP_SCAN_ERR_DEPTH:
+        PyErr_Format(
+                PyExc_ValueError,
+                "data exceeds the maximum depth at position %zd",
+                pos);
+        break;
+    case QP_SCAN_ERR_RAW_SIZE:
+        PyErr_Format(
+                PyExc_ValueError,
+                "raw size is too large at position %zd",
+                pos);
+        break;
+    case QP_SCAN_ERR_TYPED:
+        PyErr_Format(
+                PyExc_ValueError,
+                "invalid typed array at position %zd",
+                pos);
+        break;
+    case QP_SCAN_ERR_MEMORY:
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        break;
+    case QP_SCAN_ERR_REF:
+        PyErr_Format(
+                PyExc_ValueError,
+                "invalid back-reference at position %zd",
+                pos);
+        break;
+    case QP_SCAN_ERR_TEMPLATE:
+        PyErr_Format(
+                PyExc_ValueError,
+                "invalid template at position %zd",
+                pos);
+        break;
+    }
+}
 
-    case 128:
-    case 129:
-    case 130:
-    case 131:
-    case 132:
-    case 133:
-    case 134:
-    case 135:
-    case 136:
-    case 137:
-    case 138:
-    case 139:
-    case 140:
-    case 141:
-    case 142:
-    case 143:
-    case 144:
-    case 145:
-    case 146:
-    case 147:
-    case 148:
-    case 149:
-    case 150:
-    case 151:
-    case 152:
-    case 153:
-    case 154:
-    case 155:
-    case 156:
-    case 157:
-    case 158:
-    case 159:
-    case 160:
-    case 161:
-    case 162:
-    case 163:
-    case 164:
-    case 165:
-    case 166:
-    case 167:
-    case 168:
-    case 169:
-    case 170:
-    case 171:
-    case 172:
-    case 173:
-    case 174:
-    case 175:
-    case 176:
-    case 177:
-    case 178:
-    case 179:
-    case 180:
-    case 181:
-    case 182:
-    case 183:
-    case 184:
-    case 185:
-    case 186:
-    case 187:
-    case 188:
-    case 189:
-    case 190:
-    case 191:
-    case 192:
-    case 193:
-    case 194:
-    case 195:
-    case 196:
-    case 197:
-    case 198:
-    case 199:
-    case 200:
-    case 201:
-    case 202:
-    case 203:
-    case 204:
-    case 205:
-    case 206:
-    case 207:
-    case 208:
-    case 209:
-    case 210:
-    case 211:
-    case 212:
-    case 213:
-    case 214:
-    case 215:
-    case 216:
-    case 217:
-    case 218:
-    case 219:
-    case 220:
-    case 221:
-    case 222:
-    case 223:
-    case 224:
-    case 225:
-    case 226:
-    case 227:
+/*
+ * Scan the value at `*offset` in `view` and set the offset to the end of the
+ * value. The GIL is released while scanning large data. A value with
+ * back-references or templates is scanned again with a tape to check these
+ * the same as unpackb(). Returns -1 and sets PyErr when the value is invalid
+ * or incomplete.
+ */
+static int scan_view(
+        Py_buffer * view,
+        Py_ssize_t * offset,
+        Py_ssize_t max_depth)
+{
+    qp_scanner_t scanner = {0};
+    qp_scan_rc_t rc;
+    const unsigned char * data = (const unsigned char *) view->buf;
+
+    scanner.max_depth = max_depth;
+    scanner.pos = *offset;
+
+    rc = scanner_scan(&scanner, data, view->len);
+
+    if (rc == QP_SCAN_DONE && (scanner.refs || scanner.templates))
+    {
+        qp_token_t stack[QP_TAPE_STACK_SZ];
+        qp_tape_t tape;
+        Py_ssize_t end = scanner.pos;
+
+        qp_tape_init(&tape, stack);
+        scanner.tape = &tape;
+        qp_scanner_reset(&scanner);
+        scanner.pos = *offset;
+        rc = scanner_scan(&scanner, data, end);
+        if (rc == QP_SCAN_DONE)
+        {
+            rc = qp_scanner_check(&scanner, data);
+            if (rc == QP_SCAN_DONE)
+            {
+                scanner.pos = end;
+            }
+        }
+        qp_tape_free(&tape);
+    }
+
+    switch (rc)
+    {
+    case QP_SCAN_DONE:
+        *offset = scanner.pos;
+        break;
+    case QP_SCAN_MORE:
+        PyErr_Format(
+                PyExc_ValueError,
+                "missing data at position %zd",
+                scanner.pos);
+        break;
+    case QP_SCAN_ERROR:
+        scanner_set_err(&scanner, 0);
+        break;
+    }
+
+    free(scanner.frames);
+    return (rc == QP_SCAN_DONE) ? 0 : -1;
+}
+
+/*
+ * Skip the value at `*pos` and set `*pos` to the end of the value. When the
+ * end of the data closes the value, `*pos` is set to `len`. The
+ * back-references of the skipped values are counted in `scanner->refs`.
+ */
+static get_rc_t get_skip(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        Py_ssize_t * pos)
+{
+    qp_ssize_t refs = scanner->refs;
+    qp_scan_rc_t rc;
+
+    qp_scanner_reset(scanner);
+    scanner->pos = *pos;
+    rc = qp_scanner_run(scanner, data, len);
+    scanner->refs += refs;
+
+    switch (rc)
+    {
+    case QP_SCAN_DONE:
+        *pos = scanner->pos;
+        return GET_FOUND;
+    case QP_SCAN_MORE:
+        if (qp_scanner_at_end(scanner, len))
         {
-            Py_ssize_t size = tp - 128;
-            UNPACK_RAW(size, options)
-        }
-    case 228:
-        UNPACK_FIXED_RAW(uint8_t, options)
-    case 229:
-        UNPACK_FIXED_RAW(uint16_t, options)
-    case 230:
-        UNPACK_FIXED_RAW(uint32_t, options)
-    case 231:
-        UNPACK_FIXED_RAW(uint64_t, options)
-
-    case 232:
-        UNPACK_INT(int8_t)
-    case 233:
-        UNPACK_INT(int16_t)
-    case 234:
-        UNPACK_INT(int32_t)
-    case 235:
-        UNPACK_INT(int64_t)
-
-    case 236:
-        UNPACK_CHECK_SZ(sizeof(double))
+            *pos = len;
+            return GET_FOUND;
+        }
+        return GET_INCOMPLETE;
+    case QP_SCAN_ERROR:
+        break;
+    }
+    return GET_ERROR;
+}
+
+/*
+ * Walk the `n` path items in `steps` from the start of `data`. On GET_FOUND,
+ * `scanner->pos` is the offset of the value. On GET_MISSING_KEY or
+ * GET_MISSING_INDEX, `*step` is the path item which is not found, and on
+ * GET_TEMPLATE it is the path item for the template. The back-references
+ * which are found before and in the value are counted in `scanner->refs`.
+ * When a map has the same key more than once, the last value is used, the
+ * same as for unpackb(). No Python API is used so this can run without the
+ * GIL.
+ */
+static get_rc_t get_walk(
+        qp_scanner_t * scanner,
+        const unsigned char * data,
+        Py_ssize_t len,
+        get_step_t * steps,
+        Py_ssize_t n,
+        Py_ssize_t * step)
+{
+    Py_ssize_t max_depth = scanner->max_depth;
+    Py_ssize_t pos = 0;
+    Py_ssize_t match = -1;
+    Py_ssize_t end;
+    Py_ssize_t i;
+    qp_ssize_t refs = 0;
+    get_rc_t rc;
+
+    for (i = 0; i < n; i++)
+    {
+        get_step_t * s = steps + i;
+        Py_ssize_t count, j;
+        unsigned char tp;
+
+        *step = i;
+
+        if (pos >= len)
         {
-            double d;
-            memcpy(&d, *pt, sizeof(double));
-            obj = PyFloat_FromDouble(d);
+            scanner->pos = pos;
+            return GET_INCOMPLETE;
+        }
+
+        tp = data[pos];
+
+        if (tp >= QP_ARRAY0 && tp <= QP_ARRAY5)
+        {
+            count = tp - QP_ARRAY0;
+        }
+        else if (tp >= QP_MAP0 && tp <= QP_MAP5)
+        {
+            count = tp - QP_MAP0;
+        }
+        else if (tp == QP_ARRAY_OPEN || tp == QP_MAP_OPEN)
+        {
+            count = -1;
+        }
+        else if (tp == QP_HOOK && pos + 1 < len &&
+                data[pos + 1] == QP_TEMPLATE)
+        {
+            /* the records are unpacked with the keys of the template */
+            return GET_TEMPLATE;
+        }
+        else
+        {
+            /* not an array or map */
+            return GET_MISSING_KEY;
+        }
+
+        if (i == max_depth)
+        {
+            scanner->pos = pos;
+            scanner->err = QP_SCAN_ERR_DEPTH;
+            return GET_ERROR;
+        }
+
+        /* values inside this container can be nested this deep */
+        scanner->max_depth = max_depth - i - 1;
+        pos++;
+
+        if (tp <= QP_ARRAY5 || tp == QP_ARRAY_OPEN)
+        {
+            if (!s->is_int)
+            {
+                return GET_MISSING_KEY;
+            }
+
+            for (j = 0;; j++)
+            {
+                if (j == count)
+                {
+                    return GET_MISSING_INDEX;
+                }
+                if (pos >= len)
+                {
+                    if (count != -1)
+                    {
+                        scanner->pos = pos;
+                        return GET_INCOMPLETE;
+                    }
+                    /* the end of the data closes an open array */
+                    return GET_MISSING_INDEX;
+                }
+                if (count == -1 && data[pos] == QP_ARRAY_CLOSE)
+                {
+                    return GET_MISSING_INDEX;
+                }
+                if (j == s->integer)
+                {
+                    break;
+                }
+                if ((rc = get_skip(scanner, data, len, &pos)) != GET_FOUND)
+                {
+                    return rc;
+                }
+            }
+            continue;
         }
-        (*pt) += sizeof(double);
-        return obj;
 
-    case 237:
-    case 238:
-    case 239:
-    case 240:
-    case 241:
-    case 242:
+        match = -1;
+        for (j = 0;; j++)
         {
-            PyObject * o;
-            Py_ssize_t size = tp - 237;
-            if (options->use_tuples)
+            Py_ssize_t start = pos;
+            int found = 0;
+
+            if (j == count)
+            {
+                break;
+            }
+            if (pos >= len)
+            {
+                if (count != -1)
+                {
+                    scanner->pos = pos;
+                    return GET_INCOMPLETE;
+                }
+                /* the end of the data closes an open map */
+                break;
+            }
+            if (count == -1 && data[pos] == QP_MAP_CLOSE)
+            {
+                break;
+            }
+
+            if ((rc = get_skip(scanner, data, len, &pos)) != GET_FOUND)
+            {
+                return rc;
+            }
+
+            tp = data[start];
+
+            if (s->is_int)
             {
-                obj = PyTuple_New(size);
-                if (obj != NULL)
+                int64_t key;
+                found = 1;
+                switch ((qp_types_t) tp)
                 {
-                    Py_ssize_t i;
-                    for (i = 0; i < size; i++)
+                case QP_INT8:
+                    key = (int8_t) data[start + 1];
+                    break;
+                case QP_INT16:
                     {
-                        o = unpackb(pt, end, options);
+                        int16_t i16;
+                        memcpy(&i16, data + start + 1, sizeof(int16_t));
+                        key = i16;
+                    }
+                    break;
+                case QP_INT32:
+                    {
+                        int32_t i32;
+                        memcpy(&i32, data + start + 1, sizeof(int32_t));
+                        key = i32;
+                    }
+                    break;
+                case QP_INT64:
+                    memcpy(&key, data + start + 1, sizeof(int64_t));
+                    break;
+                default:
+                    /* positive and negative fixed integers */
+                    key = (tp < 64) ? tp : 63 - tp;
+                    found = tp < QP_HOOK;
+                }
+                found = found && key == s->integer;
+            }
+            else if (tp >= 128 && tp <= QP_RAW64)
+            {
+                start += qp_raw_header_size(tp);
+                found = (
+                    pos - start == s->size &&
+                    memcmp(data + start, s->raw, s->size) == 0);
+            }
+            if (found)
+            {
+                /* a later value for the same key replaces this one, the
+                 * back-references after it do not count */
+                match = pos;
+                refs = scanner->refs;
+            }
+            if (pos >= len)
+            {
+                /* the key is closed by the end of the data */
+                break;
+            }
+            if ((rc = get_skip(scanner, data, len, &pos)) != GET_FOUND)
+            {
+                return rc;
+            }
+        }
+        if (match == -1)
+        {
+            return GET_MISSING_KEY;
+        }
+        pos = match;
+        scanner->refs = refs;
+    }
+
+    /* only count the back-references in the value, an invalid value is
+     * reported when it is unpacked */
+    end = pos;
+    (void) get_skip(scanner, data, len, &end);
+
+    scanner->pos = pos;
+    return GET_FOUND;
+}
+
+/*
+ * Used by get() for data with back-references, which might point to raw
+ * data anywhere before the value, and for a template on the path. The value
+ * at the start of `view` is unpacked and the path is walked on the Python
+ * objects. Returns GET_ERROR
+ * with PyErr set on an error.
+ */
+static get_rc_t get_refs(
+        Py_buffer * view,
+        get_step_t * steps,
+        Py_ssize_t n,
+        unpack_options_t * options,
+        Py_ssize_t * step,
+        PyObject ** value)
+{
+    Py_ssize_t i;
+    Py_ssize_t offset = 0;
+    PyObject * obj = unpack_view(view, &offset, options);
+    PyObject * item;
+    PyObject * key;
+    get_rc_t rc = GET_FOUND;
+
+    if (obj == NULL)
+    {
+        return GET_ERROR;  /* PyErr is set */
+    }
+
+    for (i = 0; i < n && rc == GET_FOUND; i++)
+    {
+        get_step_t * s = steps + i;
+        *step = i;
+
+        if (PyDict_Check(obj))
+        {
+            /* the key is created the same as the keys of the map */
+            if (s->is_int)
+            {
+                key = s->obj;
+                Py_INCREF(key);
+            }
+            else if (options->decode == DECODE_NONE)
+            {
+                key = PyBytes_FromStringAndSize(s->raw, s->size);
+            }
+            else
+            {
+                key = unpack_raw(
+                        (const unsigned char *) s->raw,
+                        s->size,
+                        options);
+            }
+            if (key == NULL)
+            {
+                rc = GET_ERROR;  /* PyErr is set */
+                break;
+            }
+            item = PyDict_GetItem(obj, key);
+            Py_DECREF(key);
+            rc = (item == NULL) ? GET_MISSING_KEY : GET_FOUND;
+        }
+        else if (PyList_Check(obj) || PyTuple_Check(obj))
+        {
+            rc = !s->is_int
+                ? GET_MISSING_KEY
+                : (s->integer < 0 ||
+                   s->integer >= PySequence_Fast_GET_SIZE(obj))
+                ? GET_MISSING_INDEX
+                : GET_FOUND;
+            item = (rc == GET_FOUND)
+                ? PySequence_Fast_ITEMS(obj)[s->integer]
+                : NULL;
+        }
+        else
+        {
+            rc = GET_MISSING_KEY;
+            item = NULL;
+        }
+
+        if (item != NULL)
+        {
+            Py_INCREF(item);
+            Py_DECREF(obj);
+            obj = item;
+        }
+    }
 
-                        if (o == NULL || Py_QPackCHECK(o))
-                        {
-                            SET_UNEXPECTED(o)
-                            Py_DECREF(obj);
-                            return NULL;
-                        }
+    if (rc == GET_FOUND)
+    {
+        *value = obj;
+        return rc;
+    }
+    Py_DECREF(obj);
+    return rc;
+}
 
-                        PyTuple_SET_ITEM(obj, i, o);
-                    }
-                }
-            }
-            else
-            {
-                obj = PyList_New(size);
-                if (obj != NULL)
-                {
-                    Py_ssize_t i;
-                    for (i = 0; i < size; i++)
-                    {
-                        o = unpackb(pt, end, options);
+static int unpacker_init(unpacker_t * self, PyObject * args, PyObject * kwargs)
+{
+    PyObject * o_dictionary;
+    PyObject * o_size;
 
-                        if (o == NULL || Py_QPackCHECK(o))
-                        {
-                            SET_UNEXPECTED(o)
-                            Py_DECREF(obj);
-                            return NULL;
-                        }
+    if (PyTuple_GET_SIZE(args))
+    {
+        PyErr_SetString(
+                PyExc_TypeError,
+                "Unpacker() takes keyword arguments only");
+        return -1;
+    }
 
-                        PyList_SET_ITEM(obj, i, o);
-                    }
-                }
-            }
-            return obj;
-        }
-    case 243:
-    case 244:
-    case 245:
-    case 246:
-    case 247:
-    case 248:
-        {
-            int rc;
-            PyObject * key;
-            PyObject * value;
-            Py_ssize_t size = tp - 243;
-            obj = PyDict_New();
-            if (obj != NULL)
-            {
-                while (size--)
-                {
-                    key = unpackb(pt, end, options);
+    self->options.decode = DECODE_NONE;
+    self->options.ignore_decode_errors = 0;
+    self->options.use_tuples = 0;
 
-                    if (key == NULL || Py_QPackCHECK(key))
-                    {
-                        SET_UNEXPECTED(key)
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                    else if (PyUnicode_CheckExact(key))
-                    {
-                        PyUnicode_InternInPlace(&key);
-                    }
+    self->pos = 0;
+    self->len = 0;
+    self->scanner.tape = &self->tape;
+    qp_scanner_reset(&self->scanner);
+    unpack_dict_clear(&self->dict);
+    keycache_clear(&self->options.keycache);
+    Py_CLEAR(self->options.array_type);
 
-                    value = unpackb(pt, end, options);
+    if (unpack_options_init(&self->options, kwargs))
+    {
+        return -1;  /* PyErr is set */
+    }
 
-                    if (value == NULL || Py_QPackCHECK(value))
-                    {
-                        SET_UNEXPECTED(value)
-                        Py_DECREF(key);
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
+    /* the cache is kept between values so every key is cached */
+    self->options.keycache.seen = KEYCACHE_MIN_KEYS;
 
-                    rc = PyDict_SetItem(obj, key, value);
+    if (self->options.view_min_size != PY_SSIZE_T_MAX)
+    {
+        /* the internal buffer is re-used so views are not possible */
+        PyErr_SetString(
+                PyExc_ValueError,
+                "Unpacker() does not support raw_as_view");
+        return -1;
+    }
 
-                    Py_DECREF(key);
-                    Py_DECREF(value);
+    self->scanner.max_depth = self->options.max_depth;
 
-                    if (rc == -1)
-                    {
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                }
-            }
-            return obj;
-        }
-    case 249:
-        Py_INCREF(Py_True);
-        return Py_True;
+    /* the Unpacker has a dictionary when one of the arguments is given */
+    o_dictionary = kwargs ? PyDict_GetItemString(kwargs, "dictionary") : NULL;
+    o_size = kwargs ? PyDict_GetItemString(kwargs, "dictionary_size") : NULL;
+    if ((o_dictionary != NULL && o_dictionary != Py_None) ||
+        (o_size != NULL && o_size != Py_None))
+    {
+        return unpacker_dict_init(self, kwargs);
+    }
+    return 0;
+}
+
+/*
+ * Create the objects for the preloaded strings of the dictionary, the same
+ * as when they are unpacked.
+ */
+static int unpacker_dict_init(unpacker_t * self, PyObject * kwargs)
+{
+    unpack_dict_t * dict = &self->dict;
+    PyObject * strings;
+    Py_ssize_t i, n, size;
 
-    case 250:
-        Py_INCREF(Py_False);
-        return Py_False;
+    strings = dict_strings(kwargs, "Unpacker", DICT_DEFAULT_SZ, &size);
+    if (strings == NULL)
+    {
+        return -1;  /* PyErr is set */
+    }
 
-    case 251:
-        Py_INCREF(Py_None);
-        return Py_None;
+    n = PyTuple_GET_SIZE(strings);
+    dict->objs = (PyObject **) calloc(n + size + 1, sizeof(PyObject *));
+    if (dict->objs == NULL)
+    {
+        Py_DECREF(strings);
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        return -1;
+    }
+    dict->n_static = n;
+    dict->size = size;
 
-    case 252:
+    for (i = 0; i < n; i++)
+    {
+        PyObject * raw = PyTuple_GET_ITEM(strings, i);
+        dict->objs[i] = unpack_raw(
+                (const unsigned char *) PyBytes_AS_STRING(raw),
+                PyBytes_GET_SIZE(raw),
+                &self->options);
+        if (dict->objs[i] == NULL)
         {
-            int rc;
-            PyObject * o;
-            obj = PyList_New(0);
-            if (obj != NULL)
-            {
-                while (*pt < end)
-                {
-                    o = unpackb(pt, end, options);
+            Py_DECREF(strings);
+            return -1;  /* PyErr is set */
+        }
+    }
 
-                    if (o == NULL || o == &PY_MAP_CLOSE)
-                    {
-                        SET_UNEXPECTED(o)
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                    else if (o == &PY_ARRAY_CLOSE)
-                    {
-                        break;
-                    }
+    Py_DECREF(strings);
+    self->options.dict = dict;
+    return 0;
+}
 
-                    rc = PyList_Append(obj, o);
+static void unpacker_dealloc(unpacker_t * self)
+{
+    PyTypeObject * tp = Py_TYPE(self);
+
+    unpack_dict_clear(&self->dict);
+    keycache_clear(&self->options.keycache);
+    Py_XDECREF(self->options.array_type);
+    free(self->buffer);
+    free(self->scanner.frames);
+    qp_tape_free(&self->tape);
+    tp->tp_free((PyObject *) self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* instances of a heap type own a reference to their type */
+    Py_DECREF(tp);
+#endif
+}
 
-                    Py_DECREF(o);
+static PyObject * unpacker_feed(unpacker_t * self, PyObject * data)
+{
+    PyObject * ret;
+    LOCKED_CALL(ret, self, unpacker_do_feed(self, data))
+    return ret;
+}
 
-                    if (rc == -1)
-                    {
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                }
-            }
-            if (options->use_tuples)
-            {
-                o = PyList_AsTuple(obj);
-                Py_DECREF(obj);
-                return o;
-            }
-            return obj;
-        }
-    case 253:
-        {
-            int rc;
-            PyObject * key;
-            PyObject * value = NULL;
-            obj = PyDict_New();
-            if (obj != NULL)
-            {
-                while (*pt < end)
-                {
-                    key = unpackb(pt, end, options);
+static PyObject * unpacker_next(unpacker_t * self)
+{
+    PyObject * ret;
+    LOCKED_CALL(ret, self, unpacker_do_next(self))
+    return ret;
+}
 
-                    if (key == NULL || key == &PY_ARRAY_CLOSE)
-                    {
-                        SET_UNEXPECTED(key)
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                    else if (key == &PY_MAP_CLOSE)
-                    {
-                        break;
-                    }
-                    else if (PyUnicode_CheckExact(key))
-                    {
-                        PyUnicode_InternInPlace(&key);
-                    }
+static PyObject * unpacker_do_feed(unpacker_t * self, PyObject * data)
+{
+    Py_buffer view;
 
-                    value = unpackb(pt, end, options);
+    if (get_read_buffer(data, &view) == -1)
+    {
+        return NULL;  /* PyErr is set */
+    }
 
-                    if (value == NULL || Py_QPackCHECK(value))
-                    {
-                        SET_UNEXPECTED(value)
-                        Py_DECREF(key);
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
+    if (self->len + view.len > self->size && self->pos)
+    {
+        Py_ssize_t i;
 
-                    rc = PyDict_SetItem(obj, key, value);
+        /* compact, the consumed data will never be used again */
+        for (i = 0; i < self->tape.len; i++)
+        {
+            self->tape.tokens[i].pos -= self->pos;
+        }
+        self->len -= self->pos;
+        self->scanner.pos -= self->pos;
+        memmove(self->buffer, self->buffer + self->pos, self->len);
+        self->pos = 0;
+    }
 
-                    Py_DECREF(key);
-                    Py_DECREF(value);
+    if (self->len + view.len > self->size)
+    {
+        unsigned char * tmp;
+        Py_ssize_t size = self->size ? self->size : UNPACKER_INIT_SZ;
 
-                    if (rc == -1)
-                    {
-                        Py_DECREF(obj);
-                        return NULL;
-                    }
-                }
-            }
-            return obj;
+        while (size < self->len + view.len)
+        {
+            size *= 2;
         }
-    case 254:
-        return &PY_ARRAY_CLOSE;
-    case 255:
-        return &PY_MAP_CLOSE;
 
+        tmp = (unsigned char *) realloc(self->buffer, size);
+        if (tmp == NULL)
+        {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+            return NULL;
+        }
+        self->buffer = tmp;
+        self->size = size;
     }
 
-    return NULL;
+    memcpy(self->buffer + self->len, view.buf, view.len);
+    self->len += view.len;
+
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
 }
 
-static PyObject * _qpack_packb(
-        PyObject * self,
-        PyObject * args,
-        PyObject * kwargs)
+static PyObject * unpacker_do_next(unpacker_t * self)
 {
-    PyObject * packed;
     PyObject * obj;
-    Py_ssize_t size;
-    packer_t * packer;
 
-    packer = packer_new();
-    if (packer == NULL)
+    switch (qp_scanner_run(&self->scanner, self->buffer, self->len))
     {
-        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+    case QP_SCAN_DONE:
+        break;
+    case QP_SCAN_MORE:
+        return NULL;  /* StopIteration */
+    case QP_SCAN_ERROR:
+        scanner_set_err(&self->scanner, self->pos);
         return NULL;
     }
 
-    size = PyTuple_GET_SIZE(args);
-
-    if (size != 1)
+    /* with a dictionary, the raw data is kept to add it to the dictionary */
+    self->options.refs = (
+            self->scanner.refs != 0 ||
+            self->options.dict != NULL);
+    obj = unpackb(self->buffer, &self->tape, &self->options);
+    self->tape.len = 0;
+    self->scanner.refs = 0;
+
+    /* the value is consumed, also when it has failed to unpack */
+    self->pos = self->scanner.pos;
+    if (self->pos == self->len)
     {
-        PyErr_SetString(
-                PyExc_TypeError,
-                "packb() missing 1 required positional argument: 'o'");
-        packer_free(packer);
-        return NULL;
+        self->pos = self->len = self->scanner.pos = 0;
     }
-
-    obj = PyTuple_GET_ITEM(args, 0);
-
-    packed = (packb(obj, packer)) ?
-            NULL: PyBytes_FromStringAndSize((const char *) packer->buffer, packer->len);
-
-    packer_free(packer);
-    return packed;
+    return obj;
 }
 
-static PyObject * _qpack_unpackb(
-        PyObject * self,
+static int session_packer_init(
+        session_packer_t * self,
         PyObject * args,
         PyObject * kwargs)
 {
-    PyObject * obj;
-    PyObject * kw_decode;
-    PyObject * kw_ignore_decode_errors;
-    PyObject * kw_use_tuples;
-    PyObject * o_decode;
-    PyObject * o_ignore_decode_errors;
-    PyObject * o_use_tuples;
-    PyObject * unpacked;
-    Py_ssize_t size;
-
-    unsigned char * buffer;
-    unpack_options_t options = {
-        .decode=DECODE_NONE,        /* None */
-        .ignore_decode_errors=0,    /* False */
-        .use_tuples=0,              /* False */
-    };
-
-    size = PyTuple_GET_SIZE(args);
+    pack_dict_t * dict = &self->dict;
+    PyObject * strings;
+    Py_ssize_t i, n, size;
 
-    if (size != 1)
+    if (PyTuple_GET_SIZE(args))
     {
         PyErr_SetString(
                 PyExc_TypeError,
-                "unpackb(), exactly one positional argument is expected");
-        return NULL;
+                "Packer() takes keyword arguments only");
+        return -1;
     }
 
-    obj = PyTuple_GET_ITEM(args, 0);
+    pack_dict_clear(dict);
+    self->max_depth = QP_MAX_DEPTH;
+    if (kwargs && max_depth_init(
+            PyDict_GetItemString(kwargs, "max_depth"),
+            &self->max_depth))
+    {
+        return -1;  /* PyErr is set */
+    }
 
-    if (kwargs)
+    strings = dict_strings(kwargs, "Packer", DICT_DEFAULT_SZ, &size);
+    if (strings == NULL)
     {
-        kw_decode = Py_BuildValue("s", "decode");
-        kw_ignore_decode_errors = Py_BuildValue("s", "ignore_decode_errors");
-        kw_use_tuples = Py_BuildValue("s", "use_tuples");
-        o_decode = PyDict_GetItem(kwargs, kw_decode);
-        o_ignore_decode_errors = PyDict_GetItem(
-            kwargs,
-            kw_ignore_decode_errors);
-        o_use_tuples = PyDict_GetItem(
-            kwargs,
-            kw_use_tuples);
+        return -1;  /* PyErr is set */
+    }
 
-        Py_DECREF(kw_decode);
-        Py_DECREF(kw_ignore_decode_errors);
-        Py_DECREF(kw_use_tuples);
+    /* the hash table has at least twice the number of entries */
+    n = PyTuple_GET_SIZE(strings);
+    for (dict->slots_sz = 16; dict->slots_sz < 2 * (n + size);)
+    {
+        dict->slots_sz <<= 1;
+    }
+    dict->entries = (pack_dict_entry_t *) calloc(
+            n + size + 1,
+            sizeof(pack_dict_entry_t));
+    dict->slots = (pack_dict_slot_t *) calloc(
+            dict->slots_sz,
+            sizeof(pack_dict_slot_t));
+    if (dict->entries == NULL || dict->slots == NULL)
+    {
+        Py_DECREF(strings);
+        pack_dict_clear(dict);
+        PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
+        return -1;
+    }
+    dict->n_static = n;
+    dict->size = size;
 
+    for (i = 0; i < n; i++)
+    {
+        PyObject * raw = PyTuple_GET_ITEM(strings, i);
+        pack_dict_add(
+                dict,
+                i,
+                (const unsigned char *) PyBytes_AS_STRING(raw),
+                PyBytes_GET_SIZE(raw));
+    }
 
-        if (o_decode != NULL)
-        {
-            if (PY_COMPAT_CHECK(o_decode))
-            {
-                if (    PY_COMPAT_COMPARE(o_decode, "utf-8") ||
-                        PY_COMPAT_COMPARE(o_decode, "UTF-8") ||
-                        PY_COMPAT_COMPARE(o_decode, "Utf-8") ||
-                        PY_COMPAT_COMPARE(o_decode, "utf8") ||
-                        PY_COMPAT_COMPARE(o_decode, "UTF8") ||
-                        PY_COMPAT_COMPARE(o_decode, "Utf8"))
-                {
-                    options.decode = DECODE_UTF8;
-                }
-                else if(PY_COMPAT_COMPARE(o_decode, "latin-1") ||
-                        PY_COMPAT_COMPARE(o_decode, "LATIN-1") ||
-                        PY_COMPAT_COMPARE(o_decode, "Latin-1") ||
-                        PY_COMPAT_COMPARE(o_decode, "latin1") ||
-                        PY_COMPAT_COMPARE(o_decode, "LATIN1") ||
-                        PY_COMPAT_COMPARE(o_decode, "Latin1"))
-                {
-                    options.decode = DECODE_LATIN1;
-                }
-                else
-                {
-                    PyErr_SetString(
-                            PyExc_LookupError,
-                            "unpackb() unsupported encoding");
-                    return NULL;
-                }
-            }
-            else if (o_decode != Py_None)
-            {
-                PyErr_SetString(
-                        PyExc_LookupError,
-                        "unpackb() decode is expecting 'None' or a 'str' object");
-                return NULL;
-            }
+    Py_DECREF(strings);
+    return 0;
+}
 
-            if (o_ignore_decode_errors != NULL)
-            {
-                options.ignore_decode_errors = \
-                    PyObject_IsTrue(o_ignore_decode_errors);
-            }
-        }
+static void session_packer_dealloc(session_packer_t * self)
+{
+    PyTypeObject * tp = Py_TYPE(self);
 
-        if (o_use_tuples != NULL)
-        {
-            options.use_tuples = PyObject_IsTrue(o_use_tuples);
-        }
+    pack_dict_clear(&self->dict);
+    tp->tp_free((PyObject *) self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* instances of a heap type own a reference to their type */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject * session_packer_pack(session_packer_t * self, PyObject * obj)
+{
+    PyObject * ret;
+    LOCKED_CALL(ret, self, session_packer_do_pack(self, obj))
+    return ret;
+}
+
+/*
+ * Pack a value with back-references and the dictionary. The dictionary only
+ * changes when the value is packed, so it stays in sync with the Unpacker
+ * when packing fails.
+ */
+static PyObject * session_packer_do_pack(
+        session_packer_t * self,
+        PyObject * obj)
+{
+    PyObject * packed;
+    packer_t * packer;
+
+    if (self->dict.slots == NULL)
+    {
+        PyErr_SetString(PyExc_ValueError, "Packer() is not initialized");
+        return NULL;
     }
 
-    if (PyBytes_Check(obj))
+    packer = packer_acquire();
+    if (packer == NULL)
     {
-        if (PyBytes_AsStringAndSize(obj, (char **) &buffer, &size) == -1)
+        if (!PyErr_Occurred())
         {
-            return NULL;  /* PyErr is set */
+            PyErr_SetString(PyExc_MemoryError, "Memory allocation error");
         }
+        return NULL;
     }
-    else if (PyByteArray_Check(obj))
-    {
-        buffer = (unsigned char *) PyByteArray_AS_STRING(obj);
-        size = PyByteArray_GET_SIZE(obj);
-    }
-    else
+
+    packer->max_depth = self->max_depth;
+    packer->dict = &self->dict;
+    self->dict.pending_len = 0;
+
+    packed = (refs_init(packer) || packb(obj, packer))
+            ? NULL
+            : packer_finish(packer);
+    if (packed != NULL)
     {
-        PyErr_SetString(
-                PyExc_TypeError,
-                "unpackb(), a bytes-like object is required");
-        return NULL;
+        pack_dict_commit(
+                &self->dict,
+                (const unsigned char *) PyBytes_AS_STRING(packed));
     }
 
-    unpacked = unpackb(&buffer, buffer + size, &options);
-    return unpacked;
+    packer_release(packer);
+    return packed;
 }
@@ -4,6 +4,8 @@
 '''
 import sys
 import struct
+import array
+import hashlib
 
 # for being Python2 and Python3 compatible
 if sys.version_info[0] == 3:
@@ -11,10 +13,12 @@ if sys.version_info[0] == 3:
     PY_CONVERT = int
     INT_TYPES = int
     STR = str
-    intern = sys.intern
 
     def dict_items(d):
         return d.items()
+
+    def dict_values(d):
+        return d.values()
 else:
     PYTHON3 = False
     PY_CONVERT = ord
@@ -25,6 +29,9 @@ else:
     def dict_items(d):
         return d.iteritems()
 
+    def dict_values(d):
+        return d.itervalues()
+
 SIZE8_T = struct.Struct('<B')
 SIZE16_T = struct.Struct('<H')
 SIZE32_T = struct.Struct('<I')
@@ -36,8 +43,9 @@ INT32_T = struct.Struct('<i')
 INT64_T = struct.Struct('<q')
 
 DOUBLE = struct.Struct('<d')
+CANONICAL_NAN = b'\x00\x00\x00\x00\x00\x00\xf8\x7f'
 
-QP_HOOK = b'\x7c'
+QP_HOOK, N_HOOK = b'\x7c', 124  # typed array, reference or template
 # Fixed integer lengths: b'\x00' - '\x3f'
 # Fixed negative integer lengths: b'\x40' - '\x7c'
 # Fixed doubles: -1.0 0.0 and 1.0  '\x7d', '\x7e', '\x7f'
@@ -97,13 +105,146 @@ _NUMBER_MAP = {
     ord(QP_INT64): INT64_T,
     ord(QP_DOUBLE): DOUBLE}
 
+# A typed array is packed as QP_HOOK, a format character and a raw with the
+# items in little-endian byte order.
+_TYPED_SIZE = {
+    ord('b'): 1, ord('B'): 1, ord('h'): 2, ord('H'): 2, ord('i'): 4,
+    ord('I'): 4, ord('q'): 8, ord('Q'): 8, ord('f'): 4, ord('d'): 8}
+
+_TYPED_FORMATS = {
+    ('b', 1): b'b', ('b', 2): b'h', ('b', 4): b'i', ('b', 8): b'q',
+    ('B', 2): b'H', ('B', 4): b'I', ('B', 8): b'Q',
+    ('f', 4): b'f', ('f', 8): b'd'}
+
+# A back-reference is packed as QP_HOOK, QP_REF and a positive integer of at
+# most 32 bits with the number of earlier raw data in the same value. All raw
+# data of at least REF_MIN_SZ bytes which is packed in full is numbered, except
+# the raw of a typed array. Like the C extension, raw data larger than
+# REF_MAX_SZ bytes is not looked up and at most REFS_MAX raw data is kept.
+QP_REF, N_REF = b'r', 114
+REF_MIN_SZ = 3
+REF_MAX_SZ = 256
+REFS_MAX = 65536
+
+_REF_INT_SIZE = {
+    ord(QP_INT8): 1,
+    ord(QP_INT16): 2,
+    ord(QP_INT32): 4}
+
+# A dictionary reference is packed as QP_HOOK, QP_DICT and a positive integer
+# with the index of a string in the dictionary of a Packer and Unpacker. The
+# dictionary starts with the preloaded strings. After each value, the raw data
+# which is numbered for back-references and has at most DICT_MAX_SZ bytes is
+# added in order; once dictionary_size strings are added, each next string
+# replaces the oldest one which is added.
+QP_DICT, N_DICT = b's', 115
+DICT_MAX_SZ = 64
+DICT_DEFAULT_SZ = 4096
+DICT_MAX = 0x100000
+
+# A list of dicts with the same keys is packed as QP_HOOK, QP_TEMPLATE and an
+# array with the keys, followed by a record for each dict: an array with the
+# values. With templates=True, packb() uses a template for a list or tuple of
+# at least TEMPLATE_MIN_RECORDS dicts with the same keys in the same order.
+QP_TEMPLATE, N_TEMPLATE = b't', 116
+TEMPLATE_MIN_RECORDS = 2
+
+# With columnar=True, unpackb() returns a column with only integers or only
+# floats as an array.array; array.array has no 64-bit integers in Python 2.
+_COLUMN_TYPES = {float: 'd'}
+if PYTHON3:
+    _COLUMN_TYPES[int] = 'q'
+
+# Typecodes of typed arrays which array.array does not have on Python 2,
+# where 'l' and 'L' are 64-bit on most platforms
+if PYTHON3 or array.array('l').itemsize != 8:
+    _TYPECODES = {}
+else:
+    _TYPECODES = {'q': 'l', 'Q': 'L'}
+
+# Maximum number of nested containers, unless a different max_depth is given
+MAX_DEPTH = 1024
+
+# Map keys up to this size are cached while unpacking
+KEY_CACHE_KEY_SZ = 48
+KEY_CACHE_DEFAULT_SZ = 128
+
 _SIMPLE_MAP = {
     ord(QP_BOOL_TRUE): True,
     ord(QP_BOOL_FALSE): False,
     ord(QP_NULL): None}
 
 
-def _pack(obj, container):
+class _Refs(object):
+    '''Raw data which is packed, for back-references, and the dictionary of
+    a Packer with the raw data which is added when the value is packed.'''
+
+    __slots__ = ('table', 'n', 'dictionary', 'pending')
+
+    def __init__(self, dictionary=None):
+        self.table = {}
+        self.n = 0
+        self.dictionary = dictionary
+        self.pending = []
+
+
+class _Dictionary(object):
+    '''Strings of a Packer (raw data) or an Unpacker (objects).'''
+
+    __slots__ = ('strings', 'n_static', 'size', 'next', 'table')
+
+    def __init__(self, strings, size, table=None):
+        self.strings = strings + [None] * size
+        self.n_static = len(strings)
+        self.size = size
+        self.next = 0
+        self.table = table
+
+    def add(self, string):
+        if not self.size:
+            return
+        index = self.n_static + self.next % self.size
+        self.next += 1
+        if self.table is not None:
+            old = self.strings[index]
+            if old is not None and self.table.get(old) == index:
+                del self.table[old]
+            self.table[string] = index
+        self.strings[index] = string
+
+
+def _dict_raws(dictionary, dictionary_size, name):
+    '''Returns the raw data of the preloaded strings.'''
+    if not 0 <= dictionary_size <= DICT_MAX:
+        raise ValueError(
+            '{}() dictionary_size must be between 0 and 1048576'.format(name))
+    raws = []
+    for string in dictionary or ():
+        if isinstance(string, bytes):
+            raws.append(bytes(string))
+        elif isinstance(string, STR):
+            raws.append(string.encode('utf-8'))
+        else:
+            raise TypeError(
+                '{}() dictionary must hold str or bytes objects'
+                .format(name))
+        if len(raws[-1]) > DICT_MAX_SZ:
+            raise ValueError(
+                '{}() dictionary strings must be at most 64 bytes'
+                .format(name))
+    if len(raws) > DICT_MAX:
+        raise ValueError(
+            '{}() dictionary has more than 1048576 strings'.format(name))
+    return raws
+
+
+def _ref_size(index):
+    return 3 if index < 64 else 4 if index < 128 else \
+        5 if index < 0x8000 else 7
+
+
+def _pack(obj, container, max_depth, canonical=False, refs=None,
+          templates=False):
     if obj is True:
         container.append(QP_BOOL_TRUE)
 
@@ -121,23 +262,23 @@ def _pack(obj, container):
             container.append(struct.pack("B", 63 - obj))
             return
 
-        bit_len = obj.bit_length()
-        if bit_len < 8:
+        # the smallest type which fits, the same as the C extension
+        if -0x80 <= obj < 0x80:
             container.append(QP_INT8)
             container.append(INT8_T.pack(obj))
-        elif bit_len < 16:
+        elif -0x8000 <= obj < 0x8000:
             container.append(QP_INT16)
             container.append(INT16_T.pack(obj))
-        elif bit_len < 32:
+        elif -0x80000000 <= obj < 0x80000000:
             container.append(QP_INT32)
             container.append(INT32_T.pack(obj))
-        elif bit_len < 64:
+        elif -0x8000000000000000 <= obj < 0x8000000000000000:
             container.append(QP_INT64)
             container.append(INT64_T.pack(obj))
         else:
             raise OverflowError(
                 'qpack allows up to 64bit signed integers, '
-                'got bit length: {}'.format(bit_len))
+                'got bit length: {}'.format(obj.bit_length()))
 
     elif isinstance(obj, float):
         if obj == 0.0:
@@ -146,102 +287,353 @@ def _pack(obj, container):
             container.append(QP_DOUBLE_1)
         elif obj == -1.0:
             container.append(QP_DOUBLE_N1)
+        elif canonical and obj != obj:
+            # all NaN values are packed as the same quiet NaN
+            container.append(QP_DOUBLE)
+            container.append(CANONICAL_NAN)
         else:
             container.append(QP_DOUBLE)
             container.append(DOUBLE.pack(obj))
 
     elif isinstance(obj, STR):
-        b = obj.encode('utf-8')
-        n = len(b)
-        if n < 100:
-            container.append(struct.pack("B", 128 + n))
-        elif n < 0x100:
-            container.append(QP_RAW8)
-            container.append(SIZE8_T.pack(n))
-        elif n < 0x10000:
-            container.append(QP_RAW16)
-            container.append(SIZE16_T.pack(n))
-        elif n < 0x100000000:
-            container.append(QP_RAW32)
-            container.append(SIZE32_T.pack(n))
-        elif n < 0x10000000000000000:
-            container.append(QP_RAW64)
-            container.append(SIZE64_T.pack(n))
-        else:
-            raise ValueError(
-                'raw string length too large to fit in qpack: {}'
-                .format(n))
-        container.append(b)
+        _pack_raw(obj.encode('utf-8'), container, refs)
 
     elif isinstance(obj, bytes):
-        n = len(obj)
-        if n < 100:
-            container.append(struct.pack("B", 128 + n))
-        elif n < 0x100:
-            container.append(QP_RAW8)
-            container.append(SIZE8_T.pack(n))
-        elif n < 0x10000:
-            container.append(QP_RAW16)
-            container.append(SIZE16_T.pack(n))
-        elif n < 0x100000000:
-            container.append(QP_RAW32)
-            container.append(SIZE32_T.pack(n))
-        elif n < 0x10000000000000000:
-            container.append(QP_RAW64)
-            container.append(SIZE64_T.pack(n))
-        else:
-            raise ValueError(
-                'raw string length too large to fit in qpack: {}'
-                .format(n))
-        container.append(obj)
+        _pack_raw(obj, container, refs)
 
     elif isinstance(obj, (list, tuple)):
         n = len(obj)
-        if n < 6:
+        if n and not max_depth:
+            raise ValueError('packb() exceeds the maximum depth')
+        keys = _template_keys(obj) if templates else None
+        if keys is not None:
+            _pack_template(obj, keys, container, max_depth, refs)
+        elif n < 6:
             container.append(SIZE8_T.pack(START_ARR + n))
             for value in obj:
-                _pack(value, container)
+                _pack(value, container, max_depth - 1, canonical, refs,
+                      templates)
         else:
             container.append(QP_OPEN_ARRAY)
             for value in obj:
-                _pack(value, container)
+                _pack(value, container, max_depth - 1, canonical, refs,
+                      templates)
             container.append(QP_CLOSE_ARRAY)
 
     elif isinstance(obj, dict):
         n = len(obj)
+        if n and not max_depth:
+            raise ValueError('packb() exceeds the maximum depth')
         if n < 6:
             container.append(SIZE8_T.pack(START_MAP + n))
-            for key, value in dict_items(obj):
-                _pack(key, container)
-                _pack(value, container)
         else:
             container.append(QP_OPEN_MAP)
+        if canonical:
+            for packed, key, value in _sorted_items(obj, max_depth - 1):
+                if refs is None:
+                    container.append(packed)
+                else:
+                    _pack(key, container, max_depth - 1, True, refs)
+                _pack(value, container, max_depth - 1, True, refs)
+        else:
             for key, value in dict_items(obj):
-                _pack(key, container)
-                _pack(value, container)
+                _pack(key, container, max_depth - 1, False, refs, templates)
+                _pack(value, container, max_depth - 1, False, refs, templates)
+        if n >= 6:
             container.append(QP_CLOSE_MAP)
 
     else:
+        try:
+            view = memoryview(obj)
+        except TypeError:
+            raise TypeError(
+                'packing type {} is not supported with qpack'
+                .format(type(obj)))
+        _pack_buffer(view, container, refs)
+
+
+def _template_keys(obj):
+    '''Returns a list with the keys of the dicts in `obj` when it can be
+    packed as a template, or None. The keys must not be containers and are
+    compared on their type and value.'''
+    if len(obj) < TEMPLATE_MIN_RECORDS or not isinstance(obj[0], dict):
+        return None
+    keys = list(obj[0])
+    if not keys or any(isinstance(key, (list, tuple, dict)) for key in keys):
+        return None
+    for record in obj[1:]:
+        if not isinstance(record, dict) or len(record) != len(keys):
+            return None
+        for key, other in zip(record, keys):
+            if key is not other and (
+                    type(key) is not type(other) or key != other):
+                return None
+    return keys
+
+
+def _pack_template(obj, keys, container, max_depth, refs):
+    n = len(obj) + 1
+    container.append(QP_HOOK)
+    container.append(QP_TEMPLATE)
+    container.append(
+        SIZE8_T.pack(START_ARR + n) if n < 6 else QP_OPEN_ARRAY)
+    _pack(keys, container, max_depth - 1, False, refs)
+    size = len(keys)
+    for record in obj:
+        container.append(
+            SIZE8_T.pack(START_ARR + size) if size < 6 else QP_OPEN_ARRAY)
+        for value in dict_values(record):
+            _pack(value, container, max_depth - 2, False, refs, True)
+        if size >= 6:
+            container.append(QP_CLOSE_ARRAY)
+    if n >= 6:
+        container.append(QP_CLOSE_ARRAY)
+
+
+def _sorted_items(obj, max_depth):
+    # the keys are packed and the pairs are sorted on the packed keys
+    items = []
+    for key, value in dict_items(obj):
+        packed = []
+        _pack(key, packed, max_depth, True)
+        items.append((b''.join(packed), key, value))
+    items.sort(key=lambda item: item[0])
+    for i in range(1, len(items)):
+        if items[i - 1][0] == items[i][0]:
+            raise ValueError(
+                'packb() canonical map has keys which pack the same')
+    return items
+
+
+def _pack_raw(raw, container, refs=None):
+    n = len(raw)
+    if refs is not None and n >= REF_MIN_SZ:
+        dictionary = refs.dictionary if n <= DICT_MAX_SZ else None
+        if dictionary is not None:
+            index = dictionary.table.get(raw)
+            if index is not None and _ref_size(index) <= n:
+                container.append(QP_HOOK)
+                container.append(QP_DICT)
+                _pack(index, container, 0)
+                return
+        if n <= REF_MAX_SZ:
+            index = refs.table.get(raw)
+            if index is None:
+                if len(refs.table) < REFS_MAX:
+                    refs.table[raw] = refs.n
+            elif _ref_size(index) <= n:
+                # the back-reference is smaller than the raw data and its
+                # header of at least one byte
+                container.append(QP_HOOK)
+                container.append(QP_REF)
+                _pack(index, container, 0)
+                return
+        refs.n += 1
+        if dictionary is not None:
+            refs.pending.append(raw)
+    if n < 100:
+        container.append(struct.pack("B", 128 + n))
+    elif n < 0x100:
+        container.append(QP_RAW8)
+        container.append(SIZE8_T.pack(n))
+    elif n < 0x10000:
+        container.append(QP_RAW16)
+        container.append(SIZE16_T.pack(n))
+    elif n < 0x100000000:
+        container.append(QP_RAW32)
+        container.append(SIZE32_T.pack(n))
+    elif n < 0x10000000000000000:
+        container.append(QP_RAW64)
+        container.append(SIZE64_T.pack(n))
+    else:
+        raise ValueError(
+            'raw string length too large to fit in qpack: {}'
+            .format(n))
+    container.append(raw)
+
+
+def _pack_buffer(view, container, refs=None):
+    '''Numeric items are packed as a typed array, unsigned 8-bit and char
+    items as raw data.'''
+    fmt = view.format
+    if fmt[:1] in ('@', '=', '<'):
+        fmt = fmt[1:]
+    if fmt in ('B', 'c') and view.itemsize == 1:
+        _pack_raw(view.tobytes(), container, refs)
+        return
+    if fmt in ('b', 'h', 'i', 'l', 'q', 'n'):
+        typed = _TYPED_FORMATS.get(('b', view.itemsize))
+    elif fmt in ('H', 'I', 'L', 'Q', 'N'):
+        typed = _TYPED_FORMATS.get(('B', view.itemsize))
+    elif fmt in ('f', 'd'):
+        typed = _TYPED_FORMATS.get(('f', view.itemsize))
+    else:
+        typed = None
+    if typed is None:
         raise TypeError(
-            'packing type {} is not supported with qpack'.format(type(obj)))
+            "packb(), unsupported buffer format '{}'".format(view.format))
+    container.append(QP_HOOK)
+    container.append(typed)
+    _pack_raw(view.tobytes(), container)
+
+
+def _as_buffer(qp):
+    if not PYTHON3:
+        # the items of a str and a buffer() are 1-byte strings for ord(),
+        # which memoryview does not support on Python 2
+        if isinstance(qp, bytes):
+            return qp
+        if isinstance(qp, memoryview):
+            return qp.tobytes()
+        return buffer(qp)
+    if isinstance(qp, (bytes, bytearray)):
+        return qp
+    view = memoryview(qp)
+    if view.ndim != 1 or view.itemsize != 1:
+        view = view.cast('B')
+    return view
+
+
+class _Options(object):
+    '''Unpack options, including the state which is shared while
+    unpacking a single value.'''
+
+    __slots__ = (
+        'decode', 'ignore_decode_errors', 'use_tuples', 'view_min_size',
+        'view', 'key_cache', 'key_cache_size', 'max_depth', 'refs',
+        'dictionary', 'pending')
+
+    def __init__(self, decode=None, ignore_decode_errors=False,
+                 use_tuples=False, raw_as_view=False,
+                 key_cache_size=KEY_CACHE_DEFAULT_SZ, max_depth=MAX_DEPTH):
+        if max_depth < 0:
+            raise ValueError('max_depth must not be negative')
+        self.max_depth = max_depth
+        self.decode = decode
+        self.ignore_decode_errors = ignore_decode_errors
+        self.use_tuples = use_tuples
+        self.view = None
+        self.refs = []
+        self.dictionary = None
+        self.pending = []
+        if not 0 <= key_cache_size <= 0x100000:
+            raise ValueError(
+                'key_cache_size must be between 0 and 1048576')
+        self.key_cache = {} if key_cache_size else None
+        self.key_cache_size = key_cache_size
+        if raw_as_view is True:
+            self.view_min_size = 0
+        elif raw_as_view is False or raw_as_view is None:
+            self.view_min_size = None
+        elif raw_as_view < 0:
+            raise ValueError(
+                'raw_as_view must be a bool or a positive size')
+        else:
+            self.view_min_size = int(raw_as_view)
+
 
+def _raw_view(qp, pos, end_pos, opts):
+    if opts.view is None:
+        if not PYTHON3 and not isinstance(qp, bytes):
+            # a view on a buffer() is not supported on Python 2, and slices
+            # of a view on a bytearray are writable
+            qp = qp[:]
+        view = memoryview(qp)
+        if not view.readonly:
+            # memoryview.toreadonly() is new in Python 3.8, older versions
+            # return views on a copy of the data
+            view = view.toreadonly() if hasattr(view, 'toreadonly') \
+                else memoryview(view.tobytes())
+        opts.view = view
+    return opts.view[pos:end_pos]
+
+
+def _decode(qp, pos, end_pos, opts, key=False):
+    if opts.decode is None and opts.view_min_size is not None and \
+            end_pos - pos >= opts.view_min_size and not key:
+        return _raw_view(qp, pos, end_pos, opts)
 
-def _decode(qp, pos, end_pos, decode, ignore_decode_errors):
     raw = qp[pos:end_pos]
+    if isinstance(raw, memoryview):
+        raw = raw.tobytes()
+    elif isinstance(raw, bytearray):
+        raw = bytes(raw)
 
-    if decode is None:
+    if opts.decode is None:
         return raw
 
-    if ignore_decode_errors:
+    if opts.ignore_decode_errors:
         try:
-            raw = raw.decode(decode)
+            raw = raw.decode(opts.decode)
         finally:
             return raw
 
-    return raw.decode(decode)
+    return raw.decode(opts.decode)
+
+
+def _unpack_typed(qp, pos, end_pos, fmt, opts):
+    if PYTHON3 and opts.view_min_size is not None and \
+            end_pos - pos >= opts.view_min_size:
+        return _raw_view(qp, pos, end_pos, opts).cast(fmt)
+    arr = array.array(_TYPECODES.get(fmt, fmt))
+    if PYTHON3:
+        arr.frombytes(memoryview(qp)[pos:end_pos])
+    else:
+        arr.fromstring(bytes(qp[pos:end_pos]))
+    return arr
+
+
+def _unpack_key(qp, pos, end, opts, depth):
+    cache = opts.key_cache
+    if cache is None:
+        return _unpack(qp, pos, end, opts, depth, True)
+
+    tp = PY_CONVERT(qp[pos])
+    if not 0x80 <= tp < 0xe4 or tp - 128 > KEY_CACHE_KEY_SZ:
+        return _unpack(qp, pos, end, opts, depth, True)
+
+    end_pos = pos + 1 + tp - 128
+    raw = bytes(qp[pos + 1:end_pos])
+    key = cache.get(raw)
+    if key is None:
+        end_pos, key = _unpack(qp, pos, end, opts, depth, True)
+        if len(cache) >= opts.key_cache_size:
+            cache.clear()
+        cache[raw] = key
+    elif tp - 128 >= REF_MIN_SZ:
+        _unpack_ref_add(key, tp - 128, opts)
+    return end_pos, key
+
+
+def _unpack_value(qp, pos, end, opts):
+    # raw data is numbered for back-references within each value
+    opts.refs = []
+    opts.pending = []
+    return _unpack(qp, pos, end, opts)
+
+
+def _unpack_ref_add(value, n, opts):
+    opts.refs.append(value)
+    if opts.dictionary is not None and n <= DICT_MAX_SZ:
+        opts.pending.append(value)
+
 
+def _unpack_dict(index, opts):
+    dictionary = opts.dictionary
+    if dictionary is None:
+        raise ValueError(
+            'unpackb() found a dictionary reference, use an Unpacker with '
+            'the dictionary of the Packer')
+    if index >= len(dictionary.strings) or dictionary.strings[index] is None:
+        raise ValueError('unpackb() found an invalid dictionary reference')
+    return dictionary.strings[index]
 
-def _unpack(qp, pos, end, decode, ign_dec_err, use_tpls):
+
+def _unpack(qp, pos, end, opts, depth=0, key=False):
+    # `key` is set for a map key and for the array of keys of a template,
+    # which are never returned as a memoryview
+    if pos >= end:
+        raise ValueError('unpackb() is missing data')
     tp = PY_CONVERT(qp[pos])
     pos += 1
     if tp < 64:
@@ -250,41 +642,77 @@ def _unpack(qp, pos, end, decode, ign_dec_err, use_tpls):
     if tp < 124:
         return pos, 63 - tp
 
-    if tp == QP_HOOK:
-        # This is reserved for an object hook.
-        return pos, 0
+    if tp == N_HOOK and pos < end and PY_CONVERT(qp[pos]) == N_TEMPLATE:
+        return _unpack_template(qp, pos + 1, end, opts, depth)
+
+    if tp == N_HOOK and pos < end and PY_CONVERT(qp[pos]) in (N_REF, N_DICT):
+        try:
+            end_pos = _scan_ref(qp, pos - 1, end)
+        except ValueError:
+            raise ValueError('unpackb() found an invalid back-reference')
+        if end_pos is None:
+            raise ValueError('unpackb() is missing data')
+        index = _unpack(qp, pos + 1, end, opts)[1]
+        if PY_CONVERT(qp[pos]) == N_DICT:
+            return end_pos, _unpack_dict(index, opts)
+        if index >= len(opts.refs):
+            raise ValueError('unpackb() found an invalid back-reference')
+        value = opts.refs[index]
+        if key and isinstance(value, memoryview):
+            value = value.tobytes()
+        return end_pos, value
+
+    if tp == N_HOOK:
+        try:
+            end_pos = _scan_typed(qp, pos - 1, end)
+        except ValueError:
+            raise ValueError('unpackb() found an invalid typed array')
+        if end_pos is None:
+            raise ValueError('unpackb() is missing data')
+        fmt = PY_CONVERT(qp[pos])
+        tp = PY_CONVERT(qp[pos + 1])
+        pos += 2 if tp < 0xe4 else 2 + _RAW_MAP[tp].size
+        return end_pos, _unpack_typed(qp, pos, end_pos, chr(fmt), opts)
 
     if tp < 0x80:
         return pos, float(tp - 126)
 
     if tp < 0xe4:
         end_pos = pos + (tp - 128)
-        return end_pos, _decode(qp, pos, end_pos, decode, ign_dec_err)
+        value = _decode(qp, pos, end_pos, opts, key)
+        if tp - 128 >= REF_MIN_SZ:
+            _unpack_ref_add(value, tp - 128, opts)
+        return end_pos, value
 
     if tp < 0xe8:
         qp_type = _RAW_MAP[tp]
         end_pos = pos + qp_type.size + qp_type.unpack_from(qp, pos)[0]
         pos += qp_type.size
-        return end_pos, _decode(qp, pos, end_pos, decode, ign_dec_err)
+        value = _decode(qp, pos, end_pos, opts, key)
+        _unpack_ref_add(value, end_pos - pos, opts)
+        return end_pos, value
 
     if tp < 0xed:  # double included
         qp_type = _NUMBER_MAP[tp]
         return pos + qp_type.size, qp_type.unpack_from(qp, pos)[0]
 
+    if depth == opts.max_depth and (0xed < tp < 0xf3 or 0xf3 < tp < 0xf9 or
+                                    tp == N_OPEN_ARRAY or tp == N_OPEN_MAP):
+        raise ValueError('unpackb() exceeds the maximum depth')
+    depth += 1
+
     if tp < 0xf3:
         qp_array = []
         for _ in range(tp - 0xed):
-            pos, value = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
+            pos, value = _unpack(qp, pos, end, opts, depth, key)
             qp_array.append(value)
-        return pos, tuple(qp_array) if use_tpls else qp_array
+        return pos, tuple(qp_array) if opts.use_tuples else qp_array
 
     if tp < 0xf9:
         qp_map = {}
         for _ in range(tp - 0xf3):
-            pos, key = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
-            pos, value = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
-            if isinstance(key, str):
-                intern(key)
+            pos, key = _unpack_key(qp, pos, end, opts, depth)
+            pos, value = _unpack(qp, pos, end, opts, depth)
             qp_map[key] = value
         return pos, qp_map
 
@@ -294,33 +722,802 @@ def _unpack(qp, pos, end, decode, ign_dec_err, use_tpls):
     if tp == N_OPEN_ARRAY:
         qp_array = []
         while pos < end and PY_CONVERT(qp[pos]) != N_CLOSE_ARRAY:
-            pos, value = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
+            pos, value = _unpack(qp, pos, end, opts, depth, key)
             qp_array.append(value)
-        return pos + 1, tuple(qp_array) if use_tpls else qp_array
+        return pos + 1, tuple(qp_array) if opts.use_tuples else qp_array
 
     if tp == N_OPEN_MAP:
         qp_map = {}
         while pos < end and PY_CONVERT(qp[pos]) != N_CLOSE_MAP:
-            pos, key = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
-            pos, value = _unpack(qp, pos, end, decode, ign_dec_err, use_tpls)
-            if isinstance(key, str):
-                intern(key)
+            pos, key = _unpack_key(qp, pos, end, opts, depth)
+            pos, value = _unpack(qp, pos, end, opts, depth)
             qp_map[key] = value
         return pos + 1, qp_map
 
     raise ValueError('Error in qpack at position {}'.format(pos))
 
 
-def packb(obj):
+def _unpack_template(qp, pos, end, opts, depth):
+    '''Returns the end position and a list with a dict for each record of the
+    template with its array at `pos`. The dicts share the key objects.'''
+    if pos >= end:
+        raise ValueError('unpackb() is missing data')
+    tp = PY_CONVERT(qp[pos])
+    if tp == N_OPEN_ARRAY:
+        n = None
+    elif START_ARR < tp < START_MAP:
+        n = tp - START_ARR
+    else:
+        raise ValueError('unpackb() found an invalid template')
+    if depth == opts.max_depth:
+        raise ValueError('unpackb() exceeds the maximum depth')
+    depth += 1
+    pos += 1
+
+    if n is None and (pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_ARRAY):
+        raise ValueError('unpackb() found an invalid template')
+    pos, keys = _unpack_record(qp, pos, end, opts, depth, None)
+
+    records = []
+    while len(records) + 1 != n:
+        if n is None and (
+                pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_ARRAY):
+            pos += 1
+            break
+        pos, values = _unpack_record(qp, pos, end, opts, depth, keys)
+        records.append(dict(zip(keys, values)))
+    return pos, tuple(records) if opts.use_tuples else records
+
+
+def _unpack_record(qp, pos, end, opts, depth, keys):
+    '''Returns the end position and the keys of a template when `keys` is
+    None, or else a list with the values of the record at `pos`.'''
+    if pos >= end:
+        raise ValueError('unpackb() is missing data')
+    tp = PY_CONVERT(qp[pos])
+    if keys is None or not (START_ARR <= tp < START_MAP or
+                            tp == N_OPEN_ARRAY):
+        # the keys are any value which unpacks to a list or tuple
+        if 0xf3 <= tp < 0xf9 or tp == N_OPEN_MAP:
+            raise ValueError('unpackb() found an invalid template')
+        pos, value = _unpack(qp, pos, end, opts, depth, True)
+        if keys is not None or type(value) not in (list, tuple):
+            raise ValueError('unpackb() found an invalid template')
+        return pos, value
+
+    n = None if tp == N_OPEN_ARRAY else tp - START_ARR
+    if n != len(keys) and n is not None:
+        raise ValueError('unpackb() found an invalid template')
+    if n != 0 and depth == opts.max_depth:
+        raise ValueError('unpackb() exceeds the maximum depth')
+    pos += 1
+    values = []
+    while len(values) != n:
+        if n is None and (
+                pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_ARRAY):
+            pos += 1
+            break
+        pos, value = _unpack(qp, pos, end, opts, depth + 1)
+        values.append(value)
+    if len(values) != len(keys):
+        raise ValueError('unpackb() found an invalid template')
+    return pos, values
+
+
+def _unpack_columns(qp, pos, end, opts):
+    '''Returns the end position and a dict with a column for each key of the
+    maps in the array at `pos`, or of the records of a template, without
+    creating a dict for each row. See unpackb(columnar=True).'''
+    opts.refs = []
+    opts.pending = []
+    template = qp[pos:pos + 2] == QP_HOOK + QP_TEMPLATE
+    if template:
+        pos += 2
+    if pos >= end:
+        raise ValueError('unpackb() is missing data')
+    tp = PY_CONVERT(qp[pos])
+    if tp == N_OPEN_ARRAY:
+        n = None
+    elif START_ARR <= tp < START_MAP:
+        n = tp - START_ARR
+    elif template:
+        raise ValueError('unpackb() found an invalid template')
+    else:
+        raise ValueError('unpackb() columnar=True requires an array of maps')
+    if opts.max_depth == 0 and (template or n != 0):
+        raise ValueError('unpackb() exceeds the maximum depth')
+    pos += 1
+
+    keys = None
+    if template:
+        if n == 0 or n is None and (
+                pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_ARRAY):
+            raise ValueError('unpackb() found an invalid template')
+        pos, keys = _unpack_record(qp, pos, end, opts, 1, None)
+        if n is not None:
+            n -= 1
+
+    columns = {}
+    row = 0
+    while row != n:
+        if n is None and (pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_ARRAY):
+            pos += 1
+            break
+        if template:
+            pos, values = _unpack_record(qp, pos, end, opts, 1, keys)
+            items = zip(keys, values)
+        else:
+            pos, items = _unpack_row(qp, pos, end, opts)
+        for key, value in items:
+            column = columns.get(key)
+            if column is None:
+                column = columns[key] = [None] * row
+            if len(column) > row:
+                column[row] = value
+            else:
+                column.append(value)
+        row += 1
+        for column in dict_values(columns):
+            if len(column) != row:
+                column.append(None)
+
+    for key, column in dict_items(columns):
+        typecode = _COLUMN_TYPES.get(type(column[0]))
+        if typecode is not None and all(
+                type(value) is type(column[0]) for value in column):
+            columns[key] = array.array(typecode, column)
+    return pos, columns
+
+
+def _unpack_row(qp, pos, end, opts):
+    '''Returns the end position and a list with the key/value pairs of the
+    map at `pos`, which is a row for _unpack_columns().'''
+    if pos >= end:
+        raise ValueError('unpackb() is missing data')
+    tp = PY_CONVERT(qp[pos])
+    if tp == N_OPEN_MAP:
+        n = None
+    elif START_MAP <= tp < 0xf9:
+        n = tp - START_MAP
+    else:
+        raise ValueError('unpackb() columnar=True requires an array of maps')
+    if n != 0 and opts.max_depth == 1:
+        raise ValueError('unpackb() exceeds the maximum depth')
+    pos += 1
+    items = []
+    while len(items) != n:
+        if n is None and (pos >= end or PY_CONVERT(qp[pos]) == N_CLOSE_MAP):
+            pos += 1
+            break
+        pos, key = _unpack_key(qp, pos, end, opts, 2)
+        pos, value = _unpack(qp, pos, end, opts, 2)
+        items.append((key, value))
+    return pos, items
+
+
+_FIXED_SIZE = {
+    ord(QP_INT8): 2,
+    ord(QP_INT16): 3,
+    ord(QP_INT32): 5,
+    ord(QP_INT64): 9,
+    ord(QP_DOUBLE): 9}
+
+_SCAN_OPEN_ARRAY = -1
+_SCAN_OPEN_MAP_KEY = -2
+_SCAN_OPEN_MAP_VALUE = -3
+
+
+def _scan_typed(qp, pos, end):
+    '''Returns the end position of the typed array at `pos` or None when the
+    typed array is not complete.'''
+    if pos + 3 > end:
+        return None
+    itemsize = _TYPED_SIZE.get(PY_CONVERT(qp[pos + 1]))
+    tp = PY_CONVERT(qp[pos + 2])
+    if itemsize is None or not 0x80 <= tp < 0xe8:
+        raise ValueError('invalid typed array')
+    pos += 3
+    if tp < 0xe4:
+        n = tp - 128
+    else:
+        qp_type = _RAW_MAP[tp]
+        if pos + qp_type.size > end:
+            return None
+        n = qp_type.unpack_from(qp, pos)[0]
+        pos += qp_type.size
+    if n % itemsize:
+        raise ValueError('invalid typed array')
+    return None if pos + n > end else pos + n
+
+
+def _scan_ref(qp, pos, end):
+    '''Returns the end position of the back-reference at `pos` or None when
+    the back-reference is not complete.'''
+    if pos + 3 > end:
+        return None
+    tp = PY_CONVERT(qp[pos + 2])
+    if tp < 64:
+        return pos + 3
+    size = _REF_INT_SIZE.get(tp)
+    if size is None:
+        raise ValueError('invalid back-reference')
+    pos += 3 + size
+    if pos > end:
+        return None
+    if PY_CONVERT(qp[pos - 1]) & 0x80:
+        # the index is a positive integer
+        raise ValueError('invalid back-reference')
+    return pos
+
+
+def _scan(qp, pos, end, max_depth=MAX_DEPTH, at_end=False, tokens=None):
+    '''Returns the end position of the value at `pos` or None when the value
+    is not complete. When `at_end` is True, the end of the data closes open
+    arrays and maps, the same as for unpackb(), and a ValueError is raised
+    when the value is not complete. When `tokens` is a list, a [position, n]
+    token is added for each value like the tape of the C scanner: n is the
+    number of items of an array, pairs of a map, or else the size.'''
+    frames = []
+    parents = []  # token index for each frame when tokens are added
+    start = pos
+    while pos < end:
+        tp = PY_CONVERT(qp[pos])
+        if tp == N_HOOK and pos + 1 < end and \
+                PY_CONVERT(qp[pos + 1]) == N_TEMPLATE:
+            if pos + 2 >= end:
+                break
+            tp = PY_CONVERT(qp[pos + 2])
+            if tp != N_OPEN_ARRAY and not START_ARR <= tp < START_MAP:
+                raise ValueError(
+                    'invalid template at position {}'.format(pos - start))
+            # the array which follows is the value
+            if tokens is not None:
+                tokens.append([pos, 2])
+            pos += 2
+            continue
+        if tp == N_HOOK and pos + 1 < end and \
+                PY_CONVERT(qp[pos + 1]) in (N_REF, N_DICT):
+            try:
+                size = _scan_ref(qp, pos, end)
+            except ValueError:
+                raise ValueError(
+                    'invalid back-reference at position {}'
+                    .format(pos - start))
+            if size is None:
+                break
+            size -= pos
+        elif tp == N_HOOK:
+            try:
+                size = _scan_typed(qp, pos, end)
+            except ValueError:
+                raise ValueError(
+                    'invalid typed array at position {}'.format(pos - start))
+            if size is None:
+                break
+            size -= pos
+        elif tp < 0x80 or tp > 0xec:
+            size = 1
+        elif tp < 0xe4:
+            size = 1 + tp - 128
+        elif tp < 0xe8:
+            qp_type = _RAW_MAP[tp]
+            if pos + 1 + qp_type.size > end:
+                break
+            size = 1 + qp_type.size + qp_type.unpack_from(qp, pos + 1)[0]
+        else:
+            size = _FIXED_SIZE[tp]
+
+        if pos + size > end:
+            break
+
+        if len(frames) == max_depth and (
+                START_ARR < tp < START_MAP or START_MAP < tp < 0xf9 or
+                tp == N_OPEN_ARRAY or tp == N_OPEN_MAP):
+            raise ValueError(
+                'data exceeds the maximum depth at position {}'
+                .format(pos - start))
+
+        frame = None
+        if START_ARR < tp < START_MAP:
+            frame = n = tp - START_ARR
+        elif START_MAP < tp < 0xf9:
+            n = tp - START_MAP
+            frame = n * 2
+        elif tp == N_OPEN_ARRAY:
+            frame, n = _SCAN_OPEN_ARRAY, 0
+        elif tp == N_OPEN_MAP:
+            frame, n = _SCAN_OPEN_MAP_KEY, 0
+        elif tp == N_CLOSE_ARRAY or tp == N_CLOSE_MAP:
+            expect = _SCAN_OPEN_ARRAY if tp == N_CLOSE_ARRAY \
+                else _SCAN_OPEN_MAP_KEY
+            if not frames or frames[-1] != expect:
+                raise ValueError(
+                    'unexpected array or map close character at position {}'
+                    .format(pos - start))
+            frames.pop()
+            parents.pop()
+        elif tokens is not None:
+            tokens.append([pos, size])
+
+        if frame is not None:
+            if tokens is not None:
+                tokens.append([pos, n])
+            frames.append(frame)
+            parents.append(len(tokens) - 1 if tokens is not None else None)
+            pos += 1
+            continue
+
+        pos += size
+
+        while frames:
+            frame = frames[-1]
+            if frame > 0:
+                frame -= 1
+                if frame:
+                    frames[-1] = frame
+                    break
+                frames.pop()
+                parents.pop()
+                continue
+            if frame == _SCAN_OPEN_MAP_KEY:
+                frames[-1] = _SCAN_OPEN_MAP_VALUE
+                break
+            if frame == _SCAN_OPEN_MAP_VALUE:
+                frames[-1] = _SCAN_OPEN_MAP_KEY
+            if tokens is not None:
+                # count the item of an open array, or pair of an open map
+                tokens[parents[-1]][1] += 1
+            break
+
+        if not frames:
+            return pos
+
+    if not at_end:
+        return None
+    # the innermost container must be open and the value which is closed
+    # must complete the other containers, or be an item of an open array
+    # or a value of an open map
+    if pos == end and frames and frames[-1] in (
+            _SCAN_OPEN_ARRAY, _SCAN_OPEN_MAP_KEY) and all(
+            frame in (1, _SCAN_OPEN_ARRAY, _SCAN_OPEN_MAP_VALUE)
+            for frame in frames[:-1]):
+        if tokens is not None:
+            # the containers which are closed are items of their parents
+            for frame, parent in zip(frames[:-1], parents):
+                if frame < 0:
+                    tokens[parent][1] += 1
+        return pos
+    raise ValueError('missing data at position {}'.format(pos))
+
+
+def _tape_next(qp, tokens, i):
+    '''Returns the index of the token after the value at token `i`.'''
+    remaining = 1
+    while remaining:
+        pos, n = tokens[i]
+        tp = PY_CONVERT(qp[pos])
+        i += 1
+        remaining -= 1
+        if START_ARR < tp < START_MAP or tp == N_OPEN_ARRAY:
+            remaining += n
+        elif START_MAP < tp < 0xf9 or tp == N_OPEN_MAP:
+            remaining += 2 * n
+        elif tp == N_HOOK and PY_CONVERT(qp[pos + 1]) == N_TEMPLATE:
+            remaining += 1  # the array of the template
+    return i
+
+
+def _tape_array_size(qp, tokens, i):
+    '''Returns the number of items of the array at token `i`, or -1 when the
+    token is not an array.'''
+    pos, n = tokens[i]
+    tp = PY_CONVERT(qp[pos])
+    if tp == START_ARR:
+        return 0  # the token has the size in bytes
+    return n if START_ARR < tp < START_MAP or tp == N_OPEN_ARRAY else -1
+
+
+def _tape_check_template(qp, tokens, i):
+    '''Returns None when the template at token `i` is valid, or else the
+    index of the invalid token. The array of a template must start with the
+    keys, which is any value that unpacks to a list, followed by an array
+    with a value for each key for each record.'''
+    n = _tape_array_size(qp, tokens, i + 1)
+    if n == 0:
+        return i
+    i += 2
+    pos = tokens[i][0]
+    if qp[pos:pos + 2] == QP_HOOK + QP_TEMPLATE:
+        keys = _tape_array_size(qp, tokens, i + 1) - 1
+    else:
+        keys = _tape_array_size(qp, tokens, i)
+    if keys < 0:
+        return i
+    for _ in range(n - 1):
+        i = _tape_next(qp, tokens, i)
+        if _tape_array_size(qp, tokens, i) != keys:
+            return i
+    return None
+
+
+def _tape_check(qp, tokens):
+    '''Raises a ValueError for a back-reference to raw data which is not
+    numbered before it, or for an invalid template, in the value with
+    `tokens`. This is checked the same as by unpackb().'''
+    raws = 0
+    for i, (pos, _) in enumerate(tokens):
+        tp = PY_CONVERT(qp[pos])
+        if 0x80 + REF_MIN_SZ <= tp < 0xe8:
+            raws += 1  # numbered for back-references, see QP_REF
+        elif tp != N_HOOK:
+            continue
+        elif PY_CONVERT(qp[pos + 1]) == N_REF:
+            tp = PY_CONVERT(qp[pos + 2])
+            index = tp if tp < 64 else \
+                _NUMBER_MAP[tp].unpack_from(qp, pos + 3)[0]
+            if index >= raws:
+                raise ValueError(
+                    'invalid back-reference at position {}'.format(pos))
+        elif PY_CONVERT(qp[pos + 1]) == N_TEMPLATE:
+            invalid = _tape_check_template(qp, tokens, i)
+            if invalid is not None:
+                raise ValueError(
+                    'invalid template at position {}'
+                    .format(tokens[invalid][0]))
+
+
+def packb(obj, max_depth=MAX_DEPTH, exact=False, threads=1, canonical=False,
+          refs=False, templates=False):
     '''Serialize to QPack. (Pure Python implementation)'''
+    # the parts are joined into a bytes object of the exact size, so `exact`
+    # makes no difference here
+    if threads < 1:
+        raise ValueError('threads must be at least 1')
+    # the pure Python implementation always packs in the calling thread
+    if max_depth < 0:
+        raise ValueError('max_depth must not be negative')
     container = []
-    _pack(obj, container)
+    # the maps of canonical data are sorted, so templates are not used
+    _pack(obj, container, max_depth, canonical, _Refs() if refs else None,
+          templates and not canonical)
     return b''.join(container)
 
 
-def unpackb(qp, decode=None, ignore_decode_errors=False, use_tuples=False):
+def packed_size(obj, max_depth=MAX_DEPTH):
+    '''Returns the size of the packed data for `obj`. (Pure Python
+    implementation)'''
+    if max_depth < 0:
+        raise ValueError('max_depth must not be negative')
+    container = []
+    _pack(obj, container, max_depth)
+    return sum(len(part) for part in container)
+
+
+def digest(obj, max_depth=MAX_DEPTH):
+    '''Returns the 32 byte BLAKE2b digest of the canonical packed data for
+    `obj`. (Pure Python implementation)'''
+    packed = packb(obj, max_depth, canonical=True)
+    return hashlib.blake2b(packed, digest_size=32).digest()
+
+
+def packb_into(obj, buffer, offset=0, max_depth=MAX_DEPTH):
+    '''Serialize to QPack into a writable buffer and return the number of
+    bytes written. (Pure Python implementation)'''
+    data = packb(obj, max_depth)
+    view = memoryview(buffer)
+    if PYTHON3 and (view.ndim != 1 or view.itemsize != 1):
+        view = view.cast('B')
+    if view.readonly:
+        raise BufferError('packb_into() buffer is not writable')
+    if not 0 <= offset <= len(view):
+        raise ValueError('packb_into() offset is out of range')
+    n = len(data)
+    if offset + n > len(view):
+        raise ValueError('packb_into() buffer is too small')
+    view[offset:offset + n] = data
+    return n
+
+
+def unpackb(qp, decode=None, ignore_decode_errors=False, use_tuples=False,
+            raw_as_view=False, key_cache_size=KEY_CACHE_DEFAULT_SZ,
+            max_depth=MAX_DEPTH, threads=1, columnar=False):
     '''De-serialize QPack to Python. (Pure Python implementation)'''
-    return _unpack(qp, 0, len(qp), decode, ignore_decode_errors, use_tuples)[1]
+    if threads < 1:
+        raise ValueError('threads must be at least 1')
+    # the pure Python implementation always unpacks in the calling thread
+    qp = _as_buffer(qp)
+    opts = _Options(
+        decode, ignore_decode_errors, use_tuples, raw_as_view, key_cache_size,
+        max_depth)
+    if columnar:
+        return _unpack_columns(qp, 0, len(qp), opts)[1]
+    return _unpack_value(qp, 0, len(qp), opts)[1]
+
+
+def unpack_from(qp, offset=0, decode=None, ignore_decode_errors=False,
+                use_tuples=False, raw_as_view=False,
+                key_cache_size=KEY_CACHE_DEFAULT_SZ, max_depth=MAX_DEPTH):
+    '''De-serialize one QPack value starting at `offset` and return a tuple
+    (obj, next_offset). (Pure Python implementation)'''
+    qp = _as_buffer(qp)
+    if not 0 <= offset <= len(qp):
+        raise ValueError('unpack_from() offset is out of range')
+    opts = _Options(
+        decode, ignore_decode_errors, use_tuples, raw_as_view, key_cache_size,
+        max_depth)
+    pos, obj = _unpack_value(qp, offset, len(qp), opts)
+    return obj, pos
+
+
+def packb_many(iterable, max_depth=MAX_DEPTH, concat=False):
+    '''Serialize each object to QPack and return a list with bytes, or a
+    tuple (packed, offsets) when `concat` is True. (Pure Python
+    implementation)'''
+    packed = [packb(obj, max_depth) for obj in iterable]
+    if not concat:
+        return packed
+    offsets = array.array(_TYPECODES.get('q', 'q'), [0])
+    for data in packed:
+        offsets.append(offsets[-1] + len(data))
+    return b''.join(packed), offsets
+
+
+def unpack_many(qp, decode=None, ignore_decode_errors=False, use_tuples=False,
+                raw_as_view=False, key_cache_size=KEY_CACHE_DEFAULT_SZ,
+                max_depth=MAX_DEPTH):
+    '''De-serialize a list or tuple with QPack buffers, or all values in a
+    single buffer, and return a list. (Pure Python implementation)'''
+    opts = _Options(
+        decode, ignore_decode_errors, use_tuples, raw_as_view, key_cache_size,
+        max_depth)
+    unpacked = []
+    if isinstance(qp, (list, tuple)):
+        for data in qp:
+            data = _as_buffer(data)
+            opts.view = None
+            unpacked.append(_unpack_value(data, 0, len(data), opts)[1])
+        return unpacked
+    qp = _as_buffer(qp)
+    pos, end = 0, len(qp)
+    while pos < end:
+        pos, obj = _unpack_value(qp, pos, end, opts)
+        unpacked.append(obj)
+    return unpacked
+
+
+def skip(qp, offset=0, max_depth=MAX_DEPTH):
+    '''Returns the offset of the first byte after the QPack value at
+    `offset`. (Pure Python implementation)'''
+    qp = _as_buffer(qp)
+    if not 0 <= offset <= len(qp):
+        raise ValueError('offset is out of range')
+    tokens = []
+    end = _scan(qp, offset, len(qp), max_depth, True, tokens)
+    _tape_check(qp, tokens)
+    return end
+
+
+def validate(qp, offset=0, max_depth=MAX_DEPTH):
+    '''Check that the data from `offset` is exactly one well-formed QPack
+    value. (Pure Python implementation)'''
+    qp = _as_buffer(qp)
+    end = skip(qp, offset, max_depth)
+    if end != len(qp):
+        raise ValueError(
+            'unexpected data after the value at position {}'.format(end))
+
+
+_MISSING = object()
+
+
+def _get_walk(qp, path, end, max_depth):
+    '''Returns the position of the value at `path`, or raises a KeyError or
+    IndexError when the path is not found.'''
+    pos = 0
+    for depth, item in enumerate(path):
+        if pos >= end:
+            raise ValueError('missing data at position {}'.format(pos))
+        tp = PY_CONVERT(qp[pos])
+        if START_ARR <= tp < START_MAP:
+            count, is_map = tp - START_ARR, False
+        elif START_MAP <= tp < 0xf9:
+            count, is_map = tp - START_MAP, True
+        elif tp == N_OPEN_ARRAY or tp == N_OPEN_MAP:
+            count, is_map = None, tp == N_OPEN_MAP
+        else:
+            raise KeyError(item)
+        if depth == max_depth:
+            raise ValueError(
+                'data exceeds the maximum depth at position {}'.format(pos))
+        pos += 1
+        close = N_CLOSE_MAP if is_map else N_CLOSE_ARRAY
+        skip_depth = max_depth - depth - 1
+
+        if not is_map:
+            if not isinstance(item, INT_TYPES):
+                raise KeyError(item)
+            n = 0
+            while True:
+                if n == count or (count is None and (
+                        pos >= end or PY_CONVERT(qp[pos]) == close)):
+                    raise IndexError(item)
+                if n == item:
+                    break
+                pos = _scan(qp, pos, end, skip_depth, True)
+                n += 1
+            continue
+
+        if isinstance(item, (bytes, INT_TYPES)):
+            key = item
+        else:
+            key = item.encode('utf-8')
+
+        n, match = 0, None
+        while True:
+            if n == count or (count is None and (
+                    pos >= end or PY_CONVERT(qp[pos]) == close)):
+                break
+            start = pos
+            pos = _scan(qp, pos, end, skip_depth, True)
+            tp = PY_CONVERT(qp[start])
+            if isinstance(key, INT_TYPES):
+                found = (tp < 0x7c or 0xe8 <= tp < 0xec) and \
+                    _unpack(qp, start, end, _Options())[1] == key
+            elif 0x80 <= tp < 0xe8:
+                size = 0 if tp < 0xe4 else _RAW_MAP[tp].size
+                found = qp[start + 1 + size:pos] == key
+            else:
+                found = False
+            if found:
+                # a later value for the same key replaces this one
+                match = pos
+            if pos >= end:
+                break
+            pos = _scan(qp, pos, end, skip_depth, True)
+            n += 1
+        if match is None:
+            raise KeyError(item)
+        pos = match
+    return pos
+
+
+def _get_refs(obj, path, opts):
+    '''Returns the item at `path` in an unpacked value, or raises a KeyError
+    or IndexError when the path is not found.'''
+    for item in path:
+        if isinstance(obj, dict):
+            key = item
+            if not isinstance(item, INT_TYPES):
+                # the key is created the same as the keys of the map
+                key = item if isinstance(item, bytes) \
+                    else item.encode('utf-8')
+                if opts.decode is not None:
+                    key = _decode(key, 0, len(key), opts)
+            try:
+                obj = obj[key]
+            except KeyError:
+                raise KeyError(item)
+        elif isinstance(obj, (list, tuple)):
+            if not isinstance(item, INT_TYPES):
+                raise KeyError(item)
+            if not 0 <= item < len(obj):
+                raise IndexError(item)
+            obj = obj[item]
+        else:
+            raise KeyError(item)
+    return obj
+
+
+def get(qp, path, default=_MISSING, decode=None, ignore_decode_errors=False,
+        use_tuples=False, raw_as_view=False,
+        key_cache_size=KEY_CACHE_DEFAULT_SZ, max_depth=MAX_DEPTH):
+    '''De-serialize only the value at `path`, a list or tuple with map keys
+    and array indexes. (Pure Python implementation)'''
+    if not isinstance(path, (list, tuple)):
+        raise TypeError('get() path must be a list or tuple')
+    for item in path:
+        if not isinstance(item, INT_TYPES) and \
+                not isinstance(item, (bytes, STR)):
+            raise TypeError('get() path items must be str, bytes or int')
+    qp = _as_buffer(qp)
+    data = qp if isinstance(qp, (bytes, bytearray)) else bytes(qp)
+    if QP_HOOK + QP_REF in data or QP_HOOK + QP_DICT in data or \
+            QP_HOOK + QP_TEMPLATE in data:
+        # back-references might point to raw data anywhere before the value
+        # and the records of a template need its keys, so the value at the
+        # start is unpacked and the path is walked on the objects; this is
+        # also done for raw data with these bytes
+        opts = _Options(
+            decode, ignore_decode_errors, use_tuples, raw_as_view,
+            key_cache_size, max_depth)
+        try:
+            return _get_refs(
+                _unpack_value(qp, 0, len(qp), opts)[1], path, opts)
+        except LookupError:
+            if default is _MISSING:
+                raise
+            return default
+    opts = _Options(
+        decode, ignore_decode_errors, use_tuples, raw_as_view, key_cache_size,
+        max_depth - len(path))
+    try:
+        pos = _get_walk(qp, path, len(qp), max_depth)
+    except LookupError:
+        if default is _MISSING:
+            raise
+        return default
+    return _unpack_value(qp, pos, len(qp), opts)[1]
+
+
+class Unpacker(object):
+    '''Streaming de-serializer. (Pure Python implementation)'''
+
+    def __init__(self, decode=None, ignore_decode_errors=False,
+                 use_tuples=False, raw_as_view=False,
+                 key_cache_size=KEY_CACHE_DEFAULT_SZ, max_depth=MAX_DEPTH,
+                 dictionary=None, dictionary_size=None):
+        if raw_as_view:
+            raise ValueError('Unpacker() does not support raw_as_view')
+        self._opts = opts = _Options(
+            decode, ignore_decode_errors, use_tuples,
+            key_cache_size=key_cache_size, max_depth=max_depth)
+        self._buffer = bytearray()
+        if dictionary is not None or dictionary_size is not None:
+            if dictionary_size is None:
+                dictionary_size = DICT_DEFAULT_SZ
+            raws = _dict_raws(dictionary, dictionary_size, 'Unpacker')
+            opts.dictionary = _Dictionary(
+                [_decode(raw, 0, len(raw), opts) for raw in raws],
+                dictionary_size)
+
+    def feed(self, data):
+        '''Append a bytes-like object to the internal buffer.'''
+        self._buffer.extend(data)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        end = _scan(
+            _as_buffer(self._buffer), 0, len(self._buffer),
+            self._opts.max_depth)
+        if end is None:
+            raise StopIteration
+        qp = bytes(self._buffer[:end])
+        del self._buffer[:end]
+        obj = _unpack_value(qp, 0, end, self._opts)[1]
+        if self._opts.dictionary is not None:
+            for value in self._opts.pending:
+                self._opts.dictionary.add(value)
+        return obj
+
+    next = __next__
+
+
+class Packer(object):
+    '''Serializer for a stream of values which keeps a dictionary of strings
+    between the values. (Pure Python implementation)'''
+
+    def __init__(self, dictionary=None, dictionary_size=DICT_DEFAULT_SZ,
+                 max_depth=MAX_DEPTH):
+        if max_depth < 0:
+            raise ValueError('max_depth must not be negative')
+        self._max_depth = max_depth
+        raws = _dict_raws(dictionary, dictionary_size, 'Packer')
+        table = {}
+        for index, raw in enumerate(raws):
+            table[raw] = index
+        self._dictionary = _Dictionary(raws, dictionary_size, table)
+
+    def pack(self, obj):
+        '''Serialize a Python object to QPack format and add its strings to
+        the dictionary.'''
+        refs = _Refs(self._dictionary)
+        container = []
+        _pack(obj, container, self._max_depth, False, refs)
+        for raw in refs.pending:
+            self._dictionary.add(raw)
+        return b''.join(container)
 
 
 if __name__ == '__main__':
@@ -13,9 +13,10 @@ from qpack import __version__
 module = Extension(
     'qpack._qpack',
     define_macros=[],
-    include_dirs=['./qpack'],
+    include_dirs=['./qpack', './libqpack'],
     libraries=[],
-    sources=['./qpack/_qpack.c'],
+    sources=['./qpack/_qpack.c', './libqpack/qpack.c'],
+    depends=['./libqpack/qpack.h'],
     extra_compile_args=["--std=c99", "-pedantic"]
 )
 
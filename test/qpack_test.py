@@ -1,9 +1,15 @@
 # -*- coding: utf-8 -*-
 import sys
+import struct
+import hashlib
 import qpack
 from qpack import fallback
 import unittest
 import pickle
+import array
+import mmap
+import tempfile
+import threading
 
 if sys.version_info[0] == 3:
     INT_CONVERT = int
@@ -62,6 +68,895 @@ class TestQpack(unittest.TestCase):
             out = unpackb(qpack.packb(inp), decode='utf8')
             self.assertEqual(out, inp)
 
+    def _pack_into(self, packb_into):
+        buffer = bytearray(64)
+        for inp, want in self.CASES:
+            n = packb_into(inp, buffer, 3)
+            self.assertEqual(n, len(want))
+            self.assertEqual(list(buffer[3:3 + n]), want)
+
+        data = {'list': [b'x' * 200, 1.5, None]}
+        packed = qpack.packb(data)
+        buffer = bytearray(len(packed))
+        self.assertEqual(packb_into(data, memoryview(buffer)), len(packed))
+        self.assertEqual(bytes(buffer), packed)
+
+        with self.assertRaises(ValueError):
+            packb_into(data, bytearray(len(packed) - 1))
+        with self.assertRaises(ValueError):
+            packb_into(data, buffer, len(buffer) + 1)
+        with self.assertRaises(BufferError):
+            packb_into(data, bytes(len(packed)))
+
+    def _packed_size(self, packb, packed_size):
+        for inp, want in self.CASES:
+            self.assertEqual(packed_size(inp), len(want))
+            self.assertEqual(packb(inp, exact=True), bytes(bytearray(want)))
+
+        data = [
+            {'raw': b'x' * 70000, 'str': u'\u20ac' * 100, 'n': None},
+            list(range(-70, 70000, 99)), [1.5, -1.0, 0.0, True, False],
+            bytearray(300), [[[]] * 6] * 6]
+        if PYTHON3:
+            # typed arrays are packed on Python 3 only
+            data.append(array.array('d', [1.5] * 9))
+        packed = qpack.packb(data)
+        self.assertEqual(packed_size(data), len(packed))
+        self.assertEqual(packb(data, exact=True), packed)
+        self.assertEqual(packb(data, exact=False), packed)
+
+        with self.assertRaises(ValueError):
+            packed_size([[1]], max_depth=1)
+        with self.assertRaises(TypeError):
+            packed_size([object()])
+        with self.assertRaises(OverflowError):
+            packed_size([1, 2 ** 70])
+        with self.assertRaises(TypeError):
+            packb({'a': object()}, exact=True)
+
+    def _unpacker(self, Unpacker):
+        stream = b''.join(qpack.packb(inp) for inp, _ in self.CASES)
+        unpacker = Unpacker(decode='utf-8')
+        result = []
+        for i in range(len(stream)):
+            unpacker.feed(stream[i:i + 1])
+            result.extend(unpacker)
+        self.assertEqual(result, [inp for inp, _ in self.CASES])
+
+        data = {'a': [list(range(10)), {'b': b'x' * 300}], 'c': 1}
+        packed = qpack.packb(data) * 3
+        unpacker = Unpacker(use_tuples=True)
+        unpacker.feed(bytearray(packed[:40]))
+        self.assertEqual(list(unpacker), [])
+        unpacker.feed(memoryview(packed)[40:])
+        want = {b'a': (tuple(range(10)), {b'b': b'x' * 300}), b'c': 1}
+        self.assertEqual(list(unpacker), [want, want, want])
+
+        unpacker = Unpacker()
+        unpacker.feed(b'\xee\xfe')
+        with self.assertRaises(ValueError):
+            next(unpacker)
+
+    def _unpack_from(self, unpackb, unpack_from):
+        stream = b''.join(qpack.packb(inp) for inp, _ in self.CASES)
+        with tempfile.TemporaryFile() as f:
+            f.write(stream)
+            f.flush()
+            m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            for buf in (stream, memoryview(stream), m):
+                offset, result = 0, []
+                while offset < len(stream):
+                    obj, offset = unpack_from(buf, offset, decode='utf-8')
+                    result.append(obj)
+                self.assertEqual(offset, len(stream))
+                self.assertEqual(result, [inp for inp, _ in self.CASES])
+            m.close()
+
+        data = [1, b'two', {b'three': 3.0}]
+        packed = qpack.packb(data)
+        self.assertEqual(unpackb(memoryview(packed)), data)
+        self.assertEqual(unpackb(array.array('B', packed)), data)
+        self.assertEqual(unpack_from(b'\x00' + packed, offset=1),
+                         (data, len(packed) + 1))
+        with self.assertRaises(ValueError):
+            unpack_from(packed, len(packed) + 1)
+
+    def _raw_as_view(self, unpackb):
+        data = [b'small', b'x' * 1000, {b'key': b'y' * 500}]
+        packed = bytearray(qpack.packb(data))
+        small, large, d = unpackb(packed, raw_as_view=100)
+        self.assertIsInstance(small, bytes)
+        self.assertIsInstance(large, memoryview)
+        self.assertTrue(large.readonly)
+        self.assertIsInstance(d[b'key'], memoryview)
+        self.assertTrue(d[b'key'].readonly)
+        self.assertEqual([type(k) for k in d], [bytes])
+        del packed
+        self.assertEqual(large, b'x' * 1000)
+        self.assertEqual(d[b'key'].tobytes(), b'y' * 500)
+
+        packed = qpack.packb(data)
+        result = unpackb(packed, raw_as_view=True)
+        self.assertIsInstance(result[0], memoryview)
+        self.assertEqual(result[0], b'small')
+        self.assertEqual(unpackb(packed, raw_as_view=False), data)
+        self.assertEqual(
+            unpackb(packed, raw_as_view=True, decode='utf-8'),
+            ['small', 'x' * 1000, {'key': 'y' * 500}])
+
+        # map keys are bytes, also for templates, columns and keys which
+        # are back-references to a value
+        rows = [{b'name': b'value', b'value': i} for i in range(3)]
+        for kwargs in ({}, {'templates': True}, {'refs': True}):
+            packed = bytearray(qpack.packb(rows, **kwargs))
+            result = unpackb(packed, raw_as_view=True)
+            self.assertEqual(result, rows)
+            for d in result:
+                self.assertEqual(set(map(type, d)), {bytes})
+            columns = unpackb(packed, raw_as_view=True, columnar=True)
+            self.assertEqual(set(map(type, columns)), {bytes})
+            self.assertEqual(
+                [v.tobytes() for v in columns[b'name']], [b'value'] * 3)
+        if PYTHON3:
+            # read-only views of bytes are hashable
+            view = unpackb(qpack.packb(data), raw_as_view=True)[1]
+            self.assertEqual(hash(view), hash(b'x' * 1000))
+
+    def _key_cache(self, unpackb, Unpacker):
+        data = [{'device-%d' % (i % 3): i, 'value': i} for i in range(9)]
+        packed = qpack.packb(data)
+        result = unpackb(packed, decode='utf-8')
+        self.assertEqual(result, data)
+        # dicts are not ordered on Python 2; the keys of the first records
+        # are not cached so a small message does not pay for the cache
+        keys = [min(d) for d in result]
+        self.assertIs(keys[4], keys[7])
+        keys = [max(d) for d in result]
+        self.assertIs(keys[5], keys[8])
+
+        result = unpackb(packed, decode='utf-8', key_cache_size=0)
+        self.assertEqual(result, data)
+        result = unpackb(packed, key_cache_size=1)
+        self.assertEqual(len(result), 9)
+
+        unpacker = Unpacker(decode='utf-8')
+        unpacker.feed(qpack.packb({'name': 1}) * 2)
+        a, b = unpacker
+        self.assertIs(list(a)[0], list(b)[0])
+
+        with self.assertRaises(ValueError):
+            unpackb(packed, key_cache_size=-1)
+
+    def _max_depth(self, packb, unpackb, Unpacker):
+        data = [[{'a': [[1]]}]]
+        packed = qpack.packb(data)
+        self.assertEqual(packb(data, max_depth=5), packed)
+        self.assertEqual(unpackb(packed, decode='utf-8', max_depth=5), data)
+        with self.assertRaises(ValueError):
+            packb(data, max_depth=4)
+        with self.assertRaises(ValueError):
+            unpackb(packed, max_depth=4)
+        unpacker = Unpacker(max_depth=4)
+        unpacker.feed(packed)
+        with self.assertRaises(ValueError):
+            next(unpacker)
+
+        data = [[]] * 10 + [{}]
+        self.assertEqual(unpackb(packb(data, max_depth=1), max_depth=1), data)
+
+        # open arrays and maps are closed by the end of the data
+        self.assertEqual(unpackb(b'\xfc\xfc\x01'), [[1]])
+        self.assertEqual(unpackb(b'\xfd\x81a\xfc\x01'), {b'a': [1]})
+        with self.assertRaises(ValueError):
+            unpackb(b'\xfd\x81a')
+
+        lst = [1]
+        lst.append(lst)
+        with self.assertRaises(ValueError):
+            packb(lst, max_depth=100)
+
+    def _open_containers(self, unpackb):
+        data = [
+            list(range(i)) + [{'k%d' % j: [j] * i for j in range(i)}]
+            for i in range(12)]
+        data.append([[list(range(7))] * 7, {'a': {}, 'b': []}])
+        packed = qpack.packb(data)
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+
+        result = unpackb(packed, decode='utf-8', use_tuples=True)
+        self.assertIsInstance(result, tuple)
+        self.assertIsInstance(result[-1][0][0], tuple)
+        self.assertEqual(result[-1][0], (tuple(range(7)),) * 7)
+        self.assertEqual(result[8][:8], tuple(range(8)))
+        self.assertEqual(result[8][8]['k3'], (3,) * 8)
+
+        # the end of the data closes all open containers
+        packed = b'\xfc' + qpack.packb(list(range(10))) + b'\xfd\x81a'
+        self.assertEqual(
+            unpackb(packed + b'\x01', use_tuples=True),
+            (tuple(range(10)), {b'a': 1}))
+        with self.assertRaises(ValueError):
+            unpackb(packed)
+        with self.assertRaises(ValueError):
+            unpackb(b'\xfc\x01\xff')
+        self.assertEqual(unpackb(b'\xee\xfc\x01'), [[1]])
+        self.assertEqual(unpackb(b'\xf4\x81a\xfc\x01'), {b'a': [1]})
+
+        # large open containers, counted while scanning
+        data = {'k%d' % i: list(range(i)) for i in range(200)}
+        packed = b'\xfd' + b''.join(
+            qpack.packb(k) + b'\xfc' +
+            b''.join(qpack.packb(j) for j in v) + b'\xfe'
+            for k, v in data.items())
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+
+    def _skip(self, skip, validate):
+        stream = b''.join(qpack.packb(inp) for inp, _ in self.CASES)
+        offset, n = 0, 0
+        while offset < len(stream):
+            offset = skip(memoryview(stream), offset)
+            n += 1
+        self.assertEqual(n, len(self.CASES))
+        for inp, _ in self.CASES:
+            self.assertIsNone(validate(bytearray(qpack.packb(inp))))
+
+        data = [{'x': b'y' * 5000, 'z': list(range(100))}] * 20
+        packed = qpack.packb(data)
+        self.assertEqual(skip(packed + b'\x00'), len(packed))
+        self.assertEqual(skip(b'\x00' + packed, offset=1), len(packed) + 1)
+        self.assertIsNone(validate(b'\x00' + packed, 1))
+
+        # the end of the data closes open arrays and maps
+        self.assertEqual(skip(b'\xfc\xfd\x81a\x01'), 5)
+        self.assertIsNone(validate(b'\xfc\xfd\x81a\x01'))
+        self.assertEqual(skip(b'\xee\xfc\x01'), 3)
+        self.assertEqual(skip(packed[:-2]), len(packed) - 2)
+
+        for invalid in (
+                b'', b'\xfe', b'\xee', b'\xfd\x81a', b'\xfc\xff',
+                b'\xf4\x81a\xfe', b'\xe5\x05\x00abc', b'\xef\xfc\x01',
+                b'\xfd\xfc\x01', packed[:-300], packed + b'\x00'):
+            with self.assertRaises(ValueError):
+                validate(invalid)
+        with self.assertRaises(ValueError):
+            skip(packed, len(packed) + 1)
+        with self.assertRaises(ValueError):
+            skip(packed, max_depth=2)
+
+        # back-references and templates are checked the same as unpackb()
+        packed = qpack.packb(
+            [{'id': 'abc'}, {'id': 'abc'}], refs=True, templates=True)
+        self.assertIsNone(validate(packed))
+        for invalid in (
+                b'\xef\x86abcdef\x7cr\x05',
+                b'\x7ct\xfc\xef\x82id\x81\xffn\x00'):
+            with self.assertRaises(ValueError):
+                qpack.unpackb(invalid)
+            with self.assertRaises(ValueError):
+                validate(invalid)
+            with self.assertRaises(ValueError):
+                skip(invalid)
+
+    def _decode_ascii(self, unpackb):
+        # non-ASCII characters at each position around the sizes where
+        # the ASCII check switches between the inline, SSE2 and AVX2 loops
+        for size in (0, 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128,
+                     129, 200):
+            ascii = ''.join(chr(97 + i % 26) for i in range(size))
+            self.assertEqual(
+                unpackb(qpack.packb(ascii), decode='utf-8'), ascii)
+            self.assertEqual(
+                unpackb(qpack.packb(ascii), decode='latin-1'), ascii)
+            for pos in range(0, size, 7):
+                s = ascii[:pos] + '\u00e9\u20ac' + ascii[pos:]
+                self.assertEqual(
+                    unpackb(qpack.packb(s), decode='utf-8'), s)
+                raw = s.encode('utf-8')
+                self.assertEqual(
+                    unpackb(qpack.packb(raw), decode='latin-1'),
+                    raw.decode('latin-1'))
+                invalid = raw[:pos] + b'\xff' + raw[pos:]
+                with self.assertRaises(UnicodeDecodeError):
+                    unpackb(qpack.packb(invalid), decode='utf-8')
+                self.assertEqual(unpackb(
+                    qpack.packb(invalid),
+                    decode='utf-8',
+                    ignore_decode_errors=True), invalid)
+
+    def _typed_arrays(self, packb, unpackb, skip):
+        packed = b'\x7cq\xe5\x20\x03' + struct.pack('<100q', *range(100))
+        self.assertEqual(unpackb(packed).tolist(), list(range(100)))
+        if not PYTHON3:
+            # array.array has no buffer interface to pack it on Python 2
+            return
+
+        for typecode in 'bhHiIlLqQfd':
+            arr = array.array(typecode, [1, 2, 3, 4] * 25)
+            data = {'arr': arr, 'other': [arr, 5]}
+            packed = packb(data)
+            self.assertEqual(packed, qpack.packb(data))
+            self.assertEqual(skip(packed), len(packed))
+            unpacked = unpackb(packed, decode='utf-8')
+            self.assertIsInstance(unpacked['arr'], array.array)
+            self.assertEqual(unpacked['arr'].tolist(), arr.tolist())
+            self.assertEqual(unpacked['other'][0].tolist(), arr.tolist())
+            self.assertEqual(unpacked['other'][1], 5)
+            view = unpackb(packed, raw_as_view=True)[b'arr']
+            self.assertIsInstance(view, memoryview)
+            self.assertEqual(view.tolist(), arr.tolist())
+
+        # 100 int64 items are one header and a contiguous block
+        packed = packb(array.array('q', range(100)))
+        self.assertEqual(packed[:5], b'\x7cq\xe5\x20\x03')
+        self.assertEqual(len(packed), 5 + 800)
+        self.assertEqual(unpackb(packed).tolist(), list(range(100)))
+        self.assertEqual(unpackb(packb(array.array('d'))).tolist(), [])
+
+        # unsigned 8-bit items are packed as raw data
+        self.assertEqual(packb(array.array('B', b'abc')), b'\x83abc')
+        self.assertEqual(packb(bytearray(b'abc')), b'\x83abc')
+        self.assertEqual(packb(memoryview(b'abc')), b'\x83abc')
+
+        with self.assertRaises(TypeError):
+            packb(memoryview(b'abcd').cast('c').cast('B').cast('?'))
+        for invalid in (b'\x7cx\x80', b'\x7cq\x83abc', b'\x7cq\x05'):
+            with self.assertRaises(ValueError):
+                unpackb(invalid)
+            with self.assertRaises(ValueError):
+                skip(invalid)
+        with self.assertRaises(ValueError):
+            unpackb(packed[:-1])
+
+    def _many(self, packb_many, unpack_many):
+        values = [inp for inp, _ in self.CASES]
+        packed = packb_many(iter(values))
+        self.assertEqual(packed, [bytes(bytearray(p)) for _, p in self.CASES])
+        expected = [qpack.unpackb(p) for p in packed]
+        self.assertEqual(unpack_many(packed), expected)
+        self.assertEqual(
+            unpack_many(tuple(bytearray(p) for p in packed)), expected)
+
+        data, offsets = packb_many(values, concat=True)
+        self.assertIsInstance(offsets, array.array)
+        self.assertEqual(offsets.typecode, 'q' if PYTHON3 else 'l')
+        self.assertEqual(len(offsets), len(values) + 1)
+        self.assertEqual(data, b''.join(packed))
+        self.assertEqual(offsets[-1], len(data))
+        for i, p in enumerate(packed):
+            self.assertEqual(data[offsets[i]:offsets[i + 1]], p)
+        self.assertEqual(unpack_many(memoryview(data)), expected)
+
+        messages = [{'id': i, 'name': 'n%d' % i} for i in range(100)]
+        self.assertEqual(unpack_many(
+            packb_many(messages, concat=True)[0], decode='utf-8'), messages)
+        self.assertEqual(packb_many([]), [])
+        self.assertEqual(unpack_many(b''), [])
+        self.assertEqual(unpack_many([]), [])
+
+        with self.assertRaises(TypeError):
+            packb_many([1, object()])
+        with self.assertRaises(ValueError):
+            packb_many([[[1]]], max_depth=1)
+        with self.assertRaises(ValueError):
+            unpack_many(data + b'\xee')
+        with self.assertRaises(ValueError):
+            unpack_many([packed[0], b''])
+
+    def _get(self, get):
+        doc = {
+            'meta': {'ts': 1700000000, 'tags': ['a', 'b']},
+            'items': [{'id': i, 'v': b'x' * 5000} for i in range(10)],
+            5: 'five',
+            -1000: 'negative',
+            b'raw': None,
+        }
+        packed = qpack.packb(doc)
+        self.assertEqual(get(packed, ['meta', 'ts']), 1700000000)
+        self.assertEqual(get(packed, ('meta', b'tags', 1)), b'b')
+        self.assertEqual(
+            get(memoryview(packed), ['meta', 'tags'], decode='utf-8'),
+            ['a', 'b'])
+        self.assertEqual(get(packed, ['items', 9, 'id']), 9)
+        self.assertEqual(get(packed, [5]), b'five')
+        self.assertEqual(get(packed, [-1000]), b'negative')
+        self.assertIsNone(get(packed, ['raw']))
+        self.assertEqual(get(packed, []), qpack.unpackb(packed))
+
+        with self.assertRaises(KeyError):
+            get(packed, ['metaa'])
+        with self.assertRaises(KeyError):
+            get(packed, ['meta', 'ts', 0])
+        with self.assertRaises(KeyError):
+            get(packed, ['items', 'id'])
+        with self.assertRaises(IndexError):
+            get(packed, ['items', 10])
+        with self.assertRaises(IndexError):
+            get(packed, ['meta', 'tags', -1])
+        self.assertEqual(get(packed, ['items', 10], default=0), 0)
+        self.assertIsNone(get(packed, ['x', 'y'], default=None))
+
+        with self.assertRaises(TypeError):
+            get(packed, 'meta')
+        with self.assertRaises(TypeError):
+            get(packed, [1.5])
+        with self.assertRaises(ValueError):
+            get(packed, ['items', 0, 'id'], max_depth=2)
+
+        # open arrays and maps, closed by the end of the data
+        self.assertEqual(get(b'\xfd\x81a\xfc\x01\x02\xfe\x81b\x03', ['b']), 3)
+        self.assertEqual(get(b'\xfd\x81a\xfc\x01\x02', ['a', 1]), 2)
+        with self.assertRaises(IndexError):
+            get(b'\xfd\x81a\xfc\x01\x02', ['a', 2])
+        with self.assertRaises(KeyError):
+            get(b'\xfd\x81a\xfc\x01\x02', ['b'])
+        with self.assertRaises(ValueError):
+            get(packed[:100], ['items', 9])
+
+        # the last value of a duplicate key is used, the same as unpackb()
+        for data in (
+                b'\xf5\x81a\x01\x81a\x02',
+                b'\xf6\x81a\x01\x81b\x03\x81a\x02',
+                b'\xfd\x81a\x01\x81a\x02',
+                b'\xfd\x81a\x01\x81a\x02\xff'):
+            self.assertEqual(get(data, ['a']), qpack.unpackb(data)[b'a'])
+            self.assertEqual(get(data, ['a']), 2)
+        data = b'\xf5\x81a\xf4\x81b\x01\x81a\xf4\x81b\x02'
+        self.assertEqual(get(data, ['a', 'b']), 2)
+        with self.assertRaises(KeyError):
+            get(b'\xf6\x81a\x81x\x81a\x81y\x81b', ['c'])
+        with self.assertRaises(ValueError):
+            get(b'\xf6\x81a\x01\x81a\x02', ['a'])
+
+    def _unpack_threads(self, packb, unpackb):
+        data = [{'id': i, 'name': u'n%d' % i, 'v': [i / 2.0, None]}
+                for i in range(10000)]
+        packed = packb(data)
+        for threads in (1, 2, 3, 8, 100):
+            self.assertEqual(
+                unpackb(packed, decode='utf-8', threads=threads), data)
+        unpacked = unpackb(packed, use_tuples=True, threads=4)
+        self.assertEqual(len(unpacked), 10000)
+        self.assertEqual(unpacked[9999][b'v'], (4999.5, None))
+
+        # a small array, or a value which is not an array
+        self.assertEqual(unpackb(packb([1, 2]), threads=4), [1, 2])
+        self.assertEqual(unpackb(packb({'a': 1}), threads=4), {b'a': 1})
+
+        # the error of any thread is raised; the fallback cannot pack a str
+        # which is not ascii on Python 2
+        packed = qpack.packb([b'ok'] * 5000 + [b'\xff'] + [b'ok'] * 5000)
+        with self.assertRaises(UnicodeDecodeError):
+            unpackb(packed, decode='utf-8', threads=4)
+        self.assertEqual(
+            unpackb(
+                packed,
+                decode='utf-8',
+                ignore_decode_errors=True,
+                threads=4)[5000],
+            b'\xff')
+
+        with self.assertRaises(ValueError):
+            unpackb(packed, threads=0)
+
+    def _canonical(self, packb, digest):
+        # the same data, in a different order and with a tuple for a list
+        a = {'b': 1, 'a': [1, {'z': None, 'y': (1, 2)}], 3: u'x',
+             (1, 't'): 0.5}
+        b = {(1, 't'): 0.5, 3: u'x', 'a': [1, {'y': [1, 2], 'z': None}],
+             'b': 1}
+        packed = packb(a, canonical=True)
+        self.assertEqual(packb(b, canonical=True), packed)
+        self.assertEqual(
+            packed,
+            b'\xf7\x03\x81x\x81a\xef\x01\xf5\x81y\xef\x01\x02\x81z'
+            b'\xfb\x81b\x01\xef\x01\x81t\xec\x00\x00\x00\x00\x00\x00'
+            b'\xe0?')
+        self.assertEqual(packb(a, canonical=True, exact=True), packed)
+
+        # a map with more than five pairs, sorted on the packed keys
+        m = dict((u'k' * i, i) for i in range(10, 0, -1))
+        self.assertEqual(
+            packb(m, canonical=True),
+            b'\xfd' +
+            b''.join(packb(u'k' * i) + packb(i) for i in range(1, 11)) +
+            b'\xff')
+
+        # integers and raw data are packed with the smallest size
+        self.assertEqual(packb(-128, canonical=True), b'\xe8\x80')
+        self.assertEqual(packb(-32768), b'\xe9\x00\x80')
+        self.assertEqual(packb(-2 ** 31), b'\xea\x00\x00\x00\x80')
+        self.assertEqual(len(packb(-2 ** 63)), 9)
+
+        # all NaN values are the same
+        nan = struct.unpack('<d', b'\x01\x00\x00\x00\x00\x00\xf8\xff')[0]
+        self.assertEqual(
+            packb([nan], canonical=True),
+            b'\xee\xec\x00\x00\x00\x00\x00\x00\xf8\x7f')
+        self.assertNotEqual(packb([nan]), packb([nan], canonical=True))
+
+        if PYTHON3:
+            # u'a' and b'a' are the same key on Python 2
+            with self.assertRaises(ValueError):
+                packb({u'a': 1, b'a': 2}, canonical=True)
+
+        data = [{'n%d' % (i % 7): i, 'id': i} for i in range(1000)]
+        self.assertEqual(
+            packb(data, canonical=True, threads=4),
+            packb(data, canonical=True))
+
+        # the digest of the canonical data; hashlib has no BLAKE2b for the
+        # fallback on Python 2
+        if digest is fallback.digest and not hasattr(hashlib, 'blake2b'):
+            return
+        self.assertEqual(digest(a), digest(b))
+        self.assertEqual(len(digest(a)), 32)
+        self.assertNotEqual(digest(a), digest([a]))
+        if hasattr(hashlib, 'blake2b'):
+            blobs = dict(('k%d' % i, b'x' * (i * 1000)) for i in range(100))
+            for obj in (a, blobs, None, []):
+                self.assertEqual(
+                    digest(obj),
+                    hashlib.blake2b(
+                        packb(obj, canonical=True),
+                        digest_size=32).digest())
+        with self.assertRaises(ValueError):
+            digest([[1]], max_depth=1)
+
+    def _pack_threads(self, packb, unpackb):
+        data = [{'id': i, 'name': u'n%d' % i, 'v': [i / 2.0, None]}
+                for i in range(10000)]
+        packed = packb(data)
+        for threads in (1, 2, 3, 8, 100):
+            self.assertEqual(packb(data, threads=threads), packed)
+            self.assertEqual(packb(tuple(data), threads=threads), packed)
+        self.assertEqual(packb(data, threads=4, exact=True), packed)
+        self.assertEqual(unpackb(packb(data, threads=4), decode='utf-8'), data)
+
+        # large raw data, a small array, or a value which is not an array
+        blobs = [b'x' * 100000, b'y' * 10] * 100
+        self.assertEqual(packb(blobs, threads=4), packb(blobs))
+        self.assertEqual(packb([1, 2], threads=4), packb([1, 2]))
+        self.assertEqual(packb({'a': 1}, threads=4), packb({'a': 1}))
+
+        nested = [[[1]]] * 1000
+        self.assertEqual(packb(nested, max_depth=3, threads=4),
+                         packb(nested))
+        with self.assertRaises(ValueError):
+            packb(nested, max_depth=2, threads=4)
+
+        # the error of any thread is raised
+        data = list(range(5000))
+        data[3000] = object()
+        with self.assertRaises(TypeError):
+            packb(data, threads=4)
+        for threads in (1, 2, 4):
+            data = list(range(200))
+            data[150] = 2 ** 70
+            with self.assertRaises(OverflowError):
+                packb(data, threads=threads)
+            with self.assertRaises(OverflowError):
+                packb(data, threads=threads, exact=True)
+
+        with self.assertRaises(ValueError):
+            packb(data, threads=0)
+
+    def _refs(self, packb, unpackb, get, validate, Unpacker):
+        data = [{'name': u'sensor', 'kind': u'temp', 'v': i} for i in range(3)]
+        packed = packb(data, refs=True)
+        if PYTHON3:
+            # dicts are not ordered on Python 2
+            self.assertEqual(
+                packed,
+                b'\xf0\xf6\x84name\x86sensor\x84kind\x84temp\x81v\x00'
+                b'\xf6|r\x00|r\x01|r\x02|r\x03\x81v\x01'
+                b'\xf6|r\x00|r\x01|r\x02|r\x03\x81v\x02')
+        self.assertLess(len(packed), len(packb(data)))
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+
+        # a back-reference resolves to the object which is unpacked before
+        unpacked = unpackb(packed)
+        self.assertIs(unpacked[2][b'name'], unpacked[0][b'name'])
+        self.assertIs(list(unpacked[2])[1], list(unpacked[0])[1])
+
+        # short raw data and the raw of a typed array are not numbered, a
+        # back-reference is only used when it is smaller
+        data = [u'ab', u'ab', u'abc', u'abc', b'abc', u'x' * 200, u'x' * 200]
+        if PYTHON3:
+            # typed arrays are packed on Python 3 only
+            data.append(array.array('h', [1, 2]))
+        packed = packb(data, refs=True)
+        self.assertEqual(packed.count(b'|r'), 3)
+        self.assertEqual(unpackb(packed)[6], b'x' * 200)
+        self.assertEqual(unpackb(packed, use_tuples=True)[4], b'abc')
+
+        # more numbered raw data than fit in a fixed integer
+        data = [u'w%03d' % i for i in range(200)] * 2
+        packed = packb(data, refs=True)
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+        self.assertEqual(packb(data, refs=True, exact=True), packed)
+        self.assertEqual(packb(data, refs=True, threads=4), packed)
+
+        # canonical data with back-references
+        m = {u'b': [u'one', u'two'], u'a': [u'two', u'one']}
+        self.assertEqual(
+            packb(m, canonical=True, refs=True),
+            b'\xf5\x81a\xef\x83two\x83one\x81b\xef|r\x01|r\x00')
+
+        # get() unpacks the value when the data has back-references
+        data = {u'items': [{u'name': u'abc', u'tags': [u'abc']}] * 3}
+        packed = packb(data, refs=True)
+        self.assertEqual(get(packed, [u'items', 2, u'tags']), [b'abc'])
+        self.assertEqual(
+            get(packed, [b'items', 1, u'name'], decode='utf-8'), u'abc')
+        self.assertEqual(get(packed, [u'items', 5], default=0), 0)
+        self.assertEqual(get(packed, [u'items', 0, u'x'], default=0), 0)
+        with self.assertRaises(IndexError):
+            get(packed, [u'items', 3])
+        with self.assertRaises(KeyError):
+            get(packed, [u'items', u'x'])
+
+        # numbering starts again for each value
+        unpacker = Unpacker(decode='utf-8')
+        unpacker.feed(packed + packed)
+        self.assertEqual(list(unpacker), [data, data])
+
+        # a back-reference to raw data which is not unpacked before, which
+        # validate() rejects as well
+        self.assertIsNone(validate(packed))
+        for invalid in (b'\xef\x83abc|r\x01', b'\xee|r\x00',
+                        b'\xee|r\xe8\xff', b'\xee|r\x80',
+                        b'\xef|r\x00\x83abc', b'\xef\x82ab|r\x00',
+                        b'\xef\xe4\x01a|r\x01'):
+            with self.assertRaises(ValueError):
+                unpackb(invalid)
+            with self.assertRaises(ValueError):
+                validate(invalid)
+        self.assertIsNone(validate(b'\xef\xe4\x01a|r\x00'))
+
+    def _session(self, Packer, Unpacker, unpackb, get):
+        keys = [u'name', u'kind', b'value']
+        packer = Packer(dictionary=keys)
+        unpacker = Unpacker(decode='utf-8', dictionary=keys)
+        first = [u'name', u'sensor', u'kind', u'temp', u'value']
+        second = [u'name', u'sensor', u'kind', u'temp', {u'value': 2}]
+
+        # preloaded strings are packed as a reference, the other strings are
+        # added to the dictionary after the value
+        packed = packer.pack(first)
+        self.assertEqual(
+            packed, b'\xf2|s\x00\x86sensor|s\x01\x84temp|s\x02')
+        unpacker.feed(packed)
+        self.assertEqual(list(unpacker), [first])
+        packed = packer.pack(second)
+        self.assertEqual(packed, b'\xf2|s\x00|s\x03|s\x01|s\x04\xf4|s\x02\x02')
+        unpacker.feed(packed)
+        self.assertEqual(list(unpacker), [second])
+
+        # the strings of the dictionary are unpacked once
+        unpacker.feed(packed + packed)
+        a, b = list(unpacker)
+        self.assertIs(a[1], b[1])
+
+        # once full, each string replaces the oldest string which is added
+        packer = Packer(dictionary_size=2)
+        unpacker = Unpacker(dictionary_size=2)
+        words = [u'aaa', u'bbb', u'aaa', u'ccc', u'aaa', u'bbb', u'bbb']
+        packed = [packer.pack([w]) for w in words]
+        self.assertEqual(packed, [
+            b'\xee\x83aaa', b'\xee\x83bbb', b'\xee|s\x00', b'\xee\x83ccc',
+            b'\xee\x83aaa', b'\xee\x83bbb', b'\xee|s\x00'])
+        unpacker.feed(b''.join(packed))
+        self.assertEqual(list(unpacker), [[w.encode()] for w in words])
+
+        # raw data which is repeated in a value is a back-reference, and the
+        # dictionary does not change when a value fails to pack
+        packer = Packer(dictionary_size=16)
+        with self.assertRaises(TypeError):
+            packer.pack([u'abc', object()])
+        self.assertEqual(
+            packer.pack([u'abc', u'abc', u'x' * 65]),
+            b'\xf0\x83abc|r\x00\xc1' + b'x' * 65)
+        self.assertEqual(packer.pack([u'abc']), b'\xee|s\x00')
+
+        # dictionary references need the dictionary of the Packer
+        for fn in (unpackb, lambda qp: get(qp, [0])):
+            with self.assertRaises(ValueError):
+                fn(b'\xee|s\x00')
+        unpacker = Unpacker(dictionary=[u'abc'], dictionary_size=0)
+        unpacker.feed(b'\xee|s\x00\xee|s\x01')
+        self.assertEqual(next(unpacker), [b'abc'])
+        with self.assertRaises(ValueError):
+            next(unpacker)
+
+        with self.assertRaises(TypeError):
+            Packer(dictionary=[1])
+        with self.assertRaises(ValueError):
+            Packer(dictionary=[u'x' * 65])
+        with self.assertRaises(ValueError):
+            Unpacker(dictionary_size=-1)
+
+    def _templates(self, packb, unpackb, get, validate, Unpacker):
+        data = [{u'id': 1}, {u'id': 2}]
+        packed = packb(data, templates=True)
+        self.assertEqual(packed, b'|t\xf0\xee\x82id\xee\x01\xee\x02')
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+
+        # the keys are packed once and the dicts share the key objects
+        data = [{u'id': i, u'name': u'n%d' % i, u'kind': u'temp',
+                 u'value': i / 4.0, u'ok': True, u'tags': [u'a'] * i,
+                 u'ts': None} for i in range(10)]
+        packed = packb(data, templates=True)
+        # 30 bytes of keys for each but the first record, and four bytes for
+        # QP_HOOK, QP_TEMPLATE and the array of the keys
+        self.assertEqual(len(packb(data)) - len(packed), 9 * 30 - 4)
+        self.assertEqual(unpackb(packed, decode='utf-8'), data)
+        unpacked = unpackb(packed, use_tuples=True)
+        self.assertIsInstance(unpacked, tuple)
+        self.assertEqual(unpacked[9][b'tags'], (b'a',) * 9)
+        self.assertIs(list(unpacked[9])[3], list(unpacked[0])[3])
+
+        # templates are nested, combined with back-references and not used
+        # for canonical data, exact and threads are ignored
+        nested = {u'rows': data, u'more': [data[:2], data[:1], []]}
+        self.assertEqual(
+            unpackb(packb(nested, templates=True), decode='utf-8'), nested)
+        self.assertEqual(
+            unpackb(packb(data, templates=True, refs=True), decode='utf-8'),
+            data)
+        self.assertEqual(
+            packb(data, canonical=True, templates=True),
+            packb(data, canonical=True))
+        self.assertEqual(packb(data, templates=True, exact=True), packed)
+        self.assertEqual(packb(data, templates=True, threads=4), packed)
+
+        # the dicts must have the same keys in the same order, which are
+        # not containers
+        for data in ([{u'a': 1}], [{}, {}], [{u'a': 1}, [1]],
+                     [{u'a': 1}, {u'a': 1, u'b': 2}], [{1: 0}, {True: 0}],
+                     [{(1,): 0}, {(1,): 0}], ({u'a': 1}, {u'b': 1})):
+            self.assertEqual(packb(data, templates=True), packb(data))
+
+        # get() unpacks the value when a template is on the path
+        data = {u'rows': [{u'id': i, u'v': [i]} for i in range(3)]}
+        packed = packb(data, templates=True)
+        self.assertEqual(get(packed, [u'rows', 2, u'v']), [2])
+        self.assertEqual(get(packed, [u'rows', 3], default=0), 0)
+        with self.assertRaises(IndexError):
+            get(packed, [u'rows', 3])
+        with self.assertRaises(KeyError):
+            get(packed, [u'rows', 1, u'x'])
+
+        unpacker = Unpacker(decode='utf-8')
+        for i in range(len(packed)):
+            unpacker.feed(packed[i:i + 1])
+        self.assertEqual(list(unpacker), [data])
+
+        # the records are nested in the template and count for the depth
+        with self.assertRaises(ValueError):
+            packb(data, templates=True, max_depth=3)
+        with self.assertRaises(ValueError):
+            unpackb(packed, max_depth=3)
+        self.assertEqual(packb(data, templates=True, max_depth=4), packed)
+        self.assertEqual(unpackb(packed, max_depth=4, decode='utf-8'), data)
+
+        # a template without keys, keys which are not an array, or a record
+        # which is not an array with a value for each key, which validate()
+        # rejects as well
+        self.assertIsNone(validate(packed))
+        for invalid in (b'|t\xed', b'|t\xf3', b'|t\xfc\xfe', b'|t\xee\x01',
+                        b'|t\xef\xf3\xee\x00', b'|t\xef\xee\x81a\x01',
+                        b'|t\xef\xee\x81a\xef\x01\x02',
+                        b'|t\xef\xee\x81a\xf4\x81a\x01',
+                        b'|t\xef\xee\x81a|t\xee\xee\x81a',
+                        b'|t\xef\xee\x81a\xed', b'|t\xfc\xee\x81a\xfc\xfe',
+                        b'|t\xfc\xee\x81a\xfc\x01\x02\xfe\xfe',
+                        b'\xee|t\xfc\xee\x81a\xee\x01\xed'):
+            with self.assertRaises(ValueError):
+                unpackb(invalid)
+            with self.assertRaises(ValueError):
+                validate(invalid)
+        self.assertIsNone(validate(b'|t\xfc\xfc\x81a\xfe\xfc\x01\xfe'))
+
+    def _columnar(self, packb, unpackb):
+        data = [{u'id': i, u'ts': i * 1.5, u'name': u'n%d' % i,
+                 u'ok': i % 2 == 0, u'tags': [i]} for i in range(10)]
+        columns = {
+            u'id': list(range(10)),
+            u'ts': [i * 1.5 for i in range(10)],
+            u'name': [u'n%d' % i for i in range(10)],
+            u'ok': [i % 2 == 0 for i in range(10)],
+            u'tags': [[i] for i in range(10)]}
+
+        # the same columns for a template and with back-references; only
+        # integers or only floats are an array.array
+        for kwargs in ({}, {'templates': True}, {'refs': True},
+                       {'templates': True, 'refs': True}):
+            packed = packb(data, **kwargs)
+            unpacked = unpackb(packed, columnar=True, decode='utf-8')
+            self.assertEqual(
+                dict((k, list(v)) for k, v in unpacked.items()), columns)
+            self.assertEqual(unpacked[u'ts'], array.array('d', columns[u'ts']))
+            self.assertIsInstance(unpacked[u'name'], list)
+            self.assertIsInstance(unpacked[u'ok'], list)
+            if PYTHON3:
+                self.assertEqual(
+                    unpacked[u'id'], array.array('q', columns[u'id']))
+
+        # nested arrays follow use_tuples, the columns are lists
+        unpacked = unpackb(packb(data), columnar=True, use_tuples=True)
+        self.assertEqual(unpacked[b'tags'][3], (3,))
+        self.assertIsInstance(unpacked[b'name'], list)
+
+        # None for a missing key; the last value for a repeated key
+        data = [{u'a': 1}, {u'b': 2.5}, {}, {u'a': 3, u'b': u'x'}]
+        self.assertEqual(unpackb(packb(data), columnar=True, decode='utf-8'), {
+            u'a': [1, None, None, 3], u'b': [None, 2.5, None, u'x']})
+        self.assertEqual(
+            unpackb(b'\xee\xf5\x81a\x01\x81a\x02', columnar=True),
+            {b'a': array.array('q', [2]) if PYTHON3 else [2]})
+        self.assertEqual(unpackb(packb([]), columnar=True), {})
+        self.assertEqual(unpackb(packb([{}] * 7), columnar=True), {})
+
+        for invalid in (1, {u'a': 1}, [1], [{u'a': 1}, [1]], [[1]]):
+            with self.assertRaises(ValueError):
+                unpackb(packb(invalid), columnar=True)
+        with self.assertRaises(ValueError):
+            unpackb(b'|t\xef\xee\x81a\xf4\x81a\x01', columnar=True)
+        with self.assertRaises(ValueError):
+            unpackb(packb([{u'a': [1]}]), columnar=True, max_depth=2)
+        self.assertEqual(
+            unpackb(packb([{u'a': [1]}]), columnar=True, max_depth=3),
+            {b'a': [[1]]})
+
+    def _threads(self, packb, unpackb, Unpacker):
+        errors = []
+        shared = [{'i': i, 'raw': b'x' * i} for i in range(100)]
+        done = threading.Event()
+
+        def work(n):
+            try:
+                unpacker = Unpacker(decode='utf-8')
+                for i in range(50):
+                    doc = {
+                        'thread': n,
+                        'round': i,
+                        'items': [[j, -j, j / 4.0, u'\u20ac' * j]
+                                  for j in range(i)],
+                    }
+                    if PYTHON3:
+                        # typed arrays are packed on Python 3 only
+                        doc['ts'] = array.array('q', range(i))
+                    packed = packb(doc)
+                    unpacked = unpackb(packed, decode='utf-8')
+                    self.assertEqual(unpacked['round'], i)
+                    self.assertEqual(unpacked['items'], doc['items'])
+                    self.assertEqual(unpacked.get('ts'), doc.get('ts'))
+
+                    unpacker.feed(packed[:7])
+                    unpacker.feed(packed[7:])
+                    self.assertEqual(list(unpacker), [unpacked])
+
+                    # the shared list is changed by another thread
+                    self.assertIsInstance(unpackb(packb(shared)), list)
+            except Exception as e:
+                errors.append(e)
+
+        def change():
+            while not done.is_set():
+                shared.append({'i': -1})
+                shared.pop(0)
+
+        changer = threading.Thread(target=change)
+        changer.start()
+        threads = [threading.Thread(target=work, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        done.set()
+        changer.join()
+        self.assertEqual(errors, [])
+
     def test_packb(self):
         self.assertEqual(
             qpack.packb.__doc__,
@@ -74,6 +969,18 @@ class TestQpack(unittest.TestCase):
             'Serialize to QPack. (Pure Python implementation)')
         self._pack(fallback.packb)
 
+    def test_packed_size(self):
+        self._packed_size(qpack.packb, qpack.packed_size)
+
+    def test_fallback_packed_size(self):
+        self._packed_size(fallback.packb, fallback.packed_size)
+
+    def test_packb_into(self):
+        self._pack_into(qpack.packb_into)
+
+    def test_fallback_packb_into(self):
+        self._pack_into(fallback.packb_into)
+
     def test_unpackb(self):
         self.assertNotIn(
             'Pure Python implementation',
@@ -86,12 +993,163 @@ class TestQpack(unittest.TestCase):
             fallback.unpackb.__doc__)
         self._unpack(fallback.unpackb)
 
+    def test_unpack_from(self):
+        self._unpack_from(qpack.unpackb, qpack.unpack_from)
+
+    def test_fallback_unpack_from(self):
+        self._unpack_from(fallback.unpackb, fallback.unpack_from)
+
+    def test_raw_as_view(self):
+        self._raw_as_view(qpack.unpackb)
+
+    def test_fallback_raw_as_view(self):
+        self._raw_as_view(fallback.unpackb)
+
+    def test_key_cache(self):
+        self._key_cache(qpack.unpackb, qpack.Unpacker)
+
+    def test_fallback_key_cache(self):
+        self._key_cache(fallback.unpackb, fallback.Unpacker)
+
+    def test_unpacker(self):
+        self._unpacker(qpack.Unpacker)
+
+    def test_fallback_unpacker(self):
+        self._unpacker(fallback.Unpacker)
+
+    def test_max_depth(self):
+        self._max_depth(qpack.packb, qpack.unpackb, qpack.Unpacker)
+
+    def test_fallback_max_depth(self):
+        self._max_depth(fallback.packb, fallback.unpackb, fallback.Unpacker)
+
+    def test_open_containers(self):
+        self._open_containers(qpack.unpackb)
+
+    def test_fallback_open_containers(self):
+        self._open_containers(fallback.unpackb)
+
+    def test_skip(self):
+        self._skip(qpack.skip, qpack.validate)
+
+    def test_fallback_skip(self):
+        self._skip(fallback.skip, fallback.validate)
+
+    def test_decode_ascii(self):
+        self._decode_ascii(qpack.unpackb)
+
+    def test_fallback_decode_ascii(self):
+        self._decode_ascii(fallback.unpackb)
+
+    def test_typed_arrays(self):
+        self._typed_arrays(qpack.packb, qpack.unpackb, qpack.skip)
+
+    def test_fallback_typed_arrays(self):
+        self._typed_arrays(fallback.packb, fallback.unpackb, fallback.skip)
+
+    def test_many(self):
+        self._many(qpack.packb_many, qpack.unpack_many)
+
+    def test_fallback_many(self):
+        self._many(fallback.packb_many, fallback.unpack_many)
+
+    def test_get(self):
+        self._get(qpack.get)
+
+    def test_fallback_get(self):
+        self._get(fallback.get)
+
+    def test_unpack_threads(self):
+        self._unpack_threads(qpack.packb, qpack.unpackb)
+
+    def test_fallback_unpack_threads(self):
+        self._unpack_threads(fallback.packb, fallback.unpackb)
+
+    def test_canonical(self):
+        self._canonical(qpack.packb, qpack.digest)
+
+    def test_fallback_canonical(self):
+        self._canonical(fallback.packb, fallback.digest)
+
+    def test_pack_threads(self):
+        self._pack_threads(qpack.packb, qpack.unpackb)
+
+    def test_fallback_pack_threads(self):
+        self._pack_threads(fallback.packb, fallback.unpackb)
+
+    def test_refs(self):
+        self._refs(
+            qpack.packb, qpack.unpackb, qpack.get, qpack.validate,
+            qpack.Unpacker)
+
+    def test_fallback_refs(self):
+        self._refs(
+            fallback.packb, fallback.unpackb, fallback.get, fallback.validate,
+            fallback.Unpacker)
+
+    def test_session(self):
+        self._session(qpack.Packer, qpack.Unpacker, qpack.unpackb, qpack.get)
+
+    def test_fallback_session(self):
+        self._session(
+            fallback.Packer, fallback.Unpacker, fallback.unpackb,
+            fallback.get)
+
+    def test_templates(self):
+        self._templates(
+            qpack.packb, qpack.unpackb, qpack.get, qpack.validate,
+            qpack.Unpacker)
+
+    def test_fallback_templates(self):
+        self._templates(
+            fallback.packb, fallback.unpackb, fallback.get, fallback.validate,
+            fallback.Unpacker)
+
+    def test_columnar(self):
+        self._columnar(qpack.packb, qpack.unpackb)
+
+    def test_fallback_columnar(self):
+        self._columnar(fallback.packb, fallback.unpackb)
+
+    def test_threads(self):
+        self._threads(qpack.packb, qpack.unpackb, qpack.Unpacker)
+
+    def test_fallback_threads(self):
+        self._threads(fallback.packb, fallback.unpackb, fallback.Unpacker)
+
+    def test_deep(self):
+        data = [None]
+        for _ in range(100000):
+            data = [data]
+        with self.assertRaises(ValueError):
+            qpack.packb(data)
+        packed = qpack.packb(data, max_depth=100001)
+        self.assertEqual(len(packed), 100002)
+        result = qpack.unpackb(packed, max_depth=100001)
+        self.assertEqual(qpack.packb(result, max_depth=100001), packed)
+        with self.assertRaises(ValueError):
+            qpack.unpackb(packed)
+
+        d = {}
+        d['d'] = d
+        with self.assertRaises(ValueError):
+            qpack.packb(d)
+
     def test_packb_unsupported(self):
         with self.assertRaises(TypeError):
             fallback.packb({'module': sys})
         with self.assertRaises(TypeError):
             qpack.packb({'module': sys})
 
+    def test_packb_large(self):
+        # larger than the per-thread buffer so it is packed into bytes
+        data = [b'x' * 1000 for _ in range(200)] + [{b'n': 0xfedcba9876}]
+        for _ in range(3):
+            packed = qpack.packb(data)
+            self.assertEqual(packed, fallback.packb(data))
+            self.assertEqual(qpack.unpackb(packed), data)
+            self.assertEqual(qpack.packb(None), b'\xfb')
+
     def test_decode(self):
         if not PYTHON3:
             return
@@ -109,6 +1167,11 @@ class TestQpack(unittest.TestCase):
         self.assertEqual(type(s).__name__, 'str')
         self.assertEqual(type(b).__name__, 'bytes')
 
+        self.assertEqual(qpack.unpackb(b'\x82\xc3\xa9', decode='latin-1'),
+                         '\u00c3\u00a9')
+        with self.assertRaises(LookupError):
+            qpack.unpackb(packed, decode='ascii')
+
     def test_fallback_decode(self):
         if not PYTHON3:
             return